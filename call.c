@@ -7,22 +7,74 @@
 #include <sys/types.h>      // Data types
 #include <netinet/in.h>     // Internet address family
 #include <errno.h>          // Error handling
+#include <signal.h>         // Signal handling
+#include "frame.h"          // Length-prefixed frames
+#include "floor_label.h"    // Floor labels
+#include "endpoint.h"       // Controller address (--controller)
 
 // Define constants
-#define PORT 3000           // Port number for the controller server
 #define BUFFER_SIZE 1024    // Buffer size for sending/receiving messages
 
+#define CALL_WINDOW 64      // Calls a batch keeps outstanding at once
+
+// A batch call waiting for its reply
+typedef struct {
+    unsigned long id;       // Request id (the input line number), 0 if the slot is free
+    char source[BUFFER_SIZE];
+    char destination[BUFFER_SIZE];
+} outstanding_call;
+
 // Function prototypes
-int is_floor_valid(const char *floor);
+int connect_to_controller(void);
+int run_batch(void);
+void print_response(const char *prefix, const char *response);
 void send_message(int sockfd, const char *message);
-char *receive_message(int sockfd);
+void receive_message(int sockfd, char *message, size_t size);
+
+// Frames from the controller - a batch may receive several in one read
+char in_storage[FRAME_HEADER_SIZE + BUFFER_SIZE];
+frame_buffer in_frames;
+endpoint controller_at;     // Where the controller listens (--controller)
 
 
 int main(int argc, char *argv[]) {
 
+    frame_buffer_init(&in_frames, in_storage, sizeof(in_storage));
+
+    // the controller to call comes before everything else
+    const char *controller_spec = "127.0.0.1";
+    if (argc >= 3 && strcmp(argv[1], "--controller") == 0) {
+        controller_spec = argv[2];
+        argv[2] = argv[0];
+        argv += 2;
+        argc -= 2;
+    }
+    if (endpoint_parse(controller_spec, "127.0.0.1", &controller_at) == -1) {
+        fprintf(stderr, "Invalid controller address: %s\n", controller_spec);
+        exit(EXIT_FAILURE);
+    }
+
+    // calls read from stdin share a single connection
+    if (argc == 2 && strcmp(argv[1], "--batch") == 0) {
+        return run_batch();
+    }
+
+    // the controller's latency histograms
+    if (argc == 2 && strcmp(argv[1], "--stats") == 0) {
+        int sockfd = connect_to_controller();
+        send_message(sockfd, "STATS");
+        char response[BUFFER_SIZE];
+        receive_message(sockfd, response, sizeof(response));
+        printf("%s\n", response);
+        close(sockfd);
+        return 0;
+    }
+
     // validate/check if the correct number of command-line arguments are provided = 2
     if (argc != 3) {
-        fprintf(stderr, "Usage: %s {source floor} {destination floor}\n", argv[0]);
+        fprintf(stderr, "Usage: %s [--controller host:port] {source floor} {destination floor}\n", argv[0]);
+        fprintf(stderr, "       %s [--controller host:port] --batch < calls (one \"{source} {destination}\" per line)\n", argv[0]);
+        fprintf(stderr, "       %s [--controller host:port] --stats (latency percentiles in microseconds)\n", argv[0]);
         exit(EXIT_FAILURE);
     }
 
@@ -30,7 +82,7 @@ int main(int argc, char *argv[]) {
     const char *destination_floor = argv[2];
 
     // validate the source and destination floors
-    if (!is_floor_valid(source_floor) || !is_floor_valid(destination_floor)) {
+    if (!floor_label_valid(source_floor) || !floor_label_valid(destination_floor)) {
         fprintf(stderr, "Invalid floor(s) specified.\n");
         exit(EXIT_FAILURE);
     }
@@ -41,37 +93,7 @@ int main(int argc, char *argv[]) {
     exit(EXIT_FAILURE);
     }
 
-    // variables for socket and server
-    int sockfd;
-    struct sockaddr_in serv_addr;
-
-    // set up the socket (using IPv4)
-    sockfd = socket(AF_INET, SOCK_STREAM, 0);
-    if (sockfd < 0) {
-        perror("Socket creation failed");
-        exit(EXIT_FAILURE);
-    }
-
-    // set up the server address (using IPv4)
-
-    // initialize serv_addr structure to zero and set family
-    memset(&serv_addr, 0, sizeof(serv_addr));
-    serv_addr.sin_family = AF_INET;
-    serv_addr.sin_port = htons(PORT);
-    
-    // convert address from text to binary and check validity
-    if (inet_pton(AF_INET, "127.0.0.1", &serv_addr.sin_addr) <= 0) {
-    fprintf(stderr, "Invalid address / address not supported\n");
-    close(sockfd);
-    exit(EXIT_FAILURE);
-    }
-
-    // attempt to connect to the controller server
-    if (connect(sockfd, (struct sockaddr *)&serv_addr, sizeof(serv_addr)) < 0) {
-    fprintf(stderr, "Unable to connect to elevator system.\n");
-    close(sockfd);
-    exit(EXIT_FAILURE);
-    }
+    int sockfd = connect_to_controller();
 
     // Prepare the CALL message
     char call_message[BUFFER_SIZE];
@@ -81,21 +103,9 @@ int main(int argc, char *argv[]) {
     send_message(sockfd, call_message);
 
     // Receive the message from the controller
-    char *response = receive_message(sockfd);
-
-    // print message if valid
-    if (strncmp(response, "CAR ", 4) == 0) {
-    char car_name[BUFFER_SIZE];
-    sscanf(response + 4, "%s", car_name);
-    printf("Car %s is arriving.\n", car_name);
-    // otherwise handle invalid message
-    } else if (strcmp(response, "UNAVAILABLE") == 0) {
-        printf("Sorry, no car is available to take this request.\n");
-    } else {
-        printf("Received unexpected response from controller: %s\n", response);
-    }
-    // free the response buffer
-    free(response);
+    char response[BUFFER_SIZE];
+    receive_message(sockfd, response, sizeof(response));
+    print_response("", response);
 
     // close socket and exit
     close(sockfd);
@@ -103,99 +113,156 @@ int main(int argc, char *argv[]) {
 
 }   
 
-// Helper Functions
-
-// check if the provided floor label is valid
-// function to validate floor labels - // allowable floors = B1-B99 or 1-999
-int is_floor_valid(const char *floor) {
-
-    // check if the floor is NULL or empty
-    if (floor == NULL || strlen(floor) == 0) {
-        return 0;
+// Batch mode
+// Every call is tagged with its line number so the replies, which can arrive
+// in any order, are matched back to their calls. Up to CALL_WINDOW calls are
+// in flight at once, so reading stdin never gets far ahead of the controller.
+int run_batch(void) {
+    outstanding_call *calls = calloc(CALL_WINDOW, sizeof(outstanding_call));
+    if (calls == NULL) {
+        perror("calloc()");
+        exit(EXIT_FAILURE);
     }
 
-    // check if the floor is a basement floor (starts with 'B')
-    if (floor[0] == 'B') {
-        // the rest of the string should be a number between 1 and 99
-        char *endptr;
-        int floor_num = (int)strtol(floor + 1, &endptr, 10);
-        if (*endptr != '\0' || floor_num < 1 || floor_num > 99) {
-            return 0;
+    // A closed connection is reported by send_message() instead
+    signal(SIGPIPE, SIG_IGN);
+
+    int sockfd = connect_to_controller();
+    int in_flight = 0;
+    int at_eof = 0;
+    int failed = 0;
+    unsigned long line_number = 0;
+    char line[BUFFER_SIZE];
+
+    while (!at_eof || in_flight > 0) {
+        // Send calls until the window is full
+        while (!at_eof && in_flight < CALL_WINDOW) {
+            if (fgets(line, sizeof(line), stdin) == NULL) {
+                at_eof = 1;
+                break;
+            }
+            line_number++;
+
+            char source[BUFFER_SIZE], destination[BUFFER_SIZE], extra[2];
+            int fields = sscanf(line, "%1023s %1023s %1s", source, destination, extra);
+            if (fields <= 0) {
+                continue; // Blank line
+            }
+            if (fields != 2 || !floor_label_valid(source) || !floor_label_valid(destination)) {
+                fprintf(stderr, "Line %lu: Invalid floor(s) specified.\n", line_number);
+                failed = 1;
+                continue;
+            }
+            if (strcmp(source, destination) == 0) {
+                fprintf(stderr, "Line %lu: You are already on that floor!\n", line_number);
+                failed = 1;
+                continue;
+            }
+
+            int slot = 0;
+            while (calls[slot].id != 0) {
+                slot++;
+            }
+            calls[slot].id = line_number;
+            strcpy(calls[slot].source, source);
+            strcpy(calls[slot].destination, destination);
+            in_flight++;
+
+            char call_message[BUFFER_SIZE * 3];
+            snprintf(call_message, sizeof(call_message), "CALL %s %s %lu", source, destination, line_number);
+            send_message(sockfd, call_message);
         }
-    } else {
-        // the string should be a number between 1 and 999
-        char *endptr;
-        int floor_num = (int)strtol(floor, &endptr, 10);
-        if (*endptr != '\0' || floor_num < 1 || floor_num > 999) {
-            return 0;
+        if (in_flight == 0) {
+            break;
         }
-    }
 
-    // Floor label is valid
-    return 1;
+        // Match the next reply to its call by the id at the end
+        char response[BUFFER_SIZE];
+        receive_message(sockfd, response, sizeof(response));
+        char *space = strrchr(response, ' ');
+        unsigned long id = space != NULL ? strtoul(space + 1, NULL, 10) : 0;
+        int slot = 0;
+        while (slot < CALL_WINDOW && (id == 0 || calls[slot].id != id)) {
+            slot++;
+        }
+        if (slot == CALL_WINDOW) {
+            printf("Received unexpected response from controller: %s\n", response);
+            failed = 1;
+            continue;
+        }
+        *space = '\0';
+
+        char prefix[BUFFER_SIZE * 2 + 4];
+        snprintf(prefix, sizeof(prefix), "%s %s: ", calls[slot].source, calls[slot].destination);
+        print_response(prefix, response);
+        calls[slot].id = 0;
+        in_flight--;
+    }
 
+    close(sockfd);
+    free(calls);
+    return failed ? EXIT_FAILURE : 0;
 }
 
-// function to send a message to the server
-void send_message(int sockfd, const char *message) {
-    // calculate length of the message and convert to network byte order
-    uint32_t msg_len = strlen(message);
-    uint32_t net_len = htonl(msg_len);
-
-    // send the message length prefix
-    ssize_t sent_bytes = send(sockfd, &net_len, sizeof(net_len), 0);
-    if (sent_bytes != sizeof(net_len)) {
-        perror("Failed to send message length");
-        close(sockfd);
+// Helper Functions
+
+// connect to the controller server, exiting if it isn't reachable
+int connect_to_controller(void) {
+    // variables for socket and server
+    int sockfd;
+
+    // set up the socket (using IPv4)
+    sockfd = socket(AF_INET, SOCK_STREAM, 0);
+    if (sockfd < 0) {
+        perror("Socket creation failed");
         exit(EXIT_FAILURE);
     }
-    // sned the message
-    sent_bytes = send(sockfd, message, msg_len, 0);
-    if (sent_bytes != msg_len) {
-        perror("Failed to send message");
-        close(sockfd);
-        exit(EXIT_FAILURE);
+
+    // attempt to connect to the controller server (parsed from --controller)
+    if (connect(sockfd, (const struct sockaddr *)&controller_at.addr, sizeof(controller_at.addr)) < 0) {
+    fprintf(stderr, "Unable to connect to elevator system.\n");
+    close(sockfd);
+    exit(EXIT_FAILURE);
     }
+
+    return sockfd;
 }
 
-// function to receive length prefixed message from the server
-char *receive_message(int sockfd) {
-    // buffer to store the message length prefix
-    uint32_t net_len;
-    ssize_t received_bytes = recv(sockfd, &net_len, sizeof(net_len), MSG_WAITALL);
-    // check if server is closed
-    if (received_bytes == 0) {
-        fprintf(stderr, "Connection closed by server\n");
-        close(sockfd);
-        exit(EXIT_FAILURE);
-    // check if message length was not received
-    } else if (received_bytes != sizeof(net_len)) {
-        perror("Failed to receive message length");
-        close(sockfd);
-        exit(EXIT_FAILURE);
+// function to print the controller's answer to a call
+void print_response(const char *prefix, const char *response) {
+    // print message if valid
+    if (strncmp(response, "CAR ", 4) == 0) {
+    char car_name[BUFFER_SIZE];
+    sscanf(response + 4, "%s", car_name);
+    printf("%sCar %s is arriving.\n", prefix, car_name);
+    // otherwise handle invalid message
+    } else if (strcmp(response, "UNAVAILABLE") == 0) {
+        printf("%sSorry, no car is available to take this request.\n", prefix);
+    } else {
+        printf("%sReceived unexpected response from controller: %s\n", prefix, response);
     }
+}
 
-    // convert the length from network byte order to host byte order
-    uint32_t msg_len = ntohl(net_len);
-
-    // allocate memory to store the incoming message
-    char *message = malloc(msg_len + 1); // +1 for null terminator
-    if (message == NULL) {
-        perror("Memory allocation failed");
+// function to send a message to the server
+void send_message(int sockfd, const char *message) {
+    if (frame_send(sockfd, message) == -1) {
+        perror("Failed to send message");
         close(sockfd);
         exit(EXIT_FAILURE);
     }
+}
 
-    // receive the message
-    received_bytes = recv(sockfd, message, msg_len, MSG_WAITALL);
-    if (received_bytes != msg_len) {
-        perror("Failed to receive message");
-        free(message);
+// function to receive length prefixed message from the server
+void receive_message(int sockfd, char *message, size_t size) {
+    errno = 0;
+    if (frame_recv(sockfd, &in_frames, message, size) == -1) {
+        // check if server is closed
+        if (errno == 0) {
+            fprintf(stderr, "Connection closed by server\n");
+        } else {
+            perror("Failed to receive message");
+        }
         close(sockfd);
         exit(EXIT_FAILURE);
     }
-
-    // null-terminate the received message and return
-    message[msg_len] = '\0';
-    return message;
-}
\ No newline at end of file
+}
@@ -1,4 +1,5 @@
-#define _POSIX_C_SOURCE 199309L // Enable CLOCK_MONOTONIC definition
+#define _POSIX_C_SOURCE 200809L // Enable CLOCK_MONOTONIC and pthread_condattr_setclock()
+#define _DEFAULT_SOURCE // syscall(), for the futex wakeups in car_shm.h
 
 #include <stdio.h>      // Standard I/O functions
 #include <stdlib.h>     // Standard library functions
@@ -15,84 +16,184 @@
 #include <sys/types.h>  // Data types
 #include <errno.h>      // Error handling
 #include <netinet/in.h> // Internet address family
+#include <netinet/tcp.h> // TCP_NODELAY
+#include <poll.h>       // Waiting on the socket and wake pipe
 #include <time.h>       // Time functions
+#include "timer_wheel.h" // Phase deadlines
+#include "car_shm.h"    // Shared memory layout
+#include "frame.h"      // Length-prefixed frames
+#include "fleet_shm.h"  // Registry of the cars on this host
+#include "latency.h"    // Latency histograms (stats page)
+#include "car_trace.h"  // Event trace ring
+#include "endpoint.h"   // Controller address (--controller)
 
 // Define constants for ICP-IP communication
-#define PORT 3000            // Port number for the controller server
 #define BUFFER_SIZE 1024     // Buffer size for sending/receiving messages
-
-// Define shared memory structure
+#define OUT_QUEUE_SIZE 4096  // Bytes of frames that can wait for the controller
+#define FLEET_QUEUE_PER_CAR 256 // More bytes that can wait for each car of a fleet
+#define RECONNECT_MAX_MS 2000 // Backoff cap (or the delay, if that is longer)
+#define REGISTRY_WAIT_MS 1000 // Longest wait for another car to finish creating the registry
+
+// Fleet mode (--fleet n) hosts n cars in one process. Each still has its own
+// /car{name} segment, stats page and trace, but they share one controller
+// link and a few worker threads. A worker drives the state machines of its
+// cars from one timer wheel and sleeps in futex_waitv() on their sequence
+// counters, which every writer wakes through car_shm_broadcast()
+#define WATCH_LIMIT (FUTEX_WAITV_MAX - 1) // Cars per worker - one entry is the stop word
+
+// A simulated car
+typedef struct {
+    char *name;
+    char *shm_name;              // Name of the shared memory segment
+    car_shared_mem *mem;         // The shared memory structure
+    fleet_slot *fleet_entry;     // The car's slot in the registry, if it joined it
+    char *latency_name;          // Name of the stats page (/car{name}_latency)
+    latency_page *latency;       // The stats page, if it could be created
+    latency_histogram *floor_latency; // FLOOR frame to an idle car starting to move or open
+    latency_histogram *wake_latency;  // Deadline or FLOOR frame to the car loop running again
+    uint64_t floor_received;     // When an idle car was sent a FLOOR, 0 if none (mutex)
+    uint64_t wake_requested;     // When a FLOOR frame woke the car loop, 0 if none (mutex)
+    int idle;                    // Closed with no phase pending after the last step (mutex)
+    int writing;                 // The current step has opened a write (mutex)
+    char *trace_name;            // Name of the event trace (/car{name}_trace)
+    car_trace *trace;            // The event trace, if it could be created
+    int traced_modes;            // CAR_TRACE_MODE_* bits in the last MODE event
+    char seen_destination[4];    // destination_floor as the car last parsed it
+    int ring_status;             // Last state appended to the status ring
+    int ring_current;
+    int ring_destination;
+
+    timer_wheel *wheel;          // The wheel of the thread driving the car
+    timer_wheel_timer phase_timer; // Ends the current Opening/Open/Closing/Between phase
+    int due;                     // The phase timer fired and the phase hasn't been finished yet
+    uint64_t due_at;             // When it was due
+    uint32_t seen;               // Sequence count after the worker's last step (fleet mode)
+
+    // Protected by channel_mutex
+    int controlled;              // 0 in individual service or emergency mode
+    int registered;              // CAR sent on the current connection and not taken back
+    int sent_status;             // Last STATUS queued for the controller
+    int sent_current;
+    int sent_destination;
+    uint64_t last_queued;        // When that STATUS was queued (for the heartbeat)
+    int status_via_shm;          // The controller reads the status ring instead of STATUS frames
+} sim_car;
+
+// A worker thread driving some of a fleet's cars
 typedef struct {
-  pthread_mutex_t mutex;           // Locked while accessing struct contents
-  pthread_cond_t cond;             // Signalled when the contents change
-  char current_floor[4];           // C string in the range B99-B1 and 1-999
-  char destination_floor[4];       // Same format as above
-  char status[8];                  // C string indicating the elevator's status
-  uint8_t open_button;             // 1 if open doors button is pressed, else 0
-  uint8_t close_button;            // 1 if close doors button is pressed, else 0
-  uint8_t door_obstruction;        // 1 if obstruction detected, else 0
-  uint8_t overload;                // 1 if overload detected
-  uint8_t emergency_stop;          // 1 if stop button has been pressed, else 0
-  uint8_t individual_service_mode; // 1 if in individual service mode, else 0
-  uint8_t emergency_mode;          // 1 if in emergency mode, else 0
-} car_shared_mem;
+    pthread_t thread;
+    timer_wheel wheel;           // Door and movement deadlines of its cars
+    sim_car **cars;
+    int count;
+} car_worker;
 
 // Global variables
-char *shm_name = NULL;       // Name of the shared memory segment
-int shm_fd = -1;             // File descriptor for the shared memory object
-car_shared_mem *shared_mem = NULL; // Pointer to the shared memory structure
+sim_car *cars = NULL;        // The cars this process runs
+int car_count = 0;
+int fleet_size = 0;          // Cars hosted with --fleet, 0 for a single car
+car_worker *workers = NULL;
+int worker_count = 0;
+uint32_t stop_word = 0;      // Futex the signal thread wakes the workers with
+int use_registry = 0;        // Join the fleet registry (--registry)
+fleet_shm *fleet = NULL;     // The registry, if the cars joined it
 
 int sockfd = -1;             // Socket file descriptor for network communication
-int connected = 0;           // Connection status flag (0 = not connected, 1 = connected)
+int heartbeat_ms = 0;        // Resend an unchanged STATUS after this long (0 = never)
+endpoint controller_at;      // Where the controller listens (--controller)
 int delay = 1000;         // Delay in milliseconds for elevator operations
 pthread_t tcp_thread;     // Thread for TCP communication
+pthread_t signal_thread;  // Thread that waits for SIGINT
 
+// Every car of a fleet serves the same floors
 char *lowest_floor = NULL; // Store lowest floor globally for use in TCP thread
 char *highest_floor = NULL; // Store highest floor globally for use in TCP thread
+int lowest_floor_num = 0;   // The same floors as numbers (B1 = 0)
+int highest_floor_num = 0;
+
+// Controller channel state - protected by channel_mutex
+typedef enum {
+    CHANNEL_DOWN,        // Not connected, retrying at retry_at
+    CHANNEL_CONNECTING,  // Waiting for a non-blocking connect to finish
+    CHANNEL_UP,          // CAR sent, STATUS frames follow every transition
+    CHANNEL_CLOSING      // Mode message queued, disconnect once it has gone
+} channel_state;
+
+pthread_mutex_t channel_mutex = PTHREAD_MUTEX_INITIALIZER;
+channel_state channel = CHANNEL_DOWN;
+char *out_storage = NULL;
+frame_buffer out_queue;          // Frames waiting to be written
+int out_overflow = 0;            // The queue filled up - start a new connection
+
+// Used by the TCP thread only
+int wake_pipe[2] = {-1, -1};     // Written to wake the TCP thread from poll()
+char in_storage[FRAME_HEADER_SIZE + BUFFER_SIZE];
+frame_buffer in_frames;          // Partial frames from the controller
+int backoff_ms = 0;              // Wait before the next attempt after a failure
+uint64_t retry_at = 0;           // When to try connecting again
+
+timer_wheel wheel;              // Door and movement deadlines of a single car (CLOCK_MONOTONIC)
 
 volatile sig_atomic_t running = 1; // Flag to control the main loop (used in signal handling) (cannot be interrupted)
 
+// Function prototypes
+void set_status(sim_car *c, car_status status);
+void set_current_floor(sim_car *c, int floor);
+void set_destination_floor(sim_car *c, int floor);
+int report_status_ring(sim_car *c);
+void begin_change(sim_car *c);
+void join_registry(sim_car *c);
+void leave_registry(sim_car *c);
+void init_latency_page(sim_car *c);
+void init_trace(sim_car *c);
+void trace_event(sim_car *c, car_trace_kind kind, int value);
+void trace_modes(sim_car *c);
+void lock_segment(sim_car *c);
+int wait_segment(sim_car *c, const struct timespec *deadline);
+void record_latency(latency_histogram *h, uint64_t from, uint64_t to);
+void phase_expired(timer_wheel_timer *t, void *arg);
+void start_workers(void);
+
 // Signal Handling
 void handle_sigint(int sig) {
     running = 0;
 }
 
-void init_shared_memory(char *name, char *lowest_floor) {
+void init_shared_memory(sim_car *c) {
     // Allocate memory for the shared memory name
-    shm_name = malloc(strlen("/car") + strlen(name) + 1); 
-    if (shm_name == NULL) {
+    c->shm_name = malloc(strlen("/car") + strlen(c->name) + 1); 
+    if (c->shm_name == NULL) {
         perror("Failed to allocate memory for shared memory name");
         exit(EXIT_FAILURE);
     }
 
     // Construct the shared memory name
-    sprintf(shm_name, "/car%s", name);
+    sprintf(c->shm_name, "/car%s", c->name);
 
     // create the shared memory object
-    shm_fd = shm_open(shm_name, O_CREAT | O_RDWR, 0666); // 0666 = read/write permissions for owner, group, and others
+    int shm_fd = shm_open(c->shm_name, O_CREAT | O_RDWR, 0666); // 0666 = read/write permissions for owner, group, and others
     if (shm_fd == -1) { // or < 0 ?
         perror("Failed to create/open shared memory object");
-        free(shm_name);
-        // shm_name = NULL; ?
+        free(c->shm_name);
+        // c->shm_name = NULL; ?
         exit(EXIT_FAILURE);
     }
 
     // Set the size of the shared memory object and handle errors
     if (ftruncate(shm_fd, sizeof(car_shared_mem)) == -1) {
         perror("Failed to set size of shared memory object");
-        shm_unlink(shm_name);
-        free(shm_name);
-        // shm_name = NULL; ?
+        shm_unlink(c->shm_name);
+        free(c->shm_name);
+        // c->shm_name = NULL; ?
         exit(EXIT_FAILURE);
     }
 
     // Map the shared memory object into the address space of the process
-    shared_mem = mmap(NULL, sizeof(car_shared_mem), PROT_READ | PROT_WRITE, MAP_SHARED, shm_fd, 0);
+    c->mem = mmap(NULL, sizeof(car_shared_mem), PROT_READ | PROT_WRITE, MAP_SHARED, shm_fd, 0);
     // error handling
-    if (shared_mem == MAP_FAILED) {
+    if (c->mem == MAP_FAILED) {
         perror("Failed to map shared memory");
-        shm_unlink(shm_name);
-        free(shm_name);
+        shm_unlink(c->shm_name);
+        free(c->shm_name);
         exit(EXIT_FAILURE);
     }
 
@@ -113,6 +214,21 @@ void init_shared_memory(char *name, char *lowest_floor) {
         exit(EXIT_FAILURE);
     }
 
+    // A safety monitor running at real-time priority may wait on the mutex -
+    // priority inheritance keeps a preempted holder from stalling it
+    if (pthread_mutexattr_setprotocol(&mattr, PTHREAD_PRIO_INHERIT) != 0) {
+        perror("Failed to set mutex protocol");
+        // Handle cleanup
+        exit(EXIT_FAILURE);
+    }
+    // If anyone dies holding the mutex, the next process to lock it recovers
+    // the segment instead of hanging (see car_shm_lock())
+    if (pthread_mutexattr_setrobust(&mattr, PTHREAD_MUTEX_ROBUST) != 0) {
+        perror("Failed to set mutex as robust");
+        // Handle cleanup
+        exit(EXIT_FAILURE);
+    }
+
     // Initialize the condition variable attributes
     if (pthread_condattr_init(&cattr) != 0) {
         perror("Failed to initialize condition variable attributes");
@@ -125,14 +241,20 @@ void init_shared_memory(char *name, char *lowest_floor) {
         // Handle cleanup
         exit(EXIT_FAILURE);
     }
+    // Timed waits use the monotonic clock so phase deadlines aren't affected by clock changes
+    if (pthread_condattr_setclock(&cattr, CLOCK_MONOTONIC) != 0) {
+        perror("Failed to set condition variable clock");
+        // Handle cleanup
+        exit(EXIT_FAILURE);
+    }
 
     // Initialize the mutex and condition variable in the shared memory
-    if (pthread_mutex_init(&shared_mem->mutex, &mattr) != 0) {
+    if (pthread_mutex_init(&c->mem->mutex, &mattr) != 0) {
         perror("Failed to initialize mutex");
         // Handle cleanup
         exit(EXIT_FAILURE);
     }
-    if (pthread_cond_init(&shared_mem->cond, &cattr) != 0) {
+    if (pthread_cond_init(&c->mem->cond, &cattr) != 0) {
         perror("Failed to initialize condition variable");
         // Handle cleanup
         exit(EXIT_FAILURE);
@@ -143,428 +265,1194 @@ void init_shared_memory(char *name, char *lowest_floor) {
     pthread_condattr_destroy(&cattr);
 
     // Lock the mutex before modifying shared memory contents
-    pthread_mutex_lock(&shared_mem->mutex);
+    lock_segment(c);
 
     // Initialize other fields
-    // Initialize the current and destination floor with the lowest floor
-    strncpy(shared_mem->current_floor, lowest_floor, sizeof(shared_mem->current_floor));
-    shared_mem->current_floor[sizeof(shared_mem->current_floor) - 1] = '\0'; // Null-terminate the string
+    // Mark the segment as using the versioned layout
+    c->mem->layout_magic = CAR_SHM_MAGIC;
+    c->mem->layout_version = CAR_SHM_VERSION;
+    c->mem->seq = 0;
+    c->mem->status_head = 0;
+    c->mem->link_token = 0;
+    c->mem->changed_ns = 0;
+
+    c->ring_status = CAR_STATUS_UNKNOWN;
+    c->sent_status = CAR_STATUS_UNKNOWN;
+    c->controlled = 1;
+    timer_wheel_timer_init(&c->phase_timer, phase_expired, c);
 
-    strncpy(shared_mem->destination_floor, lowest_floor, sizeof(shared_mem->destination_floor));
-    shared_mem->destination_floor[sizeof(shared_mem->destination_floor) - 1] = '\0'; // Null-terminate the string
+    // Initialize the current and destination floor with the lowest floor
+    set_current_floor(c, lowest_floor_num);
+    set_destination_floor(c, lowest_floor_num);
 
     // Initialize the status with "Closed"
-    strncpy(shared_mem->status, "Closed", sizeof(shared_mem->status));
-    shared_mem->status[sizeof(shared_mem->status) - 1] = '\0';  // Null-terminate the string
+    set_status(c, CAR_STATUS_CLOSED);
+    report_status_ring(c);
+    c->idle = 1;
 
     // Initialize other flags
-    shared_mem->open_button = 0;
-    shared_mem->close_button = 0;
-    shared_mem->door_obstruction = 0;
-    shared_mem->overload = 0;
-    shared_mem->emergency_stop = 0;
-    shared_mem->individual_service_mode = 0;
-    shared_mem->emergency_mode = 0;
+    c->mem->open_button = 0;
+    c->mem->close_button = 0;
+    c->mem->door_obstruction = 0;
+    c->mem->overload = 0;
+    c->mem->emergency_stop = 0;
+    c->mem->individual_service_mode = 0;
+    c->mem->emergency_mode = 0;
 
     // Signal any waiting processes that the shared memory has been initialized
-    pthread_cond_broadcast(&shared_mem->cond);
+    pthread_cond_broadcast(&c->mem->cond);
 
     // Unlock the mutex after modification
-    pthread_mutex_unlock(&shared_mem->mutex);
+    pthread_mutex_unlock(&c->mem->mutex);
+}
+
+// lock a car's segment. The car can't run without it, so a mutex that can't
+// be recovered ends the process
+void lock_segment(sim_car *c) {
+    int err = car_shm_lock(c->mem, sizeof(car_shared_mem));
+    if (err != 0) {
+        errno = err;
+        perror("Failed to lock shared memory");
+        exit(EXIT_FAILURE);
+    }
+}
+
+// wait for a change to a car's segment, until 'deadline' if it isn't NULL.
+// Called with the mutex held. returns 0 when woken or ETIMEDOUT, and ends
+// the process on any other error
+int wait_segment(sim_car *c, const struct timespec *deadline) {
+    int err = car_shm_wait(c->mem, sizeof(car_shared_mem), deadline);
+    if (err != 0 && err != ETIMEDOUT) {
+        errno = err;
+        perror("Failed to wait on shared memory");
+        exit(EXIT_FAILURE);
+    }
+    return err;
+}
+
+// Stats page
+// Like the registry it is only for monitoring, so a car that can't create it
+// carries on without measuring.
+void init_latency_page(sim_car *c) {
+    c->latency_name = malloc(strlen("/car") + strlen(c->name) + strlen("_latency") + 1);
+    if (c->latency_name == NULL) {
+        return;
+    }
+    sprintf(c->latency_name, "/car%s_latency", c->name);
+    c->latency = latency_page_create(c->latency_name);
+    if (c->latency == NULL) {
+        perror("Failed to create the stats page");
+        free(c->latency_name);
+        c->latency_name = NULL;
+        return;
+    }
+    c->floor_latency = latency_page_add(c->latency, "floor");
+    c->wake_latency = latency_page_add(c->latency, "wake");
+}
+
+// count the time from 'from' to 'to', if the car is measuring
+void record_latency(latency_histogram *h, uint64_t from, uint64_t to) {
+    if (h != NULL && to >= from) {
+        latency_record(h, to - from);
+    }
+}
+
+// Event trace
+// Also optional - without it the car runs exactly as before. Events are
+// appended with the mutex held, by whichever code made the change.
+void init_trace(sim_car *c) {
+    c->trace_name = malloc(strlen("/car") + strlen(c->name) + strlen("_trace") + 1);
+    if (c->trace_name == NULL) {
+        return;
+    }
+    sprintf(c->trace_name, "/car%s_trace", c->name);
+    int fd = shm_open(c->trace_name, O_CREAT | O_RDWR, 0666);
+    if (fd == -1 || ftruncate(fd, sizeof(car_trace)) == -1) {
+        perror("Failed to create the event trace");
+        if (fd != -1) {
+            close(fd);
+            shm_unlink(c->trace_name);
+        }
+        free(c->trace_name);
+        c->trace_name = NULL;
+        return;
+    }
+    car_trace *t = mmap(NULL, sizeof(car_trace), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (t == MAP_FAILED) {
+        perror("Failed to map the event trace");
+        shm_unlink(c->trace_name);
+        free(c->trace_name);
+        c->trace_name = NULL;
+        return;
+    }
+
+    // Readers ignore the ring until the magic is set
+    __atomic_store_n(&t->magic, 0, __ATOMIC_RELAXED);
+    t->version = CAR_TRACE_VERSION;
+    t->head = 0;
+    __atomic_store_n(&t->magic, CAR_TRACE_MAGIC, __ATOMIC_RELEASE);
+
+    lock_segment(c);
+    c->trace = t;
+    trace_event(c, CAR_TRACE_STATUS, c->mem->status_code); // Where the car starts
+    pthread_mutex_unlock(&c->mem->mutex);
+}
+
+// append an event with the car's floors to the trace. Called with the mutex held
+void trace_event(sim_car *c, car_trace_kind kind, int value) {
+    if (c->trace != NULL) {
+        car_trace_push(c->trace, timer_wheel_now(), kind, value,
+                       c->mem->current_floor_num, c->mem->destination_floor_num);
+    }
+}
+
+// trace a change of mode or emergency stop. Called with the mutex held
+void trace_modes(sim_car *c) {
+    int modes = (c->mem->individual_service_mode ? CAR_TRACE_MODE_SERVICE : 0) |
+                (c->mem->emergency_mode ? CAR_TRACE_MODE_EMERGENCY : 0) |
+                (c->mem->emergency_stop ? CAR_TRACE_MODE_STOP : 0);
+    if (modes != c->traced_modes) {
+        c->traced_modes = modes;
+        trace_event(c, CAR_TRACE_MODE, modes);
+    }
+}
+
+// Fleet registry
+// The first car to join creates /fleet and every later car maps it. A car
+// that can't join carries on without it - the registry is only for monitors.
+
+// map the registry, creating it if this is the first car. returns NULL on failure
+fleet_shm *map_registry(void) {
+    int fd = shm_open(FLEET_SHM_NAME, O_CREAT | O_EXCL | O_RDWR, 0666);
+    int created = fd != -1;
+    if (!created && errno == EEXIST) {
+        fd = shm_open(FLEET_SHM_NAME, O_RDWR, 0666);
+    }
+    if (fd == -1) {
+        perror("Failed to open fleet registry");
+        return NULL;
+    }
+    if (created && ftruncate(fd, sizeof(fleet_shm)) == -1) {
+        perror("Failed to set size of fleet registry");
+        shm_unlink(FLEET_SHM_NAME);
+        close(fd);
+        return NULL;
+    }
+
+    // Another car may still be creating it - touching it before it has its
+    // size would fault, and before its magic it isn't set up
+    struct timespec pause = {0, 1000000L}; // 1ms
+    int waited = 0;
+    struct stat st;
+    while (fstat(fd, &st) == 0 && (size_t)st.st_size < sizeof(fleet_shm) && waited < REGISTRY_WAIT_MS) {
+        nanosleep(&pause, NULL);
+        waited++;
+    }
+    if ((size_t)st.st_size < sizeof(fleet_shm)) {
+        fprintf(stderr, "Fleet registry is not a registry\n");
+        close(fd);
+        return NULL;
+    }
+
+    fleet_shm *f = mmap(NULL, sizeof(fleet_shm), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (f == MAP_FAILED) {
+        perror("Failed to map fleet registry");
+        return NULL;
+    }
+
+    if (created) {
+        // A car that dies holding the mutex mustn't lock the others out
+        pthread_mutexattr_t mattr;
+        pthread_mutexattr_init(&mattr);
+        pthread_mutexattr_setpshared(&mattr, PTHREAD_PROCESS_SHARED);
+        pthread_mutexattr_setrobust(&mattr, PTHREAD_MUTEX_ROBUST);
+        if (pthread_mutex_init(&f->mutex, &mattr) != 0) {
+            perror("Failed to initialize fleet registry mutex");
+            pthread_mutexattr_destroy(&mattr);
+            munmap(f, sizeof(fleet_shm));
+            shm_unlink(FLEET_SHM_NAME);
+            return NULL;
+        }
+        pthread_mutexattr_destroy(&mattr);
+        f->version = FLEET_SHM_VERSION;
+        f->slot_count = FLEET_SHM_SLOTS;
+        __atomic_store_n(&f->magic, FLEET_SHM_MAGIC, __ATOMIC_RELEASE);
+    }
+    while (!fleet_shm_valid(f, sizeof(fleet_shm)) && waited < REGISTRY_WAIT_MS) {
+        nanosleep(&pause, NULL);
+        waited++;
+    }
+    if (!fleet_shm_valid(f, sizeof(fleet_shm))) {
+        fprintf(stderr, "Fleet registry is not a registry\n");
+        munmap(f, sizeof(fleet_shm));
+        return NULL;
+    }
+    return f;
+}
+
+// claim a registry slot for the car. The cars of a fleet share one mapping
+void join_registry(sim_car *c) {
+    if (fleet == NULL && (fleet = map_registry()) == NULL) {
+        use_registry = 0; // Don't try again for every car
+        return;
+    }
+
+    lock_segment(c);
+    c->fleet_entry = fleet_shm_claim(fleet, c->name, getpid(), delay, c->mem);
+    pthread_mutex_unlock(&c->mem->mutex);
+    if (c->fleet_entry == NULL) {
+        fprintf(stderr, "Fleet registry has no room for car %s\n", c->name);
+    }
+}
+
+// give the car's slot back
+void leave_registry(sim_car *c) {
+    if (c->fleet_entry == NULL) {
+        return;
+    }
+    fleet_shm_release(fleet, c->fleet_entry, getpid());
+    c->fleet_entry = NULL;
+}
+
+// Controller channel
+// The car loops queue STATUS and mode frames with the channel mutex held, and
+// the TCP thread does all of the socket I/O without blocking. Lock order is
+// the shared memory mutex first, then the channel mutex.
+
+// wake the TCP thread from poll()
+void wake_tcp_thread(void) {
+    char byte = 0;
+    if (write(wake_pipe[1], &byte, 1) == -1 && errno != EAGAIN) {
+        perror("write()");
+    }
+}
+
+// append a frame to the outbound queue. Called with the channel mutex held.
+// A controller that falls this far behind gets a fresh connection instead.
+void queue_frame(const char *msg) {
+    if (frame_queue(&out_queue, msg, strlen(msg)) == -1) {
+        out_overflow = 1;
+    }
+}
+
+// queue a frame from one car. On a fleet link every frame starts with the
+// name of the car it is from or for. Called with the channel mutex held
+void queue_car_frame(sim_car *c, const char *msg) {
+    if (fleet_size == 0) {
+        queue_frame(msg);
+        return;
+    }
+    char tagged[2 * BUFFER_SIZE];
+    snprintf(tagged, sizeof(tagged), "%s %s", c->name, msg);
+    queue_frame(tagged);
+}
+
+// queue the car's current status. Called with both mutexes held
+void queue_status(sim_car *c) {
+    char status_msg[BUFFER_SIZE];
+    snprintf(status_msg, BUFFER_SIZE, "STATUS %s %s %s",
+             c->mem->status, c->mem->current_floor, c->mem->destination_floor);
+    queue_car_frame(c, status_msg);
+    c->sent_status = c->mem->status_code;
+    c->sent_current = c->mem->current_floor_num;
+    c->sent_destination = c->mem->destination_floor_num;
+    c->last_queued = timer_wheel_now();
+}
+
+// introduce the car to the controller and send its status. Called with both
+// mutexes held
+void register_car(sim_car *c) {
+    char init_msg[BUFFER_SIZE];
+    snprintf(init_msg, BUFFER_SIZE, "CAR %s %s %s", c->name, lowest_floor, highest_floor);
+    queue_car_frame(c, init_msg);
+    queue_status(c);
+    c->status_via_shm = 0;
+    c->registered = 1;
+}
+
+// the car is leaving the controller's control - say why. A single car then
+// disconnects, a car of a fleet registers again on the same link once it is
+// back. Called with both mutexes held
+void leave_controller(sim_car *c) {
+    queue_car_frame(c, c->mem->individual_service_mode ? "INDIVIDUAL SERVICE" : "EMERGENCY");
+    c->registered = 0;
+    if (fleet_size == 0) {
+        channel = CHANNEL_CLOSING;
+    }
+}
+
+// append the car's state to the status ring if it changed. Called with the
+// shared memory mutex held, inside a write so a controller watching 'seq'
+// sees the event. returns 1 if an event was appended
+int report_status_ring(sim_car *c) {
+    if (c->mem->status_code != c->ring_status ||
+        c->mem->current_floor_num != c->ring_current ||
+        c->mem->destination_floor_num != c->ring_destination) {
+        c->ring_status = c->mem->status_code;
+        c->ring_current = c->mem->current_floor_num;
+        c->ring_destination = c->mem->destination_floor_num;
+        begin_change(c);
+        car_shm_push_status(c->mem);
+        return 1;
+    }
+    return 0;
+}
+
+// mirror the car's state into its registry slot if it changed. Called with
+// the shared memory mutex held
+void report_fleet(sim_car *c) {
+    if (c->fleet_entry == NULL) {
+        return;
+    }
+    if (c->fleet_entry->status_code != c->mem->status_code ||
+        c->fleet_entry->current_floor_num != c->mem->current_floor_num ||
+        c->fleet_entry->destination_floor_num != c->mem->destination_floor_num ||
+        c->fleet_entry->individual_service_mode != c->mem->individual_service_mode ||
+        c->fleet_entry->emergency_mode != c->mem->emergency_mode ||
+        c->fleet_entry->door_obstruction != c->mem->door_obstruction ||
+        c->fleet_entry->overload != c->mem->overload ||
+        c->fleet_entry->emergency_stop != c->mem->emergency_stop) {
+        fleet_shm_update(fleet, c->fleet_entry, c->mem);
+    }
+}
+
+// tell the controller about the car's latest state. Called by the car loop
+// with the shared memory mutex held, so every transition is seen
+void report_status(sim_car *c) {
+    int controlled = !c->mem->individual_service_mode && !c->mem->emergency_mode;
+    report_fleet(c);
+
+    pthread_mutex_lock(&channel_mutex);
+    int wake = controlled != c->controlled;
+    c->controlled = controlled;
+
+    if (channel == CHANNEL_UP && c->registered && !controlled) {
+        // Leaving the controller's control
+        leave_controller(c);
+        wake = 1;
+    } else if (channel == CHANNEL_UP && !c->registered && controlled && fleet_size > 0) {
+        // Back under control - a single car does this by connecting again
+        register_car(c);
+        wake = 1;
+    } else if (channel == CHANNEL_UP && c->registered && !c->status_via_shm &&
+               (c->mem->status_code != c->sent_status ||
+                c->mem->current_floor_num != c->sent_current ||
+                c->mem->destination_floor_num != c->sent_destination)) {
+        queue_status(c);
+        wake = 1;
+    }
+    pthread_mutex_unlock(&channel_mutex);
+
+    if (wake) {
+        wake_tcp_thread();
+    }
+}
+
+// start connecting to the controller. returns the socket, or -1 if the
+// attempt failed straight away. *done is set once the connection is up
+int connect_to_controller(int *done) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd == -1) {
+        perror("socket()");
+        return -1;
+    }
+    if (fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK) == -1) {
+        perror("fcntl()");
+        close(fd);
+        return -1;
+    }
+    // Queued frames already go out together, so don't hold a status back
+    // waiting for the controller to acknowledge the last one
+    int opt_enable = 1;
+    if (setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &opt_enable, sizeof(opt_enable)) == -1) {
+        perror("setsockopt()");
+    }
+
+    *done = 1;
+    if (connect(fd, (const struct sockaddr *)&controller_at.addr, sizeof(controller_at.addr)) == -1) {
+        if (errno != EINPROGRESS) {
+            close(fd);
+            return -1;
+        }
+        *done = 0; // Finishes when the socket becomes writable
+    }
+    return fd;
+}
+
+// the connection is up - introduce the cars and send their status
+void start_channel(void) {
+    pthread_mutex_lock(&channel_mutex);
+    frame_buffer_clear(&out_queue);
+    out_overflow = 0;
+    if (fleet_size > 0) {
+        queue_frame("FLEET"); // Every frame after this one is for a named car
+    }
+    channel = CHANNEL_UP;
+    pthread_mutex_unlock(&channel_mutex);
+
+    // A car that changes state meanwhile registers itself from report_status()
+    for (int i = 0; i < car_count; i++) {
+        sim_car *c = &cars[i];
+        lock_segment(c);
+        pthread_mutex_lock(&channel_mutex);
+        if (channel == CHANNEL_UP && !c->registered && c->controlled) {
+            register_car(c);
+        } else if (channel == CHANNEL_UP && fleet_size == 0 && !c->controlled) {
+            channel = CHANNEL_CLOSING; // Left the controller's control while connecting
+        }
+        pthread_mutex_unlock(&channel_mutex);
+        pthread_mutex_unlock(&c->mem->mutex);
+    }
+
+    frame_buffer_clear(&in_frames);
+    backoff_ms = delay;
+}
+
+// close the connection. 'failed' is set if it was lost rather than closed on
+// purpose, in which case retries back off
+void drop_channel(int failed) {
+    pthread_mutex_lock(&channel_mutex);
+    if (sockfd != -1) {
+        close(sockfd);
+        sockfd = -1;
+    }
+    channel = CHANNEL_DOWN;
+    frame_buffer_clear(&out_queue);
+    out_overflow = 0;
+    for (int i = 0; i < car_count; i++) {
+        cars[i].registered = 0;
+    }
+    pthread_mutex_unlock(&channel_mutex);
+
+    if (failed) {
+        retry_at = timer_wheel_now() + (uint64_t)backoff_ms * 1000000ULL;
+        int max_ms = delay > RECONNECT_MAX_MS ? delay : RECONNECT_MAX_MS;
+        backoff_ms = backoff_ms * 2 > max_ms ? max_ms : backoff_ms * 2;
+    } else {
+        retry_at = 0;
+        backoff_ms = delay;
+    }
+}
+
+// the car of a fleet called 'name' - {name}{number}, numbered from 1 - or
+// NULL if there isn't one
+sim_car *find_car(const char *name) {
+    size_t prefix = strlen(cars[0].name) - 1; // cars[0] is {name}1
+    if (strncmp(name, cars[0].name, prefix) != 0) {
+        return NULL;
+    }
+    int number = atoi(name + prefix);
+    if (number < 1 || number > car_count || strcmp(cars[number - 1].name, name) != 0) {
+        return NULL;
+    }
+    return &cars[number - 1];
+}
+
+// handle one frame from the controller. On a fleet link it starts with the
+// name of the car it is for
+void handle_frame(char *msg) {
+    sim_car *c = &cars[0];
+    if (fleet_size > 0) {
+        char *space = strchr(msg, ' ');
+        if (space == NULL) {
+            return;
+        }
+        *space = '\0';
+        if ((c = find_car(msg)) == NULL) {
+            return;
+        }
+        msg = space + 1;
+    }
+
+    if (strncmp(msg, "SHM ", 4) == 0) {
+        // The controller offers to follow the status ring. It is on this host
+        // only if it wrote the token into this car's own segment - if so, stop
+        // sending STATUS frames and tell it where the frames stopped. Every
+        // event before the ring's head has had its STATUS queued
+        char *end;
+        unsigned long long token = strtoull(msg + 4, &end, 16);
+        lock_segment(c);
+        if (*end == '\0' && token != 0 && token == __atomic_load_n(&c->mem->link_token, __ATOMIC_ACQUIRE)) {
+            char answer[64];
+            snprintf(answer, sizeof(answer), "SHM %016llx %u", token, c->mem->status_head);
+            pthread_mutex_lock(&channel_mutex);
+            c->status_via_shm = 1;
+            queue_car_frame(c, answer);
+            pthread_mutex_unlock(&channel_mutex);
+        }
+        pthread_mutex_unlock(&c->mem->mutex);
+        return;
+    }
+    if (strncmp(msg, "FLOOR ", 6) != 0) {
+        return;
+    }
+
+    lock_segment(c);
+    uint64_t now = timer_wheel_now();
+    if (c->idle) {
+        c->floor_received = now; // Should start moving or open straight away
+    }
+    c->wake_requested = now;
+    car_shm_write_begin(c->mem);
+    car_shm_request_floor(c->mem, msg + 6);
+    car_shm_write_end(c->mem);
+    car_shm_broadcast(c->mem, sizeof(car_shared_mem));
+    pthread_mutex_unlock(&c->mem->mutex);
 }
 
-// Controller helper functions (recieve)
-void recv_looped(int fd, void *buf, size_t sz) {
-    char *ptr = buf;
-    size_t remain = sz;
-    while (remain > 0) {
-        ssize_t received = read(fd, ptr, remain);
+// read whatever the controller has sent and handle each complete frame.
+// returns 0 on success, -1 if the connection failed or was closed
+int read_frames(void) {
+    for (;;) {
+        ssize_t received = frame_fill(sockfd, &in_frames);
         if (received == -1) {
-            perror("read()");
-            exit(EXIT_FAILURE);
+            return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
         } else if (received == 0) {
             // Connection closed by peer
-            fprintf(stderr, "Connection closed by peer\n");
-            exit(EXIT_FAILURE);
+            return -1;
+        }
+
+        char msg[BUFFER_SIZE];
+        int got;
+        while ((got = frame_next(&in_frames, msg, sizeof(msg))) == 1) {
+            handle_frame(msg);
+        }
+        if (got == -1) {
+            return -1; // Not part of the protocol
         }
-        ptr += received;
-        remain -= received;
     }
 }
-char *receive_msg(int fd) {
-    uint32_t nlen;
-    recv_looped(fd, &nlen, sizeof(nlen));
-    uint32_t len = ntohl(nlen);
-    char *buf = malloc(len + 1);
-    if (buf == NULL) {
-        perror("malloc()");
-        exit(EXIT_FAILURE);
+
+// write as much of the outbound queue as the socket takes.
+// returns 0 on success, -1 if the connection failed
+int write_frames(void) {
+    pthread_mutex_lock(&channel_mutex);
+    int result = frame_flush(sockfd, &out_queue);
+    if (out_overflow) {
+        result = -1;
     }
-    recv_looped(fd, buf, len);
-    buf[len] = '\0'; // Null-terminate the message
-    return buf;
-}
-// Controller helper functions (send)
-void send_looped(int fd, const void *buf, size_t sz) {
-    const char *ptr = buf;
-    size_t remain = sz;
-    while (remain > 0) {
-        ssize_t sent = write(fd, ptr, remain);
-        if (sent == -1) {
-            perror("write()");
-            exit(EXIT_FAILURE);
+    pthread_mutex_unlock(&channel_mutex);
+    return result;
+}
+
+// milliseconds until 'when', rounded up, for poll()
+int ms_until(uint64_t when, uint64_t now) {
+    if (when <= now) {
+        return 0;
+    }
+    return (int)((when - now + 999999ULL) / 1000000ULL);
+}
+
+// when the next heartbeat is due, or 0 if no car sends them
+uint64_t next_heartbeat(void) {
+    uint64_t next = 0;
+    if (heartbeat_ms <= 0) {
+        return 0;
+    }
+    pthread_mutex_lock(&channel_mutex);
+    for (int i = 0; i < car_count; i++) {
+        sim_car *c = &cars[i];
+        uint64_t due = c->last_queued + (uint64_t)heartbeat_ms * 1000000ULL;
+        if (c->registered && !c->status_via_shm && (next == 0 || due < next)) {
+            next = due;
         }
-        ptr += sent;
-        remain -= sent;
     }
+    pthread_mutex_unlock(&channel_mutex);
+    return next;
 }
-void send_message(int fd, const char *buf) {
-    uint32_t len = htonl(strlen(buf));
-    send_looped(fd, &len, sizeof(len));
-    send_looped(fd, buf, strlen(buf));
+
+// resend the status of every car that hasn't changed for a heartbeat
+void send_heartbeats(uint64_t now) {
+    for (int i = 0; i < car_count; i++) {
+        sim_car *c = &cars[i];
+        pthread_mutex_lock(&channel_mutex);
+        int due = c->registered && !c->status_via_shm &&
+                  now >= c->last_queued + (uint64_t)heartbeat_ms * 1000000ULL;
+        pthread_mutex_unlock(&channel_mutex);
+        if (!due) {
+            continue;
+        }
+        lock_segment(c);
+        pthread_mutex_lock(&channel_mutex);
+        if (channel == CHANNEL_UP && c->registered) {
+            queue_status(c);
+        }
+        pthread_mutex_unlock(&channel_mutex);
+        pthread_mutex_unlock(&c->mem->mutex);
+    }
 }
 
+// Keeps the car connected to the controller. Frames are read as soon as they
+// arrive and queued frames are written whenever the socket has room, so a slow
+// controller never holds up the car. Failed connections are retried with
+// exponential backoff starting at one delay. A fleet shares one connection.
 void *tcp_communication(void *arg) {
 
-    char *name = (char *)arg;
-    struct sockaddr_in serv_addr;
-    char send_buffer[BUFFER_SIZE];
-    char recv_buffer[BUFFER_SIZE];
-
-    // Set socket to non-blocking
-    int flags = fcntl(sockfd, F_GETFL, 0);
-    fcntl(sockfd, F_SETFL, flags | O_NONBLOCK);
+    backoff_ms = delay;
 
     while (running) {
-        // Attempt to connect if not connected
-        if (!connected && !shared_mem->individual_service_mode && !shared_mem->emergency_mode) {
-            // Create socket
-            sockfd = socket(AF_INET, SOCK_STREAM, 0); // 0 for default protocol (TCP), otherwise use IPPROTO_TCP
-            if (sockfd < 0) {
-                perror("Socket creation failed");
-                sleep(delay / 1000);
+        uint64_t now = timer_wheel_now();
+
+        pthread_mutex_lock(&channel_mutex);
+        channel_state state = channel;
+        int controlled = fleet_size > 0 || cars[0].controlled;
+        int pending = out_queue.len > 0;
+        pthread_mutex_unlock(&channel_mutex);
+
+        // Attempt to connect while the car is under the controller's control
+        // (a fleet stays connected)
+        if (state == CHANNEL_DOWN && controlled && now >= retry_at) {
+            int done;
+            int fd = connect_to_controller(&done);
+            if (fd == -1) {
+                drop_channel(1);
                 continue;
             }
+            pthread_mutex_lock(&channel_mutex);
+            sockfd = fd;
+            channel = CHANNEL_CONNECTING;
+            pthread_mutex_unlock(&channel_mutex);
+            if (done) {
+                start_channel();
+            }
+            continue;
+        }
 
-            // Set up server address
-            memset(&serv_addr, 0, sizeof(serv_addr));
-            serv_addr.sin_family = AF_INET;
-            serv_addr.sin_port = htons(PORT);
-            serv_addr.sin_addr.s_addr = inet_addr("127.0.0.1"); // htonl() ?
+        // The mode message has gone - disconnect
+        if (state == CHANNEL_CLOSING && !pending) {
+            drop_channel(0);
+            continue;
+        }
 
-            //  should i use bind()?
+        // Heartbeat while nothing changes
+        uint64_t heartbeat = state == CHANNEL_UP ? next_heartbeat() : 0;
+        if (heartbeat != 0 && now >= heartbeat) {
+            send_heartbeats(now);
+            continue;
+        }
 
-            // Attempt to connect
-            if (connect(sockfd, (struct sockaddr *)&serv_addr, sizeof(serv_addr)) < 0) {
-                // perror("Connect failed");
-                close(sockfd);
-                sleep(delay / 1000);
-                continue;
+        // Wait for the socket, the car or the next deadline
+        struct pollfd fds[2];
+        int nfds = 1;
+        int timeout = -1;
+        fds[0].fd = wake_pipe[0];
+        fds[0].events = POLLIN;
+        if (state != CHANNEL_DOWN) {
+            fds[1].fd = sockfd;
+            fds[1].events = state == CHANNEL_UP ? POLLIN : 0;
+            if (state == CHANNEL_CONNECTING || pending) {
+                fds[1].events |= POLLOUT;
             }
+            nfds = 2;
+        }
+        if (state == CHANNEL_DOWN && controlled) {
+            timeout = ms_until(retry_at, now);
+        } else if (heartbeat != 0) {
+            timeout = ms_until(heartbeat, now);
+        }
 
-            connected = 1;
-            printf("Connected to controller\n");
-
-            // Send CAR initialization message
-            pthread_mutex_lock(&shared_mem->mutex);
-            char init_msg[BUFFER_SIZE];
-            snprintf(init_msg, BUFFER_SIZE, "CAR %s %s %s", name, lowest_floor, highest_floor);
-            pthread_mutex_unlock(&shared_mem->mutex);
-
-            send_message(sockfd, init_msg);
-        }
-
-        // Send STATUS updates periodically
-        static struct timespec last_status_time = {0, 0};
-        struct timespec current_time;
-        clock_gettime(CLOCK_REALTIME, &current_time);
-        // struct timeval tv;
-        // gettimeofday(&tv, NULL);
-        // current_time.tv_sec = tv.tv_sec;
-        // current_time.tv_nsec = tv.tv_usec * 1000;
-
-        double elapsed_ms = (current_time.tv_sec - last_status_time.tv_sec) * 1000.0 +
-                            (current_time.tv_nsec - last_status_time.tv_nsec) / 1000000.0;
-
-        if (elapsed_ms >= delay) {
-            // Lock shared memory to read status
-            pthread_mutex_lock(&shared_mem->mutex);
-            char status_msg[BUFFER_SIZE];
-            snprintf(status_msg, BUFFER_SIZE, "STATUS %s %s %s",
-                     shared_mem->status, shared_mem->current_floor, shared_mem->destination_floor);
-            pthread_mutex_unlock(&shared_mem->mutex);
-
-            send_message(sockfd, status_msg);
-            last_status_time = current_time;
-        }
-
-        // if (elapsed_ms >= delay) {
-        //     // Lock shared memory to read status
-        //     pthread_mutex_lock(&shared_mem->mutex);
-        //     char status_msg[BUFFER_SIZE];
-        //     snprintf(status_msg, BUFFER_SIZE, "STATUS %s %s %s",
-        //              shared_mem->status, shared_mem->current_floor, shared_mem->destination_floor);
-        //     pthread_mutex_unlock(&shared_mem->mutex);
-
-        //     send_message(sockfd, status_msg);
-        //     last_status_time = current_time;
-        // }
-
-        // Receive messages from controller
-        char *recv_buffer = NULL;
-        recv_buffer = receive_msg(sockfd);
-        if (recv_buffer == NULL) {
-            // Connection closed or error
-            printf("Controller disconnected\n");
-            close(sockfd);
-            connected = 0;
-            sleep(delay / 1000);
+        if (poll(fds, nfds, timeout) == -1) {
+            if (errno != EINTR) {
+                perror("poll()");
+            }
             continue;
         }
-        // free(recv_buffer);
-
-        // Handle controller message
-        pthread_mutex_lock(&shared_mem->mutex);
-        if (strncmp(recv_buffer, "FLOOR ", 6) == 0) {
-            // Update destination floor
-            char *floor = recv_buffer + 6;
-            strncpy(shared_mem->destination_floor, floor, sizeof(shared_mem->destination_floor));
-            shared_mem->destination_floor[sizeof(shared_mem->destination_floor) - 1] = '\0';
-            pthread_cond_broadcast(&shared_mem->cond);
-        }
-        pthread_mutex_unlock(&shared_mem->mutex);
-        free(recv_buffer);
-
-        // Check for individual service mode or emergency mode to disconnect
-        pthread_mutex_lock(&shared_mem->mutex);
-        if ((shared_mem->individual_service_mode || shared_mem->emergency_mode) && connected) {
-            // Send appropriate message before disconnecting
-            char mode_msg[BUFFER_SIZE];
-            if (shared_mem->individual_service_mode) {
-                snprintf(mode_msg, BUFFER_SIZE, "INDIVIDUAL SERVICE");
-            } else if (shared_mem->emergency_mode) {
-                snprintf(mode_msg, BUFFER_SIZE, "EMERGENCY");
+
+        if (fds[0].revents & POLLIN) {
+            char drain[64];
+            while (read(wake_pipe[0], drain, sizeof(drain)) > 0) {
+                ;
             }
-            // where is this message being sent?
-            send_message(sockfd, mode_msg);
-            close(sockfd);
-            connected = 0;
-            printf("Disconnected from controller due to mode change\n");
-            // if ((shared_mem->individual_service_mode || shared_mem->emergency_mode) && connected) {
-            // // Send appropriate message before disconnecting
-            // char *mode_msg = shared_mem->individual_service_mode ? "INDIVIDUAL SERVICE" : "EMERGENCY";
-            // send_message(sockfd, mode_msg);
-            // close(sockfd);
-            // connected = 0;
-            // printf("Disconnected from controller due to mode change\n");
         }
-        pthread_mutex_unlock(&shared_mem->mutex);
+        if (nfds < 2 || fds[1].revents == 0) {
+            continue;
+        }
 
+        if (state == CHANNEL_CONNECTING) {
+            int err = 0;
+            socklen_t err_len = sizeof(err);
+            if (getsockopt(sockfd, SOL_SOCKET, SO_ERROR, &err, &err_len) == -1 || err != 0) {
+                drop_channel(1);
+            } else {
+                start_channel();
+            }
+            continue;
+        }
 
-        sleep(delay / 1000); // Sleep for 100ms
+        if ((fds[1].revents & (POLLIN | POLLHUP | POLLERR)) && state == CHANNEL_UP && read_frames() == -1) {
+            drop_channel(1);
+            continue;
+        }
+        if (write_frames() == -1) {
+            drop_channel(1);
+        }
     }
-    
-    // Clean up
-    if (connected) {
-        close(sockfd);
+
+    if (sockfd != -1) {
+        drop_channel(0);
     }
     return NULL;
 
 }
 
 
+// start the step's changes to a car, if this is the first. Lock-free readers
+// retry if they overlap them, and a step that changes nothing leaves 'seq'
+// alone. Called with the mutex held
+void begin_change(sim_car *c) {
+    if (!c->writing) {
+        car_shm_write_begin(c->mem);
+        c->writing = 1;
+    }
+}
+
 // Elevator Movement Helper Functions
-int floor_label_to_number(const char *floor_label) {
-    if (floor_label[0] == 'B' || floor_label[0] == 'b') {
-        // Basement floor
-        int floor_num = atoi(floor_label + 1);
-        return -floor_num;
-    } else {
-        // Regular floor
-        return atoi(floor_label);
+// These are called with the mutex held. The car keeps the binary fields in
+// sync with the strings, so its own checks compare integers.
+void set_status(sim_car *c, car_status status) {
+    int changed = c->mem->status_code != status;
+    strncpy(c->mem->status, car_status_name(status), sizeof(c->mem->status));
+    c->mem->status[sizeof(c->mem->status) - 1] = '\0';
+    c->mem->status_code = status;
+    if (changed) {
+        trace_event(c, CAR_TRACE_STATUS, status);
     }
 }
-void floor_number_to_label(int floor_num, char *floor_label, size_t label_size) {
-    if (floor_num < 0) {
-        // Basement floor
-        snprintf(floor_label, label_size, "B%d", -floor_num);
+void set_current_floor(sim_car *c, int floor) {
+    int changed = c->mem->current_floor_num != floor;
+    floor_to_label(floor, c->mem->current_floor, sizeof(c->mem->current_floor));
+    c->mem->current_floor_num = floor;
+    if (changed) {
+        trace_event(c, CAR_TRACE_FLOOR, 0);
+    }
+}
+void set_destination_floor(sim_car *c, int floor) {
+    int changed = c->mem->destination_floor_num != floor;
+    floor_to_label(floor, c->mem->destination_floor, sizeof(c->mem->destination_floor));
+    c->mem->destination_floor_num = floor;
+    memcpy(c->seen_destination, c->mem->destination_floor, sizeof(c->seen_destination));
+    if (changed) {
+        trace_event(c, CAR_TRACE_DESTINATION, 0);
+    }
+}
+// pick up a destination written as a string by the TCP thread, internal or a
+// legacy tool. Only parsed when the bytes change.
+// returns 1 if the car's state changed
+int sync_destination(sim_car *c) {
+    int floor;
+    if (memcmp(c->seen_destination, c->mem->destination_floor, sizeof(c->seen_destination)) == 0) {
+        return 0;
+    }
+    begin_change(c);
+    c->mem->destination_floor[sizeof(c->mem->destination_floor) - 1] = '\0';
+    if (floor_from_label(c->mem->destination_floor, &floor) == -1 ||
+        floor < lowest_floor_num || floor > highest_floor_num) {
+        // Reset destination_floor to current_floor
+        set_destination_floor(c, c->mem->current_floor_num);
     } else {
-        // Regular floor
-        snprintf(floor_label, label_size, "%d", floor_num);
+        int changed = c->mem->destination_floor_num != floor;
+        c->mem->destination_floor_num = floor;
+        memcpy(c->seen_destination, c->mem->destination_floor, sizeof(c->seen_destination));
+        if (changed) {
+            trace_event(c, CAR_TRACE_DESTINATION, 0);
+        }
     }
+    return 1;
 }
-void move_one_floor() {
-    // Convert current and destination floors to numbers
-    int current_floor_num = floor_label_to_number(shared_mem->current_floor);
-    int destination_floor_num = floor_label_to_number(shared_mem->destination_floor);
-
-    // Update current floor to one floor closer to destination
-    if (current_floor_num < destination_floor_num) {
-        current_floor_num++;
-    } else if (current_floor_num > destination_floor_num) {
-        current_floor_num--;
+// move one floor towards the destination
+void move_one_floor(sim_car *c) {
+    int floor = c->mem->current_floor_num;
+    if (floor < c->mem->destination_floor_num) {
+        floor++;
+    } else if (floor > c->mem->destination_floor_num) {
+        floor--;
     }
-
-    // Convert back to floor label
-    floor_number_to_label(current_floor_num, shared_mem->current_floor, sizeof(shared_mem->current_floor));
-    shared_mem->current_floor[sizeof(shared_mem->current_floor) - 1] = '\0';
-
-    // Update status to Closed
-    strncpy(shared_mem->status, "Closed", sizeof(shared_mem->status));
-    // shared_mem->status[sizeof(shared_mem->status) - 1] = '\0';
-    // Notify other processes or threads waiting on this condition variable
-    pthread_cond_broadcast(&shared_mem->cond);
-    // unlock the mutex after updating shared variables
-    pthread_mutex_unlock(&shared_mem->mutex);
+    set_current_floor(c, floor);
 }
-int is_floor_within_range(const char *floor_label) {
-    // Convert floor labels to numbers
-    int floor_num = floor_label_to_number(floor_label);
-    int lowest_floor_num = floor_label_to_number(lowest_floor);
-    int highest_floor_num = floor_label_to_number(highest_floor);
 
-    // Check if the floor number is within the range
-    return floor_num >= lowest_floor_num && floor_num <= highest_floor_num;
+// Phase timing - the wheel owns every door and movement deadline and is only
+// touched by the thread driving the car
+uint64_t delay_ns(void) {
+    return (uint64_t)delay * 1000000ULL;
+}
+// start a phase lasting one delay from 'from'
+void start_phase(sim_car *c, car_status status, uint64_t from) {
+    set_status(c, status);
+    timer_wheel_schedule(c->wheel, &c->phase_timer, from + delay_ns());
 }
-void handle_door_operations() {
-    // Lock the mutex before accessing shared variables
-    pthread_mutex_lock(&shared_mem->mutex);
+
+// handle the door buttons and obstruction sensor. A button press preempts the
+// pending phase. Called with the mutex held.
+// returns 1 if the car's state changed
+int handle_door_operations(sim_car *c, uint64_t now) {
+    int changed = 0;
 
     // If open_button is pressed, open the doors
-    if (shared_mem->open_button) {
-        // Handle open button if doors are closed or closing
-        if (strcmp(shared_mem->status, "Closed") == 0 || strcmp(shared_mem->status, "Closing") == 0) {
+    if (c->mem->open_button) {
+        begin_change(c);
+        trace_event(c, CAR_TRACE_BUTTON, CAR_TRACE_OPEN_BUTTON);
+        if (c->mem->status_code == CAR_STATUS_CLOSED || c->mem->status_code == CAR_STATUS_CLOSING) {
             // Reopen doors
-            strncpy(shared_mem->status, "Opening", sizeof(shared_mem->status));
+            start_phase(c, CAR_STATUS_OPENING, now);
+        } else if (c->mem->status_code == CAR_STATUS_OPEN && (c->phase_timer.pending || c->due)) {
+            // Keep the doors open for another delay
+            timer_wheel_schedule(c->wheel, &c->phase_timer, now + delay_ns());
         }
         // Reset open_button
-        shared_mem->open_button = 0;
+        c->mem->open_button = 0;
+        changed = 1;
     }
 
-    if (shared_mem->close_button) {
+    if (c->mem->close_button) {
+        begin_change(c);
+        trace_event(c, CAR_TRACE_BUTTON, CAR_TRACE_CLOSE_BUTTON);
         // Handle close button
-        if (strcmp(shared_mem->status, "Open") == 0) {
+        if (c->mem->status_code == CAR_STATUS_OPEN) {
             // Start closing doors
-            strncpy(shared_mem->status, "Closing", sizeof(shared_mem->status));
+            start_phase(c, CAR_STATUS_CLOSING, now);
         }
         // Reset close_button
-        shared_mem->close_button = 0;
+        c->mem->close_button = 0;
+        changed = 1;
+    }
+
+    // Something is blocking the doors - open them again
+    if (c->mem->door_obstruction && c->mem->status_code == CAR_STATUS_CLOSING) {
+        begin_change(c);
+        trace_event(c, CAR_TRACE_BUTTON, CAR_TRACE_OBSTRUCTION);
+        start_phase(c, CAR_STATUS_OPENING, now);
+        changed = 1;
+    }
+
+    return changed;
+}
+
+// phase timer callback - the car finishes the phase in its next step. The
+// wheel of a fleet worker holds timers of cars whose mutex isn't held, so
+// nothing in shared memory is touched here
+void phase_expired(timer_wheel_timer *t, void *arg) {
+    sim_car *c = arg;
+    c->due = 1;
+    c->due_at = t->expires;
+}
+
+// finish the current phase if its time has come. Called with the mutex held.
+// returns 1 if the car's state changed
+int finish_phase(sim_car *c) {
+    if (!c->due) {
+        return 0;
+    }
+    c->due = 0;
+    if (c->phase_timer.pending) {
+        return 0; // A button started another phase first
+    }
+
+    // Chained phases start when the previous one was due, so they don't drift
+    uint64_t due = c->due_at;
+    begin_change(c);
+
+    if (c->mem->status_code == CAR_STATUS_OPENING) {
+        set_status(c, CAR_STATUS_OPEN);
+        // In individual service and emergency mode the doors stay open until the close button is pressed
+        if (!c->mem->individual_service_mode && !c->mem->emergency_mode) {
+            timer_wheel_schedule(c->wheel, &c->phase_timer, due + delay_ns());
+        }
+    } else if (c->mem->status_code == CAR_STATUS_OPEN) {
+        start_phase(c, CAR_STATUS_CLOSING, due);
+    } else if (c->mem->status_code == CAR_STATUS_CLOSING) {
+        set_status(c, CAR_STATUS_CLOSED);
+    } else if (c->mem->status_code == CAR_STATUS_BETWEEN) {
+        move_one_floor(c);
+        if (c->mem->current_floor_num != c->mem->destination_floor_num &&
+            !c->mem->emergency_mode) {
+            // Keep moving
+            timer_wheel_schedule(c->wheel, &c->phase_timer, due + delay_ns());
+        } else if (c->mem->individual_service_mode || c->mem->emergency_mode) {
+            set_status(c, CAR_STATUS_CLOSED);
+        } else {
+            // Arrived - open the doors
+            start_phase(c, CAR_STATUS_OPENING, due);
+        }
     }
+    return 1;
+}
+
+// start moving if the car has somewhere to go. Called with the mutex held.
+// returns 1 if the car's state changed
+int start_moving(sim_car *c, uint64_t now) {
+    if (c->phase_timer.pending || c->mem->emergency_mode ||
+        c->mem->status_code != CAR_STATUS_CLOSED ||
+        c->mem->current_floor_num == c->mem->destination_floor_num) {
+        return 0;
+    }
+
+    // Change the car's status to 'Between' for one delay per floor
+    begin_change(c);
+    start_phase(c, CAR_STATUS_BETWEEN, now);
+    return 1;
+}
 
-    pthread_cond_broadcast(&shared_mem->cond);
-    pthread_mutex_unlock(&shared_mem->mutex);
+// one step of a car, after its thread has advanced its wheel to 'now'.
+// Called with the mutex held.
+// returns 1 if the car's state changed, and the new state may itself need handling
+int step_car(sim_car *c, uint64_t now) {
+    // The write is opened by the step's first change (begin_change())
+    int changed = 0;
+    trace_modes(c);
+    changed |= sync_destination(c);
+    changed |= handle_door_operations(c, now);
+    changed |= finish_phase(c);
+    changed |= start_moving(c, now);
+    int pushed = report_status_ring(c);
+    if (c->writing) {
+        car_shm_write_end(c->mem);
+        c->writing = 0;
+    }
+    report_status(c);
 
-    // Continue door operation based on status
-    // if status is "Opening", wait for delay and change status to "Open"
-    if (strcmp(shared_mem->status, "Opening") == 0) {
-        sleep(delay * 1000);
-        pthread_mutex_lock(&shared_mem->mutex);
-        strncpy(shared_mem->status, "Open", sizeof(shared_mem->status));
-        pthread_cond_broadcast(&shared_mem->cond);
-        pthread_mutex_unlock(&shared_mem->mutex);
-    // if status is "Closing", wait for delay and change status to "Closed"
-    } else if (strcmp(shared_mem->status, "Closing") == 0) {
-        sleep(delay * 1000);
-        pthread_mutex_lock(&shared_mem->mutex);
-        strncpy(shared_mem->status, "Closed", sizeof(shared_mem->status));
-        pthread_cond_broadcast(&shared_mem->cond);
-        pthread_mutex_unlock(&shared_mem->mutex);
+    // The step after a FLOOR frame is the one that acts on it
+    if (c->floor_received != 0) {
+        if (c->mem->status_code == CAR_STATUS_BETWEEN || c->mem->status_code == CAR_STATUS_OPENING) {
+            record_latency(c->floor_latency, c->floor_received, timer_wheel_now());
+        }
+        c->floor_received = 0;
     }
+    c->idle = c->mem->status_code == CAR_STATUS_CLOSED && !c->phase_timer.pending && !c->due;
+
+    if (changed || pushed) {
+        // Notify other processes or threads waiting on this condition variable
+        car_shm_broadcast(c->mem, sizeof(car_shared_mem));
+    }
+    return changed;
 }
 
 // Normal Operation main loop
-void normal_operation(void) {
+void normal_operation(sim_car *c) {
+    // The mutex is only released while waiting on the condition variable
+    lock_segment(c);
+
+    timer_wheel_init(&wheel, timer_wheel_now());
+    c->wheel = &wheel;
+
     // main loop runs as long as the 'running' flag is true
     while (running) {
-        // lock the shared memory mutex to safely access shared variables/avoid conflicts
-        pthread_mutex_lock(&shared_mem->mutex);
-
-        // Handle emergency mode
-        if (shared_mem->emergency_mode) {
-            // cease all operations
-            // unlock the mutex before entering the emergency handling loop to allow other threads to access shared memory
-            pthread_mutex_unlock(&shared_mem->mutex);
-            // allow door operations via buttons
-            handle_door_operations();
-            continue;
+        uint64_t now = timer_wheel_now();
+        timer_wheel_advance(&wheel, now);
+        if (step_car(c, now)) {
+            continue; // The new state may itself need handling
         }
 
-        // Handle individual service mode
-        if (shared_mem->individual_service_mode) {
-            // doors do not open/close automatically - handled by technician
-            // Technician controls movement
-            if (strcmp(shared_mem->status, "Open") == 0 || strcmp(shared_mem->status, "Closed") == 0) {
-                // Check if destination_floor has changed
-                if (strcmp(shared_mem->current_floor, shared_mem->destination_floor) != 0) {
-                    // Ensure doors are closed before moving
-                    if (strcmp(shared_mem->status, "Closed") == 0) {
-                        // Validate destination_floor
-                        if (is_floor_within_range(shared_mem->destination_floor)) {
-                            // Move one floor
-                            move_one_floor();
-                        } else {
-                            // Reset destination_floor to current_floor
-                            strncpy(shared_mem->destination_floor, shared_mem->current_floor, sizeof(shared_mem->destination_floor));
-                        }
-                    }
-                }
+        // Sleep until the next deadline or until something in shared memory changes
+        uint64_t next;
+        int woken;
+        if (timer_wheel_next(&wheel, &next) == 0) {
+            struct timespec deadline = {next / 1000000000ULL, next % 1000000000ULL};
+            woken = wait_segment(c, &deadline) == 0;
+            if (!woken) {
+                record_latency(c->wake_latency, next, timer_wheel_now());
             }
-            // unlock the mutex before handling door operations
-            pthread_mutex_unlock(&shared_mem->mutex);
-            // handle door operations via buttons
-            handle_door_operations();
-            continue;
+        } else {
+            woken = wait_segment(c, NULL) == 0;
         }
+        if (woken && c->wake_requested != 0) {
+            record_latency(c->wake_latency, c->wake_requested, timer_wheel_now());
+        }
+        c->wake_requested = 0;
+        // Writers built before version 4 only signal the condition variable -
+        // pass their changes on to any supervisors
+        if (woken) {
+            car_shm_wake_watchers(c->mem, sizeof(car_shared_mem));
+        }
+    }
 
-        // Normal operation
-        // Check if the destination floor is different from the current floor and the doors are closed (ready to move)
-        if (strcmp(shared_mem->current_floor, shared_mem->destination_floor) != 0 &&
-            strcmp(shared_mem->status, "Closed") == 0) {
-
-            // Change the car's status to 'Between'
-            strncpy(shared_mem->status, "Between", sizeof(shared_mem->status)); // ensure string is null-terminated
-
-            // Notify other processes or threads waiting on this condition variable (will be useful for queing)
-            pthread_cond_broadcast(&shared_mem->cond);
+    pthread_mutex_unlock(&c->mem->mutex);
+}
 
-            // Unlock the mutex before simulating the movement delay
-            pthread_mutex_unlock(&shared_mem->mutex);
+// Fleet workers
+// Each car belongs to one worker, which is the only thread that steps it or
+// touches its phase timer. A worker counts itself in the watchers of its
+// cars, so a button, sensor or FLOOR written to a segment wakes it, and
+// sleeps until the next deadline on its wheel. Writers that only signal the
+// condition variable (built before version 4) aren't seen.
+
+// drive some of a fleet's cars until the car is stopped
+void *drive_cars(void *arg) {
+    car_worker *w = arg;
+    struct futex_waitv waiters[FUTEX_WAITV_MAX];
+    memset(waiters, 0, sizeof(waiters));
+
+    // Count in before the first step, so no writer can miss us
+    for (int i = 0; i < w->count; i++) {
+        sim_car *c = w->cars[i];
+        __atomic_add_fetch(&c->mem->watchers, 1, __ATOMIC_SEQ_CST);
+        c->seen = __atomic_load_n(&c->mem->seq, __ATOMIC_ACQUIRE) + 1; // Step every car first
+        waiters[i].uaddr = (uintptr_t)&c->mem->seq;
+        waiters[i].flags = FUTEX_32;
+    }
+    waiters[w->count].uaddr = (uintptr_t)&stop_word;
+    waiters[w->count].flags = FUTEX_32 | FUTEX_PRIVATE_FLAG;
 
-            // Wait for delay to simulate time taken to move one floor
-            sleep(delay * 1000);
+    while (running) {
+        uint64_t now = timer_wheel_now();
+        timer_wheel_advance(&w->wheel, now);
+        for (int i = 0; i < w->count; i++) {
+            sim_car *c = w->cars[i];
+            if (!c->due && __atomic_load_n(&c->mem->seq, __ATOMIC_ACQUIRE) == c->seen) {
+                continue;
+            }
+            lock_segment(c);
+            if (c->due) {
+                record_latency(c->wake_latency, c->due_at, now);
+            }
+            if (c->wake_requested != 0) {
+                record_latency(c->wake_latency, c->wake_requested, now);
+                c->wake_requested = 0;
+            }
+            while (step_car(c, timer_wheel_now())) {
+                ;
+            }
+            c->seen = __atomic_load_n(&c->mem->seq, __ATOMIC_ACQUIRE);
+            pthread_mutex_unlock(&c->mem->mutex);
+        }
 
-            // Lock the mutex again to update shared variables
-            pthread_mutex_lock(&shared_mem->mutex);
+        // Sleep until a car's segment changes or the next deadline
+        uint64_t next;
+        struct timespec deadline;
+        struct timespec *timeout = NULL;
+        if (timer_wheel_next(&w->wheel, &next) == 0) {
+            deadline.tv_sec = next / 1000000000ULL;
+            deadline.tv_nsec = next % 1000000000ULL;
+            timeout = &deadline;
+        }
+        for (int i = 0; i < w->count; i++) {
+            waiters[i].val = w->cars[i]->seen;
+        }
+        waiters[w->count].val = 0;
+        if (syscall(SYS_futex_waitv, waiters, w->count + 1, 0, timeout, CLOCK_MONOTONIC) == -1 &&
+            errno != EAGAIN && errno != EINTR && errno != ETIMEDOUT) {
+            perror("futex_waitv()");
+            break;
+        }
+    }
 
-            // Move one floor towards the destination floor
-            move_one_floor();
+    for (int i = 0; i < w->count; i++) {
+        __atomic_sub_fetch(&w->cars[i]->mem->watchers, 1, __ATOMIC_SEQ_CST);
+    }
+    return NULL;
+}
 
-            // Check if the car has arrived at the destination floor
-            if (strcmp(shared_mem->current_floor, shared_mem->destination_floor) == 0) {
-                // Proceed to handle door operations upon arrival
-                handle_door_operations();
-            }
-        } else {
-        // Either the car is already at the destination floor or doors are not closed
+// share the cars out between the workers and start them. Each worker takes
+// at most WATCH_LIMIT cars, so there may be more workers than asked for
+void start_workers(void) {
+    if (worker_count <= 0) {
+        worker_count = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    }
+    if (worker_count < (car_count + WATCH_LIMIT - 1) / WATCH_LIMIT) {
+        worker_count = (car_count + WATCH_LIMIT - 1) / WATCH_LIMIT;
+    }
+    if (worker_count > car_count) {
+        worker_count = car_count;
+    }
+    workers = calloc(worker_count, sizeof(car_worker));
+    if (workers == NULL) {
+        perror("calloc()");
+        exit(EXIT_FAILURE);
+    }
+    uint64_t now = timer_wheel_now();
+    for (int i = 0; i < worker_count; i++) {
+        car_worker *w = &workers[i];
+        timer_wheel_init(&w->wheel, now);
+        w->cars = malloc(sizeof(sim_car *) * ((car_count + worker_count - 1) / worker_count));
+        if (w->cars == NULL) {
+            perror("malloc()");
+            exit(EXIT_FAILURE);
+        }
+    }
+    for (int i = 0; i < car_count; i++) {
+        car_worker *w = &workers[i % worker_count];
+        cars[i].wheel = &w->wheel;
+        w->cars[w->count++] = &cars[i];
+    }
+    for (int i = 0; i < worker_count; i++) {
+        if (pthread_create(&workers[i].thread, NULL, drive_cars, &workers[i]) != 0) {
+            perror("pthread_create()");
+            exit(EXIT_FAILURE);
+        }
+    }
+}
 
-            // Unlock the mutex before handling door operations
-            pthread_mutex_unlock(&shared_mem->mutex);
+// Wakes the car when SIGINT arrives. The signal is blocked in every other
+// thread, so a car sleeping on the condition variable can't miss it.
+void *signal_handling(void *arg) {
+    sigset_t *set = arg;
+    int sig;
+    while (sigwait(set, &sig) != 0) {
+        ;
+    }
+    handle_sigint(sig);
 
-            // Handle door operations
-            handle_door_operations();
-        }
+    if (fleet_size == 0) {
+        lock_segment(&cars[0]);
+        pthread_cond_broadcast(&cars[0].mem->cond);
+        pthread_mutex_unlock(&cars[0].mem->mutex);
+    } else {
+        __atomic_store_n(&stop_word, 1, __ATOMIC_SEQ_CST);
+        syscall(SYS_futex, &stop_word, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
+    }
 
+    // Unblock the TCP thread if it's waiting on the controller
+    wake_tcp_thread();
+    return NULL;
+}
 
+// unlink a car's segments
+void close_car(sim_car *c) {
+    leave_registry(c);
+    if (c->latency != NULL) {
+        munmap(c->latency, sizeof(latency_page));
+        shm_unlink(c->latency_name);
+        free(c->latency_name);
+    }
+    if (c->trace != NULL) {
+        munmap(c->trace, sizeof(car_trace));
+        shm_unlink(c->trace_name);
+        free(c->trace_name);
     }
+    munmap(c->mem, sizeof(car_shared_mem));
+    shm_unlink(c->shm_name);
+    free(c->shm_name);
 }
 
+// print how to run the car and exit
+void usage(const char *program) {
+    fprintf(stderr, "Usage: %s {name} {lowest floor} {highest floor} {delay} [--heartbeat ms] [--registry]"
+                    " [--controller host:port] [--fleet n [--workers n]]\n", program);
+    exit(EXIT_FAILURE);
+}
 
 int main(int argc, char *argv[]) {
     
     // Argument parsing and initialization
-    if (argc != 5) {
-        fprintf(stderr, "Usage: %s {name} {lowest floor} {highest floor} {delay}\n", argv[0]);
-        exit(EXIT_FAILURE);
+    if (argc < 5) {
+        usage(argv[0]);
+    }
+    const char *controller_spec = "127.0.0.1";
+    for (int i = 5; i < argc; i++) {
+        if (strcmp(argv[i], "--heartbeat") == 0 && i + 1 < argc) {
+            heartbeat_ms = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--registry") == 0) {
+            use_registry = 1;
+        } else if (strcmp(argv[i], "--controller") == 0 && i + 1 < argc) {
+            controller_spec = argv[++i];
+        } else if (strcmp(argv[i], "--fleet") == 0 && i + 1 < argc && atoi(argv[i + 1]) > 0) {
+            fleet_size = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--workers") == 0 && i + 1 < argc && atoi(argv[i + 1]) > 0) {
+            worker_count = atoi(argv[++i]);
+        } else {
+            usage(argv[0]);
+        }
     }
     
     char *name = argv[1];
@@ -572,37 +1460,120 @@ int main(int argc, char *argv[]) {
     highest_floor = argv[3];
     delay = atoi(argv[4]);   // convert to int
 
+    if (endpoint_parse(controller_spec, "127.0.0.1", &controller_at) == -1) {
+        fprintf(stderr, "Invalid controller address: %s\n", controller_spec);
+        exit(EXIT_FAILURE);
+    }
+
     // Validate delay_ms
     if (delay <= 0) {
         fprintf(stderr, "Invalid delay value. It must be a positive integer.\n");
         exit(EXIT_FAILURE);
     }
 
-    // Could add more validations for car input arguments
+    // Validate the floor range
+    if (floor_from_label(lowest_floor, &lowest_floor_num) == -1 ||
+        floor_from_label(highest_floor, &highest_floor_num) == -1 ||
+        lowest_floor_num > highest_floor_num) {
+        fprintf(stderr, "Invalid floor range. Floors must be B99-B1 or 1-999, lowest first.\n");
+        exit(EXIT_FAILURE);
+    }
+
+    if (fleet_size > 0 && !car_shm_futex_waitv_works()) {
+        fprintf(stderr, "A fleet needs futex_waitv() (Linux 5.16 or later).\n");
+        exit(EXIT_FAILURE);
+    }
+
+    // A fleet's cars are {name}1 to {name}n
+    car_count = fleet_size > 0 ? fleet_size : 1;
+    cars = calloc(car_count, sizeof(sim_car));
+    if (cars == NULL) {
+        perror("calloc()");
+        exit(EXIT_FAILURE);
+    }
+    for (int i = 0; i < car_count; i++) {
+        if (fleet_size == 0) {
+            cars[i].name = name;
+        } else if ((cars[i].name = malloc(strlen(name) + 12)) != NULL) {
+            sprintf(cars[i].name, "%s%d", name, i + 1);
+        } else {
+            perror("malloc()");
+            exit(EXIT_FAILURE);
+        }
+    }
 
-    // Signal handling
-    signal(SIGINT, handle_sigint);
+    // Signal handling - SIGINT is blocked here (and in the threads created below)
+    // and collected by the signal thread instead
     signal(SIGPIPE, SIG_IGN); // Ignore SIGPIPE signals
+    sigset_t sigint_set;
+    sigemptyset(&sigint_set);
+    sigaddset(&sigint_set, SIGINT);
+    pthread_sigmask(SIG_BLOCK, &sigint_set, NULL);
+
+    // A fleet's frames all wait in the one queue
+    size_t out_size = OUT_QUEUE_SIZE + (size_t)fleet_size * FLEET_QUEUE_PER_CAR;
+    if ((out_storage = malloc(out_size)) == NULL) {
+        perror("malloc()");
+        exit(EXIT_FAILURE);
+    }
+    frame_buffer_init(&out_queue, out_storage, out_size);
+    frame_buffer_init(&in_frames, in_storage, sizeof(in_storage));
+
+    // Pipe for waking the TCP thread - neither end may block
+    if (pipe(wake_pipe) == -1) {
+        perror("pipe()");
+        exit(EXIT_FAILURE);
+    }
+    fcntl(wake_pipe[0], F_SETFL, fcntl(wake_pipe[0], F_GETFL, 0) | O_NONBLOCK);
+    fcntl(wake_pipe[1], F_SETFL, fcntl(wake_pipe[1], F_GETFL, 0) | O_NONBLOCK);
 
     // Initialize shared memory
-    init_shared_memory(name, lowest_floor);
+    for (int i = 0; i < car_count; i++) {
+        init_shared_memory(&cars[i]);
+        init_latency_page(&cars[i]);
+        init_trace(&cars[i]);
+        if (use_registry) {
+            join_registry(&cars[i]);
+        }
+    }
 
-    // Start TCP communication thread
-    pthread_create(&tcp_thread, NULL, tcp_communication, (void *)name);
+    // Start signal and TCP communication threads
+    pthread_create(&signal_thread, NULL, signal_handling, &sigint_set);
+    if (fleet_size > 0) {
+        start_workers(); // Before the TCP thread can hand them a FLOOR
+    }
+    pthread_create(&tcp_thread, NULL, tcp_communication, NULL);
 
     // // Start elevator main loop
-    normal_operation();
+    if (fleet_size == 0) {
+        normal_operation(&cars[0]);
+    } else {
+        for (int i = 0; i < worker_count; i++) {
+            pthread_join(workers[i].thread, NULL);
+            free(workers[i].cars);
+        }
+        free(workers);
+    }
 
-    // Wait for TCP thread to finish
+    // Wait for the threads to finish
     pthread_join(tcp_thread, NULL);
+    pthread_join(signal_thread, NULL);
+
+    close(wake_pipe[0]);
+    close(wake_pipe[1]);
 
     // Cleanup shared memory
-    munmap(shared_mem, sizeof(car_shared_mem));
-    shm_unlink(shm_name);
-    close(shm_fd);
-    free(shm_name);
+    for (int i = 0; i < car_count; i++) {
+        close_car(&cars[i]);
+        if (fleet_size > 0) {
+            free(cars[i].name);
+        }
+    }
+    if (fleet != NULL) {
+        munmap(fleet, sizeof(fleet_shm));
+    }
+    free(cars);
+    free(out_storage);
 
     return 0;
 }
-
-
@@ -0,0 +1,497 @@
+#ifndef CAR_SHM_H
+#define CAR_SHM_H
+
+#include <stddef.h>         // offsetof
+#include <stdint.h>         // Standard integer types
+#include <stdio.h>          // snprintf
+#include <string.h>         // String manipulation functions
+#include <time.h>           // clock_gettime
+#include <pthread.h>        // POSIX threads
+#include <limits.h>         // INT_MAX
+#include <errno.h>          // EOWNERDEAD
+#include <unistd.h>         // syscall
+#include <fcntl.h>          // O_RDWR
+#include <sys/mman.h>       // mmap
+#include <sys/stat.h>       // fstat
+#include <sys/syscall.h>    // SYS_futex
+#include <linux/futex.h>    // FUTEX_WAKE, futex_waitv
+#include "floor_label.h"    // Floor labels and numbers
+
+// Shared memory layout of a car (/car{name}).
+//
+// The legacy fields come first and are unchanged, so anything built against
+// the original structure keeps working on a segment created by a newer car.
+// Version 1 appends a binary copy of the floors and status that the car keeps
+// in sync with the strings. Readers must check car_shm_has_layout() before
+// using it - a segment may have been created at the legacy size.
+//
+// Version 2 adds a sequence counter so observers can copy the car's state
+// without taking the mutex. Writers still hold the mutex and bracket their
+// changes with car_shm_write_begin()/car_shm_write_end(). The count is odd
+// while a write is in progress, and car_shm_read() retries until it sees the
+// same even count before and after copying. Processes built against the
+// legacy layout don't bump the count, so a read can still overlap one of
+// their writes.
+//
+// Version 3 adds a ring of status events for a controller on the same host.
+// The car appends one for every transition, and the controller reads them
+// without a STATUS frame. A reader that falls more than a ring behind has
+// missed events and starts again from a snapshot.
+//
+// Version 4 lets a watcher follow many cars from one thread by waiting on
+// their sequence counters (futex_waitv) instead of one condition variable
+// each. A watcher counts itself in 'watchers', and writers that change a
+// segment call car_shm_broadcast(), which wakes the condition variable and,
+// if anyone is watching, the futex on 'seq'.
+//
+// Version 5 adds a token a controller on the same host writes before it
+// offers the fast path (SHM {token}). Only a car that finds the token in its
+// own segment takes the offer, so a stale segment left by a crashed car is
+// never mistaken for a remote car of the same name.
+//
+// Version 6 adds the CLOCK_MONOTONIC time of the last change, stamped by
+// car_shm_broadcast(). A supervisor times its reaction from the moment the
+// change was written rather than from when it woke up, so the wakeup and
+// scheduling delay are counted.
+//
+// The car creates its mutex robust, so a process that dies holding it - the
+// car, a tester, internal, safety or the controller - doesn't hang everyone
+// else. Lock it with car_shm_lock() and wait with car_shm_wait(): the next
+// process to get the mutex closes any write the dead one left open and marks
+// it consistent.
+//
+// Building with CAR_SHM_PADDED (make PADDED=1) selects a layout with the same
+// fields grouped by the process that writes them, each group on its own cache
+// line: the car's state, the operator's buttons and modes (internal), and the
+// safety sensors. A button press then stops invalidating the line the car
+// reads on every iteration. The padded layout doesn't keep the legacy
+// offsets, so every process on the host must be built the same way - the
+// magic differs, and a padded segment is always mapped whole.
+
+#define CAR_SHM_CACHE_LINE 64
+#ifdef CAR_SHM_PADDED
+#define CAR_SHM_MAGIC 0x43415250u   // "CARP"
+#else
+#define CAR_SHM_MAGIC 0x43415231u   // "CAR1"
+#endif
+#define CAR_SHM_VERSION 6
+#define CAR_SHM_READ_RETRIES 64     // Lock-free attempts before car_shm_read() takes the mutex
+#define CAR_SHM_RING_SIZE 16        // Status events kept (a power of two)
+
+#ifndef SYS_futex_waitv
+#define SYS_futex_waitv 449         // Missing from older libc headers
+#endif
+
+// Binary car status, in the order the doors cycle
+typedef enum {
+    CAR_STATUS_OPENING,
+    CAR_STATUS_OPEN,
+    CAR_STATUS_CLOSING,
+    CAR_STATUS_CLOSED,
+    CAR_STATUS_BETWEEN,
+    CAR_STATUS_UNKNOWN
+} car_status;
+
+// One transition of a car, in the status ring
+typedef struct {
+  int16_t current_floor_num;
+  int16_t destination_floor_num;
+  uint8_t status_code;
+} car_shm_status_event;
+
+#ifndef CAR_SHM_PADDED
+typedef struct {
+  pthread_mutex_t mutex;           // Locked while accessing struct contents
+  pthread_cond_t cond;             // Signalled when the contents change
+  char current_floor[4];           // C string in the range B99-B1 and 1-999
+  char destination_floor[4];       // Same format as above
+  char status[8];                  // C string indicating the elevator's status
+  uint8_t open_button;             // 1 if open doors button is pressed, else 0
+  uint8_t close_button;            // 1 if close doors button is pressed, else 0
+  uint8_t door_obstruction;        // 1 if obstruction detected, else 0
+  uint8_t overload;                // 1 if overload detected
+  uint8_t emergency_stop;          // 1 if stop button has been pressed, else 0
+  uint8_t individual_service_mode; // 1 if in individual service mode, else 0
+  uint8_t emergency_mode;          // 1 if in emergency mode, else 0
+
+  // Version 1 - only valid when car_shm_has_layout() is true
+  uint32_t layout_magic;           // CAR_SHM_MAGIC
+  uint16_t layout_version;         // CAR_SHM_VERSION
+  int16_t current_floor_num;       // current_floor as a number (B1 = 0, B99 = -98)
+  int16_t destination_floor_num;   // destination_floor as a number
+  uint8_t status_code;             // status as a car_status
+
+  // Version 2
+  uint32_t seq;                    // Odd while a writer is changing the contents
+
+  // Version 3
+  uint32_t status_head;            // Number of events ever written to status_ring
+  car_shm_status_event status_ring[CAR_SHM_RING_SIZE];
+
+  // Version 4
+  uint32_t watchers;               // Watchers waiting on 'seq' as a futex
+
+  // Version 5
+  uint64_t link_token;             // Written by a controller offering the fast path
+
+  // Version 6
+  uint64_t changed_ns;             // CLOCK_MONOTONIC time of the last broadcast change
+} car_shared_mem;
+#else
+#define CAR_SHM_LINE __attribute__((aligned(CAR_SHM_CACHE_LINE)))
+typedef struct {
+  // Shared by everyone
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+  uint32_t watchers;
+  uint64_t link_token;
+  uint64_t changed_ns;
+
+  // Written by the car
+  char current_floor[4] CAR_SHM_LINE;
+  char destination_floor[4];
+  char status[8];
+  uint32_t layout_magic;
+  uint16_t layout_version;
+  int16_t current_floor_num;
+  int16_t destination_floor_num;
+  uint8_t status_code;
+  uint32_t seq;
+  uint32_t status_head;
+  car_shm_status_event status_ring[CAR_SHM_RING_SIZE];
+
+  // Written by the operator panel (internal)
+  uint8_t open_button CAR_SHM_LINE;
+  uint8_t close_button;
+  uint8_t individual_service_mode;
+
+  // Written by the safety system
+  uint8_t door_obstruction CAR_SHM_LINE;
+  uint8_t overload;
+  uint8_t emergency_stop;
+  uint8_t emergency_mode;
+} CAR_SHM_LINE car_shared_mem;
+#undef CAR_SHM_LINE
+#endif
+
+// A copy of a car's state, as taken by car_shm_read()
+typedef struct {
+  char current_floor[4];
+  char destination_floor[4];
+  char status[8];
+  uint8_t open_button;
+  uint8_t close_button;
+  uint8_t door_obstruction;
+  uint8_t overload;
+  uint8_t emergency_stop;
+  uint8_t individual_service_mode;
+  uint8_t emergency_mode;
+  int16_t current_floor_num;       // Filled in from the strings for legacy segments
+  int16_t destination_floor_num;
+  uint8_t status_code;
+} car_shm_snapshot;
+
+#ifndef CAR_SHM_PADDED
+#define CAR_SHM_LEGACY_SIZE offsetof(car_shared_mem, layout_magic)
+#define CAR_SHM_V1_SIZE offsetof(car_shared_mem, seq)
+#define CAR_SHM_V2_SIZE offsetof(car_shared_mem, status_head)
+#define CAR_SHM_V3_SIZE offsetof(car_shared_mem, watchers)
+#define CAR_SHM_V4_SIZE offsetof(car_shared_mem, link_token)
+#define CAR_SHM_V5_SIZE offsetof(car_shared_mem, changed_ns)
+#else
+// The padded layout has no older versions
+#define CAR_SHM_LEGACY_SIZE sizeof(car_shared_mem)
+#define CAR_SHM_V1_SIZE sizeof(car_shared_mem)
+#define CAR_SHM_V2_SIZE sizeof(car_shared_mem)
+#define CAR_SHM_V3_SIZE sizeof(car_shared_mem)
+#define CAR_SHM_V4_SIZE sizeof(car_shared_mem)
+#define CAR_SHM_V5_SIZE sizeof(car_shared_mem)
+#endif
+
+static const char *const car_status_names[] = {"Opening", "Open", "Closing", "Closed", "Between", ""};
+
+// bytes of a segment of 'size' bytes to map - as much of the layout as it
+// holds. returns 0 if it is too small to be a car
+static inline size_t car_shm_map_size(size_t size) {
+    if (size < CAR_SHM_LEGACY_SIZE) {
+        return 0;
+    }
+    return size < sizeof(car_shared_mem) ? size : sizeof(car_shared_mem);
+}
+
+// map an existing car segment (shm_name is "/car{name}"), as much of the
+// layout as it holds, and set '*mapped' to the bytes mapped. returns NULL if
+// there is no such segment, it is too small to be a car or it can't be mapped
+static inline car_shared_mem *car_shm_open(const char *shm_name, size_t *mapped) {
+    int fd = shm_open(shm_name, O_RDWR, 0666);
+    if (fd == -1) {
+        return NULL;
+    }
+    struct stat st;
+    size_t size = fstat(fd, &st) == -1 ? 0 : car_shm_map_size(st.st_size);
+    car_shared_mem *m = size == 0 ? MAP_FAILED : mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (m == MAP_FAILED) {
+        return NULL;
+    }
+    *mapped = size;
+    return m;
+}
+
+// 1 if the first 'mapped' bytes of a segment include the version 1 fields
+static inline int car_shm_has_layout(const car_shared_mem *m, size_t mapped) {
+    return mapped >= CAR_SHM_V1_SIZE && m->layout_magic == CAR_SHM_MAGIC &&
+           m->layout_version >= 1;
+}
+
+// 1 if the segment has the version 2 sequence counter
+static inline int car_shm_has_seqlock(const car_shared_mem *m, size_t mapped) {
+    return car_shm_has_layout(m, mapped) && mapped >= CAR_SHM_V2_SIZE && m->layout_version >= 2;
+}
+
+// 1 if the segment has the version 3 status ring
+static inline int car_shm_has_ring(const car_shared_mem *m, size_t mapped) {
+    return car_shm_has_seqlock(m, mapped) && mapped >= CAR_SHM_V3_SIZE && m->layout_version >= 3;
+}
+
+// 1 if the segment has the version 4 watcher count
+static inline int car_shm_has_watchers(const car_shared_mem *m, size_t mapped) {
+    return car_shm_has_ring(m, mapped) && mapped >= CAR_SHM_V4_SIZE && m->layout_version >= 4;
+}
+
+// 1 if the segment has the version 5 link token
+static inline int car_shm_has_link_token(const car_shared_mem *m, size_t mapped) {
+    return car_shm_has_watchers(m, mapped) && mapped >= CAR_SHM_V5_SIZE && m->layout_version >= 5;
+}
+
+// 1 if the segment has the version 6 change time
+static inline int car_shm_has_change_time(const car_shared_mem *m, size_t mapped) {
+    return car_shm_has_link_token(m, mapped) && mapped >= sizeof(car_shared_mem) && m->layout_version >= 6;
+}
+
+// wake any watchers waiting on the sequence counter
+static inline void car_shm_wake_watchers(car_shared_mem *m, size_t mapped) {
+    if (!car_shm_has_watchers(m, mapped)) {
+        return;
+    }
+    // Pairs with the watcher counting itself in before it reads 'seq'
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&m->watchers, __ATOMIC_RELAXED) > 0) {
+        syscall(SYS_futex, &m->seq, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+    }
+}
+
+// 1 if the kernel has futex_waitv() (Linux 5.16 and later), which watchers
+// of many cars need. Without it each car is watched on its condition variable
+static inline int car_shm_futex_waitv_works(void) {
+    uint32_t word = 1;
+    struct futex_waitv waiter;
+    memset(&waiter, 0, sizeof(waiter));
+    waiter.uaddr = (uintptr_t)&word;
+    waiter.val = 0; // Doesn't match, so this returns straight away
+    waiter.flags = FUTEX_32 | FUTEX_PRIVATE_FLAG;
+    return syscall(SYS_futex_waitv, &waiter, 1, 0, NULL, CLOCK_MONOTONIC) == -1 && errno == EAGAIN;
+}
+
+// tell everyone waiting on a car that its contents changed, stamping the
+// time of the change first
+static inline void car_shm_broadcast(car_shared_mem *m, size_t mapped) {
+    if (car_shm_has_change_time(m, mapped)) {
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        __atomic_store_n(&m->changed_ns, (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec, __ATOMIC_RELEASE);
+    }
+    pthread_cond_broadcast(&m->cond);
+    car_shm_wake_watchers(m, mapped);
+}
+
+// mark the start of a change. Called with the mutex held
+static inline void car_shm_write_begin(car_shared_mem *m) {
+    __atomic_store_n(&m->seq, m->seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+// mark the end of a change. Called with the mutex held
+static inline void car_shm_write_end(car_shared_mem *m) {
+    __atomic_store_n(&m->seq, m->seq + 1, __ATOMIC_RELEASE);
+}
+
+// make a segment usable again after a process died holding its mutex. Called
+// with the mutex held, when a lock or wait returned EOWNERDEAD. A write the
+// dead holder left open is closed, so readers stop retrying, and whatever it
+// changed is announced
+static inline void car_shm_recover(car_shared_mem *m, size_t mapped) {
+    if (car_shm_has_seqlock(m, mapped) && (m->seq & 1)) {
+        car_shm_write_end(m);
+    }
+    pthread_mutex_consistent(&m->mutex);
+    car_shm_broadcast(m, mapped);
+}
+
+// lock a car's mutex, recovering it if the last holder died. returns 0 on
+// success, or the error from pthread_mutex_lock() - ENOTRECOVERABLE if a
+// process found the holder dead and gave up without recovering
+static inline int car_shm_lock(car_shared_mem *m, size_t mapped) {
+    int err = pthread_mutex_lock(&m->mutex);
+    if (err == EOWNERDEAD) {
+        car_shm_recover(m, mapped);
+        err = 0;
+    }
+    return err;
+}
+
+// wait on the condition variable until 'deadline' (CLOCK_MONOTONIC), or
+// until woken if it is NULL. Called with the mutex held. returns 0 when
+// woken, ETIMEDOUT, or another error from the wait. Getting the mutex back
+// from a holder that died counts as a wakeup
+static inline int car_shm_wait(car_shared_mem *m, size_t mapped, const struct timespec *deadline) {
+    int err = deadline != NULL ? pthread_cond_timedwait(&m->cond, &m->mutex, deadline)
+                               : pthread_cond_wait(&m->cond, &m->mutex);
+    if (err == EOWNERDEAD) {
+        car_shm_recover(m, mapped);
+        err = 0;
+    }
+    return err;
+}
+
+// append the car's state to the status ring. Called by the car with the mutex held
+static inline void car_shm_push_status(car_shared_mem *m) {
+    uint32_t head = m->status_head;
+    car_shm_status_event *e = &m->status_ring[head & (CAR_SHM_RING_SIZE - 1)];
+    // The last release of 'status_head' must be visible before the slot is
+    // reused - pairs with the fence in car_shm_next_status()
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    e->current_floor_num = m->current_floor_num;
+    e->destination_floor_num = m->destination_floor_num;
+    e->status_code = m->status_code;
+    __atomic_store_n(&m->status_head, head + 1, __ATOMIC_RELEASE);
+}
+
+// take the next event from the status ring. '*tail' counts the events read
+// so far. returns 1 if an event was copied to 'out', 0 if there are no new
+// events, or -1 if events were overwritten before they could be read - the
+// reader is moved up to the newest event and should take a snapshot instead
+static inline int car_shm_next_status(car_shared_mem *m, uint32_t *tail, car_shm_status_event *out) {
+    uint32_t head = __atomic_load_n(&m->status_head, __ATOMIC_ACQUIRE);
+    if (head == *tail) {
+        return 0;
+    }
+    if (head - *tail > CAR_SHM_RING_SIZE) {
+        *tail = head;
+        return -1;
+    }
+    const car_shm_status_event *e = &m->status_ring[*tail & (CAR_SHM_RING_SIZE - 1)];
+    out->current_floor_num = e->current_floor_num;
+    out->destination_floor_num = e->destination_floor_num;
+    out->status_code = e->status_code;
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    // The car may have come round and started writing this slot while it was copied
+    head = __atomic_load_n(&m->status_head, __ATOMIC_RELAXED);
+    if (head - *tail >= CAR_SHM_RING_SIZE) {
+        *tail = head;
+        return -1;
+    }
+    (*tail)++;
+    return 1;
+}
+
+// send the car to a floor, as a FLOOR frame does. A car that is already there
+// with its doors closed or closing opens them again, so the stop is made.
+// Called with the mutex held
+static inline void car_shm_request_floor(car_shared_mem *m, const char *floor) {
+    if (strncmp(floor, m->current_floor, sizeof(m->current_floor)) == 0 &&
+        (m->status_code == CAR_STATUS_CLOSED || m->status_code == CAR_STATUS_CLOSING)) {
+        m->open_button = 1;
+    }
+    strncpy(m->destination_floor, floor, sizeof(m->destination_floor));
+    m->destination_floor[sizeof(m->destination_floor) - 1] = '\0';
+}
+
+static inline car_status car_status_from_name(const char *name) {
+    for (int i = 0; i < CAR_STATUS_UNKNOWN; i++) {
+        if (strcmp(name, car_status_names[i]) == 0) {
+            return (car_status)i;
+        }
+    }
+    return CAR_STATUS_UNKNOWN;
+}
+
+static inline const char *car_status_name(car_status status) {
+    return status < CAR_STATUS_UNKNOWN ? car_status_names[status] : car_status_names[CAR_STATUS_UNKNOWN];
+}
+
+static inline void car_shm_copy(const car_shared_mem *m, car_shm_snapshot *out, int binary) {
+    memcpy(out->current_floor, m->current_floor, sizeof(out->current_floor));
+    memcpy(out->destination_floor, m->destination_floor, sizeof(out->destination_floor));
+    memcpy(out->status, m->status, sizeof(out->status));
+    out->open_button = m->open_button;
+    out->close_button = m->close_button;
+    out->door_obstruction = m->door_obstruction;
+    out->overload = m->overload;
+    out->emergency_stop = m->emergency_stop;
+    out->individual_service_mode = m->individual_service_mode;
+    out->emergency_mode = m->emergency_mode;
+    if (binary) {
+        out->current_floor_num = m->current_floor_num;
+        out->destination_floor_num = m->destination_floor_num;
+        out->status_code = m->status_code;
+    }
+}
+
+// terminate the strings of a copy and fill in the binary fields of a legacy one
+static inline void car_shm_finish_copy(car_shm_snapshot *out, int binary) {
+    // The strings come from another process, so never trust the terminators
+    out->current_floor[sizeof(out->current_floor) - 1] = '\0';
+    out->destination_floor[sizeof(out->destination_floor) - 1] = '\0';
+    out->status[sizeof(out->status) - 1] = '\0';
+
+    if (!binary) {
+        int floor;
+        out->current_floor_num = floor_from_label(out->current_floor, &floor) == 0 ? floor : 0;
+        out->destination_floor_num = floor_from_label(out->destination_floor, &floor) == 0 ? floor : 0;
+        out->status_code = car_status_from_name(out->status);
+    }
+}
+
+// take a consistent copy of a car's state without the mutex. returns 0 on
+// success, or -1 if the segment has no sequence counter or every attempt
+// collided with a write
+static inline int car_shm_try_read(car_shared_mem *m, size_t mapped, car_shm_snapshot *out) {
+    if (!car_shm_has_seqlock(m, mapped)) {
+        return -1;
+    }
+    for (int attempts = 0; attempts < CAR_SHM_READ_RETRIES; attempts++) {
+        uint32_t before = __atomic_load_n(&m->seq, __ATOMIC_ACQUIRE);
+        if (before & 1) {
+            continue; // Write in progress
+        }
+        car_shm_copy(m, out, 1);
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&m->seq, __ATOMIC_RELAXED) == before) {
+            car_shm_finish_copy(out, 1);
+            return 0;
+        }
+    }
+    return -1;
+}
+
+// take a consistent copy of a car's state. 'mapped' is the number of bytes of
+// the segment that are mapped. Segments without a sequence counter, and
+// readers that keep colliding with writes, fall back to the mutex. returns 0
+// on success, or the error from car_shm_lock()
+static inline int car_shm_read(car_shared_mem *m, size_t mapped, car_shm_snapshot *out) {
+    if (car_shm_try_read(m, mapped, out) == 0) {
+        return 0;
+    }
+    int binary = car_shm_has_layout(m, mapped);
+    int err = car_shm_lock(m, mapped);
+    if (err != 0) {
+        return err;
+    }
+    car_shm_copy(m, out, binary);
+    pthread_mutex_unlock(&m->mutex);
+    car_shm_finish_copy(out, binary);
+    return 0;
+}
+
+#endif
@@ -0,0 +1,115 @@
+#ifndef CAR_TRACE_H
+#define CAR_TRACE_H
+
+#include <stddef.h>         // size_t
+#include <stdint.h>         // Standard integer types
+
+// Event trace of a car (/car{name}_trace).
+//
+// Monitors that poll /car{name} only see the states that are still there
+// when they look, so a short phase or a button that was handled at once can
+// be missed. The car appends every transition to this ring instead - status
+// changes, floors passed, new destinations, door buttons and sensor events,
+// and mode changes - each with its CLOCK_MONOTONIC time. Tools follow the
+// ring (test/car-trace) and can rebuild exactly what the car did.
+//
+// The car is the only writer and appends with the car's mutex already held,
+// so an event is a handful of stores and a release of 'head'. Readers never
+// take the mutex or make the car wait: a reader that falls more than a ring
+// behind loses the oldest events and is told how many.
+
+#define CAR_TRACE_MAGIC 0x54524331u // "TRC1"
+#define CAR_TRACE_VERSION 1
+#define CAR_TRACE_SIZE 4096         // Events kept (a power of two)
+
+typedef enum {
+    CAR_TRACE_STATUS,       // value is the new car_status
+    CAR_TRACE_FLOOR,        // The car reached 'floor'
+    CAR_TRACE_DESTINATION,  // The destination changed to 'destination'
+    CAR_TRACE_BUTTON,       // value is a car_trace_button
+    CAR_TRACE_MODE          // value holds the CAR_TRACE_MODE_* bits now set
+} car_trace_kind;
+
+typedef enum {
+    CAR_TRACE_OPEN_BUTTON,
+    CAR_TRACE_CLOSE_BUTTON,
+    CAR_TRACE_OBSTRUCTION   // The doors reopened for an obstruction
+} car_trace_button;
+
+#define CAR_TRACE_MODE_SERVICE 1
+#define CAR_TRACE_MODE_EMERGENCY 2
+#define CAR_TRACE_MODE_STOP 4
+
+// One event. 'floor' and 'destination' are the car's after the event
+typedef struct {
+  uint64_t time_ns;                // CLOCK_MONOTONIC
+  int16_t floor;                   // Floors as numbers (B1 = 0, B99 = -98)
+  int16_t destination;
+  uint8_t kind;                    // A car_trace_kind
+  uint8_t value;
+} car_trace_event;
+
+typedef struct {
+  uint32_t magic;                  // CAR_TRACE_MAGIC, set once the segment is initialised
+  uint16_t version;                // CAR_TRACE_VERSION
+  uint16_t reserved;
+  uint64_t head __attribute__((aligned(64))); // Number of events ever written
+  car_trace_event events[CAR_TRACE_SIZE] __attribute__((aligned(64)));
+} car_trace;
+
+// 1 if a mapped segment of 'mapped' bytes is an initialised trace
+static inline int car_trace_valid(const car_trace *t, size_t mapped) {
+    return mapped >= sizeof(car_trace) &&
+           __atomic_load_n(&t->magic, __ATOMIC_ACQUIRE) == CAR_TRACE_MAGIC &&
+           t->version == CAR_TRACE_VERSION;
+}
+
+// append an event. Only called by the car, with its mutex held
+static inline void car_trace_push(car_trace *t, uint64_t time_ns, car_trace_kind kind, int value,
+                                  int floor, int destination) {
+    uint64_t head = t->head;
+    car_trace_event *e = &t->events[head & (CAR_TRACE_SIZE - 1)];
+    // The last release of 'head' must be visible before the slot is reused -
+    // pairs with the fence in car_trace_next(), as in car_shm_write_begin()
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    e->time_ns = time_ns;
+    e->floor = floor;
+    e->destination = destination;
+    e->kind = kind;
+    e->value = value;
+    __atomic_store_n(&t->head, head + 1, __ATOMIC_RELEASE);
+}
+
+// take the next event. '*tail' counts the events read so far, and starts at
+// 0 for the whole ring or car_trace_head() for new events only. returns 1 if
+// an event was copied to 'out', 0 if there are no new events, or the negated
+// number of events that were overwritten before they could be read - the
+// reader is moved up to the oldest event still in the ring
+static inline long car_trace_next(const car_trace *t, uint64_t *tail, car_trace_event *out) {
+    uint64_t head = __atomic_load_n(&t->head, __ATOMIC_ACQUIRE);
+    if (head == *tail) {
+        return 0;
+    }
+    if (head - *tail > CAR_TRACE_SIZE) {
+        uint64_t lost = head - CAR_TRACE_SIZE - *tail;
+        *tail = head - CAR_TRACE_SIZE;
+        return -(long)lost;
+    }
+    *out = t->events[*tail & (CAR_TRACE_SIZE - 1)];
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    // The car may have come round and started writing this slot while it was copied
+    head = __atomic_load_n(&t->head, __ATOMIC_RELAXED);
+    if (head - *tail >= CAR_TRACE_SIZE) {
+        uint64_t lost = head - CAR_TRACE_SIZE + 1 - *tail;
+        *tail += lost;
+        return -(long)lost;
+    }
+    (*tail)++;
+    return 1;
+}
+
+static inline uint64_t car_trace_head(const car_trace *t) {
+    return __atomic_load_n(&t->head, __ATOMIC_ACQUIRE);
+}
+
+#endif
@@ -0,0 +1,1849 @@
+#include <stdio.h>          // Standard I/O functions
+#include <stdlib.h>         // Standard library functions
+#include <string.h>         // String manipulation functions
+#include <stdint.h>         // Standard integer types
+#include <unistd.h>         // POSIX API functions
+#include <signal.h>         // Signal handling
+#include <fcntl.h>          // File control options
+#include <errno.h>          // Error handling
+#include <time.h>           // Time functions
+#include <poll.h>           // Waiting on the primary (--standby)
+#include <arpa/inet.h>      // Internet operations
+#include <sys/socket.h>     // Socket programming
+#include <sys/types.h>      // Data types
+#include <sys/epoll.h>      // Event notification (epoll reactor)
+#include <sys/eventfd.h>    // Wakeups from the shared memory watchers
+#include <netinet/in.h>     // Internet address family
+#include <netinet/tcp.h>    // TCP_NODELAY
+#include "stop_queue.h"     // Per-car stop queue
+#include "dispatch.h"       // Car selection
+#include "frame.h"          // Length-prefixed frames
+#include "shm_link.h"       // Shared memory fast path to local cars
+#include "eta_model.h"      // Learned per-car floor and stop times
+#include "park.h"           // Idle car parking policies
+#include "latency.h"        // Latency histograms (STATS)
+#include "floor_label.h"    // Floor labels and numbers
+#include "endpoint.h"       // Listening and shard addresses (--listen, --peer)
+
+// Define constants
+#define BUFFER_SIZE 1024        // Largest frame body accepted from a client
+#define OUT_BUFFER_SIZE 4096    // Pending outbound bytes kept per connection
+#define MAX_EVENTS 256          // Events handled per epoll_wait() call
+#define LISTEN_BACKLOG 512      // Pending connections (bursts of CALL clients)
+#define CALL_WINDOW 64          // Unanswered calls read from one session before it is paused
+#define REQUEST_ID_SIZE 16      // Request ids are up to 15 digits
+
+// Relative cost of a stop against travelling one floor. A stop is three door
+// phases (opening, open, closing) and a floor is one movement phase, each
+// lasting one car delay. Used until the cars have been timed (see eta_model.h)
+#define FLOOR_TIME 1.0
+#define STOP_TIME 3.0
+
+// Parking (--park). A car is idle once it has waited with its doors closed
+// for as long as one of its stops takes - a car that hasn't been timed yet
+// is assumed to have the default one second delay
+#define PARK_INTERVAL_MS 100    // How often the idle cars are looked at
+#define PARK_IDLE_STOPS 1.0     // Stop times a car waits before it is parked
+
+// Hot standby (--standby). A standby follows the primary's cars over a
+// STANDBY connection and takes over the port once the primary has gone
+#define STANDBY_RETRY_MS 100    // Wait before following again if the port is still taken
+#define STANDBY_POLL_MS 100     // Longest a standby waits before checking 'running'
+
+// Zone sharding (--peer). The cars of a large site are split between the
+// shards of a cluster - low-rise, high-rise, service - each a controller
+// that its own cars connect to. Every shard subscribes to the others (ZONES)
+// and is told the floor ranges of their cars whenever they change (ZONE),
+// so a call point can call any shard: a call that none of the shard's own
+// cars can serve is passed on to a shard whose cars can, as a session call
+// on the link to it, and the reply is passed back
+#define MAX_SHARDS 16           // Other shards a controller can be given
+#define MAX_ZONES 64            // Distinct car floor ranges a shard reports
+#define SHARD_RETRY_MS 1000     // Wait before connecting to a shard again
+
+// Connection types - a connection is unknown until its first frame arrives
+#define CONN_UNKNOWN 0
+#define CONN_CAR 1
+#define CONN_CALL 2
+#define CONN_STANDBY 3
+#define CONN_PEER 4             // Another shard following this one's zones - its calls aren't passed on
+#define CONN_SHARD 5            // This controller's link to another shard
+#define CONN_FLEET 6            // Many cars on one connection (car --fleet), each frame naming its car
+
+struct connection;
+
+// The floors one of a shard's cars serves
+typedef struct {
+    int lowest;
+    int highest;
+} zone;
+
+// Another shard of the cluster (--peer)
+typedef struct {
+    endpoint where;
+    struct connection *conn;    // NULL while disconnected
+    uint64_t retry_at;          // When to connect again
+    zone zones[MAX_ZONES];      // As last reported, none until then
+    int zone_count;
+} shard;
+
+// A registered car
+typedef struct car {
+    char name[BUFFER_SIZE];
+    int lowest_floor;           // Floor numbers as in floor_label.h
+    int highest_floor;
+    int current_floor;
+    int destination_floor;
+    char status[8];
+    stop_queue queue;           // Floors the car has been told to visit
+    eta_model eta;              // How long the car has been taking per floor and stop
+    uint64_t idle_since;        // When the car was last left with nothing to do, 0 while busy
+    shm_link *shm;              // Set if status and floors go through the car's segment
+    shm_link *shm_offer;        // Mapped and offered (SHM), until the car takes the offer
+    int replicate;              // 1 if the standby's copy of the car is out of date
+    struct connection *conn;    // NULL for a car taken over from a failed primary until it reconnects
+    struct car *next;
+} car;
+
+// Per-connection state. Frames are length prefixed, so partial reads are
+// collected in 'in' until a complete frame is available.
+typedef struct connection {
+    int fd;
+    int type;
+    car *car;                      // Set once a CAR frame has registered this connection
+    frame_buffer in;
+    frame_buffer out;              // Frames that could not be written immediately
+    char in_storage[FRAME_HEADER_SIZE + BUFFER_SIZE];
+    char out_storage[OUT_BUFFER_SIZE];
+    int watching_out;              // 1 while EPOLLOUT is registered
+    int close_after_flush;         // CALL connections are closed once the reply is out
+    int awaiting;                  // Calls waiting for the end of the batch
+    int paused;                    // 1 while on the paused list
+    int connecting;                // 1 while a link to a shard is being set up
+    shard *shard;                  // The shard at the other end of a CONN_SHARD link
+    struct connection *next_paused;
+    struct connection *next_subscriber;
+    struct connection *next_closed;
+} connection;
+
+// A call waiting for the end of the current batch of events
+typedef struct {
+    connection *conn;
+    int source;
+    int destination;
+    char id[REQUEST_ID_SIZE];   // Request id of a session call, "" for a one-off call
+    uint64_t received;          // When the CALL frame was handled
+} pending_call;
+
+// A call passed on to another shard, waiting for its reply
+typedef struct forwarded_call {
+    unsigned long id;           // Request id on the link to the shard
+    shard *shard;
+    connection *conn;           // The call point, NULL once it has hung up
+    char id_text[REQUEST_ID_SIZE]; // The call point's request id, "" for a one-off call
+    uint64_t received;
+    struct forwarded_call *next;
+} forwarded_call;
+
+// Global variables
+int epoll_fd = -1;                  // Reactor file descriptor
+int listen_fd = -1;                 // Listening socket
+car *cars = NULL;                   // Linked list of registered cars
+connection *closed = NULL;          // Connections closed during the current batch of events
+connection *paused = NULL;          // Sessions with frames left unread after filling their window
+pending_call *pending = NULL;       // Calls received during the current batch of events
+int pending_count = 0;
+int pending_capacity = 0;
+dispatch_cost_fn dispatch_cost = dispatch_cost_journey;  // Selected with --dispatch
+int batch_window_ms = 0;            // How long calls are collected before dispatching (--batch-window)
+uint64_t batch_deadline = 0;        // When the current window closes (CLOCK_MONOTONIC ns)
+int use_shm = 0;                    // Use the shared memory fast path for local cars (--shm)
+int notify_fd = -1;                 // eventfd the shared memory watchers write to
+park_fn parking = NULL;             // Selected with --park, NULL leaves idle cars where they are
+park_stats call_stats;              // Calls made from each floor, for the parking policy
+uint64_t park_due = 0;              // When the idle cars are next looked at
+int standby_mode = 0;               // Follow a primary controller until it fails (--standby)
+connection *standby = NULL;         // The standby following this controller, if any
+latency_histogram call_latency;     // CALL frame handled to its reply queued
+latency_histogram status_latency;   // Time to apply one status update
+latency_histogram dispatch_latency; // Time to assign one batch of calls
+endpoint listen_at;                 // Address the controller listens on (--listen)
+shard shards[MAX_SHARDS];           // The other shards of the cluster (--peer)
+int shard_count = 0;
+connection *subscribers = NULL;     // Shards following this one's zones
+int zones_changed = 0;              // The floors the cars cover may have changed
+forwarded_call *forwarded = NULL;   // Calls waiting on another shard's reply
+unsigned long next_forward_id = 1;
+
+volatile sig_atomic_t running = 1;  // Cleared by SIGINT to stop the reactor
+
+// Function prototypes
+void handle_sigint(int sig);
+int set_nonblocking(int fd);
+void accept_connections(void);
+void handle_readable(connection *c);
+int handle_frames(connection *c);
+void resume_paused_connections(void);
+void flush_connection(connection *c);
+void handle_frame(connection *c, char *msg);
+void handle_car(connection *c, char *msg);
+void handle_status(connection *c, char *msg);
+car *register_car(connection *c, char *msg);
+void handle_car_status(car *cr, char *msg);
+void handle_fleet(connection *c);
+void handle_fleet_frame(connection *c, char *msg);
+void send_to_car(car *cr, const char *msg);
+void update_car_status(car *cr, const char *status, int current_num, int destination_num);
+void handle_shm(connection *c, char *msg);
+void accept_shm(car *cr, char *msg);
+void handle_shm_notify(void);
+void drain_status_rings(void);
+void handle_call(connection *c, char *msg);
+void reply_call(connection *c, const char *id, const char *reply);
+void dispatch_pending_calls(void);
+uint64_t now_ns(void);
+int calls_due(void);
+int batch_timeout(void);
+int park_timeout(void);
+int next_timeout(void);
+void park_idle_cars(void);
+void handle_mode_change(connection *c);
+void queue_message(connection *c, const char *msg);
+void close_connection(connection *c);
+void free_closed_connections(void);
+void remove_car(car *cr);
+void send_floor(car *cr);
+void request_floor(car *cr, int floor);
+car *new_car(const char *name, int lowest_num, int highest_num);
+car *find_car(const char *name);
+int open_listener(void);
+void handle_standby(connection *c);
+void handle_stats(connection *c);
+void replicate_cars(void);
+size_t replicate_car(car *cr, int send);
+size_t replicate_frame(const char *msg, int send);
+void follow_primary(void);
+void apply_replica(char *msg);
+int car_serves(const car *cr, int source, int destination);
+int zones_serve(const zone *zones, int count, int source, int destination);
+shard *shard_serving(int source, int destination);
+void forward_call(shard *s, connection *c, const char *id, int source, int destination);
+void connect_shard(shard *s);
+void finish_connect(connection *c);
+void reconnect_shards(void);
+int shard_timeout(void);
+void handle_zones(connection *c);
+void handle_shard_frame(connection *c, char *msg);
+size_t format_zones(char *msg, size_t size);
+void publish_zones(void);
+
+
+int main(int argc, char **argv) {
+    double park_half_life = PARK_HALF_LIFE;
+    const char *listen_spec = "0.0.0.0";
+
+    // Parse arguments
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--dispatch") == 0 && i + 1 < argc) {
+            const dispatch_policy *policy = dispatch_find_policy(argv[++i]);
+            if (policy == NULL) {
+                fprintf(stderr, "Unknown dispatch policy: %s (eta, journey, balance or energy)\n", argv[i]);
+                exit(EXIT_FAILURE);
+            }
+            dispatch_cost = policy->cost;
+        } else if (strcmp(argv[i], "--batch-window") == 0 && i + 1 < argc) {
+            batch_window_ms = atoi(argv[++i]);
+            if (batch_window_ms < 0) {
+                fprintf(stderr, "Invalid batch window: %s\n", argv[i]);
+                exit(EXIT_FAILURE);
+            }
+        } else if (strcmp(argv[i], "--shm") == 0) {
+            use_shm = 1;
+        } else if (strcmp(argv[i], "--park") == 0 && i + 1 < argc) {
+            const park_policy *policy = park_find_policy(argv[++i]);
+            if (policy == NULL) {
+                fprintf(stderr, "Unknown parking policy: %s (demand or lobby)\n", argv[i]);
+                exit(EXIT_FAILURE);
+            }
+            parking = policy->park;
+        } else if (strcmp(argv[i], "--standby") == 0) {
+            standby_mode = 1;
+        } else if (strcmp(argv[i], "--listen") == 0 && i + 1 < argc) {
+            listen_spec = argv[++i];
+        } else if (strcmp(argv[i], "--peer") == 0 && i + 1 < argc) {
+            if (shard_count == MAX_SHARDS) {
+                fprintf(stderr, "Too many shards (at most %d)\n", MAX_SHARDS);
+                exit(EXIT_FAILURE);
+            }
+            if (endpoint_parse(argv[++i], "127.0.0.1", &shards[shard_count].where) == -1) {
+                fprintf(stderr, "Invalid shard address: %s\n", argv[i]);
+                exit(EXIT_FAILURE);
+            }
+            shard_count++;
+        } else if (strcmp(argv[i], "--park-half-life") == 0 && i + 1 < argc) {
+            park_half_life = atof(argv[++i]);
+            if (park_half_life <= 0) {
+                fprintf(stderr, "Invalid half life: %s\n", argv[i]);
+                exit(EXIT_FAILURE);
+            }
+        } else {
+            fprintf(stderr, "Usage: %s [--dispatch eta|journey|balance|energy] [--batch-window ms] [--shm]"
+                            " [--park demand|lobby] [--park-half-life s] [--standby]"
+                            " [--listen host:port] [--peer host:port]...\n", argv[0]);
+            exit(EXIT_FAILURE);
+        }
+    }
+    if (endpoint_parse(listen_spec, "0.0.0.0", &listen_at) == -1) {
+        fprintf(stderr, "Invalid listening address: %s\n", listen_spec);
+        exit(EXIT_FAILURE);
+    }
+
+    park_stats_init(&call_stats, park_half_life);
+
+    // Signal handling
+    signal(SIGINT, handle_sigint);
+    signal(SIGPIPE, SIG_IGN); // Writes to closed sockets are reported through errno instead
+
+    // A standby copies the primary's cars and queues until the primary goes
+    // away, then takes over its port. The cars reconnect within their retry
+    // delay and carry on with the stops they already had
+    if (standby_mode) {
+        for (;;) {
+            follow_primary();
+            if (!running) {
+                exit(EXIT_SUCCESS);
+            }
+            listen_fd = open_listener();
+            if (listen_fd != -1) {
+                break;
+            }
+            if (errno != EADDRINUSE) {
+                perror("bind()");
+                exit(EXIT_FAILURE);
+            }
+            // The primary is still there (it dropped this standby)
+            struct timespec pause = {0, STANDBY_RETRY_MS * 1000000L};
+            nanosleep(&pause, NULL);
+        }
+        printf("Taking over from the primary controller\n");
+        fflush(stdout);
+    } else {
+        listen_fd = open_listener();
+        if (listen_fd == -1) {
+            perror("bind()");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    // Create the reactor and register the listening socket
+    epoll_fd = epoll_create1(0);
+    if (epoll_fd == -1) {
+        perror("epoll_create1()");
+        exit(EXIT_FAILURE);
+    }
+
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.ptr = NULL; // NULL marks the listening socket
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, listen_fd, &ev) == -1) {
+        perror("epoll_ctl()");
+        exit(EXIT_FAILURE);
+    }
+
+    // Cars on this host report their status through shared memory. The
+    // reactor drains their status rings on every pass, and a watcher thread
+    // per SHM_LINK_WATCH_LIMIT cars wakes it through an eventfd
+    if (use_shm) {
+        notify_fd = eventfd(0, EFD_NONBLOCK);
+        if (notify_fd == -1) {
+            perror("eventfd()");
+            exit(EXIT_FAILURE);
+        }
+        if (shm_link_start(notify_fd) == -1) {
+            fprintf(stderr, "--shm needs futex_waitv() (Linux 5.16 or later).\n");
+            exit(EXIT_FAILURE);
+        }
+        ev.events = EPOLLIN;
+        ev.data.ptr = &notify_fd; // Marks the eventfd
+        if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, notify_fd, &ev) == -1) {
+            perror("epoll_ctl()");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    // Follow the zones of the other shards
+    for (int i = 0; i < shard_count; i++) {
+        connect_shard(&shards[i]);
+    }
+
+    // Main loop - a single thread services every car and call point
+    struct epoll_event events[MAX_EVENTS];
+    while (running) {
+        // Wake up when the current batch of calls is due, or to park idle cars
+        int n = epoll_wait(epoll_fd, events, MAX_EVENTS, next_timeout());
+        if (n == -1) {
+            if (errno == EINTR) {
+                continue; // Interrupted by a signal, re-check 'running'
+            }
+            perror("epoll_wait()");
+            break;
+        }
+
+        for (int i = 0; i < n; i++) {
+            connection *c = events[i].data.ptr;
+            if (c == NULL) {
+                accept_connections();
+                continue;
+            }
+            if (events[i].data.ptr == &notify_fd) {
+                handle_shm_notify();
+                continue;
+            }
+            if (c->connecting) {
+                finish_connect(c);
+                continue;
+            }
+            if (events[i].events & (EPOLLERR | EPOLLHUP)) {
+                close_connection(c);
+                continue;
+            }
+            if (events[i].events & EPOLLOUT) {
+                flush_connection(c);
+                if (c->fd == -1) {
+                    continue;
+                }
+            }
+            if (events[i].events & (EPOLLIN | EPOLLRDHUP)) {
+                handle_readable(c);
+            }
+        }
+        // Calls that arrived together are assigned together
+        if (calls_due()) {
+            dispatch_pending_calls();
+            resume_paused_connections();
+            if (calls_due()) {
+                dispatch_pending_calls();
+            }
+        }
+        if (parking != NULL && now_ns() >= park_due) {
+            park_idle_cars();
+        }
+        if (use_shm) {
+            drain_status_rings(); // Events that came in while the events above were handled
+        }
+        replicate_cars();
+        if (zones_changed) {
+            publish_zones();
+        }
+        reconnect_shards();
+        free_closed_connections();
+    }
+
+    // Clean up
+    while (cars != NULL) {
+        if (cars->conn != NULL) {
+            close_connection(cars->conn);
+        } else {
+            remove_car(cars);
+        }
+    }
+    for (int i = 0; i < shard_count; i++) {
+        if (shards[i].conn != NULL) {
+            close_connection(shards[i].conn);
+        }
+    }
+    free_closed_connections();
+    free(pending);
+    if (notify_fd != -1) {
+        shm_link_stop();
+        close(notify_fd);
+    }
+    close(listen_fd);
+    close(epoll_fd);
+
+    return 0;
+}
+
+// Signal Handling
+void handle_sigint(int sig) {
+    running = 0;
+}
+
+// HELPER FUNCTIONS
+
+// create the non-blocking listening socket. returns it, or -1 with errno set
+// if the port couldn't be bound
+int open_listener(void) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd == -1) {
+        perror("socket()");
+        exit(EXIT_FAILURE);
+    }
+
+    int opt_enable = 1;
+    if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &opt_enable, sizeof(opt_enable)) == -1) {
+        perror("setsockopt()");
+        exit(EXIT_FAILURE);
+    }
+
+    if (bind(fd, (const struct sockaddr *)&listen_at.addr, sizeof(listen_at.addr)) == -1) {
+        int saved = errno;
+        close(fd);
+        errno = saved;
+        return -1;
+    }
+
+    if (listen(fd, LISTEN_BACKLOG) == -1) {
+        perror("listen()");
+        exit(EXIT_FAILURE);
+    }
+
+    if (set_nonblocking(fd) == -1) {
+        perror("fcntl()");
+        exit(EXIT_FAILURE);
+    }
+    return fd;
+}
+
+// set O_NONBLOCK on a file descriptor
+int set_nonblocking(int fd) {
+    int flags = fcntl(fd, F_GETFL, 0);
+    if (flags == -1) {
+        return -1;
+    }
+    return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+// current CLOCK_MONOTONIC time in nanoseconds
+uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+// 1 if the pending calls should be dispatched now. Without a batch window a
+// batch is whatever arrived in one epoll_wait(), otherwise calls are collected
+// until the window opened by the first of them closes
+int calls_due(void) {
+    return pending_count > 0 && (batch_window_ms == 0 || now_ns() >= batch_deadline);
+}
+
+// epoll_wait() timeout in milliseconds - until the batch window closes while
+// calls are waiting, otherwise until the next event
+int batch_timeout(void) {
+    if (pending_count == 0) {
+        return -1;
+    }
+    uint64_t now = now_ns();
+    if (batch_window_ms == 0 || now >= batch_deadline) {
+        return 0;
+    }
+    return (int)((batch_deadline - now + 999999ULL) / 1000000ULL);
+}
+
+// epoll_wait() timeout in milliseconds until the idle cars are next looked
+// at. Nothing is parked before the first call has been seen
+int park_timeout(void) {
+    if (parking == NULL || call_stats.lowest > call_stats.highest) {
+        return -1;
+    }
+    uint64_t now = now_ns();
+    if (now >= park_due) {
+        return 0;
+    }
+    return (int)((park_due - now + 999999ULL) / 1000000ULL);
+}
+
+// the soonest of the batch, parking and shard reconnection timeouts
+int next_timeout(void) {
+    int timeout = batch_timeout();
+    int others[] = {park_timeout(), shard_timeout()};
+    for (size_t i = 0; i < sizeof(others) / sizeof(others[0]); i++) {
+        if (timeout == -1 || (others[i] != -1 && others[i] < timeout)) {
+            timeout = others[i];
+        }
+    }
+    return timeout;
+}
+
+// accept every pending connection on the listening socket
+void accept_connections(void) {
+    for (;;) {
+        int fd = accept(listen_fd, NULL, NULL);
+        if (fd == -1) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                perror("accept()");
+            }
+            return;
+        }
+
+        if (set_nonblocking(fd) == -1) {
+            perror("fcntl()");
+            close(fd);
+            continue;
+        }
+        // Replies and FLOOR frames are flushed a batch at a time already
+        int opt_enable = 1;
+        if (setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &opt_enable, sizeof(opt_enable)) == -1) {
+            perror("setsockopt()");
+        }
+
+        connection *c = calloc(1, sizeof(connection));
+        if (c == NULL) {
+            perror("calloc()");
+            close(fd);
+            continue;
+        }
+        c->fd = fd;
+        c->type = CONN_UNKNOWN;
+        frame_buffer_init(&c->in, c->in_storage, sizeof(c->in_storage));
+        frame_buffer_init(&c->out, c->out_storage, sizeof(c->out_storage));
+
+        struct epoll_event ev;
+        memset(&ev, 0, sizeof(ev));
+        ev.events = EPOLLIN | EPOLLRDHUP;
+        ev.data.ptr = c;
+        if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev) == -1) {
+            perror("epoll_ctl()");
+            close(fd);
+            free(c);
+        }
+    }
+}
+
+// read everything available and dispatch each complete frame
+void handle_readable(connection *c) {
+    for (;;) {
+        if (handle_frames(c) == -1) {
+            return;
+        }
+
+        ssize_t received = frame_fill(c->fd, &c->in);
+        if (received == -1) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                close_connection(c);
+            }
+            return;
+        } else if (received == 0) {
+            // Connection closed by peer
+            close_connection(c);
+            return;
+        }
+    }
+}
+
+// dispatch every complete frame already read from a connection. A session
+// that fills its call window is paused with the rest of its frames left in
+// the buffer, so its replies can't overrun the outbound buffer.
+// returns 0 when the buffer has been drained, -1 if the connection was
+// closed or paused
+int handle_frames(connection *c) {
+    char msg[BUFFER_SIZE];
+    for (;;) {
+        if (c->awaiting >= CALL_WINDOW) {
+            if (!c->paused) {
+                c->paused = 1;
+                c->next_paused = paused;
+                paused = c;
+            }
+            return -1;
+        }
+
+        int got = frame_next(&c->in, msg, sizeof(msg));
+        if (got == 0) {
+            return 0;
+        } else if (got == -1) {
+            // Oversized frame - not part of the protocol
+            fprintf(stderr, "Oversized frame rejected\n");
+            close_connection(c);
+            return -1;
+        }
+
+        handle_frame(c, msg);
+        if (c->fd == -1) {
+            return -1; // Connection was closed while handling the frame
+        }
+    }
+}
+
+// carry on with the frames of sessions paused during the last batch. Anything
+// still unread in the socket is reported again by epoll_wait()
+void resume_paused_connections(void) {
+    connection *list = paused;
+    paused = NULL;
+    while (list != NULL) {
+        connection *c = list;
+        list = c->next_paused;
+        c->paused = 0;
+        if (c->fd != -1) {
+            handle_frames(c);
+        }
+    }
+}
+
+// write as much pending output as the socket accepts. Writability is only
+// watched for while bytes are still pending.
+void flush_connection(connection *c) {
+    if (c->connecting) {
+        return; // Flushed once the link to the shard is up
+    }
+    if (frame_flush(c->fd, &c->out) == -1) {
+        if (c->type == CONN_FLEET) {
+            // Its cars go once epoll reports the hangup - the caller may be
+            // working through them
+            shutdown(c->fd, SHUT_RDWR);
+            return;
+        }
+        close_connection(c);
+        return;
+    }
+
+    if (c->out.len == 0 && c->close_after_flush) {
+        close_connection(c);
+        return;
+    }
+
+    int want_out = c->out.len > 0;
+    if (want_out != c->watching_out) {
+        struct epoll_event ev;
+        memset(&ev, 0, sizeof(ev));
+        ev.events = EPOLLIN | EPOLLRDHUP | (want_out ? EPOLLOUT : 0);
+        ev.data.ptr = c;
+        epoll_ctl(epoll_fd, EPOLL_CTL_MOD, c->fd, &ev);
+        c->watching_out = want_out;
+    }
+}
+
+// dispatch a single frame based on its keyword
+void handle_frame(connection *c, char *msg) {
+    if (c->type == CONN_SHARD) {
+        handle_shard_frame(c, msg); // Replies and zones from another shard
+    } else if (c->type == CONN_FLEET) {
+        handle_fleet_frame(c, msg);
+    } else if (strncmp(msg, "CAR ", 4) == 0) {
+        handle_car(c, msg);
+    } else if (strncmp(msg, "STATUS ", 7) == 0) {
+        handle_status(c, msg);
+    } else if (strncmp(msg, "SHM ", 4) == 0) {
+        handle_shm(c, msg);
+    } else if (strncmp(msg, "CALL ", 5) == 0) {
+        handle_call(c, msg);
+    } else if (strcmp(msg, "INDIVIDUAL SERVICE") == 0 || strcmp(msg, "EMERGENCY") == 0) {
+        handle_mode_change(c);
+    } else if (strcmp(msg, "STANDBY") == 0) {
+        handle_standby(c);
+    } else if (strcmp(msg, "STATS") == 0) {
+        handle_stats(c);
+    } else if (strcmp(msg, "ZONES") == 0) {
+        handle_zones(c);
+    } else if (strcmp(msg, "FLEET") == 0) {
+        handle_fleet(c);
+    } else {
+        fprintf(stderr, "Unexpected message: %s\n", msg);
+    }
+}
+
+// CAR {name} {lowest floor} {highest floor}
+void handle_car(connection *c, char *msg) {
+    if (c->type != CONN_UNKNOWN) {
+        fprintf(stderr, "Invalid registration: %s\n", msg);
+        close_connection(c);
+        return;
+    }
+    c->type = CONN_CAR;
+    if (register_car(c, msg) == NULL) {
+        close_connection(c);
+    }
+}
+
+// register the car of a CAR frame on connection 'c' - its own or a fleet link.
+// returns NULL if the frame was invalid or the car couldn't be allocated
+car *register_car(connection *c, char *msg) {
+    char name[BUFFER_SIZE], lowest[BUFFER_SIZE], highest[BUFFER_SIZE];
+    int lowest_num, highest_num;
+    if (sscanf(msg, "CAR %1023s %1023s %1023s", name, lowest, highest) != 3 ||
+        floor_from_label(lowest, &lowest_num) == -1 || floor_from_label(highest, &highest_num) == -1) {
+        fprintf(stderr, "Invalid registration: %s\n", msg);
+        return NULL;
+    }
+
+    // A car that reconnects replaces its previous registration, unless this
+    // controller took it over from a failed primary - then it keeps its queue
+    car *cr = find_car(name);
+    car *adopted = NULL;
+    if (cr != NULL && cr->conn == NULL &&
+        cr->lowest_floor == lowest_num && cr->highest_floor == highest_num) {
+        adopted = cr;
+    } else if (cr != NULL && cr->conn != NULL && cr->conn->type != CONN_FLEET) {
+        close_connection(cr->conn);
+    } else if (cr != NULL) {
+        remove_car(cr); // The rest of a fleet link's cars stay
+    }
+
+    cr = adopted != NULL ? adopted : new_car(name, lowest_num, highest_num);
+    if (cr == NULL) {
+        return NULL;
+    }
+    cr->conn = c;
+    if (c->type == CONN_CAR) {
+        c->car = cr;
+    }
+    zones_changed = 1;
+
+    // A car on this host can skip TCP for everything but registration and
+    // mode changes. A segment of the same name is only the car's if the car
+    // finds the token written into it
+    if (use_shm) {
+        shm_link *l = shm_link_open(name);
+        uint64_t token = l != NULL ? shm_link_offer(l) : 0;
+        if (token != 0) {
+            char offer[32];
+            snprintf(offer, sizeof(offer), "SHM %016llx", (unsigned long long)token);
+            cr->shm_offer = l;
+            send_to_car(cr, offer);
+        } else if (l != NULL) {
+            shm_link_close(l);
+        }
+    }
+    if (adopted != NULL) {
+        send_floor(cr); // Carry on where the primary left off
+    }
+    return cr;
+}
+
+// STATUS {status} {current floor} {destination floor}
+void handle_status(connection *c, char *msg) {
+    if (c->type != CONN_CAR || c->car == NULL) {
+        return;
+    }
+    handle_car_status(c->car, msg);
+}
+
+// a STATUS frame from a car, on its own connection or a fleet link
+void handle_car_status(car *cr, char *msg) {
+    if (cr->shm != NULL) {
+        return; // Sent before the car switched to its status ring
+    }
+
+    char status[BUFFER_SIZE], current[BUFFER_SIZE], destination[BUFFER_SIZE];
+    int current_num, destination_num;
+    if (sscanf(msg, "STATUS %1023s %1023s %1023s", status, current, destination) != 3 ||
+        strlen(status) >= sizeof(cr->status) ||
+        floor_from_label(current, &current_num) == -1 || floor_from_label(destination, &destination_num) == -1) {
+        fprintf(stderr, "Invalid status from car %s: %s\n", cr->name, msg);
+        return;
+    }
+    update_car_status(cr, status, current_num, destination_num);
+}
+
+// FLEET - the connection carries many cars (car --fleet)
+void handle_fleet(connection *c) {
+    if (c->type == CONN_UNKNOWN) {
+        c->type = CONN_FLEET;
+    }
+}
+
+// {name} {frame} - a frame from one of the cars on a fleet link. The frames
+// are those a car sends on its own connection, but a car leaving the
+// controller's control only takes that car out of service
+void handle_fleet_frame(connection *c, char *msg) {
+    char *frame = strchr(msg, ' ');
+    if (frame == NULL) {
+        fprintf(stderr, "Unexpected message: %s\n", msg);
+        return;
+    }
+    *frame++ = '\0';
+    if (strncmp(frame, "CAR ", 4) == 0) {
+        register_car(c, frame);
+        return;
+    }
+
+    car *cr = find_car(msg);
+    if (cr == NULL || cr->conn != c) {
+        return; // Not on this link (any more)
+    }
+    if (strncmp(frame, "STATUS ", 7) == 0) {
+        handle_car_status(cr, frame);
+    } else if (strncmp(frame, "SHM ", 4) == 0) {
+        accept_shm(cr, frame);
+    } else if (strcmp(frame, "INDIVIDUAL SERVICE") == 0 || strcmp(frame, "EMERGENCY") == 0) {
+        remove_car(cr);
+    } else {
+        fprintf(stderr, "Unexpected message from car %s: %s\n", cr->name, frame);
+    }
+}
+
+// record a car's new status, however it arrived
+void update_car_status(car *cr, const char *status, int current_num, int destination_num) {
+    uint64_t now = now_ns();
+    cr->replicate = 1;
+    eta_model_observe(&cr->eta, status, current_num, now);
+    strcpy(cr->status, status);
+    cr->current_floor = current_num;
+    cr->destination_floor = destination_num;
+
+    int opening = strcmp(status, "Opening") == 0 || strcmp(status, "Open") == 0;
+    stop_queue_set_position(&cr->queue, current_num, strcmp(status, "Between") == 0, opening);
+
+    // Once the doors start opening at the head of the queue that stop has been
+    // served, so the car is sent on to the next one
+    int head;
+    if (opening && stop_queue_head(&cr->queue, &head) == 0 && head == current_num) {
+        stop_queue_pop(&cr->queue);
+        if (stop_queue_head(&cr->queue, &head) == 0) {
+            send_floor(cr);
+        }
+    }
+
+    if (strcmp(status, "Closed") != 0 || cr->queue.length > 0) {
+        cr->idle_since = 0;
+    } else if (cr->idle_since == 0) {
+        cr->idle_since = now;
+    }
+    latency_record(&status_latency, now_ns() - now);
+}
+
+// SHM {token} {status head} - the car took the shared memory offer
+void handle_shm(connection *c, char *msg) {
+    if (c->type != CONN_CAR || c->car == NULL) {
+        return;
+    }
+    accept_shm(c->car, msg);
+}
+
+// a car's answer to the shared memory offer, on its own connection or a fleet link
+void accept_shm(car *cr, char *msg) {
+    unsigned long long token;
+    unsigned head;
+    if (cr->shm_offer == NULL || sscanf(msg, "SHM %llx %u", &token, &head) != 2 ||
+        shm_link_accept(cr->shm_offer, token, head) == -1) {
+        fprintf(stderr, "Invalid shared memory answer from car %s: %s\n", cr->name, msg);
+        return;
+    }
+    cr->shm = cr->shm_offer;
+    cr->shm_offer = NULL;
+    drain_status_rings(); // Anything since its last STATUS frame
+}
+
+// a shared memory watcher has seen new status events
+void handle_shm_notify(void) {
+    shm_link_take_notify();
+    drain_status_rings();
+}
+
+// apply the status events of every car using the shared memory fast path
+void drain_status_rings(void) {
+    for (car *cr = cars; cr != NULL; cr = cr->next) {
+        if (cr->shm == NULL) {
+            continue;
+        }
+        car_shm_status_event e;
+        while (shm_link_next_status(cr->shm, &e) == 1) {
+            update_car_status(cr, car_status_name(e.status_code), e.current_floor_num, e.destination_floor_num);
+        }
+    }
+}
+
+// CALL {source floor} {destination floor} [request id]
+// A call without an id gets one reply and the connection is closed. Calls
+// with an id are part of a session - the connection stays open, any number
+// of calls can be outstanding, and each reply ends with the id of its call.
+void handle_call(connection *c, char *msg) {
+    char source[BUFFER_SIZE], destination[BUFFER_SIZE], id[BUFFER_SIZE];
+    int source_num, destination_num;
+    if (c->type == CONN_CAR || c->type == CONN_STANDBY) {
+        return; // Cars don't place calls
+    }
+    if (c->type != CONN_PEER) {
+        c->type = CONN_CALL;
+    }
+
+    int fields = sscanf(msg, "CALL %1023s %1023s %1023s", source, destination, id);
+    if (fields != 3) {
+        id[0] = '\0';
+    } else if (strlen(id) >= REQUEST_ID_SIZE || strspn(id, "0123456789") != strlen(id)) {
+        reply_call(c, "", "UNAVAILABLE"); // Not a request id
+        return;
+    }
+
+    if (fields < 2 ||
+        floor_from_label(source, &source_num) == -1 || floor_from_label(destination, &destination_num) == -1 ||
+        source_num == destination_num) {
+        reply_call(c, id, "UNAVAILABLE");
+        return;
+    }
+
+    // A call for floors none of this shard's cars serve goes to a shard
+    // that has one. Calls from other shards are always answered here, so a
+    // call is passed on at most once
+    if (c->type != CONN_PEER && shard_count > 0) {
+        int served = 0;
+        for (car *cr = cars; cr != NULL && !served; cr = cr->next) {
+            served = car_serves(cr, source_num, destination_num);
+        }
+        shard *s = served ? NULL : shard_serving(source_num, destination_num);
+        if (s != NULL) {
+            forward_call(s, c, id, source_num, destination_num);
+            return;
+        }
+    }
+
+    // Assigned once the rest of the batch has been read
+    if (pending_count == pending_capacity) {
+        int capacity = pending_capacity == 0 ? 64 : pending_capacity * 2;
+        pending_call *grown = realloc(pending, sizeof(pending_call) * capacity);
+        if (grown == NULL) {
+            perror("realloc()");
+            reply_call(c, id, "UNAVAILABLE");
+            return;
+        }
+        pending = grown;
+        pending_capacity = capacity;
+    }
+    if (pending_count == 0) {
+        batch_deadline = now_ns() + (uint64_t)batch_window_ms * 1000000ULL;
+    }
+    park_stats_record(&call_stats, source_num, now_ns());
+    pending[pending_count].conn = c;
+    pending[pending_count].source = source_num;
+    pending[pending_count].destination = destination_num;
+    strcpy(pending[pending_count].id, id);
+    pending[pending_count].received = now_ns();
+    pending_count++;
+    c->awaiting++;
+}
+
+// answer a call. One-off calls are closed once the reply has been written
+void reply_call(connection *c, const char *id, const char *reply) {
+    if (id[0] != '\0') {
+        char tagged[BUFFER_SIZE + REQUEST_ID_SIZE + 1];
+        snprintf(tagged, sizeof(tagged), "%s %s", reply, id);
+        queue_message(c, tagged);
+    } else {
+        queue_message(c, reply);
+        c->close_after_flush = 1;
+    }
+    flush_connection(c);
+}
+
+// assign every call received during the current batch, then reply to
+// each call point and redirect the cars whose next stop changed
+void dispatch_pending_calls(void) {
+    int ncars = 0, ncalls = 0;
+    if (pending_count == 0) {
+        return;
+    }
+    for (car *cr = cars; cr != NULL; cr = cr->next) {
+        ncars += cr->conn != NULL; // Cars taken over from a primary wait until they are back
+    }
+
+    car **owners = malloc(sizeof(car *) * (ncars + 1));
+    int *heads = malloc(sizeof(int) * (ncars + 1));
+    dispatch_car *dcars = malloc(sizeof(dispatch_car) * (ncars + 1));
+    dispatch_call *calls = malloc(sizeof(dispatch_call) * pending_count);
+    if (owners == NULL || heads == NULL || dcars == NULL || calls == NULL) {
+        perror("malloc()");
+        ncars = 0;
+    }
+
+    // Cars that haven't been timed yet are assumed to be as fast as the
+    // average of those that have. The relative costs aren't in seconds, so
+    // they are only used while no car has been timed
+    double fleet_floor = 0, fleet_stop = 0;
+    int timed = 0;
+    for (car *cr = cars; cr != NULL; cr = cr->next) {
+        if (eta_model_learned(&cr->eta)) {
+            double floor_time, stop_time;
+            eta_model_estimate(&cr->eta, FLOOR_TIME, STOP_TIME, &floor_time, &stop_time);
+            fleet_floor += floor_time;
+            fleet_stop += stop_time;
+            timed++;
+        }
+    }
+    if (timed > 0) {
+        fleet_floor /= timed;
+        fleet_stop /= timed;
+    } else {
+        fleet_floor = FLOOR_TIME;
+        fleet_stop = STOP_TIME;
+    }
+
+    int i = 0;
+    for (car *cr = cars; cr != NULL && i < ncars; cr = cr->next) {
+        if (cr->conn == NULL) {
+            continue;
+        }
+        owners[i] = cr;
+        if (stop_queue_head(&cr->queue, &heads[i]) == -1) {
+            heads[i] = STOP_QUEUE_LOWEST - 1; // No stop
+        }
+        dcars[i].queue = &cr->queue;
+        dcars[i].lowest_floor = cr->lowest_floor;
+        dcars[i].highest_floor = cr->highest_floor;
+        eta_model_estimate(&cr->eta, fleet_floor, fleet_stop, &dcars[i].floor_time, &dcars[i].stop_time);
+        i++;
+    }
+
+    // Call points that hung up before the batch ended don't get a car
+    for (int k = 0; k < pending_count; k++) {
+        if (pending[k].conn != NULL) {
+            pending[ncalls++] = pending[k];
+        }
+    }
+    pending_count = ncalls;
+    if (ncars > 0) {
+        for (int k = 0; k < ncalls; k++) {
+            calls[k].source = pending[k].source;
+            calls[k].destination = pending[k].destination;
+        }
+        uint64_t started = now_ns();
+        dispatch_assign_batch(dcars, ncars, calls, ncalls, dispatch_cost);
+        latency_record(&dispatch_latency, now_ns() - started);
+    }
+
+    for (int k = 0; k < ncalls; k++) {
+        connection *c = pending[k].conn;
+        if (c == NULL) {
+            continue; // Closed while replying to an earlier call
+        }
+        c->awaiting--;
+        if (ncars > 0 && calls[k].car != -1) {
+            owners[calls[k].car]->replicate = 1;
+            char reply[BUFFER_SIZE + 4];
+            snprintf(reply, sizeof(reply), "CAR %s", owners[calls[k].car]->name);
+            reply_call(c, pending[k].id, reply);
+        } else {
+            reply_call(c, pending[k].id, "UNAVAILABLE");
+        }
+        latency_record(&call_latency, now_ns() - pending[k].received);
+    }
+
+    // Only redirect a car if its next stop changed
+    for (i = 0; i < ncars; i++) {
+        int head;
+        if (stop_queue_head(&owners[i]->queue, &head) == 0 && head != heads[i]) {
+            send_floor(owners[i]);
+        }
+    }
+
+    pending_count = 0;
+    free(owners);
+    free(heads);
+    free(dcars);
+    free(calls);
+}
+
+// let the parking policy move cars that have been idle for long enough
+void park_idle_cars(void) {
+    uint64_t now = now_ns();
+    park_due = now + (uint64_t)PARK_INTERVAL_MS * 1000000ULL;
+    int ncars = 0;
+    for (car *cr = cars; cr != NULL; cr = cr->next) {
+        ncars += cr->conn != NULL;
+    }
+    if (ncars == 0 || call_stats.lowest > call_stats.highest) {
+        return;
+    }
+
+    car **owners = malloc(sizeof(car *) * ncars);
+    park_car *pcars = malloc(sizeof(park_car) * ncars);
+    if (owners == NULL || pcars == NULL) {
+        perror("malloc()");
+        free(owners);
+        free(pcars);
+        return;
+    }
+
+    int idle = 0, i = 0;
+    for (car *cr = cars; cr != NULL && i < ncars; cr = cr->next) {
+        if (cr->conn == NULL) {
+            continue;
+        }
+        double floor_time, stop_time;
+        eta_model_estimate(&cr->eta, FLOOR_TIME, STOP_TIME, &floor_time, &stop_time);
+        owners[i] = cr;
+        pcars[i].lowest_floor = cr->lowest_floor;
+        pcars[i].highest_floor = cr->highest_floor;
+        pcars[i].position = cr->current_floor;
+        pcars[i].idle = cr->idle_since != 0 && cr->queue.length == 0 &&
+                        now - cr->idle_since >= (uint64_t)(PARK_IDLE_STOPS * stop_time * 1e9);
+        pcars[i].target = PARK_STAY;
+        idle += pcars[i].idle;
+        i++;
+    }
+
+    if (idle > 0) {
+        parking(&call_stats, pcars, ncars, now);
+        for (i = 0; i < ncars; i++) {
+            if (pcars[i].idle && pcars[i].target != PARK_STAY && pcars[i].target != owners[i]->current_floor) {
+                request_floor(owners[i], pcars[i].target);
+                owners[i]->idle_since = 0; // Until it has arrived
+            }
+        }
+    }
+    free(owners);
+    free(pcars);
+}
+
+// INDIVIDUAL SERVICE / EMERGENCY - the car leaves the controller's control
+void handle_mode_change(connection *c) {
+    if (c->type == CONN_CAR) {
+        close_connection(c);
+    }
+}
+
+// STATS - reply with one line per latency histogram (microseconds) and close
+void handle_stats(connection *c) {
+    if (c->type != CONN_UNKNOWN) {
+        return;
+    }
+    c->type = CONN_CALL;
+
+    const char *names[] = {"call", "status", "dispatch"};
+    const latency_histogram *histograms[] = {&call_latency, &status_latency, &dispatch_latency};
+    char reply[BUFFER_SIZE];
+    size_t len = 0;
+    for (int i = 0; i < 3; i++) {
+        if (i > 0 && len < sizeof(reply) - 1) {
+            reply[len++] = '\n';
+        }
+        len += latency_format(histograms[i], names[i], reply + len, sizeof(reply) - len);
+        if (len >= sizeof(reply)) {
+            len = sizeof(reply) - 1; // Truncated - the rest is dropped
+        }
+    }
+    queue_message(c, reply);
+    c->close_after_flush = 1;
+    flush_connection(c);
+}
+
+// append a length-prefixed frame to the connection's outbound buffer
+void queue_message(connection *c, const char *msg) {
+    if (frame_queue(&c->out, msg, strlen(msg)) == -1) {
+        // Peer isn't reading - drop it rather than grow without bound
+        fprintf(stderr, "Outbound buffer full, dropping connection\n");
+        c->close_after_flush = 0;
+        frame_buffer_clear(&c->out);
+        shutdown(c->fd, SHUT_RDWR);
+    }
+}
+
+// close a connection, removing its car (if any) from service
+void close_connection(connection *c) {
+    if (c->fd == -1) {
+        return;
+    }
+    if (c->car != NULL) {
+        remove_car(c->car);
+        c->car = NULL;
+    }
+    if (c->type == CONN_FLEET) {
+        for (car *cr = cars, *next; cr != NULL; cr = next) {
+            next = cr->next;
+            if (cr->conn == c) {
+                remove_car(cr);
+            }
+        }
+    }
+    if (c == standby) {
+        standby = NULL;
+    }
+    if (c->type == CONN_PEER) {
+        for (connection **p = &subscribers; *p != NULL; p = &(*p)->next_subscriber) {
+            if (*p == c) {
+                *p = c->next_subscriber;
+                break;
+            }
+        }
+    }
+    // Calls passed on over a link that failed get no car, and replies for a
+    // call point that hung up are dropped
+    for (forwarded_call **p = &forwarded; *p != NULL;) {
+        forwarded_call *f = *p;
+        if (f->conn == c) {
+            f->conn = NULL;
+        }
+        if (c->type == CONN_SHARD && f->shard == c->shard) {
+            *p = f->next;
+            if (f->conn != NULL) {
+                f->conn->awaiting--;
+                reply_call(f->conn, f->id_text, "UNAVAILABLE");
+            }
+            free(f);
+        } else {
+            p = &f->next;
+        }
+    }
+    if (c->type == CONN_SHARD) {
+        c->shard->conn = NULL;
+        c->shard->zone_count = 0;
+        c->shard->retry_at = now_ns() + (uint64_t)SHARD_RETRY_MS * 1000000ULL;
+    }
+    // The connection may be freed before the batch window closes
+    for (int k = 0; k < pending_count; k++) {
+        if (pending[k].conn == c) {
+            pending[k].conn = NULL;
+        }
+    }
+    if (c->paused) {
+        for (connection **p = &paused; *p != NULL; p = &(*p)->next_paused) {
+            if (*p == c) {
+                *p = c->next_paused;
+                break;
+            }
+        }
+        c->paused = 0;
+    }
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, c->fd, NULL);
+    close(c->fd);
+    c->fd = -1;
+    // Other events for this connection may still be pending in the current
+    // epoll_wait() batch, so freeing is deferred until the batch is finished
+    c->next_closed = closed;
+    closed = c;
+}
+
+// free connections closed while handling the last batch of events
+void free_closed_connections(void) {
+    while (closed != NULL) {
+        connection *c = closed;
+        closed = c->next_closed;
+        free(c);
+    }
+}
+
+// remove a car from service
+void remove_car(car *cr) {
+    car **pp = &cars;
+    while (*pp != NULL && *pp != cr) {
+        pp = &(*pp)->next;
+    }
+    if (*pp != NULL) {
+        *pp = cr->next;
+    }
+    if (cr->conn != NULL && cr->conn->car == cr) {
+        cr->conn->car = NULL;
+    }
+    if (cr->shm != NULL) {
+        shm_link_close(cr->shm);
+    }
+    if (cr->shm_offer != NULL) {
+        shm_link_close(cr->shm_offer);
+    }
+    zones_changed = 1;
+    if (standby != NULL) {
+        char msg[BUFFER_SIZE + 8];
+        snprintf(msg, sizeof(msg), "DROP %s", cr->name);
+        if (standby->out.size - standby->out.len < replicate_frame(msg, 0)) {
+            close_connection(standby); // Too far behind - it follows again from scratch
+        } else {
+            replicate_frame(msg, 1);
+        }
+    }
+    free(cr);
+}
+
+// tell a car to go to the floor at the head of its queue
+void send_floor(car *cr) {
+    int head;
+    if (stop_queue_head(&cr->queue, &head) == 0) {
+        request_floor(cr, head);
+    }
+}
+
+// send a car to a floor
+void request_floor(car *cr, int floor) {
+    char label[4];
+    char msg[16];
+    floor_to_label(floor, label, sizeof(label));
+    if (cr->shm != NULL) {
+        // A car can't run without its mutex either, so one that can't be
+        // recovered ends the car and closes its connection
+        shm_link_request_floor(cr->shm, label);
+        return;
+    }
+    snprintf(msg, sizeof(msg), "FLOOR %s", label);
+    send_to_car(cr, msg);
+}
+
+// send a frame to a car, naming the car if it shares a fleet link
+void send_to_car(car *cr, const char *msg) {
+    if (cr->conn->type == CONN_FLEET) {
+        char tagged[2 * BUFFER_SIZE];
+        snprintf(tagged, sizeof(tagged), "%s %s", cr->name, msg);
+        queue_message(cr->conn, tagged);
+    } else {
+        queue_message(cr->conn, msg);
+    }
+    flush_connection(cr->conn);
+}
+
+// register a car, standing at its lowest floor with its doors closed.
+// returns NULL if it couldn't be allocated
+car *new_car(const char *name, int lowest_num, int highest_num) {
+    car *cr = calloc(1, sizeof(car));
+    if (cr == NULL) {
+        perror("calloc()");
+        return NULL;
+    }
+    snprintf(cr->name, sizeof(cr->name), "%s", name);
+    cr->lowest_floor = lowest_num;
+    cr->highest_floor = highest_num;
+    cr->current_floor = lowest_num;
+    cr->destination_floor = lowest_num;
+    strcpy(cr->status, "Closed");
+    stop_queue_init(&cr->queue, lowest_num);
+    eta_model_init(&cr->eta);
+    cr->idle_since = now_ns();
+    cr->replicate = 1;
+    cr->next = cars;
+    cars = cr;
+    return cr;
+}
+
+// the registered car called 'name', or NULL
+car *find_car(const char *name) {
+    for (car *cr = cars; cr != NULL; cr = cr->next) {
+        if (strcmp(cr->name, name) == 0) {
+            return cr;
+        }
+    }
+    return NULL;
+}
+
+// REPLICATION - the primary streams a copy of every car to its standby.
+// Cars are copied whole whenever they change, at most once per pass of
+// the reactor:
+//   SYNC {name} {lowest} {highest} {status} {current} {destination} {hold} {hold floor}
+//        {floor time} {floor samples} {stop time} {stop samples}
+//   SWEEP {name} {direction} {floor}...    (appended to the car's route)
+//   DROP {name}
+// Floors are sent as numbers. A long sweep is split over several SWEEP
+// frames, which the standby joins back up as they travel the same way
+
+// STANDBY - another controller wants to follow this one
+void handle_standby(connection *c) {
+    if (c->type != CONN_UNKNOWN) {
+        return;
+    }
+    if (standby != NULL) {
+        close_connection(standby); // Only one standby at a time
+    }
+    c->type = CONN_STANDBY;
+    standby = c;
+    for (car *cr = cars; cr != NULL; cr = cr->next) {
+        cr->replicate = 1;
+    }
+}
+
+// bring the standby's copy up to date with every car that has changed. Cars
+// whose frames don't fit in the outbound buffer wait until it has drained
+void replicate_cars(void) {
+    if (standby == NULL) {
+        return;
+    }
+    for (car *cr = cars; cr != NULL; cr = cr->next) {
+        if (!cr->replicate) {
+            continue;
+        }
+        size_t need = replicate_car(cr, 0);
+        if (need > standby->out.size) {
+            fprintf(stderr, "Car %s has too many stops to copy to the standby\n", cr->name);
+            cr->replicate = 0;
+            continue;
+        }
+        if (standby->out.size - standby->out.len < need) {
+            break; // Carried on once the buffer has drained
+        }
+        replicate_car(cr, 1);
+        cr->replicate = 0;
+    }
+    flush_connection(standby);
+}
+
+// the frames copying a car to the standby. They are only queued if 'send'
+// is set. returns the bytes they take up in the outbound buffer
+size_t replicate_car(car *cr, int send) {
+    char msg[BUFFER_SIZE + 256];
+    size_t total = 0;
+    snprintf(msg, sizeof(msg), "SYNC %s %d %d %s %d %d %d %d %.9g %d %.9g %d",
+             cr->name, cr->lowest_floor, cr->highest_floor, cr->status,
+             cr->current_floor, cr->destination_floor, cr->queue.hold, cr->queue.hold_floor,
+             cr->eta.floor_time, cr->eta.floor_samples, cr->eta.stop_time, cr->eta.stop_samples);
+    total += replicate_frame(msg, send);
+
+    int floors[STOP_QUEUE_FLOORS];
+    int dir;
+    for (int i = 0, n; (n = stop_queue_sweep(&cr->queue, i, &dir, floors, STOP_QUEUE_FLOORS)) != -1; i++) {
+        size_t len = snprintf(msg, sizeof(msg), "SWEEP %s %d", cr->name, dir);
+        for (int k = 0; k < n; k++) {
+            len += snprintf(msg + len, sizeof(msg) - len, " %d", floors[k]);
+            if (len > BUFFER_SIZE - 16 || k + 1 == n) {
+                total += replicate_frame(msg, send);
+                len = snprintf(msg, sizeof(msg), "SWEEP %s %d", cr->name, dir);
+            }
+        }
+    }
+    return total;
+}
+
+// queue a frame for the standby if 'send' is set. returns its size
+size_t replicate_frame(const char *msg, int send) {
+    if (send) {
+        queue_message(standby, msg);
+    }
+    return FRAME_HEADER_SIZE + strlen(msg);
+}
+
+// follow the primary controller, keeping a copy of its cars. returns once the
+// connection to the primary has gone, or if it couldn't be made
+void follow_primary(void) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd == -1) {
+        perror("socket()");
+        exit(EXIT_FAILURE);
+    }
+    struct sockaddr_in addr = listen_at.addr;
+    if (addr.sin_addr.s_addr == htonl(INADDR_ANY)) {
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK); // The primary is on this host
+    }
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1 || frame_send(fd, "STANDBY") == -1) {
+        close(fd);
+        return; // No primary - take over straight away
+    }
+
+    // The primary sends every car again, so start from an empty copy
+    while (cars != NULL) {
+        remove_car(cars);
+    }
+
+    char storage[FRAME_HEADER_SIZE + 2 * BUFFER_SIZE];
+    char msg[2 * BUFFER_SIZE];
+    frame_buffer in;
+    frame_buffer_init(&in, storage, sizeof(storage));
+    while (running) {
+        struct pollfd pfd = {fd, POLLIN, 0};
+        int ready = poll(&pfd, 1, STANDBY_POLL_MS);
+        if (ready == -1 && errno != EINTR) {
+            perror("poll()");
+            break;
+        }
+        if (ready <= 0) {
+            continue;
+        }
+        if (frame_fill(fd, &in) <= 0) {
+            break; // The primary has gone
+        }
+        int got;
+        while ((got = frame_next(&in, msg, sizeof(msg))) == 1) {
+            apply_replica(msg);
+        }
+        if (got == -1) {
+            fprintf(stderr, "Oversized frame from the primary\n");
+            break;
+        }
+    }
+    close(fd);
+}
+
+// apply one replication frame from the primary
+void apply_replica(char *msg) {
+    char name[BUFFER_SIZE], status[8];
+    int lowest, highest, current, destination, hold, hold_floor, floor_samples, stop_samples;
+    double floor_time, stop_time;
+    car *cr;
+
+    if (sscanf(msg, "SYNC %1023s %d %d %7s %d %d %d %d %lf %d %lf %d", name, &lowest, &highest,
+               status, &current, &destination, &hold, &hold_floor,
+               &floor_time, &floor_samples, &stop_time, &stop_samples) == 12) {
+        cr = find_car(name);
+        if (cr != NULL && (cr->lowest_floor != lowest || cr->highest_floor != highest)) {
+            remove_car(cr);
+            cr = NULL;
+        }
+        if (cr == NULL && (cr = new_car(name, lowest, highest)) == NULL) {
+            return;
+        }
+        strcpy(cr->status, status);
+        cr->current_floor = current;
+        cr->destination_floor = destination;
+        int opening = strcmp(status, "Opening") == 0 || strcmp(status, "Open") == 0;
+        stop_queue_init(&cr->queue, current);
+        stop_queue_set_position(&cr->queue, current, strcmp(status, "Between") == 0, opening);
+        if (hold) {
+            stop_queue_set_hold(&cr->queue, hold_floor);
+        }
+        eta_model_seed(&cr->eta, floor_time, floor_samples, stop_time, stop_samples);
+        cr->idle_since = strcmp(status, "Closed") == 0 && !hold ? now_ns() : 0;
+    } else if (strncmp(msg, "SWEEP ", 6) == 0) {
+        char *save;
+        strtok_r(msg, " ", &save);
+        char *token = strtok_r(NULL, " ", &save);
+        cr = token != NULL ? find_car(token) : NULL;
+        token = strtok_r(NULL, " ", &save);
+        if (cr == NULL || token == NULL) {
+            return;
+        }
+        int dir = atoi(token);
+        while ((token = strtok_r(NULL, " ", &save)) != NULL) {
+            stop_queue_append(&cr->queue, dir, atoi(token));
+        }
+        cr->idle_since = 0;
+    } else if (sscanf(msg, "DROP %1023s", name) == 1) {
+        if ((cr = find_car(name)) != NULL) {
+            remove_car(cr);
+        }
+    }
+}
+
+// 1 if a car covers both floors of a call
+int car_serves(const car *cr, int source, int destination) {
+    return cr->conn != NULL &&
+           source >= cr->lowest_floor && source <= cr->highest_floor &&
+           destination >= cr->lowest_floor && destination <= cr->highest_floor;
+}
+
+// 1 if one of a shard's zones covers both floors of a call
+int zones_serve(const zone *zones, int count, int source, int destination) {
+    for (int i = 0; i < count; i++) {
+        if (source >= zones[i].lowest && source <= zones[i].highest &&
+            destination >= zones[i].lowest && destination <= zones[i].highest) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// the first connected shard with a car for both floors, or NULL
+shard *shard_serving(int source, int destination) {
+    for (int i = 0; i < shard_count; i++) {
+        shard *s = &shards[i];
+        if (s->conn != NULL && zones_serve(s->zones, s->zone_count, source, destination)) {
+            return s;
+        }
+    }
+    return NULL;
+}
+
+// pass a call on to another shard as a session call with an id of our own.
+// The call point waits for the shard's reply as if the call were local
+void forward_call(shard *s, connection *c, const char *id, int source, int destination) {
+    forwarded_call *f = calloc(1, sizeof(forwarded_call));
+    if (f == NULL) {
+        perror("calloc()");
+        reply_call(c, id, "UNAVAILABLE");
+        return;
+    }
+    f->id = next_forward_id++;
+    f->shard = s;
+    f->conn = c;
+    strcpy(f->id_text, id);
+    f->received = now_ns();
+    f->next = forwarded;
+    forwarded = f;
+    c->awaiting++;
+
+    char msg[32];
+    snprintf(msg, sizeof(msg), "CALL %s %s %lu", floor_label(source), floor_label(destination), f->id);
+    queue_message(s->conn, msg);
+    flush_connection(s->conn);
+}
+
+// start connecting to a shard and ask for its zones. The connect finishes in
+// the main loop; on failure it is tried again after SHARD_RETRY_MS
+void connect_shard(shard *s) {
+    s->retry_at = now_ns() + (uint64_t)SHARD_RETRY_MS * 1000000ULL;
+
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd == -1) {
+        perror("socket()");
+        return;
+    }
+    if (set_nonblocking(fd) == -1) {
+        perror("fcntl()");
+        close(fd);
+        return;
+    }
+    int opt_enable = 1;
+    if (setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &opt_enable, sizeof(opt_enable)) == -1) {
+        perror("setsockopt()");
+    }
+    if (connect(fd, (const struct sockaddr *)&s->where.addr, sizeof(s->where.addr)) == -1 &&
+        errno != EINPROGRESS) {
+        close(fd);
+        return;
+    }
+
+    connection *c = calloc(1, sizeof(connection));
+    if (c == NULL) {
+        perror("calloc()");
+        close(fd);
+        return;
+    }
+    c->fd = fd;
+    c->type = CONN_SHARD;
+    c->shard = s;
+    c->connecting = 1;
+    c->watching_out = 1;
+    frame_buffer_init(&c->in, c->in_storage, sizeof(c->in_storage));
+    frame_buffer_init(&c->out, c->out_storage, sizeof(c->out_storage));
+
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN | EPOLLRDHUP | EPOLLOUT;
+    ev.data.ptr = c;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev) == -1) {
+        perror("epoll_ctl()");
+        close(fd);
+        free(c);
+        return;
+    }
+    s->conn = c;
+    queue_message(c, "ZONES"); // Sent once connected
+}
+
+// a link to a shard became writable or failed while connecting
+void finish_connect(connection *c) {
+    int err = 0;
+    socklen_t len = sizeof(err);
+    if (getsockopt(c->fd, SOL_SOCKET, SO_ERROR, &err, &len) == -1 || err != 0) {
+        close_connection(c); // Not up yet - retried later
+        return;
+    }
+    c->connecting = 0;
+    printf("Connected to shard %s\n", c->shard->where.text);
+    flush_connection(c);
+}
+
+// connect again to shards whose link went down, once their wait is over
+void reconnect_shards(void) {
+    uint64_t now = now_ns();
+    for (int i = 0; i < shard_count; i++) {
+        if (shards[i].conn == NULL && now >= shards[i].retry_at) {
+            connect_shard(&shards[i]);
+        }
+    }
+}
+
+// milliseconds until a shard is due to be connected again, or -1 if every
+// shard is connected
+int shard_timeout(void) {
+    uint64_t now = now_ns();
+    int timeout = -1;
+    for (int i = 0; i < shard_count; i++) {
+        if (shards[i].conn != NULL) {
+            continue;
+        }
+        int wait = shards[i].retry_at > now ? (int)((shards[i].retry_at - now + 999999) / 1000000) : 0;
+        if (timeout == -1 || wait < timeout) {
+            timeout = wait;
+        }
+    }
+    return timeout;
+}
+
+// ZONES - another shard follows this one's zones from now on
+void handle_zones(connection *c) {
+    if (c->type != CONN_UNKNOWN) {
+        return;
+    }
+    c->type = CONN_PEER;
+    c->next_subscriber = subscribers;
+    subscribers = c;
+
+    char msg[BUFFER_SIZE];
+    format_zones(msg, sizeof(msg));
+    queue_message(c, msg);
+    flush_connection(c);
+}
+
+// a frame on the link to another shard:
+//   ZONE {lowest} {highest} ...   the floors of its cars, as numbers
+//   {reply} {id}                  the reply to a call passed on to it
+void handle_shard_frame(connection *c, char *msg) {
+    shard *s = c->shard;
+    if (strncmp(msg, "ZONE", 4) == 0 && (msg[4] == ' ' || msg[4] == '\0')) {
+        char *p = msg + 4, *end;
+        s->zone_count = 0;
+        while (s->zone_count < MAX_ZONES) {
+            long lowest = strtol(p, &end, 10);
+            if (end == p) {
+                break;
+            }
+            p = end;
+            long highest = strtol(p, &end, 10);
+            if (end == p) {
+                break;
+            }
+            p = end;
+            s->zones[s->zone_count].lowest = (int)lowest;
+            s->zones[s->zone_count].highest = (int)highest;
+            s->zone_count++;
+        }
+        return;
+    }
+
+    char *space = strrchr(msg, ' ');
+    if (space == NULL) {
+        fprintf(stderr, "Unexpected message from shard %s: %s\n", s->where.text, msg);
+        return;
+    }
+    *space = '\0';
+    unsigned long id = strtoul(space + 1, NULL, 10);
+    for (forwarded_call **p = &forwarded; *p != NULL; p = &(*p)->next) {
+        forwarded_call *f = *p;
+        if (f->id != id || f->shard != s) {
+            continue;
+        }
+        *p = f->next;
+        if (f->conn != NULL) {
+            f->conn->awaiting--;
+            latency_record(&call_latency, now_ns() - f->received);
+            reply_call(f->conn, f->id_text, msg);
+        }
+        free(f);
+        return;
+    }
+}
+
+// ZONE followed by the floor range of each connected car, without repeats.
+// returns the length of the frame
+size_t format_zones(char *msg, size_t size) {
+    zone zones[MAX_ZONES];
+    int count = 0;
+    size_t len = (size_t)snprintf(msg, size, "ZONE");
+    for (car *cr = cars; cr != NULL && count < MAX_ZONES; cr = cr->next) {
+        if (cr->conn == NULL) {
+            continue;
+        }
+        int seen = 0;
+        for (int i = 0; i < count && !seen; i++) {
+            seen = zones[i].lowest == cr->lowest_floor && zones[i].highest == cr->highest_floor;
+        }
+        if (seen) {
+            continue;
+        }
+        zones[count].lowest = cr->lowest_floor;
+        zones[count].highest = cr->highest_floor;
+        count++;
+        len += (size_t)snprintf(msg + len, size - len, " %d %d", cr->lowest_floor, cr->highest_floor);
+    }
+    return len;
+}
+
+// tell every subscribed shard the current zones
+void publish_zones(void) {
+    zones_changed = 0;
+    if (subscribers == NULL) {
+        return;
+    }
+    char msg[BUFFER_SIZE];
+    format_zones(msg, sizeof(msg));
+    for (connection *c = subscribers; c != NULL;) {
+        connection *next = c->next_subscriber; // Flushing may close it
+        queue_message(c, msg);
+        flush_connection(c);
+        c = next;
+    }
+}
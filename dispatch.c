@@ -0,0 +1,186 @@
+#include <stdlib.h>         // Standard library functions
+#include <string.h>         // String manipulation functions
+#include <math.h>           // INFINITY
+#include "dispatch.h"
+
+static const dispatch_policy dispatch_policies[] = {
+    {"eta", dispatch_cost_eta},
+    {"journey", dispatch_cost_journey},
+    {"balance", dispatch_cost_balance},
+    {"energy", dispatch_cost_energy},
+    {NULL, NULL}
+};
+
+// HELPER FUNCTIONS
+
+static double pickup_time(const dispatch_car *car, const stop_queue_cost *cost) {
+    return cost->pickup_floors * car->floor_time + cost->pickup_stops * car->stop_time;
+}
+
+static double ride_time(const dispatch_car *car, const stop_queue_cost *cost) {
+    return cost->ride_floors * car->floor_time + cost->ride_stops * car->stop_time;
+}
+
+// Time the call adds to the route of every passenger already in the queue
+static double added_time(const dispatch_car *car, const stop_queue_cost *cost) {
+    return cost->added_floors * car->floor_time + cost->added_stops * car->stop_time;
+}
+
+static int services(const dispatch_car *car, int source, int destination) {
+    return source >= car->lowest_floor && source <= car->highest_floor &&
+           destination >= car->lowest_floor && destination <= car->highest_floor;
+}
+
+// score a call against a car. returns INFINITY if the car can't take it
+static double score(const dispatch_car *car, int source, int destination, dispatch_cost_fn cost) {
+    stop_queue_cost c;
+
+    if (!services(car, source, destination)) {
+        return INFINITY;
+    }
+    if (stop_queue_probe(car->queue, source, destination, &c) == -1) {
+        return INFINITY;
+    }
+    return cost(car, &c);
+}
+
+// COST FUNCTIONS
+
+// How long the passenger waits for the car
+double dispatch_cost_eta(const dispatch_car *car, const stop_queue_cost *cost) {
+    return pickup_time(car, cost);
+}
+
+// How long until the passenger arrives, plus the delay to everyone else
+double dispatch_cost_journey(const dispatch_car *car, const stop_queue_cost *cost) {
+    return pickup_time(car, cost) + ride_time(car, cost) + added_time(car, cost);
+}
+
+// Waiting time, with every stop the car already has counted against it so
+// that calls spread across the fleet
+double dispatch_cost_balance(const dispatch_car *car, const stop_queue_cost *cost) {
+    return pickup_time(car, cost) + car->queue->length * car->stop_time;
+}
+
+// Extra travel the call causes, with the waiting time only breaking ties
+double dispatch_cost_energy(const dispatch_car *car, const stop_queue_cost *cost) {
+    return added_time(car, cost) * 1000.0 + pickup_time(car, cost);
+}
+
+const dispatch_policy *dispatch_find_policy(const char *name) {
+    for (const dispatch_policy *p = dispatch_policies; p->name != NULL; p++) {
+        if (strcmp(p->name, name) == 0) {
+            return p;
+        }
+    }
+    return NULL;
+}
+
+// ASSIGNMENT
+
+int dispatch_assign(dispatch_car *cars, int ncars, int source, int destination, dispatch_cost_fn cost) {
+    int best = -1;
+    double best_cost = INFINITY;
+
+    for (int i = 0; i < ncars; i++) {
+        double s = score(&cars[i], source, destination, cost);
+        if (s < best_cost) {
+            best = i;
+            best_cost = s;
+        }
+    }
+
+    if (best != -1 && stop_queue_add(cars[best].queue, source, destination) == -1) {
+        return -1;
+    }
+    return best;
+}
+
+void dispatch_assign_batch(dispatch_car *cars, int ncars, dispatch_call *calls, int ncalls, dispatch_cost_fn cost) {
+    double *costs;
+    int remaining = ncalls;
+
+    if (ncalls == 0) {
+        return;
+    }
+
+    costs = malloc(sizeof(double) * ncalls * (ncars > 0 ? ncars : 1));
+    if (costs == NULL) {
+        // Fall back to assigning in arrival order
+        for (int k = 0; k < ncalls; k++) {
+            calls[k].car = dispatch_assign(cars, ncars, calls[k].source, calls[k].destination, cost);
+        }
+        return;
+    }
+
+    for (int k = 0; k < ncalls; k++) {
+        calls[k].car = -2;  // Not assigned yet
+        for (int i = 0; i < ncars; i++) {
+            costs[k * ncars + i] = score(&cars[i], calls[k].source, calls[k].destination, cost);
+        }
+    }
+
+    while (remaining > 0) {
+        int pick = -1;
+        int pick_car = -1;
+        double pick_best = INFINITY;
+        double pick_regret = -1;
+
+        // The call with the largest gap between its best and second best car
+        // goes next, since it has the most to lose by waiting
+        for (int k = 0; k < ncalls; k++) {
+            int best = -1;
+            double first = INFINITY;
+            double second = INFINITY;
+            double regret;
+
+            if (calls[k].car != -2) {
+                continue;
+            }
+            for (int i = 0; i < ncars; i++) {
+                double c = costs[k * ncars + i];
+                if (c < first) {
+                    second = first;
+                    first = c;
+                    best = i;
+                } else if (c < second) {
+                    second = c;
+                }
+            }
+
+            regret = second - first;    // INFINITY if only one car can take it
+            if (best == -1) {
+                regret = -1;
+            }
+            if (pick == -1 || regret > pick_regret ||
+                (regret == pick_regret && first < pick_best)) {
+                pick = k;
+                pick_car = best;
+                pick_best = first;
+                pick_regret = regret;
+            }
+        }
+
+        if (pick_car == -1) {
+            calls[pick].car = -1;
+            remaining--;
+            continue;
+        }
+
+        if (stop_queue_add(cars[pick_car].queue, calls[pick].source, calls[pick].destination) == -1) {
+            costs[pick * ncars + pick_car] = INFINITY;
+            continue;
+        }
+        calls[pick].car = pick_car;
+        remaining--;
+
+        // Only the chosen car's route changed
+        for (int k = 0; k < ncalls; k++) {
+            if (calls[k].car == -2) {
+                costs[k * ncars + pick_car] = score(&cars[pick_car], calls[k].source, calls[k].destination, cost);
+            }
+        }
+    }
+
+    free(costs);
+}
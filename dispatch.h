@@ -0,0 +1,60 @@
+#ifndef DISPATCH_H
+#define DISPATCH_H
+
+#include "stop_queue.h"     // Per-car stop queue
+
+// Dispatch engine used by the controller to choose which car takes a call.
+//
+// Every car that services both floors is scored by a cost function applied to
+// what stop_queue_probe() says the call would do to its route. The cost
+// function is pluggable, so the controller can trade waiting time against
+// ride time, load balancing or travel (energy).
+//
+// Calls that arrive together can be assigned as a batch. The batch is
+// assigned most-constrained first: the call that would lose the most by not
+// getting its best car goes first, and only the chosen car's costs are
+// recomputed after each assignment.
+
+// A car as seen by the dispatcher. Times are in the same (arbitrary) unit.
+typedef struct {
+    stop_queue *queue;
+    int lowest_floor;
+    int highest_floor;
+    double floor_time;      // Time to travel one floor
+    double stop_time;       // Time spent at a stop (doors opening, open and closing)
+} dispatch_car;
+
+// returns the cost of giving a call to a car, lower is better
+typedef double (*dispatch_cost_fn)(const dispatch_car *car, const stop_queue_cost *cost);
+
+typedef struct {
+    const char *name;
+    dispatch_cost_fn cost;
+} dispatch_policy;
+
+// A call waiting to be assigned
+typedef struct {
+    int source;
+    int destination;
+    int car;                // Index of the assigned car, -1 if no car can take it
+} dispatch_call;
+
+// Built-in cost functions
+double dispatch_cost_eta(const dispatch_car *car, const stop_queue_cost *cost);
+double dispatch_cost_journey(const dispatch_car *car, const stop_queue_cost *cost);
+double dispatch_cost_balance(const dispatch_car *car, const stop_queue_cost *cost);
+double dispatch_cost_energy(const dispatch_car *car, const stop_queue_cost *cost);
+
+// look up a built-in policy by name ("eta", "journey", "balance" or "energy").
+// returns NULL if there is no such policy
+const dispatch_policy *dispatch_find_policy(const char *name);
+
+// assign a single call and add its stops to the chosen car's queue.
+// returns the index of the car, or -1 if no car can take the call
+int dispatch_assign(dispatch_car *cars, int ncars, int source, int destination, dispatch_cost_fn cost);
+
+// assign every call in a batch, setting each call's 'car' and adding the stops
+// to the chosen cars' queues
+void dispatch_assign_batch(dispatch_car *cars, int ncars, dispatch_call *calls, int ncalls, dispatch_cost_fn cost);
+
+#endif
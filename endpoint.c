@@ -0,0 +1,48 @@
+#include <stdio.h>          // snprintf
+#include <stdlib.h>         // strtol
+#include <string.h>         // String manipulation functions
+#include <netdb.h>          // getaddrinfo
+#include <arpa/inet.h>      // htons
+#include "endpoint.h"
+
+int endpoint_parse(const char *spec, const char *default_host, endpoint *out) {
+    char host[ENDPOINT_HOST_SIZE];
+    long port = ENDPOINT_DEFAULT_PORT;
+    if (spec == NULL || spec[0] == '\0' || strlen(spec) >= sizeof(host)) {
+        return -1;
+    }
+
+    // A port on its own, or after the last colon
+    const char *colon = strrchr(spec, ':');
+    const char *port_text = colon != NULL ? colon + 1 : (strspn(spec, "0123456789") == strlen(spec) ? spec : NULL);
+    if (port_text != NULL) {
+        char *endptr;
+        port = strtol(port_text, &endptr, 10);
+        if (port_text[0] < '0' || port_text[0] > '9' || *endptr != '\0' || port < 1 || port > 65535) {
+            return -1;
+        }
+    }
+    if (port_text == spec) {
+        snprintf(host, sizeof(host), "%s", default_host);
+    } else if (colon != NULL) {
+        snprintf(host, sizeof(host), "%.*s", (int)(colon - spec), spec);
+    } else {
+        snprintf(host, sizeof(host), "%s", spec);
+    }
+    if (host[0] == '\0') {
+        snprintf(host, sizeof(host), "%s", default_host);
+    }
+
+    struct addrinfo hints, *found;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(host, NULL, &hints, &found) != 0) {
+        return -1;
+    }
+    memcpy(&out->addr, found->ai_addr, sizeof(out->addr));
+    freeaddrinfo(found);
+    out->addr.sin_port = htons((uint16_t)port);
+    snprintf(out->text, sizeof(out->text), "%s:%ld", host, port);
+    return 0;
+}
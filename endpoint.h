@@ -0,0 +1,29 @@
+#ifndef ENDPOINT_H
+#define ENDPOINT_H
+
+#include <netinet/in.h>     // struct sockaddr_in
+
+// Address of a controller, for the programs that connect to one and the
+// controller itself (--controller / --listen / --peer).
+//
+// An endpoint is written "host:port", "host" or "port". A missing port is
+// ENDPOINT_DEFAULT_PORT and a missing host is whatever the caller passes as
+// its default - the loopback address to connect, every address to listen.
+// Hosts can be names or dotted IPv4 addresses and are resolved once, when
+// the endpoint is parsed.
+
+#define ENDPOINT_DEFAULT_PORT 3000
+#define ENDPOINT_HOST_SIZE 256
+#define ENDPOINT_TEXT_SIZE (ENDPOINT_HOST_SIZE + 8) // The host, a colon and a port
+
+typedef struct {
+    struct sockaddr_in addr;
+    char text[ENDPOINT_TEXT_SIZE];  // As given, for messages
+} endpoint;
+
+// parse 'spec' into 'out', using 'default_host' if it has no host.
+// returns 0 on success, -1 if it isn't a valid endpoint or the host
+// couldn't be resolved
+int endpoint_parse(const char *spec, const char *default_host, endpoint *out);
+
+#endif
@@ -0,0 +1,82 @@
+#include <string.h>         // String manipulation functions
+#include "eta_model.h"
+
+// HELPER FUNCTIONS
+
+// fold a sample of 'ns' nanoseconds into an average
+static void add_sample(double *average, int *samples, uint64_t ns) {
+    double t = (double)ns / 1e9;
+    if (*samples == 0) {
+        *average = t;
+    } else {
+        if (*samples >= ETA_MODEL_WARMUP && t > *average * ETA_MODEL_OUTLIER) {
+            t = *average * ETA_MODEL_OUTLIER;
+        }
+        *average += ETA_MODEL_WEIGHT * (t - *average);
+    }
+    (*samples)++;
+}
+
+void eta_model_init(eta_model *m) {
+    memset(m, 0, sizeof(*m));
+}
+
+void eta_model_observe(eta_model *m, const char *status, int floor, uint64_t now) {
+    int moving = strcmp(status, "Between") == 0;
+
+    // Floors - the floor changes while Between, and on arrival together with
+    // the doors opening (or the car stopping with them closed)
+    if (floor != m->floor && m->moving && m->floor_mark != 0 && now > m->floor_mark) {
+        add_sample(&m->floor_time, &m->floor_samples, now - m->floor_mark);
+    }
+    if (moving && (!m->moving || floor != m->floor)) {
+        m->floor_mark = now; // Left or passed a floor
+    } else if (!moving) {
+        m->floor_mark = 0;
+    }
+
+    // Stops - the first Opening starts the stop and Closed ends it
+    if (strcmp(status, "Opening") == 0) {
+        if (m->stop_mark == 0) {
+            m->stop_mark = now;
+        }
+    } else if (strcmp(status, "Closed") == 0) {
+        if (m->stop_mark != 0 && now > m->stop_mark) {
+            add_sample(&m->stop_time, &m->stop_samples, now - m->stop_mark);
+        }
+        m->stop_mark = 0;
+    } else if (moving) {
+        m->stop_mark = 0;
+    }
+
+    m->moving = moving;
+    m->floor = floor;
+}
+
+void eta_model_seed(eta_model *m, double floor_time, int floor_samples, double stop_time, int stop_samples) {
+    m->floor_time = floor_samples > 0 ? floor_time : 0;
+    m->floor_samples = floor_samples > 0 ? floor_samples : 0;
+    m->stop_time = stop_samples > 0 ? stop_time : 0;
+    m->stop_samples = stop_samples > 0 ? stop_samples : 0;
+}
+
+int eta_model_learned(const eta_model *m) {
+    return m->floor_samples > 0 || m->stop_samples > 0;
+}
+
+void eta_model_estimate(const eta_model *m, double default_floor, double default_stop,
+                        double *floor_time, double *stop_time) {
+    if (m->floor_samples > 0 && m->stop_samples > 0) {
+        *floor_time = m->floor_time;
+        *stop_time = m->stop_time;
+    } else if (m->floor_samples > 0) {
+        *floor_time = m->floor_time;
+        *stop_time = m->floor_time * default_stop / default_floor;
+    } else if (m->stop_samples > 0) {
+        *floor_time = m->stop_time * default_floor / default_stop;
+        *stop_time = m->stop_time;
+    } else {
+        *floor_time = default_floor;
+        *stop_time = default_stop;
+    }
+}
@@ -0,0 +1,58 @@
+#ifndef ETA_MODEL_H
+#define ETA_MODEL_H
+
+#include <stdint.h>         // Standard integer types
+
+// Per-car timing profile learned by the controller from a car's status stream.
+//
+// Each car is started with its own delay and may run slower than it claims,
+// so rather than assuming every car takes the same time per floor the
+// controller times the transitions it is sent, the same way display-cars
+// does. A floor is timed from the car leaving (Closed to Between) or passing
+// the previous floor to it reaching the next one, and a stop from the doors
+// starting to open to them being closed again, so a stop includes any time
+// the doors were held or reopened.
+//
+// Both are kept as exponentially weighted moving averages. Once a few samples
+// are in, a sample more than ETA_MODEL_OUTLIER times the average is clamped
+// rather than dropped, so a car that really has slowed down is followed
+// within a handful of floors without one held door skewing its profile.
+//
+// Times are in seconds.
+
+#define ETA_MODEL_WEIGHT 0.25   // Weight of each new sample
+#define ETA_MODEL_WARMUP 3      // Samples before outliers are clamped
+#define ETA_MODEL_OUTLIER 4.0   // Clamp samples to this multiple of the average
+
+typedef struct {
+    double floor_time;      // Average time to travel one floor
+    double stop_time;       // Average time from doors opening to closed
+    int floor_samples;
+    int stop_samples;
+
+    // Transitions being timed
+    int moving;             // 1 while the last status was Between
+    int floor;              // Floor of the last status
+    uint64_t floor_mark;    // When the car left or passed 'floor', 0 if not timing
+    uint64_t stop_mark;     // When the doors started opening, 0 if not timing
+} eta_model;
+
+void eta_model_init(eta_model *m);
+
+// time a status update received at 'now' (CLOCK_MONOTONIC nanoseconds)
+void eta_model_observe(eta_model *m, const char *status, int floor, uint64_t now);
+
+// carry over a profile learned elsewhere (a standby controller's copy of
+// the primary's). A count of 0 leaves that time unlearned
+void eta_model_seed(eta_model *m, double floor_time, int floor_samples, double stop_time, int stop_samples);
+
+// 1 if the car has been timed over at least one floor or one stop
+int eta_model_learned(const eta_model *m);
+
+// the car's expected floor and stop times. A time that hasn't been measured
+// yet is scaled from the other one in the ratio of the defaults, and a car
+// with no measurements at all gets the defaults
+void eta_model_estimate(const eta_model *m, double default_floor, double default_stop,
+                        double *floor_time, double *stop_time);
+
+#endif
@@ -0,0 +1,228 @@
+#ifndef FLEET_SHM_H
+#define FLEET_SHM_H
+
+#include <stdint.h>         // Standard integer types
+#include <string.h>         // String manipulation functions
+#include <signal.h>         // kill
+#include <errno.h>          // Error handling
+#include <pthread.h>        // POSIX threads
+#include <time.h>           // struct timespec
+#include "car_shm.h"        // Car status and floor helpers, futex syscall
+
+// Shared memory registry of every car on a host (/fleet).
+//
+// Cars started with --registry claim a slot and mirror their state into it,
+// so a monitor maps this one segment and iterates the slots instead of
+// opening every /car{name} in /dev/shm on each refresh. Each slot is one
+// cache line and has a single writer, its car, which brackets every update
+// with the slot's sequence count the same way car_shm_write_begin() does.
+// Readers copy a slot with fleet_shm_read_slot() and never block the car.
+//
+// The mutex is only taken to claim or release a slot, and 'generation' is
+// bumped each time, so a monitor can tell when cars have joined or left
+// without comparing names. The segment outlives the cars - a slot whose car
+// died is reused by the next car with that name, or once its pid is gone.
+//
+// Version 2 lets a monitor sleep until something changes instead of
+// rereading every slot each frame. Every update, claim and release bumps
+// 'changes', and if a monitor has counted itself in 'watchers' the car wakes
+// it with a futex on 'changes' - one futex for the whole fleet, however many
+// cars there are (fleet_shm_wait()). A monitor that dies without counting
+// itself out only costs the cars a needless wake call.
+
+#define FLEET_SHM_NAME "/fleet"
+#define FLEET_SHM_MAGIC 0x464c5431u  // "FLT1"
+#define FLEET_SHM_VERSION 2
+#define FLEET_SHM_SLOTS 256
+#define FLEET_NAME_SIZE 32           // Longest car name is one less
+#define FLEET_CACHE_LINE 64
+
+// One car's entry - written by that car only
+typedef struct {
+  uint32_t seq;                    // Odd while the car is updating the slot
+  uint32_t in_use;                 // 1 while a car owns the slot
+  int32_t pid;                     // Owning car process
+  int32_t delay_ms;                // The car's phase delay
+  char name[FLEET_NAME_SIZE];      // Car name, without the /car prefix
+  int16_t current_floor_num;       // Floors as numbers (B1 = 0, B99 = -98)
+  int16_t destination_floor_num;
+  uint8_t status_code;             // As a car_status
+  uint8_t individual_service_mode;
+  uint8_t emergency_mode;
+  uint8_t door_obstruction;
+  uint8_t overload;
+  uint8_t emergency_stop;
+} __attribute__((aligned(FLEET_CACHE_LINE))) fleet_slot;
+
+typedef struct {
+  uint32_t magic;                  // FLEET_SHM_MAGIC, set once the segment is initialised
+  uint16_t version;                // FLEET_SHM_VERSION
+  uint16_t slot_count;             // FLEET_SHM_SLOTS
+  uint32_t generation;             // Bumped whenever a slot is claimed or released
+  pthread_mutex_t mutex;           // Held to claim or release a slot (robust)
+  uint32_t changes __attribute__((aligned(FLEET_CACHE_LINE))); // Bumped by every change to a slot
+  uint32_t watchers;               // Monitors waiting on 'changes' as a futex
+  fleet_slot slots[FLEET_SHM_SLOTS] __attribute__((aligned(FLEET_CACHE_LINE)));
+} fleet_shm;
+
+// 1 if a mapped segment of 'mapped' bytes is an initialised registry
+static inline int fleet_shm_valid(const fleet_shm *f, size_t mapped) {
+    return mapped >= sizeof(fleet_shm) &&
+           __atomic_load_n(&f->magic, __ATOMIC_ACQUIRE) == FLEET_SHM_MAGIC &&
+           f->version == FLEET_SHM_VERSION && f->slot_count == FLEET_SHM_SLOTS;
+}
+
+static inline uint32_t fleet_shm_generation(const fleet_shm *f) {
+    return __atomic_load_n(&f->generation, __ATOMIC_ACQUIRE);
+}
+
+// take the registry mutex, recovering it if its owner died holding it
+static inline int fleet_shm_lock(fleet_shm *f) {
+    int ret = pthread_mutex_lock(&f->mutex);
+    if (ret == EOWNERDEAD) {
+        pthread_mutex_consistent(&f->mutex);
+        ret = 0;
+    }
+    return ret;
+}
+
+// count a change and wake any monitors waiting for one
+static inline void fleet_shm_changed(fleet_shm *f) {
+    __atomic_add_fetch(&f->changes, 1, __ATOMIC_RELEASE);
+    // Pairs with the monitor counting itself in before it reads 'changes'
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&f->watchers, __ATOMIC_RELAXED) > 0) {
+        syscall(SYS_futex, &f->changes, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+    }
+}
+
+static inline uint32_t fleet_shm_changes(const fleet_shm *f) {
+    return __atomic_load_n(&f->changes, __ATOMIC_ACQUIRE);
+}
+
+// count a monitor in (1) or out (-1) of the cars' wakeups
+static inline void fleet_shm_watch(fleet_shm *f, int delta) {
+    __atomic_add_fetch(&f->watchers, delta, __ATOMIC_SEQ_CST);
+}
+
+// sleep until 'changes' is no longer 'seen' or 'timeout' (relative, NULL
+// for none) has passed. The monitor must have called fleet_shm_watch()
+static inline void fleet_shm_wait(fleet_shm *f, uint32_t seen, const struct timespec *timeout) {
+    syscall(SYS_futex, &f->changes, FUTEX_WAIT, seen, timeout, NULL, 0);
+}
+
+// mark the start of a change to a slot. Only called by the slot's car
+static inline void fleet_shm_write_begin(fleet_slot *s) {
+    __atomic_store_n(&s->seq, s->seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+// mark the end of a change to a slot
+static inline void fleet_shm_write_end(fleet_slot *s) {
+    __atomic_store_n(&s->seq, s->seq + 1, __ATOMIC_RELEASE);
+}
+
+// copy a car's state into its slot. Called by the car with its own mutex held
+static inline void fleet_shm_update(fleet_shm *f, fleet_slot *s, const car_shared_mem *m) {
+    fleet_shm_write_begin(s);
+    s->current_floor_num = m->current_floor_num;
+    s->destination_floor_num = m->destination_floor_num;
+    s->status_code = m->status_code;
+    s->individual_service_mode = m->individual_service_mode;
+    s->emergency_mode = m->emergency_mode;
+    s->door_obstruction = m->door_obstruction;
+    s->overload = m->overload;
+    s->emergency_stop = m->emergency_stop;
+    fleet_shm_write_end(s);
+    fleet_shm_changed(f);
+}
+
+// claim a slot for car 'name' and fill it from 'm'. A slot left behind by an
+// earlier car of the same name, or by a car that no longer exists, is reused.
+// returns the slot, or NULL if the registry is full or the name too long
+static inline fleet_slot *fleet_shm_claim(fleet_shm *f, const char *name, int32_t pid,
+                                          int32_t delay_ms, const car_shared_mem *m) {
+    if (strlen(name) >= FLEET_NAME_SIZE || fleet_shm_lock(f) != 0) {
+        return NULL;
+    }
+
+    fleet_slot *claimed = NULL;
+    for (int i = 0; i < FLEET_SHM_SLOTS && claimed == NULL; i++) {
+        fleet_slot *s = &f->slots[i];
+        if (s->in_use && strcmp(s->name, name) == 0) {
+            claimed = s;
+        }
+    }
+    for (int i = 0; i < FLEET_SHM_SLOTS && claimed == NULL; i++) {
+        fleet_slot *s = &f->slots[i];
+        if (!s->in_use || (kill(s->pid, 0) == -1 && errno == ESRCH)) {
+            claimed = s;
+        }
+    }
+
+    if (claimed != NULL) {
+        fleet_shm_write_begin(claimed);
+        strcpy(claimed->name, name);
+        claimed->pid = pid;
+        claimed->delay_ms = delay_ms;
+        fleet_shm_write_end(claimed);
+        fleet_shm_update(f, claimed, m);
+        __atomic_store_n(&claimed->in_use, 1, __ATOMIC_RELEASE);
+        __atomic_store_n(&f->generation, f->generation + 1, __ATOMIC_RELEASE);
+        fleet_shm_changed(f);
+    }
+    pthread_mutex_unlock(&f->mutex);
+    return claimed;
+}
+
+// give a slot back when its car exits, unless a newer car has taken it over
+static inline void fleet_shm_release(fleet_shm *f, fleet_slot *s, int32_t pid) {
+    if (fleet_shm_lock(f) != 0) {
+        return;
+    }
+    if (s->in_use && s->pid == pid) {
+        __atomic_store_n(&s->in_use, 0, __ATOMIC_RELEASE);
+        __atomic_store_n(&f->generation, f->generation + 1, __ATOMIC_RELEASE);
+        fleet_shm_changed(f);
+    }
+    pthread_mutex_unlock(&f->mutex);
+}
+
+// take a consistent copy of a slot without blocking its car. returns 1 if
+// 'out' holds a registered car, 0 if the slot is free or kept changing
+static inline int fleet_shm_read_slot(const fleet_slot *s, fleet_slot *out) {
+    for (int attempts = 0; attempts < CAR_SHM_READ_RETRIES; attempts++) {
+        uint32_t before = __atomic_load_n(&s->seq, __ATOMIC_ACQUIRE);
+        if (before & 1) {
+            continue; // Write in progress
+        }
+        if (!__atomic_load_n(&s->in_use, __ATOMIC_ACQUIRE)) {
+            return 0;
+        }
+        memcpy(out, (const void *)s, sizeof(*out));
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&s->seq, __ATOMIC_RELAXED) == before) {
+            out->name[FLEET_NAME_SIZE - 1] = '\0';
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// fill a car snapshot from a slot copy, for code written against car_shm_read()
+static inline void fleet_shm_to_snapshot(const fleet_slot *s, car_shm_snapshot *out) {
+    memset(out, 0, sizeof(*out));
+    floor_to_label(s->current_floor_num, out->current_floor, sizeof(out->current_floor));
+    floor_to_label(s->destination_floor_num, out->destination_floor, sizeof(out->destination_floor));
+    snprintf(out->status, sizeof(out->status), "%s", car_status_name((car_status)s->status_code));
+    out->door_obstruction = s->door_obstruction;
+    out->overload = s->overload;
+    out->emergency_stop = s->emergency_stop;
+    out->individual_service_mode = s->individual_service_mode;
+    out->emergency_mode = s->emergency_mode;
+    out->current_floor_num = s->current_floor_num;
+    out->destination_floor_num = s->destination_floor_num;
+    out->status_code = s->status_code;
+}
+
+#endif
@@ -0,0 +1,97 @@
+#ifndef FLOOR_LABEL_H
+#define FLOOR_LABEL_H
+
+#include <stddef.h>         // size_t
+#include <string.h>         // String manipulation functions
+
+// Floor labels (B99-B1, 1-999) and the numbers used for them everywhere
+// else: B99 is -98, B1 is 0, 1 is 1 and 999 is 999, so the numbering is
+// contiguous and the difference between two floors is the distance
+// travelled.
+//
+// Every program converts through these functions so they all agree on what
+// a floor is. The labels of the whole range are a table built by the
+// compiler, so a number becomes a label with one lookup. A label is parsed
+// with a loop over at most three digits and is only valid if it is the
+// table's label for that number - "01", "B0", "+1" and "B100" are all
+// rejected, and a label that is accepted always formats back the same.
+
+#define FLOOR_LOWEST (-98)          // B99
+#define FLOOR_HIGHEST 999
+#define FLOOR_COUNT (FLOOR_HIGHEST - FLOOR_LOWEST + 1)
+#define FLOOR_LABEL_SIZE 4          // Longest label and its NUL
+
+// Labels with a given prefix and each last digit, up and down
+#define FLOOR_UP(p) p "0", p "1", p "2", p "3", p "4", p "5", p "6", p "7", p "8", p "9"
+#define FLOOR_DOWN(p) p "9", p "8", p "7", p "6", p "5", p "4", p "3", p "2", p "1", p "0"
+#define FLOOR_UP_2(p) FLOOR_UP(p "0"), FLOOR_UP(p "1"), FLOOR_UP(p "2"), FLOOR_UP(p "3"), FLOOR_UP(p "4"), \
+                      FLOOR_UP(p "5"), FLOOR_UP(p "6"), FLOOR_UP(p "7"), FLOOR_UP(p "8"), FLOOR_UP(p "9")
+
+// Indexed by floor - FLOOR_LOWEST
+static const char floor_labels[FLOOR_COUNT][FLOOR_LABEL_SIZE] = {
+    FLOOR_DOWN("B9"), FLOOR_DOWN("B8"), FLOOR_DOWN("B7"), FLOOR_DOWN("B6"), FLOOR_DOWN("B5"),
+    FLOOR_DOWN("B4"), FLOOR_DOWN("B3"), FLOOR_DOWN("B2"), FLOOR_DOWN("B1"),
+    "B9", "B8", "B7", "B6", "B5", "B4", "B3", "B2", "B1",
+    "1", "2", "3", "4", "5", "6", "7", "8", "9",
+    FLOOR_UP("1"), FLOOR_UP("2"), FLOOR_UP("3"), FLOOR_UP("4"), FLOOR_UP("5"),
+    FLOOR_UP("6"), FLOOR_UP("7"), FLOOR_UP("8"), FLOOR_UP("9"),
+    FLOOR_UP_2("1"), FLOOR_UP_2("2"), FLOOR_UP_2("3"), FLOOR_UP_2("4"), FLOOR_UP_2("5"),
+    FLOOR_UP_2("6"), FLOOR_UP_2("7"), FLOOR_UP_2("8"), FLOOR_UP_2("9")
+};
+
+#undef FLOOR_UP
+#undef FLOOR_DOWN
+#undef FLOOR_UP_2
+
+static const char floor_unknown_label[FLOOR_LABEL_SIZE] = "?";
+
+// 1 if 'floor' is a number in the range
+static inline int floor_valid(int floor) {
+    return (unsigned)(floor - FLOOR_LOWEST) < FLOOR_COUNT;
+}
+
+// the label of a floor number, or "?" if it is out of range
+static inline const char *floor_label(int floor) {
+    return floor_valid(floor) ? floor_labels[floor - FLOOR_LOWEST] : floor_unknown_label;
+}
+
+// convert a floor label to a number. returns 0 on success, -1 if the label
+// is not a valid floor
+static inline int floor_from_label(const char *label, int *floor) {
+    if (label == NULL) {
+        return -1;
+    }
+    int basement = label[0] == 'B';
+    const char *digits = label + basement;
+    int num = 0, len = 0;
+    while (len < 3 && (unsigned)(digits[len] - '0') < 10) {
+        num = num * 10 + (digits[len] - '0');
+        len++;
+    }
+    int f = basement ? 1 - num : num;
+    if (len == 0 || digits[len] != '\0' || !floor_valid(f) ||
+        strcmp(label, floor_labels[f - FLOOR_LOWEST]) != 0) {
+        return -1;                  // Leading zeros, B0 and 0 aren't the floor's label
+    }
+    *floor = f;
+    return 0;
+}
+
+// 1 if a label is a valid floor
+static inline int floor_label_valid(const char *label) {
+    int floor;
+    return floor_from_label(label, &floor) == 0;
+}
+
+// copy the label of a floor number into 'label' ("?" if it is out of range).
+// 'label' needs FLOOR_LABEL_SIZE bytes for every floor to fit
+static inline void floor_to_label(int floor, char *label, size_t label_size) {
+    if (label_size >= FLOOR_LABEL_SIZE) {
+        memcpy(label, floor_label(floor), FLOOR_LABEL_SIZE);
+    } else if (label_size > 0) {
+        strncpy(label, floor_label(floor), label_size - 1);
+        label[label_size - 1] = '\0';
+    }
+}
+
+#endif
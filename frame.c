@@ -0,0 +1,152 @@
+#include <string.h>         // String manipulation functions
+#include <unistd.h>         // POSIX API functions
+#include <errno.h>          // Error handling
+#include <arpa/inet.h>      // htonl/ntohl
+#include <sys/uio.h>        // writev
+#include "frame.h"
+
+// HELPER FUNCTIONS
+
+// move the held bytes back to the start of the storage
+static void compact(frame_buffer *b) {
+    if (b->start > 0) {
+        memmove(b->data, b->data + b->start, b->len);
+        b->start = 0;
+    }
+}
+
+void frame_buffer_init(frame_buffer *b, void *storage, size_t size) {
+    b->data = storage;
+    b->size = size;
+    b->start = 0;
+    b->len = 0;
+}
+
+void frame_buffer_clear(frame_buffer *b) {
+    b->start = 0;
+    b->len = 0;
+}
+
+int frame_queue(frame_buffer *b, const char *body, size_t len) {
+    size_t need = FRAME_HEADER_SIZE + len;
+    if (b->len + need > b->size) {
+        return -1;
+    }
+    if (b->start + b->len + need > b->size) {
+        compact(b);
+    }
+    uint32_t nlen = htonl((uint32_t)len);
+    char *end = b->data + b->start + b->len;
+    memcpy(end, &nlen, sizeof(nlen));
+    memcpy(end + sizeof(nlen), body, len);
+    b->len += need;
+    return 0;
+}
+
+int frame_flush(int fd, frame_buffer *b) {
+    while (b->len > 0) {
+        ssize_t sent = write(fd, b->data + b->start, b->len);
+        if (sent == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+        }
+        b->start += sent;
+        b->len -= sent;
+    }
+    b->start = 0;
+    return 0;
+}
+
+ssize_t frame_fill(int fd, frame_buffer *b) {
+    if (b->len == 0) {
+        b->start = 0;
+    } else if (b->start + b->len == b->size) {
+        compact(b);
+    }
+    if (b->len == b->size) {
+        errno = ENOBUFS;
+        return -1;
+    }
+
+    for (;;) {
+        size_t end = b->start + b->len;
+        ssize_t received = read(fd, b->data + end, b->size - end);
+        if (received == -1 && errno == EINTR) {
+            continue;
+        }
+        if (received > 0) {
+            b->len += received;
+        }
+        return received;
+    }
+}
+
+int frame_next(frame_buffer *b, char *msg, size_t size) {
+    uint32_t nlen;
+    if (b->len < sizeof(nlen)) {
+        return 0;
+    }
+    memcpy(&nlen, b->data + b->start, sizeof(nlen));
+    uint32_t len = ntohl(nlen);
+    if (len >= size) {
+        return -1; // Oversized frame - not part of the protocol
+    }
+    if (b->len - sizeof(nlen) < len) {
+        return 0; // Rest of the frame hasn't arrived yet
+    }
+
+    memcpy(msg, b->data + b->start + sizeof(nlen), len);
+    msg[len] = '\0';
+    b->start += sizeof(nlen) + len;
+    b->len -= sizeof(nlen) + len;
+    return 1;
+}
+
+int frame_send(int fd, const char *msg) {
+    size_t len = strlen(msg);
+    uint32_t nlen = htonl((uint32_t)len);
+    struct iovec iov[2] = {
+        {&nlen, sizeof(nlen)},
+        {(void *)msg, len}
+    };
+    int iovcnt = 2;
+    struct iovec *next = iov;
+
+    while (iovcnt > 0) {
+        ssize_t sent = writev(fd, next, iovcnt);
+        if (sent == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        // Skip whatever was written, which may end part way through either piece
+        while (iovcnt > 0 && (size_t)sent >= next->iov_len) {
+            sent -= next->iov_len;
+            next++;
+            iovcnt--;
+        }
+        if (iovcnt > 0) {
+            next->iov_base = (char *)next->iov_base + sent;
+            next->iov_len -= sent;
+        }
+    }
+    return 0;
+}
+
+ssize_t frame_recv(int fd, frame_buffer *b, char *msg, size_t size) {
+    for (;;) {
+        size_t held = b->len;
+        int got = frame_next(b, msg, size);
+        if (got == 1) {
+            return (ssize_t)(held - b->len - FRAME_HEADER_SIZE);
+        } else if (got == -1) {
+            return -1;
+        }
+        if (frame_fill(fd, b) <= 0) {
+            return -1;
+        }
+    }
+}
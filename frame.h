@@ -0,0 +1,63 @@
+#ifndef FRAME_H
+#define FRAME_H
+
+#include <stddef.h>         // size_t
+#include <stdint.h>         // Standard integer types
+#include <sys/types.h>      // ssize_t
+
+// Length-prefixed framing shared by the car, controller and call programs.
+//
+// Every frame is a 32-bit length in network byte order followed by that many
+// bytes of body. The caller provides the storage for a frame_buffer, so
+// nothing here allocates. Incoming bytes are collected with frame_fill() and
+// split with frame_next(), which handles every frame that arrived in one
+// read(). Outgoing frames are queued with frame_queue() and written together
+// by frame_flush(). The buffer only moves bytes back to the start when it
+// runs out of room at the end.
+//
+// frame_send() and frame_recv() are blocking versions for programs that
+// exchange one frame at a time.
+
+#define FRAME_HEADER_SIZE sizeof(uint32_t)
+
+typedef struct {
+    char *data;                 // Caller-provided storage
+    size_t size;                // Bytes of storage
+    size_t start;               // Offset of the first unconsumed byte
+    size_t len;                 // Bytes held from 'start'
+} frame_buffer;
+
+// use 'size' bytes at 'storage' for an empty buffer
+void frame_buffer_init(frame_buffer *b, void *storage, size_t size);
+
+// discard everything in a buffer
+void frame_buffer_clear(frame_buffer *b);
+
+// append a frame with a 'len' byte body. returns 0 on success, -1 if the
+// buffer has no room for it
+int frame_queue(frame_buffer *b, const char *body, size_t len);
+
+// write as much of a buffer as the socket accepts without blocking.
+// returns 0 on success (bytes may still be queued), -1 if the connection failed
+int frame_flush(int fd, frame_buffer *b);
+
+// read once into the free space of a buffer. returns the bytes read, 0 if
+// the peer closed the connection, or -1 with errno set (EAGAIN if nothing
+// was available on a non-blocking socket, ENOBUFS if the buffer is full)
+ssize_t frame_fill(int fd, frame_buffer *b);
+
+// take the next complete frame out of a buffer and copy its body, NUL
+// terminated, into 'msg'. returns 1 if a frame was taken, 0 if the next frame
+// hasn't fully arrived, or -1 if it won't fit in 'size' bytes
+int frame_next(frame_buffer *b, char *msg, size_t size);
+
+// send one frame, blocking until all of it has been written. The length and
+// body go out in a single writev(). returns 0 on success, -1 on failure
+int frame_send(int fd, const char *msg);
+
+// receive one frame into 'msg', blocking until it has arrived. Frames that
+// arrived with it stay in 'b' for the next call. returns the body length, or
+// -1 if the connection failed or closed, or the frame won't fit in 'size'
+ssize_t frame_recv(int fd, frame_buffer *b, char *msg, size_t size);
+
+#endif
@@ -7,32 +7,21 @@
 #include <sys/mman.h>       // Memory management
 #include <sys/stat.h>       // File status
 #include <pthread.h>        // POSIX threads
-
-// define the shared memory structure
-typedef struct {
-  pthread_mutex_t mutex;           // Locked while accessing struct contents
-  pthread_cond_t cond;             // Signalled when the contents change
-  char current_floor[4];           // C string in the range B99-B1 and 1-999
-  char destination_floor[4];       // Same format as above
-  char status[8];                  // C string indicating the elevator's status
-  uint8_t open_button;             // 1 if open doors button is pressed, else 0
-  uint8_t close_button;            // 1 if close doors button is pressed, else 0
-  uint8_t door_obstruction;        // 1 if obstruction detected, else 0
-  uint8_t overload;                // 1 if overload detected
-  uint8_t emergency_stop;          // 1 if stop button has been pressed, else 0
-  uint8_t individual_service_mode; // 1 if in individual service mode, else 0
-  uint8_t emergency_mode;          // 1 if in emergency mode, else 0
-} car_shared_mem;
+#include <errno.h>          // Error handling
+#include "car_shm.h"        // Shared memory layout
+#include "latency.h"        // The car's stats page
 
 // function prototypes
 int is_valid_operation(const char *operation);
-int get_next_floor(const char *current_floor, char *next_floor, const char *direction);
+int get_next_floor(const car_shared_mem *shared_mem, int *next_floor, const char *direction);
 int is_doors_closed(const car_shared_mem *shared_mem);
 int is_elevator_moving(const car_shared_mem *shared_mem);
-int floor_label_to_number(const char *floor_label);
-void floor_number_to_label(int floor_num, char *floor_label, size_t label_size);
+car_status get_status(const car_shared_mem *shared_mem);
+int print_latency(const char *car_name);
 
 char *shm_name = NULL;
+size_t mapped_size = 0; // Bytes mapped - the segment may use the legacy layout
+int has_layout = 0;     // 1 if the segment has the binary floor/status fields
 
 // begin main function
 int main(int argc, char *argv[]) {
@@ -52,28 +41,75 @@ int main(int argc, char *argv[]) {
         exit(EXIT_FAILURE);
     }
 
+    // the stats page is separate from the car's segment and only read
+    if (strcmp(operation, "latency") == 0) {
+        return print_latency(car_name);
+    }
+
     // construct the shared memory name
     // char shm_name[32];
     // snprintf(shm_name, sizeof(shm_name), "/car%s", car_name);
     shm_name = malloc(strlen("/car") + strlen(car_name) + 1);
+    if (shm_name == NULL) {
+        perror("malloc()");
+        exit(EXIT_FAILURE);
+    }
+    sprintf(shm_name, "/car%s", car_name);
 
-    // open the shared memory segment
-    int shm_fd = shm_open(shm_name, O_RDWR, 0666);
-    if (shm_fd == -1) {
+    // open the shared memory segment, as much of the layout as it holds
+    car_shared_mem *shared_mem = car_shm_open(shm_name, &mapped_size);
+    if (shared_mem == NULL) {
         fprintf(stderr, "Unable to access car %s.\n", car_name);
         exit(EXIT_FAILURE);
     }
 
-    // map the shared memory segment to the car
-    car_shared_mem *shared_mem = mmap(NULL, sizeof(car_shared_mem), PROT_READ | PROT_WRITE, MAP_SHARED, shm_fd, 0);
-    if (shared_mem == MAP_FAILED) {
-        perror("Failed to map shared memory");
-        close(shm_fd);
+    // lock the mutex before accessing shared memory
+    int err = car_shm_lock(shared_mem, mapped_size);
+    if (err != 0) {
+        errno = err;
+        perror("Failed to lock shared memory");
+        munmap(shared_mem, mapped_size);
         exit(EXIT_FAILURE);
     }
+    has_layout = car_shm_has_layout(shared_mem, mapped_size);
+    int has_seqlock = car_shm_has_seqlock(shared_mem, mapped_size);
+    // up and down check the car first, so a refused move writes nothing
+    int next_floor = 0;
+    if (strcmp(operation, "up") == 0 || strcmp(operation, "down") == 0) {
+        // check if the elevator is in individual service mode
+        if (shared_mem->individual_service_mode == 0) {
+            fprintf(stderr, "Operation only allowed in service mode.\n");
+            pthread_mutex_unlock(&shared_mem->mutex);
+            munmap(shared_mem, mapped_size);
+            exit(EXIT_FAILURE);
+        }
+        // check if the elevator is moving
+        if (is_elevator_moving(shared_mem)) {
+            fprintf(stderr, "Operation not allowed while elevator is moving.\n");
+            pthread_mutex_unlock(&shared_mem->mutex);
+            munmap(shared_mem, mapped_size);
+            exit(EXIT_FAILURE);
+        }
+        // check if the doors are closed
+        if (!is_doors_closed(shared_mem)) {
+            fprintf(stderr, "Operation not allowed while doors are open.\n");
+            pthread_mutex_unlock(&shared_mem->mutex);
+            munmap(shared_mem, mapped_size);
+            exit(EXIT_FAILURE);
+        }
+        // compute next floor
+        int result = get_next_floor(shared_mem, &next_floor, operation);
+        if (result == -1) {
+            fprintf(stderr, "Cannot move %s from floor %s.\n", operation, shared_mem->current_floor);
+            pthread_mutex_unlock(&shared_mem->mutex);
+            munmap(shared_mem, mapped_size);
+            exit(EXIT_FAILURE);
+        }
+    }
 
-    // lock the mutex before accessing shared memory
-    pthread_mutex_lock(&shared_mem->mutex);
+    if (has_seqlock) {
+        car_shm_write_begin(shared_mem);
+    }
 
     // perform requested operation
     // set open_button to 1
@@ -92,56 +128,25 @@ int main(int argc, char *argv[]) {
     // set individual_service_mode to 0
     } else if (strcmp(operation, "service_off") == 0) {
         shared_mem->individual_service_mode = 0;
-    // set destination_floor to the next floor and handle errors
+    // set destination_floor to the next floor
     } else if (strcmp(operation, "up") == 0 || strcmp(operation, "down") == 0) {
-        // check if the elevator is in individual service mode
-        if (shared_mem->individual_service_mode == 0) {
-            fprintf(stderr, "Operation only allowed in service mode.\n");
-            pthread_mutex_unlock(&shared_mem->mutex);
-            munmap(shared_mem, sizeof(car_shared_mem));
-            close(shm_fd);
-            exit(EXIT_FAILURE);
-        }
-        // check if the doors are closed
-        if (!is_doors_closed(shared_mem)) {
-            fprintf(stderr, "Operation not allowed while doors are open.\n");
-            pthread_mutex_unlock(&shared_mem->mutex);
-            munmap(shared_mem, sizeof(car_shared_mem));
-            close(shm_fd);
-            exit(EXIT_FAILURE);
-        }
-        // check if the elevator is moving
-        if (is_elevator_moving(shared_mem)) {
-            fprintf(stderr, "Operation not allowed while elevator is moving.\n");
-            pthread_mutex_unlock(&shared_mem->mutex);
-            munmap(shared_mem, sizeof(car_shared_mem));
-            close(shm_fd);
-            exit(EXIT_FAILURE);
-        }
-        // compute next floor
-        char next_floor[4];
-        int result = get_next_floor(shared_mem->current_floor, next_floor, operation);
-        if (result == -1) {
-            fprintf(stderr, "Cannot move %s from floor %s.\n", operation, shared_mem->current_floor);
-            pthread_mutex_unlock(&shared_mem->mutex);
-            munmap(shared_mem, sizeof(car_shared_mem));
-            close(shm_fd);
-            exit(EXIT_FAILURE);
+        floor_to_label(next_floor, shared_mem->destination_floor, sizeof(shared_mem->destination_floor));
+        if (has_layout) {
+            shared_mem->destination_floor_num = next_floor;
         }
-        // set destination_floor to the next floor
-        strncpy(shared_mem->destination_floor, next_floor, sizeof(shared_mem->destination_floor));
-        shared_mem->destination_floor[sizeof(shared_mem->destination_floor) - 1] = '\0'; // Ensure null-termination
     }
 
     // signal the condition variable if necessary
-    pthread_cond_broadcast(&shared_mem->cond);
+    if (has_seqlock) {
+        car_shm_write_end(shared_mem);
+    }
+    car_shm_broadcast(shared_mem, mapped_size);
 
     // unlock the mutex
     pthread_mutex_unlock(&shared_mem->mutex);
 
-    // unmap the shared memory and close the file descriptor
-    munmap(shared_mem, sizeof(car_shared_mem));
-    close(shm_fd);
+    // unmap the shared memory
+    munmap(shared_mem, mapped_size);
 
     // program terminates after performing the operation
     return 0;
@@ -158,7 +163,8 @@ int is_valid_operation(const char *operation) {
         "service_on",
         "service_off",
         "up",
-        "down"
+        "down",
+        "latency"
     };
     size_t num_operations = sizeof(valid_operations) / sizeof(valid_operations[0]);
     for (size_t i = 0; i < num_operations; i++) {
@@ -170,16 +176,16 @@ int is_valid_operation(const char *operation) {
 }
 
 // function to calculate the next floor up or down based on the current floor
-int get_next_floor(const char *current_floor, char *next_floor, const char *direction) {
-    // convert current floor label to a number
-    int floor_num = floor_label_to_number(current_floor);
-
-    // check for conversion errors
-    if (floor_num == -9999) {
+int get_next_floor(const car_shared_mem *shared_mem, int *next_floor, const char *direction) {
+    // read the current floor as a number
+    int floor_num;
+    if (has_layout) {
+        floor_num = shared_mem->current_floor_num;
+    } else if (floor_from_label(shared_mem->current_floor, &floor_num) == -1) {
         return -1; // Invalid floor label
     }
 
-    // calculate the next floor number
+    // calculate the next floor number (B1 is 0, so there is no gap between B1 and 1)
     if (strcmp(direction, "up") == 0) {
         floor_num += 1;
     } else if (strcmp(direction, "down") == 0) {
@@ -187,54 +193,50 @@ int get_next_floor(const char *current_floor, char *next_floor, const char *dire
     }
 
     // check if the next floor is within valid range (B99 to 999)
-    if (floor_num < -99 || floor_num > 999 || floor_num == 0) {
+    if (floor_num < -98 || floor_num > 999) {
         return -1; // Cannot move further in this direction
     }
 
-    // convert floor number back to floor label
-    floor_number_to_label(floor_num, next_floor, 4);
-
+    *next_floor = floor_num;
     return 0; // Success
 }
 
+// function to read the car's status, using the binary copy if there is one
+car_status get_status(const car_shared_mem *shared_mem) {
+    if (has_layout) {
+        return (car_status)shared_mem->status_code;
+    }
+    return car_status_from_name(shared_mem->status);
+}
+
 // function to check if the doors are closed
 int is_doors_closed(const car_shared_mem *shared_mem) {
-    return (strcmp(shared_mem->status, "Closed") == 0);
+    return get_status(shared_mem) == CAR_STATUS_CLOSED;
 }
 
 // function to check if the elevator is moving (status is "Between")
 int is_elevator_moving(const car_shared_mem *shared_mem) {
-    return (strcmp(shared_mem->status, "Between") == 0);
+    return get_status(shared_mem) == CAR_STATUS_BETWEEN;
 }
 
-// helper function to convert floor label to a number
-int floor_label_to_number(const char *floor_label) {
-    if (floor_label == NULL || strlen(floor_label) == 0) {
-        return -9999; // Error code for invalid input
-    }
-    int floor_num = 0;
-    if (floor_label[0] == 'B') {
-        // Basement floor
-        floor_num = -(atoi(floor_label + 1));
-    } else {
-        // Regular floor
-        floor_num = atoi(floor_label);
+// function to print the latency histograms from a car's stats page
+// (microseconds)
+int print_latency(const char *car_name) {
+    char page_name[256];
+    snprintf(page_name, sizeof(page_name), "/car%s_latency", car_name);
+    const latency_page *page = latency_page_open(page_name);
+    if (page == NULL) {
+        fprintf(stderr, "Unable to access the stats of car %s.\n", car_name);
+        return EXIT_FAILURE;
     }
-    // Check for invalid conversion
-    if (floor_num == 0 && strcmp(floor_label, "0") != 0) {
-        return -9999; // Error code for invalid input
+    for (uint32_t i = 0; i < page->count; i++) {
+        char name[LATENCY_NAME_SIZE];
+        char line[256];
+        memcpy(name, page->names[i], sizeof(name));
+        name[sizeof(name) - 1] = '\0';
+        latency_format(&page->histograms[i], name, line, sizeof(line));
+        printf("%s\n", line);
     }
-    return floor_num;
+    latency_page_close(page);
+    return 0;
 }
-
-// Helper function to convert floor number to floor label
-void floor_number_to_label(int floor_num, char *floor_label, size_t label_size) {
-    if (floor_num < 0) {
-        // Basement floor
-        snprintf(floor_label, label_size, "B%d", -floor_num);
-    } else {
-        // Regular floor
-        snprintf(floor_label, label_size, "%d", floor_num);
-    }
-    floor_label[label_size - 1] = '\0'; // Ensure null-termination
-}
\ No newline at end of file
@@ -0,0 +1,143 @@
+#include <stdio.h>          // snprintf
+#include <string.h>         // String manipulation functions
+#include <errno.h>          // Error handling
+#include <fcntl.h>          // File control options
+#include <unistd.h>         // POSIX API functions
+#include <sys/mman.h>       // Memory management
+#include <sys/stat.h>       // File status
+#include "latency.h"
+
+#define SUB_COUNT (1u << LATENCY_SUB_BITS)
+
+// HELPER FUNCTIONS
+
+static int bucket_of(uint64_t ns) {
+    if (ns < SUB_COUNT) {
+        return (int)ns;
+    }
+    if (ns >> LATENCY_MAX_BITS) {
+        return LATENCY_BUCKETS - 1;
+    }
+    int magnitude = 63 - __builtin_clzll(ns);           // ns is in [2^magnitude, 2^(magnitude+1))
+    int shift = magnitude - LATENCY_SUB_BITS;
+    int group = shift + 1;
+    return (group << LATENCY_SUB_BITS) + (int)((ns >> shift) - SUB_COUNT);
+}
+
+// the largest value counted in a bucket
+static uint64_t bucket_end(int bucket) {
+    if (bucket < (int)SUB_COUNT) {
+        return bucket;
+    }
+    int shift = (bucket >> LATENCY_SUB_BITS) - 1;
+    uint64_t start = (uint64_t)(SUB_COUNT + (bucket & (SUB_COUNT - 1))) << shift;
+    return start + ((uint64_t)1 << shift) - 1;
+}
+
+void latency_init(latency_histogram *h) {
+    memset(h, 0, sizeof(*h));
+}
+
+void latency_record(latency_histogram *h, uint64_t ns) {
+    h->buckets[bucket_of(ns)]++;
+    h->count++;
+    h->sum_ns += ns;
+    if (ns > h->max_ns) {
+        h->max_ns = ns;
+    }
+}
+
+uint64_t latency_percentile(const latency_histogram *h, double percentile) {
+    if (h->count == 0) {
+        return 0;
+    }
+    uint64_t rank = (uint64_t)(percentile / 100.0 * (double)h->count + 0.5);
+    if (rank < 1) {
+        rank = 1;
+    } else if (rank > h->count) {
+        rank = h->count;
+    }
+    uint64_t seen = 0;
+    for (int i = 0; i < LATENCY_BUCKETS; i++) {
+        seen += h->buckets[i];
+        if (seen >= rank) {
+            uint64_t end = bucket_end(i);
+            return end < h->max_ns ? end : h->max_ns;
+        }
+    }
+    return h->max_ns; // Counts changed while being read
+}
+
+int latency_format(const latency_histogram *h, const char *name, char *buf, size_t size) {
+    double mean = h->count > 0 ? (double)h->sum_ns / (double)h->count : 0;
+    return snprintf(buf, size, "%s n %llu mean %.1f p50 %.1f p99 %.1f p999 %.1f max %.1f",
+                    name, (unsigned long long)h->count, mean / 1000.0,
+                    latency_percentile(h, 50) / 1000.0, latency_percentile(h, 99) / 1000.0,
+                    latency_percentile(h, 99.9) / 1000.0, h->max_ns / 1000.0);
+}
+
+// STATS PAGES
+
+latency_page *latency_page_create(const char *shm_name) {
+    int fd = shm_open(shm_name, O_CREAT | O_RDWR, 0666);
+    if (fd == -1) {
+        return NULL;
+    }
+    if (ftruncate(fd, sizeof(latency_page)) == -1) {
+        int saved = errno;
+        close(fd);
+        errno = saved;
+        return NULL;
+    }
+    latency_page *page = mmap(NULL, sizeof(latency_page), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    int saved = errno;
+    close(fd);
+    if (page == MAP_FAILED) {
+        errno = saved;
+        return NULL;
+    }
+    memset(page, 0, sizeof(*page));
+    page->magic = LATENCY_PAGE_MAGIC;
+    return page;
+}
+
+latency_histogram *latency_page_add(latency_page *page, const char *name) {
+    if (page->count == LATENCY_PAGE_SLOTS) {
+        return NULL;
+    }
+    int slot = page->count;
+    snprintf(page->names[slot], LATENCY_NAME_SIZE, "%s", name);
+    latency_init(&page->histograms[slot]);
+    page->count++;
+    return &page->histograms[slot];
+}
+
+const latency_page *latency_page_open(const char *shm_name) {
+    int fd = shm_open(shm_name, O_RDONLY, 0);
+    if (fd == -1) {
+        return NULL;
+    }
+    struct stat st;
+    if (fstat(fd, &st) == -1 || st.st_size < (off_t)sizeof(latency_page)) {
+        close(fd);
+        errno = EINVAL;
+        return NULL;
+    }
+    latency_page *page = mmap(NULL, sizeof(latency_page), PROT_READ, MAP_SHARED, fd, 0);
+    int saved = errno;
+    close(fd);
+    if (page == MAP_FAILED) {
+        errno = saved;
+        return NULL;
+    }
+    if (page->magic != LATENCY_PAGE_MAGIC || page->count > LATENCY_PAGE_SLOTS) {
+        munmap(page, sizeof(latency_page));
+        errno = EINVAL;
+        return NULL;
+    }
+    return page;
+}
+
+void latency_page_close(const latency_page *page) {
+    munmap((void *)page, sizeof(latency_page));
+}
@@ -0,0 +1,73 @@
+#ifndef LATENCY_H
+#define LATENCY_H
+
+#include <stddef.h>         // size_t
+#include <stdint.h>         // Standard integer types
+
+// Latency histograms kept by the controller and the car.
+//
+// Averages hide the occasional slow call or late wakeup, so each measurement
+// is counted in a log-linear (HDR style) histogram: values below
+// 2^LATENCY_SUB_BITS ns get a bucket each, and every doubling above that is
+// split into 2^LATENCY_SUB_BITS buckets, so any percentile is reported to
+// within about 3% of the true value at a fixed 9 KB per histogram. Recording
+// is a shift and an increment, cheap enough for every call and status.
+//
+// The controller answers a STATS frame with its histograms, one per line of
+// the reply (call --stats). A car publishes its own in a stats page,
+// /car{name}_latency, which internal {car} latency prints. A page has a
+// single writer and readers copy it without locking - a histogram read while
+// a value is being recorded may be one count out, which doesn't matter for
+// percentiles.
+
+#define LATENCY_SUB_BITS 5          // 32 buckets per doubling
+#define LATENCY_MAX_BITS 40         // Values from 2^40 ns (about 18 minutes) share the top bucket
+#define LATENCY_BUCKETS ((LATENCY_MAX_BITS - LATENCY_SUB_BITS + 1) << LATENCY_SUB_BITS)
+
+#define LATENCY_PAGE_MAGIC 0x4c415431u  // "LAT1"
+#define LATENCY_PAGE_SLOTS 4            // Histograms in one page
+#define LATENCY_NAME_SIZE 16
+
+typedef struct {
+    uint64_t count;
+    uint64_t sum_ns;
+    uint64_t max_ns;
+    uint64_t buckets[LATENCY_BUCKETS];
+} latency_histogram;
+
+// A set of named histograms in shared memory
+typedef struct {
+    uint32_t magic;
+    uint32_t count;                     // Slots in use
+    char names[LATENCY_PAGE_SLOTS][LATENCY_NAME_SIZE];
+    latency_histogram histograms[LATENCY_PAGE_SLOTS];
+} latency_page;
+
+void latency_init(latency_histogram *h);
+
+// count one measurement of 'ns' nanoseconds
+void latency_record(latency_histogram *h, uint64_t ns);
+
+// the value in ns that 'percentile' (0-100) percent of the measurements are
+// at or below, rounded up to the end of its bucket. 0 if nothing was recorded
+uint64_t latency_percentile(const latency_histogram *h, double percentile);
+
+// one line summarising a histogram:
+// "{name} n {count} mean {us} p50 {us} p99 {us} p999 {us} max {us}"
+// returns the length, as snprintf() does
+int latency_format(const latency_histogram *h, const char *name, char *buf, size_t size);
+
+// create (or reset) the stats page 'shm_name' and map it for writing.
+// returns NULL with errno set on failure
+latency_page *latency_page_create(const char *shm_name);
+
+// add a histogram to a page. returns NULL if the page is full
+latency_histogram *latency_page_add(latency_page *page, const char *name);
+
+// map an existing stats page for reading. returns NULL with errno set on
+// failure (EINVAL if it isn't a stats page)
+const latency_page *latency_page_open(const char *shm_name);
+
+void latency_page_close(const latency_page *page);
+
+#endif
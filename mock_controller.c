@@ -9,40 +9,22 @@
 #include <netinet/in.h>
 #include <unistd.h>
 #include <errno.h>
+#include "frame.h"
+#include "endpoint.h"
 
-void recv_looped(int fd, void *buf, size_t sz) {
-    char *ptr = buf;
-    size_t remain = sz;
-    while (remain > 0) {
-        ssize_t received = read(fd, ptr, remain);
-        if (received == -1) {
-            perror("read()");
-            exit(1);
-        } else if (received == 0) {
-            // Connection closed by peer
-            fprintf(stderr, "Connection closed by peer\n");
-            exit(1);
-        }
-        ptr += received;
-        remain -= received;
+int main(int argc, char **argv) {
+    // Usage: ./mock_controller [--listen host:port]
+    endpoint listen_at;
+    if (argc != 1 && (argc != 3 || strcmp(argv[1], "--listen") != 0)) {
+        fprintf(stderr, "Usage: %s [--listen host:port]\n", argv[0]);
+        exit(1);
     }
-}
-
-char *receive_msg(int fd) {
-    uint32_t nlen;
-    recv_looped(fd, &nlen, sizeof(nlen));
-    uint32_t len = ntohl(nlen);
-    char *buf = malloc(len + 1);
-    if (!buf) {
-        perror("malloc()");
+    const char *listen_spec = argc == 3 ? argv[2] : "0.0.0.0";
+    if (endpoint_parse(listen_spec, "0.0.0.0", &listen_at) == -1) {
+        fprintf(stderr, "Invalid address: %s\n", listen_spec);
         exit(1);
     }
-    recv_looped(fd, buf, len);
-    buf[len] = '\0';
-    return buf;
-}
 
-int main() {
     int listensockfd = socket(AF_INET, SOCK_STREAM, 0);
     if (listensockfd == -1) {
         perror("socket()");
@@ -56,12 +38,7 @@ int main() {
         exit(1);
     }
 
-    struct sockaddr_in addr;
-    memset(&addr, 0, sizeof(addr));
-    addr.sin_family = AF_INET;
-    addr.sin_port = htons(3000);
-    addr.sin_addr.s_addr = htonl(INADDR_ANY);
-    if (bind(listensockfd, (const struct sockaddr *)&addr, sizeof(addr)) == -1) {
+    if (bind(listensockfd, (const struct sockaddr *)&listen_at.addr, sizeof(listen_at.addr)) == -1) {
         perror("bind()");
         exit(1);
     }
@@ -71,7 +48,7 @@ int main() {
         exit(1);
     }
 
-    printf("Mock controller is running and listening on port 3000...\n");
+    printf("Mock controller is running and listening on %s...\n", listen_at.text);
 
     for (;;) {
         struct sockaddr_in clientaddr;
@@ -83,18 +60,20 @@ int main() {
             continue;
         }
 
-        char *msg = receive_msg(clientfd);
+        char storage[FRAME_HEADER_SIZE + 1024];
+        frame_buffer in;
+        frame_buffer_init(&in, storage, sizeof(storage));
+        char msg[1024];
+        if (frame_recv(clientfd, &in, msg, sizeof(msg)) == -1) {
+            fprintf(stderr, "Connection closed by peer\n");
+            close(clientfd);
+            continue;
+        }
         printf("Received message from client: %s\n", msg);
-        free(msg);
 
         // For testing, send a FLOOR command to the car
-        const char *floor_cmd = "FLOOR 5";
-        uint32_t len = htonl(strlen(floor_cmd));
-        if (write(clientfd, &len, sizeof(len)) != sizeof(len)) {
-            perror("write()");
-        }
-        if (write(clientfd, floor_cmd, strlen(floor_cmd)) != (ssize_t)strlen(floor_cmd)) {
-            perror("write()");
+        if (frame_send(clientfd, "FLOOR 5") == -1) {
+            perror("writev()");
         }
 
         if (shutdown(clientfd, SHUT_RDWR) == -1) {
@@ -0,0 +1,175 @@
+#include <stdlib.h>         // Standard library functions
+#include <string.h>         // String manipulation functions
+#include <math.h>           // exp
+#include "park.h"
+
+#define RENORMALISE_AFTER 500.0     // Exponent at which the weights are rebased
+#define MIN_GAIN 0.1                // Fraction of the waiting cost a move has to save
+#define LOBBY 1                     // Floor the lobby policy parks at
+
+static const park_policy park_policies[] = {
+    {"demand", park_demand},
+    {"lobby", park_lobby},
+    {NULL, NULL}
+};
+
+// HELPER FUNCTIONS
+
+// natural log of the factor a call has grown by between 'epoch' and 'now'
+static double growth(const park_stats *s, uint64_t now) {
+    return M_LN2 * (double)(now - s->epoch) / 1e9 / s->half_life;
+}
+
+static int services(const park_car *car, int floor) {
+    return floor >= car->lowest_floor && floor <= car->highest_floor;
+}
+
+// distance from each floor that has had calls to the nearest car serving it
+// other than cars[skip], or -1 if there is none. Indexed from s->lowest
+static void nearest_others(const park_stats *s, const park_car *cars, int ncars, int skip, int *nearest) {
+    for (int floor = s->lowest; floor <= s->highest; floor++) {
+        int best = -1;
+        for (int i = 0; i < ncars; i++) {
+            int distance = abs(cars[i].position - floor);
+            if (i != skip && services(&cars[i], floor) && (best == -1 || distance < best)) {
+                best = distance;
+            }
+        }
+        nearest[floor - s->lowest] = best;
+    }
+}
+
+// rate-weighted distance from every floor that has had calls to the nearest
+// car serving it - how far the next passenger can expect their car to be -
+// given where 'car' is and the nearest of the others. 'rates' holds the rate
+// of each floor from s->lowest up
+static double waiting_cost(const park_stats *s, const double *rates, const int *nearest, const park_car *car) {
+    double total = 0;
+    for (int floor = s->lowest; floor <= s->highest; floor++) {
+        double rate = rates[floor - s->lowest];
+        if (rate <= 0) {
+            continue;
+        }
+        int distance = nearest[floor - s->lowest];
+        if (services(car, floor) && (distance == -1 || abs(car->position - floor) < distance)) {
+            distance = abs(car->position - floor);
+        }
+        if (distance > 0) {
+            total += rate * distance;
+        }
+    }
+    return total;
+}
+
+// STATISTICS
+
+void park_stats_init(park_stats *s, double half_life) {
+    memset(s, 0, sizeof(*s));
+    s->half_life = half_life;
+    s->lowest = STOP_QUEUE_HIGHEST + 1; // No calls yet
+    s->highest = STOP_QUEUE_LOWEST - 1;
+}
+
+void park_stats_record(park_stats *s, int floor, uint64_t now) {
+    if (floor < STOP_QUEUE_LOWEST || floor > STOP_QUEUE_HIGHEST) {
+        return;
+    }
+    if (s->lowest > s->highest) {
+        s->epoch = now;
+    } else if (growth(s, now) > RENORMALISE_AFTER) {
+        double shrink = exp(-growth(s, now));
+        for (int f = s->lowest; f <= s->highest; f++) {
+            s->weight[f - STOP_QUEUE_LOWEST] *= shrink;
+        }
+        s->epoch = now;
+    }
+    s->weight[floor - STOP_QUEUE_LOWEST] += exp(growth(s, now));
+    if (floor < s->lowest) {
+        s->lowest = floor;
+    }
+    if (floor > s->highest) {
+        s->highest = floor;
+    }
+}
+
+double park_stats_rate(const park_stats *s, int floor, uint64_t now) {
+    if (floor < s->lowest || floor > s->highest) {
+        return 0;
+    }
+    return s->weight[floor - STOP_QUEUE_LOWEST] * exp(-growth(s, now));
+}
+
+// POLICIES
+
+// Spread the idle cars over the floors calls come from. Each idle car in
+// turn is moved to whichever busy floor leaves the next passenger closest to
+// a car, counting the cars already placed, as long as that saves a
+// worthwhile part of the expected travel
+void park_demand(const park_stats *stats, park_car *cars, int ncars, uint64_t now) {
+    if (stats->lowest > stats->highest) {
+        for (int i = 0; i < ncars; i++) {
+            cars[i].target = PARK_STAY; // No calls yet
+        }
+        return;
+    }
+    // The rates only change with time, so work them out once for every move
+    double rates[stats->highest - stats->lowest + 1];
+    int nearest[stats->highest - stats->lowest + 1];
+    for (int floor = stats->lowest; floor <= stats->highest; floor++) {
+        rates[floor - stats->lowest] = park_stats_rate(stats, floor, now);
+    }
+
+    for (int i = 0; i < ncars; i++) {
+        cars[i].target = PARK_STAY;
+        if (!cars[i].idle) {
+            continue;
+        }
+
+        int stay = cars[i].position;
+        nearest_others(stats, cars, ncars, i, nearest);
+        double current = waiting_cost(stats, rates, nearest, &cars[i]);
+        double best = current;
+        int best_floor = stay;
+        for (int floor = stats->lowest; floor <= stats->highest; floor++) {
+            if (floor == stay || !services(&cars[i], floor) || rates[floor - stats->lowest] <= 0) {
+                continue;
+            }
+            cars[i].position = floor;
+            double cost = waiting_cost(stats, rates, nearest, &cars[i]);
+            if (cost < best) {
+                best = cost;
+                best_floor = floor;
+            }
+        }
+
+        if (best_floor != stay && best < current * (1.0 - MIN_GAIN)) {
+            cars[i].position = best_floor;
+            cars[i].target = best_floor;
+        } else {
+            cars[i].position = stay;
+        }
+    }
+}
+
+// Send every idle car back to the lobby, or the nearest floor to it that the
+// car serves
+void park_lobby(const park_stats *stats, park_car *cars, int ncars, uint64_t now) {
+    for (int i = 0; i < ncars; i++) {
+        int floor = LOBBY;
+        if (floor < cars[i].lowest_floor) {
+            floor = cars[i].lowest_floor;
+        } else if (floor > cars[i].highest_floor) {
+            floor = cars[i].highest_floor;
+        }
+        cars[i].target = cars[i].idle && cars[i].position != floor ? floor : PARK_STAY;
+    }
+}
+
+const park_policy *park_find_policy(const char *name) {
+    for (const park_policy *p = park_policies; p->name != NULL; p++) {
+        if (strcmp(p->name, name) == 0) {
+            return p;
+        }
+    }
+    return NULL;
+}
@@ -0,0 +1,64 @@
+#ifndef PARK_H
+#define PARK_H
+
+#include <stdint.h>         // Standard integer types
+#include "stop_queue.h"     // Floor numbering
+
+// Parking policies used by the controller to reposition idle cars.
+//
+// A car that has delivered its last passenger otherwise waits wherever that
+// was. The controller counts the calls made from each floor, with older
+// calls fading out over a half life, so the counts follow demand as it
+// shifts - towards the lobby in the morning, the upper floors at lunch.
+// Every so often the selected policy is given the idle cars and may send
+// any of them to another floor to wait for the next call there.
+//
+// Like the dispatch cost functions the policy is pluggable.
+
+#define PARK_HALF_LIFE 600.0    // Default half life of a call in seconds
+#define PARK_STAY (STOP_QUEUE_LOWEST - 1) // A target below every floor - -1 is B2
+
+// Calls per floor, decayed exponentially. Counts are stored relative to
+// 'epoch' so that recording a call doesn't have to touch every floor
+typedef struct {
+    double weight[STOP_QUEUE_FLOORS];   // Index (floor - STOP_QUEUE_LOWEST)
+    double half_life;                   // Seconds
+    uint64_t epoch;                     // CLOCK_MONOTONIC ns the weights are relative to
+    int lowest;                         // Range of floors that have been called from
+    int highest;
+} park_stats;
+
+// A car as seen by a parking policy
+typedef struct {
+    int lowest_floor;
+    int highest_floor;
+    int position;           // Current floor, or where an idle car has been sent
+    int idle;               // 1 if the car may be moved
+    int target;             // Set by the policy - floor to park at, or PARK_STAY
+} park_car;
+
+// decide where the idle cars should wait, setting each one's 'target'
+typedef void (*park_fn)(const park_stats *stats, park_car *cars, int ncars, uint64_t now);
+
+typedef struct {
+    const char *name;
+    park_fn park;
+} park_policy;
+
+void park_stats_init(park_stats *s, double half_life);
+
+// count a call from 'floor' made at 'now' (CLOCK_MONOTONIC nanoseconds)
+void park_stats_record(park_stats *s, int floor, uint64_t now);
+
+// decayed number of calls from 'floor' as of 'now'
+double park_stats_rate(const park_stats *s, int floor, uint64_t now);
+
+// Built-in policies
+void park_demand(const park_stats *stats, park_car *cars, int ncars, uint64_t now);
+void park_lobby(const park_stats *stats, park_car *cars, int ncars, uint64_t now);
+
+// look up a built-in policy by name ("demand" or "lobby"). returns NULL if
+// there is no such policy
+const park_policy *park_find_policy(const char *name);
+
+#endif
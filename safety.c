@@ -0,0 +1,554 @@
+#define _POSIX_C_SOURCE 200809L // Enable CLOCK_MONOTONIC definition
+#define _DEFAULT_SOURCE // syscall(), for the futex wakeups in car_shm.h
+
+#include <stdio.h>          // Standard I/O functions
+#include <stdlib.h>         // Standard library functions
+#include <string.h>         // String manipulation functions
+#include <stdint.h>         // Standard integer types
+#include <unistd.h>         // POSIX API functions
+#include <fcntl.h>          // File control options
+#include <signal.h>         // Signal handling
+#include <sched.h>          // Real-time scheduling
+#include <errno.h>          // Error handling
+#include <time.h>           // Time functions
+#include <sys/mman.h>       // Memory management
+#include <sys/stat.h>       // File status
+#include <pthread.h>        // POSIX threads
+#include <linux/futex.h>    // futex_waitv
+#include "car_shm.h"        // Shared memory layout
+
+// The safety monitor checks a car every time anything in its segment
+// changes - there is no polling. It runs SCHED_FIFO with its memory locked so
+// a wakeup isn't delayed by other processes or by page faults, and records
+// how long each reaction took: from the time the writer stamped on the
+// change (version 6 segments) to the monitor's first corrective write, so
+// waking up and being scheduled are counted. Changes from writers that don't
+// stamp are timed from the wakeup instead.
+//
+// Given several cars it supervises them all from one process. Cars with a
+// version 4 segment are shared out between one thread per core, and each
+// thread sleeps in futex_waitv() on the sequence counters of its cars, which
+// every writer wakes through car_shm_broadcast(). Older segments, or kernels
+// without futex_waitv(), get a thread of their own that sleeps on the car's
+// condition variable as a single monitor does.
+
+#define WATCH_LIMIT (FUTEX_WAITV_MAX - 1) // Cars per futex thread - one entry is the stop word
+#define THREAD_STACK_SIZE (256 * 1024)    // Locked in memory, so keep it small
+#define LATENCY_BUCKETS 10000             // 1us histogram buckets, the last one is everything longer
+
+// A car being supervised
+typedef struct {
+    const char *name;
+    car_shared_mem *mem;
+    size_t mapped;          // Bytes mapped - the segment may use the legacy layout
+    int has_seqlock;
+    int has_change_time;
+    uint32_t seen;          // Sequence count after the last check
+    uint64_t stamp_seen;    // Change time after the last check
+    uint64_t wrote_ns;      // When the current check made its first change
+    int watched;            // Counted in the segment's watchers
+} supervised_car;
+
+// A thread supervising one or more cars
+typedef struct {
+    pthread_t thread;
+    int futex;              // 1 if it waits on futexes rather than a condition variable
+    supervised_car **cars;
+    int count;
+    uint64_t worst_ns;      // Longest reaction
+    unsigned long reactions;
+    unsigned long stamped;  // Reactions timed from the writer's stamp
+    uint32_t *latency;      // Reactions per microsecond taken
+} monitor;
+
+// Function prototypes
+int open_car(const char *name, supervised_car *c);
+void react(monitor *t, supervised_car *c, uint64_t woke);
+void *watch_condition(void *arg);
+void *watch_futexes(void *arg);
+int check_car(supervised_car *c);
+void begin_change(supervised_car *c, int *changed);
+int is_consistent(const car_shared_mem *m);
+void set_status(car_shared_mem *m, size_t mapped, car_status status);
+void report(supervised_car *c, const char *message);
+void abandon(supervised_car *c, int err);
+void say(const char *message);
+void go_realtime(void);
+uint64_t now_ns(void);
+void *signal_handling(void *arg);
+
+// Global variables
+supervised_car *cars = NULL;
+int num_cars = 0;
+monitor *monitors = NULL;
+int num_monitors = 0;
+volatile int running = 1;   // Cleared by the signal thread
+uint32_t stop_word = 0;     // Futex the signal thread wakes the futex threads with
+int report_latency = 0;     // Print the reaction times on exit (--latency)
+
+int main(int argc, char *argv[]) {
+    int threads = 0;
+    const char **names = malloc(sizeof(char *) * argc);
+    if (names == NULL) {
+        perror("malloc()");
+        exit(EXIT_FAILURE);
+    }
+
+    // check/validate the arguments
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--latency") == 0) {
+            report_latency = 1;
+        } else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc && atoi(argv[i + 1]) > 0) {
+            threads = atoi(argv[++i]);
+        } else if (argv[i][0] == '-') {
+            num_cars = 0;
+            break;
+        } else {
+            names[num_cars++] = argv[i];
+        }
+    }
+    if (num_cars == 0) {
+        fprintf(stderr, "Usage: %s {car name}... [--latency] [--threads n]\n", argv[0]);
+        exit(EXIT_FAILURE);
+    }
+
+    cars = calloc(num_cars, sizeof(supervised_car));
+    if (cars == NULL) {
+        perror("calloc()");
+        exit(EXIT_FAILURE);
+    }
+    for (int i = 0; i < num_cars; i++) {
+        if (open_car(names[i], &cars[i]) == -1) {
+            printf("Unable to access car %s.\n", names[i]);
+            fflush(stdout);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    // Split the cars between condition variable threads (one per car) and
+    // futex threads (one per core, as evenly as possible)
+    int futex_ok = car_shm_futex_waitv_works();
+    int watchable = 0;
+    for (int i = 0; i < num_cars; i++) {
+        watchable += futex_ok && car_shm_has_watchers(cars[i].mem, cars[i].mapped);
+    }
+    int futex_threads = 0;
+    if (watchable > 0) {
+        futex_threads = threads > 0 ? threads : (int)sysconf(_SC_NPROCESSORS_ONLN);
+        if (futex_threads > watchable) {
+            futex_threads = watchable;
+        }
+        if (futex_threads < (watchable + WATCH_LIMIT - 1) / WATCH_LIMIT) {
+            futex_threads = (watchable + WATCH_LIMIT - 1) / WATCH_LIMIT;
+        }
+    }
+    num_monitors = futex_threads + (num_cars - watchable);
+    monitors = calloc(num_monitors, sizeof(monitor));
+    supervised_car **slots = malloc(sizeof(supervised_car *) * num_cars);
+    if (monitors == NULL || slots == NULL) {
+        perror("malloc()");
+        exit(EXIT_FAILURE);
+    }
+
+    int next_cond = futex_threads;
+    int next_futex = 0;
+    int used = 0;
+    for (int m = 0; m < futex_threads; m++) {
+        monitors[m].futex = 1;
+        monitors[m].cars = &slots[used];
+        used += watchable / futex_threads + (m < watchable % futex_threads);
+    }
+    for (int i = 0; i < num_cars; i++) {
+        monitor *t;
+        if (futex_ok && car_shm_has_watchers(cars[i].mem, cars[i].mapped)) {
+            // Deal the cars out in turn
+            t = &monitors[next_futex];
+            next_futex = (next_futex + 1) % futex_threads;
+        } else {
+            t = &monitors[next_cond];
+            t->cars = &slots[used++];
+            next_cond++;
+        }
+        t->cars[t->count++] = &cars[i];
+    }
+
+    // SIGINT is collected by the signal thread, which wakes every monitor
+    sigset_t sigint_set;
+    sigemptyset(&sigint_set);
+    sigaddset(&sigint_set, SIGINT);
+    pthread_sigmask(SIG_BLOCK, &sigint_set, NULL);
+
+    // Threads created from here on inherit the real-time policy
+    go_realtime();
+
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setstacksize(&attr, THREAD_STACK_SIZE);
+    for (int m = 0; m < num_monitors; m++) {
+        monitors[m].latency = calloc(LATENCY_BUCKETS, sizeof(uint32_t));
+        if (monitors[m].latency == NULL) {
+            perror("calloc()");
+            exit(EXIT_FAILURE);
+        }
+        void *(*body)(void *) = monitors[m].futex ? watch_futexes : watch_condition;
+        if (pthread_create(&monitors[m].thread, &attr, body, &monitors[m]) != 0) {
+            perror("pthread_create()");
+            exit(EXIT_FAILURE);
+        }
+    }
+    pthread_t signal_thread;
+    pthread_create(&signal_thread, &attr, signal_handling, &sigint_set);
+    pthread_attr_destroy(&attr);
+
+    pthread_join(signal_thread, NULL);
+    uint64_t worst_ns = 0;
+    unsigned long reactions = 0;
+    unsigned long stamped = 0;
+    for (int m = 0; m < num_monitors; m++) {
+        pthread_join(monitors[m].thread, NULL);
+        if (monitors[m].worst_ns > worst_ns) {
+            worst_ns = monitors[m].worst_ns;
+        }
+        reactions += monitors[m].reactions;
+        stamped += monitors[m].stamped;
+    }
+
+    if (report_latency && reactions == 0) {
+        fprintf(stderr, "No reactions to time (%d cars, %d threads)\n", num_cars, num_monitors);
+    } else if (report_latency) {
+        // 99th percentile from the merged histograms
+        unsigned long rank = reactions - reactions / 100;
+        unsigned long seen = 0;
+        int p99 = 0;
+        for (int b = 0; b < LATENCY_BUCKETS && seen < rank; b++) {
+            for (int m = 0; m < num_monitors; m++) {
+                seen += monitors[m].latency[b];
+            }
+            p99 = b;
+        }
+        fprintf(stderr, "Worst-case reaction time: %.1f us, p99 under %d us, over %lu reactions "
+                "(%lu timed from the writer's stamp, %d cars, %d threads)\n",
+                worst_ns / 1000.0, p99 + 1, reactions, stamped, num_cars, num_monitors);
+    }
+
+    for (int m = 0; m < num_monitors; m++) {
+        free(monitors[m].latency);
+    }
+    for (int i = 0; i < num_cars; i++) {
+        if (cars[i].watched) {
+            __atomic_sub_fetch(&cars[i].mem->watchers, 1, __ATOMIC_SEQ_CST);
+        }
+        munmap(cars[i].mem, cars[i].mapped);
+    }
+    free(slots);
+    free(monitors);
+    free(cars);
+    free(names);
+    return 0;
+}
+
+// map a car's segment. returns 0 on success, -1 if the car doesn't exist
+int open_car(const char *name, supervised_car *c) {
+    char shm_name[BUFSIZ];
+    snprintf(shm_name, sizeof(shm_name), "/car%s", name);
+    size_t mapped;
+    car_shared_mem *m = car_shm_open(shm_name, &mapped);
+    if (m == NULL) {
+        return -1;
+    }
+    c->name = name;
+    c->mem = m;
+    c->mapped = mapped;
+    c->has_seqlock = car_shm_has_seqlock(m, mapped);
+    c->has_change_time = car_shm_has_change_time(m, mapped);
+    if (c->has_change_time) {
+        c->stamp_seen = __atomic_load_n(&m->changed_ns, __ATOMIC_ACQUIRE); // Older changes were before us
+    }
+    return 0;
+}
+
+// check a car and record how long any reaction took. Called with the car's mutex held
+void react(monitor *t, supervised_car *c, uint64_t woke) {
+    // A new stamp is the time of the change being checked. Without one the
+    // change came from a writer that doesn't stamp
+    uint64_t since = woke;
+    int stamped = 0;
+    if (c->has_change_time) {
+        uint64_t stamp = __atomic_load_n(&c->mem->changed_ns, __ATOMIC_ACQUIRE);
+        if (stamp != c->stamp_seen && stamp <= woke) {
+            since = stamp;
+            stamped = 1;
+        }
+    }
+
+    // Only a check that writes something bumps the sequence count, so other
+    // watchers aren't woken for nothing
+    int changed = check_car(c);
+    if (changed) {
+        if (c->has_seqlock) {
+            car_shm_write_end(c->mem);
+        }
+        car_shm_broadcast(c->mem, c->mapped);
+        uint64_t took = c->wrote_ns - since;
+        if (took > t->worst_ns) {
+            t->worst_ns = took;
+        }
+        uint64_t bucket = took / 1000;
+        t->latency[bucket < LATENCY_BUCKETS ? bucket : LATENCY_BUCKETS - 1]++;
+        t->reactions++;
+        t->stamped += stamped;
+    }
+    if (c->has_seqlock) {
+        c->seen = __atomic_load_n(&c->mem->seq, __ATOMIC_RELAXED);
+    }
+    if (c->has_change_time) {
+        c->stamp_seen = __atomic_load_n(&c->mem->changed_ns, __ATOMIC_ACQUIRE); // Including our own
+    }
+}
+
+// supervise one car by sleeping on its condition variable
+void *watch_condition(void *arg) {
+    monitor *t = arg;
+    supervised_car *c = t->cars[0];
+
+    // The mutex is only released while waiting on the condition variable
+    int err = car_shm_lock(c->mem, c->mapped);
+    while (running && err == 0) {
+        react(t, c, now_ns());
+        err = car_shm_wait(c->mem, c->mapped, NULL);
+    }
+    if (err != 0) {
+        abandon(c, err);
+        return NULL;
+    }
+    pthread_mutex_unlock(&c->mem->mutex);
+    return NULL;
+}
+
+// supervise several cars by sleeping on all of their sequence counters at once
+void *watch_futexes(void *arg) {
+    monitor *t = arg;
+    struct futex_waitv waiters[FUTEX_WAITV_MAX];
+    memset(waiters, 0, sizeof(waiters));
+
+    // Count in before the first check, so no writer can miss us
+    for (int i = 0; i < t->count; i++) {
+        __atomic_add_fetch(&t->cars[i]->mem->watchers, 1, __ATOMIC_SEQ_CST);
+        t->cars[i]->watched = 1;
+    }
+
+    int woken = -1;
+    for (int i = 0; i < t->count; i++) {
+        t->cars[i]->seen = __atomic_load_n(&t->cars[i]->mem->seq, __ATOMIC_ACQUIRE) + 1; // Check every car first
+    }
+    while (running) {
+        uint64_t woke = now_ns();
+        for (int i = 0; i < t->count; i++) {
+            supervised_car *c = t->cars[i];
+            // A writer that only used the condition variable is passed on by
+            // the car without a new count, so the car that woke us is checked anyway
+            if (i != woken && __atomic_load_n(&c->mem->seq, __ATOMIC_ACQUIRE) == c->seen) {
+                continue;
+            }
+            int err = car_shm_lock(c->mem, c->mapped);
+            if (err != 0) {
+                // Dropped from the thread, which goes on with its other cars
+                abandon(c, err);
+                t->cars[i--] = t->cars[--t->count];
+                continue;
+            }
+            react(t, c, woke);
+            pthread_mutex_unlock(&c->mem->mutex);
+        }
+
+        // Cars may have been dropped, so the list is rebuilt every time
+        for (int i = 0; i < t->count; i++) {
+            waiters[i].uaddr = (uintptr_t)&t->cars[i]->mem->seq;
+            waiters[i].val = t->cars[i]->seen;
+            waiters[i].flags = FUTEX_32;
+        }
+        waiters[t->count].uaddr = (uintptr_t)&stop_word;
+        waiters[t->count].val = 0;
+        waiters[t->count].flags = FUTEX_32 | FUTEX_PRIVATE_FLAG;
+        woken = syscall(SYS_futex_waitv, waiters, t->count + 1, 0, NULL, CLOCK_MONOTONIC);
+        if (woken == -1 && errno != EAGAIN && errno != EINTR) {
+            perror("futex_waitv()");
+            break;
+        }
+    }
+    return NULL;
+}
+
+// HELPER FUNCTIONS
+
+// check a car and act on whatever is wrong. Called with the mutex held.
+// returns 1 if the segment was changed, leaving the write open for react()
+// to end
+int check_car(supervised_car *c) {
+    car_shared_mem *m = c->mem;
+    int changed = 0;
+
+    // Something is blocking the doors while they close - open them again
+    if (m->door_obstruction == 1 && strncmp(m->status, "Closing", sizeof(m->status)) == 0) {
+        begin_change(c, &changed);
+        set_status(m, c->mapped, CAR_STATUS_OPENING);
+    }
+
+    // The car is made safe before the message is written
+    if (m->emergency_stop == 1 && m->emergency_mode == 0) {
+        begin_change(c, &changed);
+        m->emergency_mode = 1;
+        report(c, "The emergency stop button has been pressed!");
+    }
+
+    if (m->overload == 1 && m->emergency_mode == 0) {
+        begin_change(c, &changed);
+        m->emergency_mode = 1;
+        report(c, "The overload sensor has been tripped!");
+    }
+
+    if (m->emergency_mode != 1 && !is_consistent(m)) {
+        begin_change(c, &changed);
+        m->emergency_mode = 1;
+        report(c, "Data consistency error!");
+    }
+
+    return changed;
+}
+
+// start the check's changes to a car, if this is the first. Lock-free
+// readers retry if they overlap them. Called with the mutex held
+void begin_change(supervised_car *c, int *changed) {
+    if (*changed) {
+        return;
+    }
+    c->wrote_ns = now_ns();
+    if (c->has_seqlock) {
+        car_shm_write_begin(c->mem);
+    }
+    *changed = 1;
+}
+
+// 1 if every field of the car holds a value it can legitimately have
+int is_consistent(const car_shared_mem *m) {
+    int floor;
+
+    // The strings come from another process - don't trust their terminators
+    if (memchr(m->current_floor, '\0', sizeof(m->current_floor)) == NULL ||
+        floor_from_label(m->current_floor, &floor) == -1) {
+        return 0;
+    }
+    if (memchr(m->destination_floor, '\0', sizeof(m->destination_floor)) == NULL ||
+        floor_from_label(m->destination_floor, &floor) == -1) {
+        return 0;
+    }
+    if (memchr(m->status, '\0', sizeof(m->status)) == NULL) {
+        return 0;
+    }
+    car_status status = car_status_from_name(m->status);
+    if (status == CAR_STATUS_UNKNOWN) {
+        return 0;
+    }
+
+    // Every flag is 0 or 1
+    const uint8_t flags[] = {
+        m->open_button, m->close_button, m->door_obstruction, m->overload,
+        m->emergency_stop, m->individual_service_mode, m->emergency_mode
+    };
+    for (size_t i = 0; i < sizeof(flags) / sizeof(flags[0]); i++) {
+        if (flags[i] > 1) {
+            return 0;
+        }
+    }
+
+    // Only doors that are moving can be obstructed
+    if (m->door_obstruction == 1 && status != CAR_STATUS_OPENING && status != CAR_STATUS_CLOSING) {
+        return 0;
+    }
+    return 1;
+}
+
+// change the car's status, keeping the binary copy in step. Called with the mutex held
+void set_status(car_shared_mem *m, size_t mapped, car_status status) {
+    strcpy(m->status, car_status_name(status));
+    if (car_shm_has_layout(m, mapped)) {
+        m->status_code = status;
+    }
+}
+
+// print a safety message about a car, naming it if there are several
+void report(supervised_car *c, const char *message) {
+    if (num_cars == 1) {
+        say(message);
+        return;
+    }
+    char line[BUFSIZ];
+    snprintf(line, sizeof(line), "Car %s: %s", c->name, message);
+    say(line);
+}
+
+// stop supervising a car whose mutex can't be taken, rather than checking
+// and writing its segment without it
+void abandon(supervised_car *c, int err) {
+    fprintf(stderr, "Unable to lock car %s (%s), no longer supervising it\n", c->name, strerror(err));
+    if (c->watched) {
+        __atomic_sub_fetch(&c->mem->watchers, 1, __ATOMIC_SEQ_CST);
+        c->watched = 0;
+    }
+}
+
+// print a safety message straight away (write() rather than buffered stdio)
+void say(const char *message) {
+    size_t len = strlen(message);
+    if (write(STDOUT_FILENO, message, len) == -1 || write(STDOUT_FILENO, "\n", 1) == -1) {
+        perror("write()");
+    }
+}
+
+// run ahead of ordinary processes and keep every page resident. The monitor
+// still works without either, so failures are only reported
+void go_realtime(void) {
+    struct sched_param param;
+    memset(&param, 0, sizeof(param));
+    param.sched_priority = sched_get_priority_max(SCHED_FIFO) - 1;
+    if (sched_setscheduler(0, SCHED_FIFO, &param) == -1) {
+        perror("Warning: sched_setscheduler(SCHED_FIFO)");
+    }
+    if (mlockall(MCL_CURRENT | MCL_FUTURE) == -1) {
+        perror("Warning: mlockall()");
+    }
+}
+
+// current CLOCK_MONOTONIC time in nanoseconds
+uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// Wakes every monitor when SIGINT arrives. The signal is blocked in every
+// other thread, so a monitor sleeping on a condition variable can't miss it.
+void *signal_handling(void *arg) {
+    sigset_t *set = arg;
+    int sig;
+    while (sigwait(set, &sig) != 0) {
+        ;
+    }
+
+    running = 0;
+    for (int m = 0; m < num_monitors; m++) {
+        if (!monitors[m].futex) {
+            // Without the mutex the broadcast may be missed, but then the
+            // monitor has already given up on the car
+            car_shared_mem *mem = monitors[m].cars[0]->mem;
+            int err = car_shm_lock(mem, monitors[m].cars[0]->mapped);
+            pthread_cond_broadcast(&mem->cond);
+            if (err == 0) {
+                pthread_mutex_unlock(&mem->mutex);
+            }
+        }
+    }
+    __atomic_store_n(&stop_word, 1, __ATOMIC_SEQ_CST);
+    syscall(SYS_futex, &stop_word, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
+    return NULL;
+}
@@ -0,0 +1,280 @@
+#define _POSIX_C_SOURCE 200809L // Enable CLOCK_MONOTONIC definition
+#define _DEFAULT_SOURCE // syscall(), for the futex wakeups in car_shm.h
+
+#include <stdio.h>          // Standard I/O functions
+#include <stdlib.h>         // Standard library functions
+#include <string.h>         // String manipulation functions
+#include <unistd.h>         // POSIX API functions
+#include <fcntl.h>          // File control options
+#include <errno.h>          // Error handling
+#include <time.h>           // Time functions
+#include <pthread.h>        // POSIX threads
+#include <sys/mman.h>       // Memory management
+#include <sys/stat.h>       // File status
+#include <sys/random.h>     // getrandom
+#include <linux/futex.h>    // futex_waitv
+#include "shm_link.h"
+
+// A thread watching up to SHM_LINK_WATCH_LIMIT links
+typedef struct shm_watcher {
+    pthread_t thread;
+    shm_link *links[SHM_LINK_WATCH_LIMIT];
+    int count;                  // Including closed links it hasn't let go of yet
+    uint32_t changed;           // Futex bumped when a link is added or closed
+    struct shm_watcher *next;
+} shm_watcher;
+
+// Watchers and their link lists are guarded by watch_mutex. The reactor never
+// holds it for longer than it takes to add or close a link
+static pthread_mutex_t watch_mutex = PTHREAD_MUTEX_INITIALIZER;
+static shm_watcher *watchers = NULL;
+static int stopping = 0;
+static int notify_fd = -1;
+static int notify_pending = 0;  // 1 from a watcher's write until the reactor takes it
+
+// HELPER FUNCTIONS
+
+// make a watcher look at its links again. Called with watch_mutex held
+static void poke(shm_watcher *w) {
+    __atomic_store_n(&w->changed, w->changed + 1, __ATOMIC_RELEASE);
+    syscall(SYS_futex, &w->changed, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+}
+
+// wake the reactor, unless it has yet to take the last wakeup
+static void notify(void) {
+    if (__atomic_exchange_n(&notify_pending, 1, __ATOMIC_ACQ_REL) == 0) {
+        uint64_t one = 1;
+        if (write(notify_fd, &one, sizeof(one)) == -1) {
+            perror("write()");
+        }
+    }
+}
+
+// lock the car's mutex, recovering it from any process that died holding it.
+// returns 0 on success, or -1 if it can't be recovered - the link is then dead.
+// The car itself dying is seen when its connection closes
+static int lock_car(shm_link *l) {
+    if (l->dead) {
+        return -1;
+    }
+    int err = car_shm_lock(l->mem, l->mapped);
+    if (err != 0) {
+        errno = err;
+        perror("Failed to lock car");
+        l->dead = 1;
+        return -1;
+    }
+    return 0;
+}
+
+static void free_link(shm_link *l) {
+    __atomic_sub_fetch(&l->mem->watchers, 1, __ATOMIC_SEQ_CST);
+    munmap(l->mem, l->mapped);
+    free(l);
+}
+
+// sleeps on the sequence counters of a watcher's cars and wakes the reactor
+// when any of their status rings has new events
+static void *watch_links(void *arg) {
+    shm_watcher *w = arg;
+    struct futex_waitv waiters[FUTEX_WAITV_MAX];
+    memset(waiters, 0, sizeof(waiters));
+
+    pthread_mutex_lock(&watch_mutex);
+    while (!stopping) {
+        // A count taken before the ring is looked at - any event pushed after
+        // that changes it, so the wait below returns straight away
+        int ready = 0;
+        for (int i = 0; i < w->count;) {
+            shm_link *l = w->links[i];
+            if (l->closed) {
+                free_link(l);
+                w->links[i] = w->links[--w->count];
+                continue;
+            }
+            waiters[i].uaddr = (uintptr_t)&l->mem->seq;
+            waiters[i].val = __atomic_load_n(&l->mem->seq, __ATOMIC_ACQUIRE);
+            waiters[i].flags = FUTEX_32;
+            uint32_t head = __atomic_load_n(&l->mem->status_head, __ATOMIC_ACQUIRE);
+            if (head != l->watched_head) {
+                l->watched_head = head;
+                ready = 1;
+            }
+            i++;
+        }
+        int n = w->count;
+        waiters[n].uaddr = (uintptr_t)&w->changed;
+        waiters[n].val = w->changed;
+        waiters[n].flags = FUTEX_32 | FUTEX_PRIVATE_FLAG;
+        pthread_mutex_unlock(&watch_mutex);
+
+        // Only this thread unmaps its links, so they stay mapped while it sleeps
+        if (ready) {
+            notify();
+        }
+        if (syscall(SYS_futex_waitv, waiters, n + 1, 0, NULL, CLOCK_MONOTONIC) == -1 &&
+            errno != EAGAIN && errno != EINTR) {
+            perror("futex_waitv()");
+            return NULL;
+        }
+        pthread_mutex_lock(&watch_mutex);
+    }
+    pthread_mutex_unlock(&watch_mutex);
+    return NULL;
+}
+
+// a watcher with room for another link, started if need be. Called with
+// watch_mutex held. returns NULL if a new watcher couldn't be started
+static shm_watcher *watcher_with_room(void) {
+    for (shm_watcher *w = watchers; w != NULL; w = w->next) {
+        if (w->count < SHM_LINK_WATCH_LIMIT) {
+            return w;
+        }
+    }
+    shm_watcher *w = calloc(1, sizeof(shm_watcher));
+    if (w == NULL) {
+        perror("calloc()");
+        return NULL;
+    }
+    if (pthread_create(&w->thread, NULL, watch_links, w) != 0) {
+        perror("pthread_create()");
+        free(w);
+        return NULL;
+    }
+    w->next = watchers;
+    watchers = w;
+    return w;
+}
+
+int shm_link_start(int fd) {
+    if (!car_shm_futex_waitv_works()) {
+        return -1;
+    }
+    notify_fd = fd;
+    return 0;
+}
+
+void shm_link_stop(void) {
+    pthread_mutex_lock(&watch_mutex);
+    stopping = 1;
+    for (shm_watcher *w = watchers; w != NULL; w = w->next) {
+        poke(w);
+    }
+    pthread_mutex_unlock(&watch_mutex);
+
+    while (watchers != NULL) {
+        shm_watcher *w = watchers;
+        watchers = w->next;
+        pthread_join(w->thread, NULL);
+        for (int i = 0; i < w->count; i++) {
+            free_link(w->links[i]);
+        }
+        free(w);
+    }
+}
+
+shm_link *shm_link_open(const char *name) {
+    char shm_name[BUFSIZ];
+    snprintf(shm_name, sizeof(shm_name), "/car%s", name);
+    size_t mapped;
+    car_shared_mem *m = car_shm_open(shm_name, &mapped);
+    if (m == NULL) {
+        return NULL; // Not on this host
+    }
+    if (!car_shm_has_link_token(m, mapped)) {
+        munmap(m, mapped);
+        return NULL; // Built before the handshake
+    }
+
+    shm_link *l = calloc(1, sizeof(shm_link));
+    if (l == NULL) {
+        perror("calloc()");
+        munmap(m, mapped);
+        return NULL;
+    }
+    l->mem = m;
+    l->mapped = mapped;
+    // Count in before the watcher first looks, so the car can't miss it
+    __atomic_add_fetch(&m->watchers, 1, __ATOMIC_SEQ_CST);
+    l->watched_head = __atomic_load_n(&m->status_head, __ATOMIC_ACQUIRE);
+
+    pthread_mutex_lock(&watch_mutex);
+    shm_watcher *w = watcher_with_room();
+    if (w == NULL) {
+        pthread_mutex_unlock(&watch_mutex);
+        free_link(l);
+        return NULL;
+    }
+    l->watcher = w;
+    w->links[w->count++] = l;
+    poke(w);
+    pthread_mutex_unlock(&watch_mutex);
+    return l;
+}
+
+uint64_t shm_link_offer(shm_link *l) {
+    uint64_t token;
+    if (getrandom(&token, sizeof(token), 0) != sizeof(token)) {
+        perror("getrandom()");
+        return 0;
+    }
+    token |= token == 0; // 0 means nothing was offered
+    l->token = token;
+    __atomic_store_n(&l->mem->link_token, token, __ATOMIC_RELEASE);
+    return token;
+}
+
+int shm_link_accept(shm_link *l, uint64_t token, uint32_t head) {
+    if (l->token == 0 || token != l->token) {
+        return -1;
+    }
+    l->tail = head;
+    return 0;
+}
+
+void shm_link_close(shm_link *l) {
+    pthread_mutex_lock(&watch_mutex);
+    l->closed = 1;
+    poke(l->watcher);
+    pthread_mutex_unlock(&watch_mutex);
+}
+
+void shm_link_take_notify(void) {
+    __atomic_store_n(&notify_pending, 0, __ATOMIC_SEQ_CST);
+    uint64_t count;
+    while (read(notify_fd, &count, sizeof(count)) > 0) {
+        ;
+    }
+}
+
+int shm_link_next_status(shm_link *l, car_shm_status_event *out) {
+    int got = car_shm_next_status(l->mem, &l->tail, out);
+    if (got == -1) {
+        car_shm_snapshot snap;
+        if (car_shm_try_read(l->mem, l->mapped, &snap) == -1) {
+            if (lock_car(l) == -1) {
+                return 0;
+            }
+            car_shm_copy(l->mem, &snap, 1);
+            pthread_mutex_unlock(&l->mem->mutex);
+        }
+        out->current_floor_num = snap.current_floor_num;
+        out->destination_floor_num = snap.destination_floor_num;
+        out->status_code = snap.status_code;
+        return 1;
+    }
+    return got;
+}
+
+int shm_link_request_floor(shm_link *l, const char *floor) {
+    car_shared_mem *m = l->mem;
+    if (lock_car(l) == -1) {
+        return -1;
+    }
+    car_shm_write_begin(m);
+    car_shm_request_floor(m, floor);
+    car_shm_write_end(m);
+    car_shm_broadcast(m, l->mapped);
+    pthread_mutex_unlock(&m->mutex);
+    return 0;
+}
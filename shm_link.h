@@ -0,0 +1,87 @@
+#ifndef SHM_LINK_H
+#define SHM_LINK_H
+
+#include <stdint.h>         // Standard integer types
+#include "car_shm.h"        // Shared memory layout
+
+// Shared memory fast path between the controller and a car on the same host.
+//
+// A car still registers over TCP. The controller then maps the /car{name}
+// segment on its own host, writes a random token into it and offers the fast
+// path with SHM {token}. The car only takes the offer if the token is in its
+// own segment - a remote car of the same name, or a stale segment a crashed
+// car left behind, fails the check and the car stays on TCP. A car that takes
+// it answers SHM {token} {status head}, and from then on the status updates
+// come from the segment's status ring and floor requests are written straight
+// into the segment. The reactor
+// drains the rings itself, on every pass of its loop and whenever
+// 'notify_fd' (an eventfd in the reactor) is written.
+//
+// Nothing waits on a car in the reactor. One watcher thread for up to
+// SHM_LINK_WATCH_LIMIT cars sleeps in futex_waitv() on their sequence
+// counters, which every writer wakes through car_shm_broadcast(), and writes
+// 'notify_fd' once when any of the rings has new events - not again until
+// the reactor has taken that wakeup.
+//
+// Everything other than the watchers is only used from the reactor thread.
+// The reactor only takes a car's mutex to write a floor request, or to read
+// a snapshot that kept colliding with the car's writes. The mutex is robust:
+// one left by a process that died holding it is recovered (car_shm_lock()),
+// and only a mutex that can't be recovered marks the link dead. A car that
+// dies is removed when its connection closes, as over TCP.
+
+#define SHM_LINK_WATCH_LIMIT 127    // Cars per watcher - FUTEX_WAITV_MAX less the watcher's own word
+
+struct shm_watcher;
+
+typedef struct {
+    car_shared_mem *mem;
+    size_t mapped;
+    uint64_t token;             // Offered to the car, 0 until then
+    uint32_t tail;              // Status events read so far (reactor)
+    uint32_t watched_head;      // Status events the watcher has seen (watcher)
+    int closed;                 // Set by shm_link_close(), the watcher then unmaps the link
+    int dead;                   // The car's mutex can't be recovered
+    struct shm_watcher *watcher;
+} shm_link;
+
+// set up the watchers, which write to 'notify_fd' when there are new status
+// events. returns 0 on success, or -1 if the kernel has no futex_waitv()
+// (Linux 5.16 and later)
+int shm_link_start(int notify_fd);
+
+// stop the watchers and free any links left
+void shm_link_stop(void);
+
+// map car 'name' and start watching it. returns NULL if the car's segment
+// doesn't exist on this host or is too old for the handshake (before layout
+// version 5)
+shm_link *shm_link_open(const char *name);
+
+// write a new random token into the car's segment and return it, for the
+// SHM {token} offer. returns 0 if no token could be made
+uint64_t shm_link_offer(shm_link *l);
+
+// the car has confirmed the offer. Its status ring is read from event
+// 'head', the ring's head when it stopped sending STATUS frames. returns 0
+// on success, or -1 if 'token' isn't the one offered
+int shm_link_accept(shm_link *l, uint64_t token, uint32_t head);
+
+// stop using a link. The segment is unmapped and the link freed once its
+// watcher has let go of it
+void shm_link_close(shm_link *l);
+
+// take a wakeup from 'notify_fd'. Called by the reactor before it drains the
+// rings, so events that arrive while it does are signalled again
+void shm_link_take_notify(void);
+
+// take the car's next status event. returns 1 if 'out' was filled, 0 if
+// there are no new events. Events the car overwrote before they were read
+// are replaced by a snapshot of its current state
+int shm_link_next_status(shm_link *l, car_shm_status_event *out);
+
+// send the car to a floor (a label such as "B2" or "7"). returns 0 on
+// success, or -1 if the link is dead (its mutex can't be recovered)
+int shm_link_request_floor(shm_link *l, const char *floor);
+
+#endif
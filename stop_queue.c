@@ -0,0 +1,483 @@
+#include <string.h>         // String manipulation functions
+#include <stdlib.h>         // Standard library functions
+#include "stop_queue.h"
+
+// Ways a floor can be placed in the route
+#define PLACE_EXISTING 0    // A stop already covers the floor
+#define PLACE_HOLD 1        // Reopen the doors at the car's current floor
+#define PLACE_INSERT 2      // Add the floor to an existing sweep
+#define PLACE_PEAK 3        // New turnaround, the old one moves to the next sweep
+#define PLACE_NEW_SWEEP 4   // Start a new sweep at the end of the route
+
+typedef struct {
+    int kind;
+    int sweep;              // Sweep the floor lands in
+    int dir;                // Direction of a new sweep
+    int floors;             // Floors travelled from the scan's entry point to the floor
+    int stops;              // Stops made on the way
+    int added_floors;       // Growth of the route
+} placement;
+
+// A pickup placement seen through a dropoff scan. Placing the pickup can
+// change the turnaround of one sweep, move the old turnaround into the next
+// sweep, or append a sweep, and the dropoff has to be planned against that
+// route without the queue being changed.
+typedef struct {
+    int nsweeps;
+    int new_dir;            // Direction of an appended sweep (0 if none)
+    int new_floor;
+    int changed;            // Sweep whose turnaround became 'changed_last' (-1 if none)
+    int changed_last;
+    int peak_moved;         // 1 if the old turnaround of 'changed' moved to the next sweep
+    int moved;              // The old turnaround
+} overlay;
+
+// HELPER FUNCTIONS
+
+static int direction(int from, int to) {
+    return (to > from) - (to < from);
+}
+
+static stop_sweep *sweep_at(stop_queue *q, int i) {
+    return &q->sweeps[(q->base + i) % STOP_QUEUE_MAX_SWEEPS];
+}
+
+static const stop_sweep *sweep_at_const(const stop_queue *q, int i) {
+    return &q->sweeps[(q->base + i) % STOP_QUEUE_MAX_SWEEPS];
+}
+
+static int has_floor(const stop_sweep *s, int floor) {
+    int b = floor - STOP_QUEUE_LOWEST;
+    return (s->bits[b >> 6] >> (b & 63)) & 1;
+}
+
+static void set_floor(stop_sweep *s, int floor) {
+    int b = floor - STOP_QUEUE_LOWEST;
+    s->bits[b >> 6] |= (uint64_t)1 << (b & 63);
+}
+
+static void clear_floor(stop_sweep *s, int floor) {
+    int b = floor - STOP_QUEUE_LOWEST;
+    s->bits[b >> 6] &= ~((uint64_t)1 << (b & 63));
+}
+
+// number of stops in a sweep between floors lo and hi (inclusive)
+static int count_range(const stop_sweep *s, int lo, int hi) {
+    if (lo > hi) {
+        return 0;
+    }
+    int a = lo - STOP_QUEUE_LOWEST, b = hi - STOP_QUEUE_LOWEST;
+    int wa = a >> 6, wb = b >> 6;
+    uint64_t lo_mask = ~(uint64_t)0 << (a & 63);
+    uint64_t hi_mask = ~(uint64_t)0 >> (63 - (b & 63));
+    if (wa == wb) {
+        return __builtin_popcountll(s->bits[wa] & lo_mask & hi_mask);
+    }
+    int n = __builtin_popcountll(s->bits[wa] & lo_mask) + __builtin_popcountll(s->bits[wb] & hi_mask);
+    for (int w = wa + 1; w < wb; w++) {
+        n += __builtin_popcountll(s->bits[w]);
+    }
+    return n;
+}
+
+// next stop after 'floor' in the direction 'dir'. The sweep must have one.
+static int next_floor(const stop_sweep *s, int floor, int dir) {
+    int b = floor - STOP_QUEUE_LOWEST;
+    if (dir > 0) {
+        b++;
+        int w = b >> 6;
+        uint64_t word = (b & 63) ? s->bits[w] & (~(uint64_t)0 << (b & 63)) : s->bits[w];
+        while (word == 0) {
+            word = s->bits[++w];
+        }
+        return (w << 6) + __builtin_ctzll(word) + STOP_QUEUE_LOWEST;
+    } else {
+        b--;
+        int w = b >> 6;
+        uint64_t word = s->bits[w] & (~(uint64_t)0 >> (63 - (b & 63)));
+        while (word == 0) {
+            word = s->bits[--w];
+        }
+        return (w << 6) + 63 - __builtin_clzll(word) + STOP_QUEUE_LOWEST;
+    }
+}
+
+// stops in sweep 'i' strictly after 'entry' and up to 'floor' (in travel order),
+// as seen through the overlay
+static int count_ahead(const stop_queue *q, const overlay *ov, int i, int entry, int floor) {
+    int lo = entry < floor ? entry + 1 : floor;
+    int hi = entry < floor ? floor : entry - 1;
+    if (i >= q->nsweeps) {
+        return ov->new_floor >= lo && ov->new_floor <= hi;
+    }
+    int n = count_range(sweep_at_const(q, i), lo, hi);
+    if (ov->peak_moved && ov->moved >= lo && ov->moved <= hi) {
+        if (i == ov->changed) {
+            n--;
+        } else if (i == ov->changed + 1) {
+            n++;
+        }
+    }
+    return n;
+}
+
+static int view_dir(const stop_queue *q, const overlay *ov, int i) {
+    return i < q->nsweeps ? sweep_at_const(q, i)->dir : ov->new_dir;
+}
+
+static int view_last(const stop_queue *q, const overlay *ov, int i) {
+    if (i >= q->nsweeps) {
+        return ov->new_floor;
+    }
+    return i == ov->changed ? ov->changed_last : sweep_at_const(q, i)->last;
+}
+
+static int view_has(const stop_queue *q, const overlay *ov, int i, int floor) {
+    if (i >= q->nsweeps) {
+        return floor == ov->new_floor;
+    }
+    if (ov->peak_moved && floor == ov->moved) {
+        if (i == ov->changed) {
+            return 0;
+        } else if (i == ov->changed + 1) {
+            return 1;
+        }
+    }
+    return has_floor(sweep_at_const(q, i), floor);
+}
+
+// find where 'floor' should be visited, travelling in direction 'dir' once
+// there, scanning the route from sweep 'start' with the car at 'entry'.
+// A floor is placed:
+//  - on an existing stop when the car already stops there heading the right way
+//  - in a sweep heading the right way that passes it
+//  - as a new turnaround when it lies beyond one, so the car goes a little
+//    further before turning instead of doubling back later
+//  - in a new sweep at the end of the route otherwise
+// A pickup must depart in the passenger's direction. A dropoff can be any stop.
+static placement scan(const stop_queue *q, const overlay *ov, int start, int entry, int floor, int dir, int pickup) {
+    placement p = {0};
+    int e = entry;
+
+    for (int i = start; i < ov->nsweeps; i++) {
+        int d = view_dir(q, ov, i);
+        int last = view_last(q, ov, i);
+        int final = i == ov->nsweeps - 1;
+        int beyond = (floor - last) * d > 0;
+
+        p.sweep = i;
+        if (d == dir && (floor - e) * d > 0) {
+            if (!beyond) {
+                if (view_has(q, ov, i, floor)) {
+                    // The turnaround departs the other way, no good for a pickup
+                    if (!(pickup && floor == last && !final)) {
+                        p.kind = PLACE_EXISTING;
+                        p.floors += abs(floor - e);
+                        p.stops += count_ahead(q, ov, i, e, floor) - 1;
+                        return p;
+                    }
+                } else {
+                    p.kind = PLACE_INSERT;
+                    p.floors += abs(floor - e);
+                    p.stops += count_ahead(q, ov, i, e, floor);
+                    return p;
+                }
+            } else if (final || !pickup) {
+                // Extend the sweep. The old turnaround is visited on the way back.
+                p.kind = final ? PLACE_INSERT : PLACE_PEAK;
+                p.floors += abs(floor - e);
+                p.stops += count_ahead(q, ov, i, e, last) - !final;
+                p.added_floors = (final ? 1 : 2) * abs(floor - last);
+                return p;
+            }
+        } else if (d == -dir && (floor == last || beyond)) {
+            // The car turns around here, heading the passenger's way
+            p.kind = floor == last ? PLACE_EXISTING : (final ? PLACE_INSERT : PLACE_PEAK);
+            p.floors += abs(floor - e);
+            p.stops += count_ahead(q, ov, i, e, last) - (floor == last || !final);
+            p.added_floors = (final ? 1 : 2) * abs(floor - last);
+            return p;
+        }
+
+        // Passed the whole sweep
+        p.floors += abs(last - e);
+        p.stops += count_ahead(q, ov, i, e, last);
+        e = last;
+    }
+
+    // Nothing on the route covers the floor, start a new sweep
+    p.sweep = ov->nsweeps;
+    if (floor == e) {
+        if (ov->nsweeps > start) {
+            p.kind = PLACE_EXISTING; // Final stop, nothing departs from it
+            p.sweep = ov->nsweeps - 1;
+            p.stops--;
+        } else {
+            // Empty route and the car has just left the floor, bring it back
+            p.kind = q->hold ? PLACE_EXISTING : PLACE_HOLD;
+        }
+        return p;
+    }
+    p.kind = PLACE_NEW_SWEEP;
+    p.dir = direction(e, floor);
+    p.floors += abs(floor - e);
+    p.added_floors = abs(floor - e);
+    return p;
+}
+
+// build the overlay that shows the route after a pickup placement
+static void overlay_for(const stop_queue *q, const placement *p, int floor, overlay *ov) {
+    memset(ov, 0, sizeof(*ov));
+    ov->nsweeps = q->nsweeps;
+    ov->changed = -1;
+    if (p->kind == PLACE_NEW_SWEEP) {
+        ov->nsweeps++;
+        ov->new_dir = p->dir;
+        ov->new_floor = floor;
+    } else if (p->kind == PLACE_INSERT || p->kind == PLACE_PEAK) {
+        const stop_sweep *s = sweep_at_const(q, p->sweep);
+        if ((floor - s->last) * s->dir > 0) {
+            ov->changed = p->sweep;
+            ov->changed_last = floor;
+            ov->peak_moved = p->kind == PLACE_PEAK;
+            ov->moved = s->last;
+        }
+    }
+}
+
+// plan both stops of a call. returns 0 on success, -1 if the route is too long
+static int plan(const stop_queue *q, int source, int destination,
+                placement *pickup, placement *dropoff, int *pickup_at_position) {
+    int dir = direction(source, destination);
+    int entry = q->hold ? q->hold_floor : q->position;
+    int hold_floors = abs(entry - q->position);
+    overlay ov;
+    memset(&ov, 0, sizeof(ov));
+    ov.nsweeps = q->nsweeps;
+    ov.changed = -1;
+
+    // The car may be standing at its next stop before it has been popped
+    const stop_sweep *first = q->nsweeps > 0 ? sweep_at_const(q, 0) : NULL;
+    int at_stop = !q->hold && first != NULL && first->first == q->position;
+    int departure = 0;
+    if (first != NULL && (!at_stop || first->count > 1)) {
+        departure = first->dir;
+    } else if (first != NULL && q->nsweeps > 1) {
+        departure = sweep_at_const(q, 1)->dir;
+    }
+
+    *pickup_at_position = (q->hold ? source == q->hold_floor : source == q->position && !q->moving) &&
+                          (departure == 0 || departure == dir);
+    if (*pickup_at_position) {
+        // On the car's floor (or the floor it's reopening at) and heading their
+        // way. If the doors are open the passenger can get straight in,
+        // otherwise the doors open again.
+        memset(pickup, 0, sizeof(*pickup));
+        pickup->kind = q->hold || q->doors_open || at_stop ? PLACE_EXISTING : PLACE_HOLD;
+        *dropoff = scan(q, &ov, 0, source, destination, dir, 0);
+    } else {
+        *pickup = scan(q, &ov, 0, entry, source, dir, 1);
+        pickup->floors += hold_floors;
+        pickup->stops += q->hold;
+        overlay_for(q, pickup, source, &ov);
+        *dropoff = scan(q, &ov, pickup->sweep, source, destination, dir, 0);
+    }
+
+    int new_sweeps = (pickup->kind == PLACE_NEW_SWEEP) + (dropoff->kind == PLACE_NEW_SWEEP);
+    if (q->nsweeps + new_sweeps > STOP_QUEUE_MAX_SWEEPS) {
+        return -1;
+    }
+    return 0;
+}
+
+// add a floor to the queue as planned
+static void apply(stop_queue *q, const placement *p, int floor) {
+    stop_sweep *s;
+    switch (p->kind) {
+    case PLACE_EXISTING:
+        return;
+    case PLACE_HOLD:
+        q->hold = 1;
+        q->hold_floor = floor;
+        break;
+    case PLACE_INSERT:
+        s = sweep_at(q, p->sweep);
+        set_floor(s, floor);
+        s->count++;
+        if ((floor - s->first) * s->dir < 0) {
+            s->first = floor;
+        }
+        if ((floor - s->last) * s->dir > 0) {
+            s->last = floor;
+        }
+        break;
+    case PLACE_PEAK: {
+        // The old turnaround is visited on the way back instead
+        s = sweep_at(q, p->sweep);
+        stop_sweep *next = sweep_at(q, p->sweep + 1);
+        int old = s->last;
+        clear_floor(s, old);
+        set_floor(s, floor);
+        s->last = floor;
+        if (s->first == old) {
+            s->first = floor;
+        }
+        set_floor(next, old);
+        next->first = old;
+        next->count++;
+        break;
+    }
+    case PLACE_NEW_SWEEP:
+        s = sweep_at(q, q->nsweeps);
+        memset(s, 0, sizeof(*s));
+        s->dir = p->dir;
+        s->first = s->last = floor;
+        s->count = 1;
+        set_floor(s, floor);
+        q->nsweeps++;
+        break;
+    }
+    q->length++;
+}
+
+// QUEUE OPERATIONS
+
+void stop_queue_init(stop_queue *q, int position) {
+    q->position = position;
+    q->moving = 0;
+    q->doors_open = 0;
+    q->hold = 0;
+    q->hold_floor = position;
+    q->length = 0;
+    q->base = 0;
+    q->nsweeps = 0;
+}
+
+void stop_queue_set_position(stop_queue *q, int position, int moving, int doors_open) {
+    q->position = position;
+    q->moving = moving;
+    q->doors_open = doors_open;
+}
+
+int stop_queue_head(const stop_queue *q, int *floor) {
+    if (q->hold) {
+        *floor = q->hold_floor;
+    } else if (q->nsweeps > 0) {
+        *floor = sweep_at_const(q, 0)->first;
+    } else {
+        return -1;
+    }
+    return 0;
+}
+
+int stop_queue_pop(stop_queue *q) {
+    if (q->hold) {
+        q->hold = 0;
+    } else if (q->nsweeps > 0) {
+        stop_sweep *s = sweep_at(q, 0);
+        clear_floor(s, s->first);
+        if (--s->count == 0) {
+            q->base = (q->base + 1) % STOP_QUEUE_MAX_SWEEPS;
+            q->nsweeps--;
+        } else {
+            s->first = next_floor(s, s->first, s->dir);
+        }
+    } else {
+        return -1;
+    }
+    q->length--;
+    return 0;
+}
+
+int stop_queue_add(stop_queue *q, int source, int destination) {
+    placement pickup, dropoff;
+    int at_position;
+    if (plan(q, source, destination, &pickup, &dropoff, &at_position) == -1) {
+        return -1;
+    }
+    apply(q, &pickup, source);
+    apply(q, &dropoff, destination);
+    return 0;
+}
+
+int stop_queue_probe(const stop_queue *q, int source, int destination, stop_queue_cost *cost) {
+    placement pickup, dropoff;
+    int at_position;
+    if (plan(q, source, destination, &pickup, &dropoff, &at_position) == -1) {
+        return -1;
+    }
+    cost->pickup_floors = at_position ? 0 : pickup.floors;
+    cost->pickup_stops = at_position ? 0 : pickup.stops;
+    cost->ride_floors = dropoff.floors;
+    cost->ride_stops = dropoff.stops;
+    cost->added_stops = (pickup.kind != PLACE_EXISTING) + (dropoff.kind != PLACE_EXISTING);
+    cost->added_floors = pickup.added_floors + dropoff.added_floors;
+    return 0;
+}
+
+int stop_queue_list(const stop_queue *q, int *floors, int max) {
+    int n = 0;
+    if (q->hold && n < max) {
+        floors[n++] = q->hold_floor;
+    }
+    for (int i = 0; i < q->nsweeps && n < max; i++) {
+        const stop_sweep *s = sweep_at_const(q, i);
+        int f = s->first;
+        for (int k = 0; k < s->count && n < max; k++) {
+            floors[n++] = f;
+            if (k + 1 < s->count) {
+                f = next_floor(s, f, s->dir);
+            }
+        }
+    }
+    return n;
+}
+
+int stop_queue_sweep(const stop_queue *q, int i, int *dir, int *floors, int max) {
+    if (i < 0 || i >= q->nsweeps) {
+        return -1;
+    }
+    const stop_sweep *s = sweep_at_const(q, i);
+    int n = 0, f = s->first;
+    *dir = s->dir;
+    for (int k = 0; k < s->count && n < max; k++) {
+        floors[n++] = f;
+        if (k + 1 < s->count) {
+            f = next_floor(s, f, s->dir);
+        }
+    }
+    return n;
+}
+
+int stop_queue_append(stop_queue *q, int dir, int floor) {
+    if (floor < STOP_QUEUE_LOWEST || floor > STOP_QUEUE_HIGHEST || (dir != 1 && dir != -1)) {
+        return -1;
+    }
+    stop_sweep *s = q->nsweeps > 0 ? sweep_at(q, q->nsweeps - 1) : NULL;
+    if (s != NULL && s->dir == dir && (floor - s->last) * dir > 0) {
+        set_floor(s, floor);
+        s->last = floor;
+        s->count++;
+    } else {
+        if (q->nsweeps == STOP_QUEUE_MAX_SWEEPS) {
+            return -1;
+        }
+        s = sweep_at(q, q->nsweeps);
+        memset(s, 0, sizeof(*s));
+        s->dir = dir;
+        s->first = s->last = floor;
+        s->count = 1;
+        set_floor(s, floor);
+        q->nsweeps++;
+    }
+    q->length++;
+    return 0;
+}
+
+void stop_queue_set_hold(stop_queue *q, int floor) {
+    if (!q->hold) {
+        q->length++;
+    }
+    q->hold = 1;
+    q->hold_floor = floor;
+}
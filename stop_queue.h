@@ -0,0 +1,95 @@
+#ifndef STOP_QUEUE_H
+#define STOP_QUEUE_H
+
+#include <stdint.h>         // Standard integer types
+
+// Per-car stop queue used by the controller.
+//
+// Floors use contiguous numbering: B99 is -98, B1 is 0, 1 is 1 and 999 is 999,
+// so the difference between two floors is the distance travelled.
+//
+// The queue is stored as the car's route rather than a list of stops. The route
+// is split into sweeps - runs of stops the car reaches while travelling in one
+// direction. Consecutive sweeps alternate direction, and because a sweep is
+// monotonic its stops are fully described by a bitmap over the floor range.
+// Adding a stop is a bitmap update in the sweep it lands in and finding that
+// sweep only walks the direction changes, so the cost doesn't grow with the
+// number of queued stops.
+
+#define STOP_QUEUE_LOWEST (-98)     // B99
+#define STOP_QUEUE_HIGHEST 999
+#define STOP_QUEUE_FLOORS (STOP_QUEUE_HIGHEST - STOP_QUEUE_LOWEST + 1)
+#define STOP_QUEUE_WORDS ((STOP_QUEUE_FLOORS + 63) / 64)
+#define STOP_QUEUE_MAX_SWEEPS 32    // Direction changes a queue can hold
+
+// A run of stops visited while travelling in one direction
+typedef struct {
+    int dir;                            // 1 up, -1 down
+    int first;                          // Stop reached first
+    int last;                           // Stop reached last (the turnaround)
+    int count;                          // Number of stops
+    uint64_t bits[STOP_QUEUE_WORDS];    // Bit (floor - STOP_QUEUE_LOWEST) set for each stop
+} stop_sweep;
+
+typedef struct {
+    int position;           // Floor the car is on (or has just left)
+    int moving;             // 1 while the car is between floors
+    int doors_open;         // 1 while the doors are opening or open
+    int hold;               // 1 if the car has to open its doors at 'hold_floor' first
+    int hold_floor;         // The floor the car was on when the hold was added
+    int length;             // Total number of stops, including the hold
+    int base;               // Ring index of the first sweep
+    int nsweeps;
+    stop_sweep sweeps[STOP_QUEUE_MAX_SWEEPS];
+} stop_queue;
+
+// What adding a call would do to a car's route, without changing the queue
+typedef struct {
+    int pickup_floors;      // Floors travelled before reaching the source floor
+    int pickup_stops;       // Stops made before reaching the source floor
+    int ride_floors;        // Floors travelled from the source to the destination
+    int ride_stops;         // Stops made between the source and the destination
+    int added_stops;        // New stops the call adds to the queue (0-2)
+    int added_floors;       // Floors the call adds to the car's route
+} stop_queue_cost;
+
+// reset a queue to empty with the car standing at 'position'
+void stop_queue_init(stop_queue *q, int position);
+
+// record the car's latest reported position and door state
+void stop_queue_set_position(stop_queue *q, int position, int moving, int doors_open);
+
+// floor of the next stop. returns 0 on success, -1 if the queue is empty
+int stop_queue_head(const stop_queue *q, int *floor);
+
+// remove the next stop. returns 0 on success, -1 if the queue is empty
+int stop_queue_pop(stop_queue *q);
+
+// add the stops for a call from 'source' to 'destination'.
+// returns 0 on success, -1 if the route would need too many direction changes
+int stop_queue_add(stop_queue *q, int source, int destination);
+
+// work out what stop_queue_add() would do, without modifying the queue.
+// returns 0 on success, -1 if the call can't be added
+int stop_queue_probe(const stop_queue *q, int source, int destination, stop_queue_cost *cost);
+
+// copy up to 'max' stops into 'floors' in visiting order. returns the number copied
+int stop_queue_list(const stop_queue *q, int *floors, int max);
+
+// Copying a queue to another controller (see the standby in controller.c).
+// The route is read out a sweep at a time and rebuilt stop by stop
+
+// copy up to 'max' stops of sweep 'i' (0 is the sweep the car is on) into
+// 'floors' in visiting order and set its direction. The hold isn't part of
+// any sweep. returns the number copied, or -1 if there is no such sweep
+int stop_queue_sweep(const stop_queue *q, int i, int *dir, int *floors, int max);
+
+// add a stop at the end of the route. It extends the last sweep if that is
+// travelling in 'dir' and hasn't reached the floor yet, otherwise it starts a
+// new sweep. returns 0 on success, -1 if the route has too many sweeps
+int stop_queue_append(stop_queue *q, int dir, int floor);
+
+// make the car open its doors at 'floor', where it is standing, first
+void stop_queue_set_hold(stop_queue *q, int floor);
+
+#endif
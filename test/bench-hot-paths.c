@@ -0,0 +1,444 @@
+// Micro-benchmarks for the hot paths of the car and the controller
+// Built and run by 'make bench' (here or in the top directory). Each
+// benchmark is run several times and the median is reported, so runs on the
+// same idle machine are comparable and a change that makes a path faster or
+// slower shows up as a change in its line.
+//
+//   floor_from_label      floor_from_label() on every floor label
+//   floor_to_label        floor_to_label() on every floor number
+//   frame_queue_next      frame_queue() + frame_next() of a CALL in memory
+//   frame_send_recv       frame_send() + frame_recv() over a socketpair
+//   shm_round_trip        one process locks a car's mutex, changes the car and
+//                         broadcasts, a second process wakes, answers the same
+//                         way, and the first wakes again
+//   condvar_wake          from the broadcast to the other process running
+//                         with the mutex, from the round trips (p50/p99 too)
+//   dispatch_call_{N}     dispatch_assign() of one call with N cars that
+//                         already have stops queued, for N from 1 to 256
+//
+// Usage: ./bench-hot-paths [--json] [--repeat N]
+// The text output is one line per benchmark, "{name} {ns} ns/op ...", and
+// --json prints the same results as a JSON object.
+
+#define _DEFAULT_SOURCE // syscall(), for the futex wakeups in car_shm.h
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include "../car_shm.h"
+#include "../frame.h"
+#include "../dispatch.h"
+#include "../latency.h"
+
+#define DEFAULT_REPEATS 5
+#define MAX_RESULTS 32
+#define FLOOR_OPS 2000000L
+#define FRAME_OPS 2000000L
+#define SOCKET_OPS 200000L
+#define ROUND_TRIP_OPS 20000L
+#define DISPATCH_CALLS 1024         // Calls cycled through by the dispatch benchmarks
+#define DISPATCH_FLOORS 20
+#define DISPATCH_QUEUED 3           // Calls already queued for each car
+
+typedef struct {
+    char name[32];
+    double ns_per_op;               // Median over the repeats
+    double min_ns;
+    double p50_ns, p99_ns;          // Only for benchmarks timed op by op
+    int has_percentiles;
+} result;
+
+static result results[MAX_RESULTS];
+static int result_count = 0;
+static int repeats = DEFAULT_REPEATS;
+static volatile long sink;          // Keeps the compiler from dropping the work
+
+// The region shared by the two processes of the round-trip benchmark
+typedef struct {
+    car_shared_mem mem;
+    uint64_t sent_ns;               // When the last broadcast was made
+    uint32_t ping, pong;
+    int stop;
+    latency_histogram wake;         // Broadcast to the other process running
+} round_trip;
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int by_value(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+// splitmix64, so every run sees the same calls
+static uint64_t next_random(uint64_t *state)
+{
+    uint64_t z = (*state += 0x9e3779b97f4a7c15ULL);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+// run 'fn' 'repeats' times and record the median and fastest ns per op
+static result *measure(const char *name, double (*fn)(void *), void *arg)
+{
+    double runs[64];
+    int n = repeats < 64 ? repeats : 64;
+    for (int i = 0; i < n; i++) {
+        runs[i] = fn(arg);
+    }
+    qsort(runs, n, sizeof(double), by_value);
+
+    result *r = &results[result_count++];
+    memset(r, 0, sizeof(*r));
+    snprintf(r->name, sizeof(r->name), "%s", name);
+    r->ns_per_op = n % 2 ? runs[n / 2] : (runs[n / 2 - 1] + runs[n / 2]) / 2;
+    r->min_ns = runs[0];
+    return r;
+}
+
+// FLOOR LABELS
+
+static char labels[FLOOR_COUNT][FLOOR_LABEL_SIZE];
+
+static double bench_floor_from_label(void *arg)
+{
+    long total = 0;
+    int floor;
+    uint64_t start = now_ns();
+    for (long i = 0; i < FLOOR_OPS; i++) {
+        if (floor_from_label(labels[i % FLOOR_COUNT], &floor) == 0) {
+            total += floor;
+        }
+    }
+    uint64_t elapsed = now_ns() - start;
+    sink = total;
+    return (double)elapsed / FLOOR_OPS;
+}
+
+static double bench_floor_to_label(void *arg)
+{
+    long total = 0;
+    char label[4];
+    uint64_t start = now_ns();
+    for (long i = 0; i < FLOOR_OPS; i++) {
+        floor_to_label(FLOOR_LOWEST + (int)(i % FLOOR_COUNT), label, sizeof(label));
+        total += label[0];
+    }
+    uint64_t elapsed = now_ns() - start;
+    sink = total;
+    return (double)elapsed / FLOOR_OPS;
+}
+
+// FRAMES
+
+static double bench_frame_queue_next(void *arg)
+{
+    static char storage[65536];
+    frame_buffer b;
+    frame_buffer_init(&b, storage, sizeof(storage));
+    char msg[64];
+    long total = 0;
+    uint64_t start = now_ns();
+    for (long i = 0; i < FRAME_OPS; i++) {
+        frame_queue(&b, "CALL 3 7", 8);
+        total += frame_next(&b, msg, sizeof(msg));
+    }
+    uint64_t elapsed = now_ns() - start;
+    sink = total;
+    return (double)elapsed / FRAME_OPS;
+}
+
+static double bench_frame_send_recv(void *arg)
+{
+    int fds[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == -1) {
+        perror("socketpair()");
+        exit(1);
+    }
+    char storage[4096];
+    frame_buffer b;
+    frame_buffer_init(&b, storage, sizeof(storage));
+    char msg[64];
+    long total = 0;
+    uint64_t start = now_ns();
+    for (long i = 0; i < SOCKET_OPS; i++) {
+        if (frame_send(fds[0], "STATUS Closed 3 7") == -1) {
+            perror("frame_send()");
+            exit(1);
+        }
+        total += frame_recv(fds[1], &b, msg, sizeof(msg));
+    }
+    uint64_t elapsed = now_ns() - start;
+    close(fds[0]);
+    close(fds[1]);
+    sink = total;
+    return (double)elapsed / SOCKET_OPS;
+}
+
+// SHARED MEMORY
+
+static round_trip *rt;
+
+// set up the mutex and condition variable the way the car does
+static void init_round_trip(void)
+{
+    rt = mmap(NULL, sizeof(round_trip), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (rt == MAP_FAILED) {
+        perror("mmap()");
+        exit(1);
+    }
+    memset(rt, 0, sizeof(*rt));
+    pthread_mutexattr_t mattr;
+    pthread_condattr_t cattr;
+    pthread_mutexattr_init(&mattr);
+    pthread_mutexattr_setpshared(&mattr, PTHREAD_PROCESS_SHARED);
+    pthread_condattr_init(&cattr);
+    pthread_condattr_setpshared(&cattr, PTHREAD_PROCESS_SHARED);
+    pthread_condattr_setclock(&cattr, CLOCK_MONOTONIC);
+    if (pthread_mutex_init(&rt->mem.mutex, &mattr) != 0 || pthread_cond_init(&rt->mem.cond, &cattr) != 0) {
+        fprintf(stderr, "Unable to set up the shared mutex and condition variable.\n");
+        exit(1);
+    }
+    pthread_mutexattr_destroy(&mattr);
+    pthread_condattr_destroy(&cattr);
+    rt->mem.layout_magic = CAR_SHM_MAGIC;
+    rt->mem.layout_version = CAR_SHM_VERSION;
+    latency_init(&rt->wake);
+}
+
+// The other process: answers every ping the way the car answers a button
+static void round_trip_answer(void)
+{
+    pthread_mutex_lock(&rt->mem.mutex);
+    for (;;) {
+        while (rt->ping == rt->pong && !rt->stop) {
+            pthread_cond_wait(&rt->mem.cond, &rt->mem.mutex);
+        }
+        if (rt->stop) {
+            break;
+        }
+        latency_record(&rt->wake, now_ns() - rt->sent_ns);
+        car_shm_write_begin(&rt->mem);
+        rt->mem.current_floor_num = (int16_t)rt->ping;
+        rt->pong = rt->ping;
+        car_shm_write_end(&rt->mem);
+        rt->sent_ns = now_ns();
+        car_shm_broadcast(&rt->mem, sizeof(rt->mem));
+    }
+    pthread_mutex_unlock(&rt->mem.mutex);
+}
+
+static double bench_shm_round_trip(void *arg)
+{
+    pthread_mutex_lock(&rt->mem.mutex);
+    rt->stop = 0;
+    pthread_mutex_unlock(&rt->mem.mutex);
+    pid_t child = fork();
+    if (child == -1) {
+        perror("fork()");
+        exit(1);
+    }
+    if (child == 0) {
+        round_trip_answer();
+        _exit(0);
+    }
+
+    pthread_mutex_lock(&rt->mem.mutex);
+    uint64_t start = now_ns();
+    for (long i = 0; i < ROUND_TRIP_OPS; i++) {
+        car_shm_write_begin(&rt->mem);
+        rt->mem.destination_floor_num = (int16_t)i;
+        rt->ping++;
+        car_shm_write_end(&rt->mem);
+        rt->sent_ns = now_ns();
+        car_shm_broadcast(&rt->mem, sizeof(rt->mem));
+        while (rt->pong != rt->ping) {
+            pthread_cond_wait(&rt->mem.cond, &rt->mem.mutex);
+        }
+        latency_record(&rt->wake, now_ns() - rt->sent_ns);
+    }
+    uint64_t elapsed = now_ns() - start;
+    rt->stop = 1;
+    pthread_cond_broadcast(&rt->mem.cond);
+    pthread_mutex_unlock(&rt->mem.mutex);
+    waitpid(child, NULL, 0);
+    return (double)elapsed / ROUND_TRIP_OPS;
+}
+
+// DISPATCH
+
+typedef struct {
+    int ncars;
+    dispatch_car *cars;
+    stop_queue *queues;             // The cars' queues
+    stop_queue *initial;            // Queues as set up, to undo each assignment
+    int calls[DISPATCH_CALLS][2];
+} dispatch_setup;
+
+static void random_call(uint64_t *state, int *source, int *destination)
+{
+    *source = 1 + (int)(next_random(state) % DISPATCH_FLOORS);
+    do {
+        *destination = 1 + (int)(next_random(state) % DISPATCH_FLOORS);
+    } while (*destination == *source);
+}
+
+static void init_dispatch(dispatch_setup *s, int ncars)
+{
+    uint64_t state = 42;
+    s->ncars = ncars;
+    s->cars = malloc(sizeof(dispatch_car) * ncars);
+    s->queues = malloc(sizeof(stop_queue) * ncars);
+    s->initial = malloc(sizeof(stop_queue) * ncars);
+    if (s->cars == NULL || s->queues == NULL || s->initial == NULL) {
+        perror("malloc()");
+        exit(1);
+    }
+    for (int i = 0; i < ncars; i++) {
+        stop_queue_init(&s->initial[i], 1 + (int)(next_random(&state) % DISPATCH_FLOORS));
+        for (int k = 0; k < DISPATCH_QUEUED; k++) {
+            int source, destination;
+            random_call(&state, &source, &destination);
+            stop_queue_add(&s->initial[i], source, destination);
+        }
+        s->queues[i] = s->initial[i];
+        s->cars[i].queue = &s->queues[i];
+        s->cars[i].lowest_floor = 1;
+        s->cars[i].highest_floor = DISPATCH_FLOORS;
+        s->cars[i].floor_time = 1.0;
+        s->cars[i].stop_time = 3.0;
+    }
+    for (int k = 0; k < DISPATCH_CALLS; k++) {
+        random_call(&state, &s->calls[k][0], &s->calls[k][1]);
+    }
+}
+
+static void free_dispatch(dispatch_setup *s)
+{
+    free(s->cars);
+    free(s->queues);
+    free(s->initial);
+}
+
+// only the assignment is timed - the chosen car's queue is put back after
+// each call, so every call sees the same fleet
+static double bench_dispatch(void *arg)
+{
+    dispatch_setup *s = arg;
+    const dispatch_policy *policy = dispatch_find_policy("journey");
+    long ops = 200000L / s->ncars + DISPATCH_CALLS;
+    uint64_t elapsed = 0;
+    long total = 0;
+    for (long i = 0; i < ops; i++) {
+        const int *call = s->calls[i % DISPATCH_CALLS];
+        uint64_t start = now_ns();
+        int chosen = dispatch_assign(s->cars, s->ncars, call[0], call[1], policy->cost);
+        elapsed += now_ns() - start;
+        if (chosen >= 0) {
+            s->queues[chosen] = s->initial[chosen];
+        }
+        total += chosen;
+    }
+    sink = total;
+    return (double)elapsed / ops;
+}
+
+// OUTPUT
+
+static void print_text(void)
+{
+    printf("# median of %d runs\n", repeats);
+    for (int i = 0; i < result_count; i++) {
+        const result *r = &results[i];
+        printf("%-20s %10.1f ns/op  min %10.1f", r->name, r->ns_per_op, r->min_ns);
+        if (r->has_percentiles) {
+            printf("  p50 %10.1f  p99 %10.1f", r->p50_ns, r->p99_ns);
+        }
+        printf("\n");
+    }
+}
+
+static void print_json(void)
+{
+    printf("{\n  \"repeats\": %d,\n  \"benchmarks\": [\n", repeats);
+    for (int i = 0; i < result_count; i++) {
+        const result *r = &results[i];
+        printf("    {\"name\": \"%s\", \"ns_per_op\": %.1f, \"min_ns\": %.1f", r->name, r->ns_per_op, r->min_ns);
+        if (r->has_percentiles) {
+            printf(", \"p50_ns\": %.1f, \"p99_ns\": %.1f", r->p50_ns, r->p99_ns);
+        }
+        printf("}%s\n", i + 1 < result_count ? "," : "");
+    }
+    printf("  ]\n}\n");
+}
+
+int main(int argc, char **argv)
+{
+    int json = 0;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--json") == 0) {
+            json = 1;
+        } else if (strcmp(argv[i], "--repeat") == 0 && i + 1 < argc && atoi(argv[i + 1]) > 0) {
+            repeats = atoi(argv[++i]);
+        } else {
+            fprintf(stderr, "Usage: %s [--json] [--repeat N]\n", argv[0]);
+            exit(1);
+        }
+    }
+
+    for (int i = 0; i < FLOOR_COUNT; i++) {
+        floor_to_label(FLOOR_LOWEST + i, labels[i], sizeof(labels[i]));
+    }
+    measure("floor_from_label", bench_floor_from_label, NULL);
+    measure("floor_to_label", bench_floor_to_label, NULL);
+    measure("frame_queue_next", bench_frame_queue_next, NULL);
+    measure("frame_send_recv", bench_frame_send_recv, NULL);
+
+    init_round_trip();
+    measure("shm_round_trip", bench_shm_round_trip, NULL);
+    // Each round trip is two wakeups, one in each process
+    result *wake = &results[result_count++];
+    memset(wake, 0, sizeof(*wake));
+    snprintf(wake->name, sizeof(wake->name), "condvar_wake");
+    wake->ns_per_op = (double)rt->wake.sum_ns / rt->wake.count;
+    wake->min_ns = (double)latency_percentile(&rt->wake, 0);
+    wake->p50_ns = (double)latency_percentile(&rt->wake, 50);
+    wake->p99_ns = (double)latency_percentile(&rt->wake, 99);
+    wake->has_percentiles = 1;
+    munmap(rt, sizeof(round_trip));
+
+    static const int fleet_sizes[] = {1, 4, 16, 64, 256};
+    for (size_t i = 0; i < sizeof(fleet_sizes) / sizeof(fleet_sizes[0]); i++) {
+        dispatch_setup *s = malloc(sizeof(dispatch_setup));
+        if (s == NULL) {
+            perror("malloc()");
+            exit(1);
+        }
+        init_dispatch(s, fleet_sizes[i]);
+        char name[32];
+        snprintf(name, sizeof(name), "dispatch_call_%d", fleet_sizes[i]);
+        measure(name, bench_dispatch, s);
+        free_dispatch(s);
+        free(s);
+    }
+
+    if (json) {
+        print_json();
+    } else {
+        print_text();
+    }
+    return 0;
+}
@@ -0,0 +1,163 @@
+// Micro-benchmark for the car_shared_mem layout
+// Built twice by 'make bench-shm-layout': bench-shm-layout-packed with the
+// legacy layout and bench-shm-layout-padded with -DCAR_SHM_PADDED. Run both on
+// an otherwise idle machine with at least three cores and compare.
+//
+// One thread plays the car, updating its state under the sequence counter
+// the way normal_operation() does, while a second thread takes lock-free
+// snapshots of that state like a monitor. Two more threads play internal
+// (buttons) and the safety system (sensors), storing to their own fields as
+// fast as they can. Each run is timed with the button and sensor threads
+// idle and then busy - in the packed layout their stores invalidate the
+// car's cache line, so the busy run is slower.
+//
+// Usage: ./bench-shm-layout-packed [iterations]
+
+#define _GNU_SOURCE // pthread_setaffinity_np()
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <sched.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "../car_shm.h"
+
+#define DEFAULT_ITERATIONS 10000000L
+
+static car_shared_mem *mem;
+static long iterations = DEFAULT_ITERATIONS;
+static volatile int stop_writers;
+static volatile int stop_observer;
+static int cpus;
+
+enum { WRITER_BUTTONS, WRITER_SENSORS };
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// keep each thread on its own core where there are enough of them
+static void pin(int cpu)
+{
+    if (cpus < 4) return;
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu % cpus, &set);
+    pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+}
+
+static void *writer(void *arg)
+{
+    int kind = (int)(intptr_t)arg;
+    pin(2 + kind);
+    uint8_t v = 0;
+    while (!stop_writers) {
+        v ^= 1;
+        if (kind == WRITER_BUTTONS) {
+            __atomic_store_n(&mem->open_button, v, __ATOMIC_RELAXED);
+            __atomic_store_n(&mem->close_button, v, __ATOMIC_RELAXED);
+        } else {
+            __atomic_store_n(&mem->door_obstruction, v, __ATOMIC_RELAXED);
+            __atomic_store_n(&mem->overload, v, __ATOMIC_RELAXED);
+        }
+    }
+    return NULL;
+}
+
+static void *observer(void *arg)
+{
+    long *reads = arg;
+    pin(1);
+    while (!stop_observer) {
+        uint32_t before = __atomic_load_n(&mem->seq, __ATOMIC_ACQUIRE);
+        if (before & 1) continue;
+        int16_t current = mem->current_floor_num;
+        int16_t destination = mem->destination_floor_num;
+        uint8_t status = mem->status_code;
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&mem->seq, __ATOMIC_RELAXED) == before) {
+            (*reads)++;
+        }
+        (void)current; (void)destination; (void)status;
+    }
+    return NULL;
+}
+
+// time 'iterations' car updates with an observer running, optionally with
+// the button and sensor threads storing at the same time
+static void run(int busy)
+{
+    pthread_t writers[2], obs;
+    long reads = 0;
+    stop_writers = 0;
+    stop_observer = 0;
+    if (busy) {
+        pthread_create(&writers[0], NULL, writer, (void *)(intptr_t)WRITER_BUTTONS);
+        pthread_create(&writers[1], NULL, writer, (void *)(intptr_t)WRITER_SENSORS);
+    }
+    pthread_create(&obs, NULL, observer, &reads);
+
+    pin(0);
+    uint64_t start = now_ns();
+    for (long i = 0; i < iterations; i++) {
+        car_shm_write_begin(mem);
+        mem->current_floor_num = (int16_t)(i & 63);
+        mem->destination_floor_num = (int16_t)((i + 1) & 63);
+        mem->status_code = (uint8_t)(i % CAR_STATUS_UNKNOWN);
+        car_shm_write_end(mem);
+    }
+    uint64_t elapsed = now_ns() - start;
+
+    stop_observer = 1;
+    pthread_join(obs, NULL);
+    if (busy) {
+        stop_writers = 1;
+        pthread_join(writers[0], NULL);
+        pthread_join(writers[1], NULL);
+    }
+
+    printf("  %-22s %7.2f ns/update  %7.2f M snapshots/s\n",
+           busy ? "buttons+sensors busy:" : "buttons+sensors idle:",
+           (double)elapsed / iterations, reads / ((double)elapsed / 1000.0));
+}
+
+int main(int argc, char **argv)
+{
+    if (argc >= 2) {
+        iterations = atol(argv[1]);
+        if (iterations <= 0) {
+            fprintf(stderr, "Usage: %s [iterations]\n", argv[0]);
+            exit(1);
+        }
+    }
+    cpus = (int)sysconf(_SC_NPROCESSORS_ONLN);
+
+    // Private memory is enough - the cache behaviour is the same as a segment
+    if (posix_memalign((void **)&mem, CAR_SHM_CACHE_LINE, sizeof(car_shared_mem)) != 0) {
+        perror("posix_memalign");
+        exit(1);
+    }
+    memset(mem, 0, sizeof(*mem));
+
+#ifdef CAR_SHM_PADDED
+    printf("padded layout (%zu bytes, buttons at +%zu, sensors at +%zu)\n",
+#else
+    printf("packed layout (%zu bytes, buttons at +%zu, sensors at +%zu)\n",
+#endif
+           sizeof(car_shared_mem), offsetof(car_shared_mem, open_button),
+           offsetof(car_shared_mem, door_obstruction));
+    if (cpus < 4) {
+        printf("  only %d CPU(s) online - threads share cores, expect no difference\n", cpus);
+    }
+    run(0);
+    run(1);
+
+    free(mem);
+    return 0;
+}
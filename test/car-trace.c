@@ -0,0 +1,134 @@
+// Prints a car's event trace (see car_trace.h)
+// Usage: ./car-trace {car name} [--follow]
+// Every event still in the ring is printed, one per line:
+//   {seconds since the first event} {event} {value} {floor} {destination}
+// With --follow new events are printed as the car appends them until the
+// car exits (or SIGINT). The output is plain columns, for feeding to other
+// tools.
+
+#define _DEFAULT_SOURCE // syscall(), for the futex wakeups in car_shm.h
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <signal.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "../car_shm.h"
+#include "../car_trace.h"
+
+#define POLL_NS 10000000L // While following, look for new events every 10ms
+
+static const char *kind_names[] = {"STATUS", "FLOOR", "DESTINATION", "BUTTON", "MODE"};
+static const char *button_names[] = {"open", "close", "obstruction"};
+
+static volatile sig_atomic_t running = 1;
+
+static void handle_sigint(int sig)
+{
+    running = 0;
+}
+
+static void print_event(const car_trace_event *e, uint64_t start)
+{
+    char floor[4], destination[4], value[32];
+    floor_to_label(e->floor, floor, sizeof(floor));
+    floor_to_label(e->destination, destination, sizeof(destination));
+    switch (e->kind) {
+    case CAR_TRACE_STATUS:
+        snprintf(value, sizeof(value), "%s", car_status_name((car_status)e->value));
+        break;
+    case CAR_TRACE_BUTTON:
+        snprintf(value, sizeof(value), "%s", e->value <= CAR_TRACE_OBSTRUCTION ? button_names[e->value] : "?");
+        break;
+    case CAR_TRACE_MODE:
+        snprintf(value, sizeof(value), "%s%s%s%s",
+                 e->value & CAR_TRACE_MODE_SERVICE ? "service," : "",
+                 e->value & CAR_TRACE_MODE_EMERGENCY ? "emergency," : "",
+                 e->value & CAR_TRACE_MODE_STOP ? "stop," : "",
+                 e->value == 0 ? "normal" : "");
+        value[strlen(value) - (e->value != 0)] = '\0'; // Trailing comma
+        break;
+    default:
+        strcpy(value, "-");
+        break;
+    }
+    printf("%.6f %s %s %s %s\n", (double)(e->time_ns - start) / 1e9,
+           e->kind <= CAR_TRACE_MODE ? kind_names[e->kind] : "?", value, floor, destination);
+}
+
+int main(int argc, char **argv)
+{
+    if (argc < 2 || argc > 3 || (argc == 3 && strcmp(argv[2], "--follow") != 0)) {
+        fprintf(stderr, "Usage: %s {car name} [--follow]\n", argv[0]);
+        exit(1);
+    }
+    int follow = argc == 3;
+
+    char name[256];
+    snprintf(name, sizeof(name), "/car%s_trace", argv[1]);
+    int fd = shm_open(name, O_RDONLY, 0);
+    struct stat st;
+    if (fd == -1 || fstat(fd, &st) == -1) {
+        fprintf(stderr, "Unable to access the trace of car %s.\n", argv[1]);
+        exit(1);
+    }
+    size_t mapped = st.st_size;
+    const car_trace *t = mapped >= sizeof(car_trace) ? mmap(NULL, mapped, PROT_READ, MAP_SHARED, fd, 0) : MAP_FAILED;
+    close(fd);
+    if (t == MAP_FAILED || !car_trace_valid(t, mapped)) {
+        fprintf(stderr, "Unable to access the trace of car %s.\n", argv[1]);
+        exit(1);
+    }
+
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = handle_sigint;
+    sigaction(SIGINT, &sa, NULL);
+
+    // Start from the oldest event still in the ring
+    uint64_t tail = 0;
+    uint64_t start = 0;
+    int started = 0;
+    while (running) {
+        car_trace_event e;
+        long got = car_trace_next(t, &tail, &e);
+        if (got == 1) {
+            if (!started) {
+                start = e.time_ns;
+                started = 1;
+            }
+            print_event(&e, start);
+            continue;
+        }
+        if (got < 0) {
+            if (started) {
+                printf("# lost %ld events\n", -got);
+            }
+            continue; // Before the first event - just the ring's older contents
+        }
+        if (!follow) {
+            break;
+        }
+        fflush(stdout);
+        // The car unlinks its trace when it exits
+        struct stat gone;
+        int check = shm_open(name, O_RDONLY, 0);
+        if (check == -1) {
+            break;
+        }
+        int same = fstat(check, &gone) == 0 && gone.st_ino == st.st_ino;
+        close(check);
+        if (!same) {
+            break;
+        }
+        struct timespec pause = {0, POLL_NS};
+        nanosleep(&pause, NULL);
+    }
+
+    munmap((void *)t, mapped);
+    return 0;
+}
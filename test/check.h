@@ -0,0 +1,52 @@
+#ifndef CHECK_H
+#define CHECK_H
+
+// Checks shared by the unit testers (test-timer-wheel, test-stop-queue,
+// test-frame and test-dispatch). Each check prints "ok" or "FAILED" with what
+// it expected and what it got, and check_done() prints the number that failed
+// and gives the tester's exit status.
+
+#include <stdio.h>
+#include <string.h>
+
+static int failures = 0;
+
+static inline void check(const char *what, long long expected, long long got)
+{
+    printf("%s: %s (expected %lld, got %lld)\n", expected == got ? "ok" : "FAILED", what, expected, got);
+    failures += expected != got;
+}
+
+static inline void check_str(const char *what, const char *expected, const char *got)
+{
+    int ok = strcmp(expected, got) == 0;
+    printf("%s: %s (expected \"%s\", got \"%s\")\n", ok ? "ok" : "FAILED", what, expected, got);
+    failures += !ok;
+}
+
+#ifdef STOP_QUEUE_H
+// check a queue's stops, in visiting order, against a list like "6 8 7 4".
+// Only for testers that include stop_queue.h first
+static inline void check_queue(const char *what, const stop_queue *q, const char *expected)
+{
+    int floors[64];
+    int n = stop_queue_list(q, floors, 64);
+    char got[256] = "";
+    for (int i = 0; i < n; i++) {
+        snprintf(got + strlen(got), sizeof(got) - strlen(got), i > 0 ? " %d" : "%d", floors[i]);
+    }
+    if (n != q->length) {
+        snprintf(got + strlen(got), sizeof(got) - strlen(got), " (length %d)", q->length);
+    }
+    check_str(what, expected, got);
+}
+#endif
+
+// returns 0 if every check passed, 1 otherwise
+static inline int check_done(void)
+{
+    printf("%d failed\n", failures);
+    return failures != 0;
+}
+
+#endif
@@ -1,12 +1,33 @@
 // This program requires a library called 'ncurses' to run
 // Install it with 'sudo apt install ncurses-dev' (on Ubuntu)
 // then type 'make display-cars'
+// Usage: ./display-cars [lowest floor] [highest floor] [--registry]
+// With --registry, cars started with --registry are read from the fleet
+// registry instead of opening every /dev/shm/car* segment on each refresh.
+// The display then sleeps until a car reports a change, and only animates
+// while some car is moving or has its doors moving. Without it, /dev/shm is
+// watched with inotify for cars starting and exiting, each car's segment
+// stays mapped, and a car is only reread once its sequence count moves.
+// Either way only the cars that changed are redrawn.
+
+#define _DEFAULT_SOURCE // syscall(), for the futex wakeups in car_shm.h
 
 #include <ncurses.h>
 #include <math.h>
 #include <dirent.h>
 #include <sys/time.h>
-#include "shared.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/inotify.h>
+#include "../car_shm.h"
+#include "../fleet_shm.h"
 
 // Default refresh rate: 50 frames/sec
 #define FRAME_RATE 50
@@ -19,163 +40,172 @@ struct carinfo {
     int64_t delay;
     struct timeval status_tv;
     char state;
-    car_shared_mem mem;
-    struct carinfo *next;
+    car_shm_snapshot mem;
+    int dirty;               // Changed since it was last drawn
+    // Without --registry the car's segment stays mapped
+    car_shared_mem *shm;
+    size_t mapped;
+    uint32_t seq;            // Sequence count of the last read (segments that have one)
+    // With --registry
+    int slot;
+    uint32_t slot_seq;
 };
 
+// Cars, sorted by name
 static struct carinfo *cars = NULL;
+static int car_count = 0, car_capacity = 0;
+static int cars_changed = 1;                // The set of cars changed - lay them out again
 static int highest = 1, lowest = 1;
+// With --registry the cars are read from the fleet registry, mapped once
+static int use_registry = 0;
+static fleet_shm *fleet = NULL;
+static uint32_t seen_generation;
+static int active_slots[FLEET_SHM_SLOTS]; // Slots in use as of seen_generation
+static int active_count = -1;             // -1 until the registry has been read
+static int wake_pipe[2] = {-1, -1};       // Written by the watcher when the registry changes
+// Without --registry
+static int inotify_fd = -1;               // -1 if inotify isn't available - rescan each frame
 int64_t us_diff(const struct timeval *, const struct timeval *);
 void scan_cars(void);
+void scan_registry(void);
+void draw_car(struct carinfo *c, int carpos, int w, int h, const struct timeval *current_tv);
+int car_animating(const struct carinfo *c, const struct timeval *current_tv);
+void start_watcher(void);
 
+// Floor labels go through floor_label.h like everywhere else. A label that
+// isn't a floor counts as B1, as car_shm_read() treats one
 int fti(const char *f)
 {
-    if (f[0] == 'B') return 1-atoi(f+1);
-    else return atoi(f);
+    int floor;
+    return floor_from_label(f, &floor) == 0 ? floor : 0;
 }
 void itf(char *out, int f)
 {
-    if (f <= 0) sprintf(out, "B%d", 1-f);
-    else sprintf(out, "%d", f);
+    floor_to_label(f, out, FLOOR_LABEL_SIZE);
 }
 
 int main(int argc, char **argv)
 {
+    if (argc >= 2 && strcmp(argv[argc - 1], "--registry") == 0) {
+        use_registry = 1;
+        argc--;
+    }
     if (argc >= 3) {
-        lowest = fti(argv[1]);
-        highest = fti(argv[2]);
+        if (floor_from_label(argv[1], &lowest) == -1 || floor_from_label(argv[2], &highest) == -1) {
+            fprintf(stderr, "Invalid floor(s) specified.\n");
+            exit(1);
+        }
     }
     if (highest < lowest) {
         fprintf(stderr, "Lowest floor must be lower than highest floor\n");
         exit(1);
     }
-    
+
+    if (use_registry) {
+        start_watcher();
+    } else {
+        inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+        if (inotify_fd != -1 &&
+            inotify_add_watch(inotify_fd, "/dev/shm", IN_CREATE | IN_DELETE | IN_MOVED_TO | IN_MOVED_FROM) == -1) {
+            close(inotify_fd);
+            inotify_fd = -1;
+        }
+    }
+
 	initscr();
     nodelay(stdscr, true);
+    curs_set(0);
 
+    int last_w = -1, last_h = -1, last_highest = highest, last_lowest = lowest;
+    int animating = 0;
     for (;;) {
-        erase();
-        move(0, 20);
-        scan_cars();
-        if (getch() == 27) { // Esc
+        // Sleep until a key, a change or the next frame of an animation.
+        // Without the registry nothing says when a car's state changes, so
+        // its segments are still checked every frame - but reading an
+        // unchanged car is one load of its sequence count
+        struct pollfd fds[2] = {{STDIN_FILENO, POLLIN, 0}, {-1, POLLIN, 0}};
+        int timeout = REFRESH_DELAY / 1000;
+        if (use_registry) {
+            fds[1].fd = wake_pipe[0];
+            if (!animating && fleet != NULL) {
+                timeout = -1;
+            }
+        }
+        if (last_w != -1) {
+            poll(fds, 2, timeout);
+        }
+        if (fds[1].revents & POLLIN) {
+            char drain[64];
+            while (read(wake_pipe[0], drain, sizeof(drain)) > 0);
+        }
+
+        int key, quit = 0;
+        while ((key = getch()) != ERR) {
+            if (key == 27) { // Esc
+                quit = 1;
+            }
+        }
+        if (quit) {
             break;
         }
+
+        if (use_registry) {
+            scan_registry();
+        } else {
+            scan_cars();
+        }
         int w, h;
         getmaxyx(stdscr, h, w);
 
         int height = highest - lowest + 1;
-        
-        // Write floor numbers
-        for (int i = 0; i < height; i++) {
-            int y1 = (h * i / height);
-            int y2 = (h * (i + 1) / height - 1);
-            move((y1 + y2) / 2, 0);
-            char buf[4];
-            itf(buf, highest - i);
-            printw("%s", buf);
-        }
 
-        // Count how many cars are active
-        int numcars = 0;
-        struct carinfo *c = cars;
-        while (c != NULL) {
-            if (c->state == 'c') numcars++;
-            c = c->next;
+        // Lay everything out again only when the cars, the floors or the
+        // terminal changed - otherwise just the cars that changed are redrawn
+        if (cars_changed || w != last_w || h != last_h || highest != last_highest || lowest != last_lowest) {
+            erase();
+            // Write floor numbers
+            for (int i = 0; i < height; i++) {
+                int y1 = (h * i / height);
+                int y2 = (h * (i + 1) / height - 1);
+                move((y1 + y2) / 2, 0);
+                char buf[4];
+                itf(buf, highest - i);
+                printw("%s", buf);
+            }
+            for (int i = 0; i < car_count; i++) {
+                cars[i].dirty = 1;
+            }
+            cars_changed = 0;
+            last_w = w;
+            last_h = h;
+            last_highest = highest;
+            last_lowest = lowest;
         }
 
-        // Draw each car
-        c = cars;
-        int carpos = 0;
-
         struct timeval current_tv;
         gettimeofday(&current_tv, NULL);
 
-        while (c != NULL) {
-            if (c->state != 'c') continue; // Only render active cars
-
-            // Determine X bounds of the car
-            int x1 = ((w - 4) * carpos / numcars) + 4;
-            int x2 = ((w - 4) * (carpos + 1) / numcars) + 3;
-            int colwidth = x2 - x1 + 1;
-            // Determine Y bounds of the car
-            int current_floor = fti(c->mem.current_floor);
-            
-            float floor = height - 1 - (current_floor - lowest);
-            // Look at timestamp of last status change - guess progress
-            int64_t us_passed = us_diff(&c->status_tv, &current_tv);
-            float progress = fminf(1.0f * us_passed / c->delay, 1.0f);
-
-            if (strcmp(c->mem.status, "Between")==0) {
-                int destination_floor = fti(c->mem.destination_floor);
-                int dir = (destination_floor - current_floor) / abs(destination_floor - current_floor);
-                floor -= progress * dir;
-            }
-            
-            int y1 = (int) roundf(h * floor / height);
-            int y2 = (int) roundf(h * (floor + 1) / height - 1);
-
-            for (int x = x1; x <= x2; x++) {
-                move(y1, x);
-                printw("=");
-                move(y2, x);
-                printw("=");
-            }
-            for (int y = y1 + 1; y < y2; y++) {
-                move(y, x1);
-                printw("||");
-                move(y, x2-1);
-                printw("||");
-            }
-            // Draw the insides of the car, showing the doors open/closed
-            int door_closed_w;
-            if (strcmp(c->mem.status, "Open")==0) {
-                door_closed_w = 0;
-            } else if (strcmp(c->mem.status, "Opening")==0) {
-                door_closed_w = (int) roundf( (colwidth - 2) / 2 * (1.0f - progress) );
-            } else if (strcmp(c->mem.status, "Closing")==0) {
-                door_closed_w = (int) roundf( (colwidth - 2) / 2 * progress );
-            } else {
-                door_closed_w = (colwidth - 2) / 2;
-            }
-
-            // Display service mode / emergency mode
-            move(y2, x1);
-            if (c->mem.individual_service_mode) printw("(S)");
-            if (c->mem.emergency_mode) printw("(E)");
-
-            for (int y = y1 + 1; y < y2; y++) {
-                move(y, x1 + 2);
-                for (int i = 2; i < door_closed_w; i++) {
-                    printw(".");
-                }
-                move(y, x2 - door_closed_w);
-                for (int i = 0; i < door_closed_w - 1; i++) {
-                    printw(".");
-                }
-                move(y, x1 + door_closed_w);
-                printw("|");
-                move(y, x2 - door_closed_w);
-                printw("|");
+        animating = 0;
+        for (int i = 0; i < car_count; i++) {
+            struct carinfo *c = &cars[i];
+            int moving = car_animating(c, &current_tv);
+            if (c->dirty || moving) {
+                draw_car(c, i, w, h, &current_tv);
+                c->dirty = 0;
             }
+            animating |= moving;
+        }
 
-            // Write car name
-            move(y1, (colwidth - strlen(c->name + 3) - 4)/2 + x1);
-            printw("( %s )", c->name + 3);
-            // Write car status
-            move(y2, (colwidth - strlen(c->mem.status))/2 + x1);
-            printw("%s", c->mem.status);
-            
-            carpos++;
-            c = c->next;
-        }
-        
         move(0, 0);
-        
+
         refresh();
-        usleep(REFRESH_DELAY);
     }
 	endwin();
 
+    if (fleet != NULL) {
+        fleet_shm_watch(fleet, -1);
+    }
+
 	return 0;
 }
 
@@ -186,124 +216,484 @@ int64_t us_diff(const struct timeval *before, const struct timeval *after)
     return diff;
 }
 
-struct carinfo *get_car_by_name(const char *name)
+// how far the current phase of a car has got, from the time since its
+// status last changed and its delay
+float car_progress(const struct carinfo *c, const struct timeval *current_tv)
+{
+    int64_t us_passed = us_diff(&c->status_tv, current_tv);
+    return fminf(1.0f * us_passed / c->delay, 1.0f);
+}
+
+// 1 if a car is drawn part way through a phase, so needs drawing every frame
+int car_animating(const struct carinfo *c, const struct timeval *current_tv)
+{
+    if (strcmp(c->mem.status, "Between") != 0 && strcmp(c->mem.status, "Opening") != 0 &&
+        strcmp(c->mem.status, "Closing") != 0) {
+        return 0;
+    }
+    // Keep drawing for a frame past the end, so the last position is shown
+    return us_diff(&c->status_tv, current_tv) < c->delay + REFRESH_DELAY;
+}
+
+void draw_car(struct carinfo *c, int carpos, int w, int h, const struct timeval *current_tv)
 {
-    struct carinfo *c = cars;
-    while (c != NULL) {
-        if (strcmp(name, c->name)==0) {
-            return c;
+    int height = highest - lowest + 1;
+
+    // Determine X bounds of the car
+    int x1 = ((w - 4) * carpos / car_count) + 4;
+    int x2 = ((w - 4) * (carpos + 1) / car_count) + 3;
+    int colwidth = x2 - x1 + 1;
+
+    // Clear the car's column
+    for (int y = 0; y < h; y++) {
+        move(y, x1);
+        for (int x = x1; x <= x2; x++) {
+            addch(' ');
         }
-        c = c->next;
     }
-    return NULL;
+
+    // Determine Y bounds of the car
+    int current_floor = fti(c->mem.current_floor);
+
+    float floor = height - 1 - (current_floor - lowest);
+    // Look at timestamp of last status change - guess progress
+    float progress = car_progress(c, current_tv);
+
+    if (strcmp(c->mem.status, "Between")==0) {
+        int destination_floor = fti(c->mem.destination_floor);
+        if (destination_floor != current_floor) {
+            int dir = (destination_floor - current_floor) / abs(destination_floor - current_floor);
+            floor -= progress * dir;
+        }
+    }
+
+    int y1 = (int) roundf(h * floor / height);
+    int y2 = (int) roundf(h * (floor + 1) / height - 1);
+
+    for (int x = x1; x <= x2; x++) {
+        move(y1, x);
+        printw("=");
+        move(y2, x);
+        printw("=");
+    }
+    for (int y = y1 + 1; y < y2; y++) {
+        move(y, x1);
+        printw("||");
+        move(y, x2-1);
+        printw("||");
+    }
+    // Draw the insides of the car, showing the doors open/closed
+    int door_closed_w;
+    if (strcmp(c->mem.status, "Open")==0) {
+        door_closed_w = 0;
+    } else if (strcmp(c->mem.status, "Opening")==0) {
+        door_closed_w = (int) roundf( (colwidth - 2) / 2 * (1.0f - progress) );
+    } else if (strcmp(c->mem.status, "Closing")==0) {
+        door_closed_w = (int) roundf( (colwidth - 2) / 2 * progress );
+    } else {
+        door_closed_w = (colwidth - 2) / 2;
+    }
+
+    // Display service mode / emergency mode
+    move(y2, x1);
+    if (c->mem.individual_service_mode) printw("(S)");
+    if (c->mem.emergency_mode) printw("(E)");
+
+    for (int y = y1 + 1; y < y2; y++) {
+        move(y, x1 + 2);
+        for (int i = 2; i < door_closed_w; i++) {
+            printw(".");
+        }
+        move(y, x2 - door_closed_w);
+        for (int i = 0; i < door_closed_w - 1; i++) {
+            printw(".");
+        }
+        move(y, x1 + door_closed_w);
+        printw("|");
+        move(y, x2 - door_closed_w);
+        printw("|");
+    }
+
+    // Write car name
+    move(y1, (colwidth - strlen(c->name + 3) - 4)/2 + x1);
+    printw("( %s )", c->name + 3);
+    // Write car status
+    move(y2, (colwidth - strlen(c->mem.status))/2 + x1);
+    printw("%s", c->mem.status);
 }
 
+// the index of car 'name', or if there is none -1 - the index it would be
+// inserted at
+int find_car(const char *name)
+{
+    int lo = 0, hi = car_count;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        int cmp = strcmp(cars[mid].name, name);
+        if (cmp == 0) {
+            return mid;
+        }
+        if (cmp < 0) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return -1 - lo;
+}
+
+// add car 'name' in alphabetical order. returns its index. The other cars
+// may move, so pointers into the array don't survive this
+int add_car(const char *name, const car_shm_snapshot *snap, const struct timeval *current_tv)
+{
+    int i = find_car(name);
+    if (i >= 0) {
+        return i;
+    }
+    i = -1 - i;
+    if (car_count == car_capacity) {
+        car_capacity = car_capacity ? car_capacity * 2 : 16;
+        cars = realloc(cars, sizeof(struct carinfo) * car_capacity);
+        if (cars == NULL) {
+            endwin();
+            perror("realloc()");
+            exit(1);
+        }
+    }
+    memmove(&cars[i + 1], &cars[i], sizeof(struct carinfo) * (car_count - i));
+    car_count++;
+
+    struct carinfo *c = &cars[i];
+    memset(c, 0, sizeof(*c));
+    strncpy(c->name, name, 127);
+    c->status_tv = *current_tv;
+    c->mem = *snap;
+    c->delay = 1000000; // Default (1000ms)
+    c->slot = -1;
+    c->dirty = 1;
+    cars_changed = 1;
+    return i;
+}
+
+void remove_car(int i)
+{
+    if (cars[i].shm != NULL) {
+        munmap(cars[i].shm, cars[i].mapped);
+    }
+    memmove(&cars[i], &cars[i + 1], sizeof(struct carinfo) * (car_count - i - 1));
+    car_count--;
+    cars_changed = 1;
+}
+
+// Clean up cars that are no longer present
 void cleanup(void)
 {
-    // Clean up cars that are no longer present
-    struct carinfo *c = cars;
-    struct carinfo *prev = NULL;
-    while (c != NULL) {
-        if (c->state == 'o') {
-            if (prev) {
-                prev->next = c->next;
+    for (int i = car_count - 1; i >= 0; i--) {
+        if (cars[i].state == 'o') {
+            remove_car(i);
+        }
+    }
+}
+
+// record the latest state of car 'c'
+void update_car(struct carinfo *c, const car_shm_snapshot *snap, const struct timeval *current_tv)
+{
+    c->state = 'c';
+    if (strcmp(c->mem.status, snap->status) != 0 || strcmp(c->mem.current_floor, snap->current_floor) != 0) {
+        if ((strcmp(c->mem.status, "Between")==0 && strcmp(snap->status, "Opening")==0) ||
+            (strcmp(c->mem.status, "Between")==0 && strcmp(snap->status, "Closed")==0) ||
+            (strcmp(c->mem.status, "Opening")==0 && strcmp(snap->status, "Open")==0) ||
+            (strcmp(c->mem.status, "Closing")==0 && strcmp(snap->status, "Closed")==0) ||
+            (strcmp(c->mem.current_floor, snap->current_floor)!=0)) {
+                c->delay = us_diff(&c->status_tv, current_tv);
+        }
+        c->status_tv = *current_tv;
+    }
+    if (memcmp(&c->mem, snap, sizeof(*snap)) != 0) {
+        c->dirty = 1;
+    }
+    c->mem = *snap;
+
+    // Dynamically resize
+    int curr_floor = fti(c->mem.current_floor);
+    highest = MAX(highest, curr_floor);
+    lowest = MIN(lowest, curr_floor);
+    int dest_floor = fti(c->mem.destination_floor);
+    highest = MAX(highest, dest_floor);
+    lowest = MIN(lowest, dest_floor);
+}
+
+// 1 if a /dev/shm entry is a car's segment. Cars also keep their latency
+// page and event trace there, which aren't cars
+int is_car_segment(const char *name)
+{
+    if (strncmp(name, "car", 3) != 0) {
+        return 0;
+    }
+    const char *extras[] = {"_latency", "_trace"};
+    size_t len = strlen(name);
+    for (size_t i = 0; i < sizeof(extras) / sizeof(extras[0]); i++) {
+        size_t extra = strlen(extras[i]);
+        if (len > extra && strcmp(name + len - extra, extras[i]) == 0) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// map the segment of car 'name' (without the leading /) and add the car.
+// returns its index, or -1 if it isn't a car
+int open_car(const char *name, const struct timeval *current_tv)
+{
+    char shmname[257];
+    snprintf(shmname, sizeof(shmname), "/%s", name);
+    int fd = shm_open(shmname, O_RDWR, 0);
+    if (fd == -1) {
+        return -1;
+    }
+    // Cars built against the original layout create smaller segments
+    struct stat st;
+    size_t mapped = fstat(fd, &st) == -1 ? 0 : car_shm_map_size(st.st_size);
+    if (mapped == 0) {
+        close(fd);
+        return -1;
+    }
+    car_shared_mem *shm = mmap(0, mapped, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (shm == MAP_FAILED) {
+        return -1;
+    }
+    // Take a consistent snapshot without stalling the car
+    car_shm_snapshot snap;
+    if (car_shm_read(shm, mapped, &snap) != 0) {
+        munmap(shm, mapped);
+        return -1; // Its mutex can't be recovered
+    }
+
+    int i = find_car(name);
+    if (i >= 0) {
+        // Replaced by a new car of the same name
+        munmap(cars[i].shm, cars[i].mapped);
+    } else {
+        i = add_car(name, &snap, current_tv);
+    }
+    struct carinfo *c = &cars[i];
+    c->shm = shm;
+    c->mapped = mapped;
+    c->seq = car_shm_has_seqlock(shm, mapped) ? __atomic_load_n(&shm->seq, __ATOMIC_ACQUIRE) : 0;
+    update_car(c, &snap, current_tv);
+    c->dirty = 1;
+    return i;
+}
+
+// apply the cars that started and exited since the last frame
+void read_inotify(const struct timeval *current_tv)
+{
+    char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    for (;;) {
+        ssize_t len = read(inotify_fd, buf, sizeof(buf));
+        if (len <= 0) {
+            break;
+        }
+        for (char *p = buf; p < buf + len; p += sizeof(struct inotify_event) + ((struct inotify_event *)p)->len) {
+            const struct inotify_event *e = (const struct inotify_event *)p;
+            if (e->len == 0 || !is_car_segment(e->name)) {
+                continue;
+            }
+            if (e->mask & (IN_CREATE | IN_MOVED_TO)) {
+                open_car(e->name, current_tv);
             } else {
-                cars = c->next;
+                int i = find_car(e->name);
+                if (i >= 0) {
+                    remove_car(i);
+                }
             }
-            struct carinfo *old = c;
-            c = c->next;
-            free(old);
-        } else {
-            prev = c;
-            c = c->next;
         }
     }
 }
 
 void scan_cars(void)
 {
-    {
+    // Get the current time
+    struct timeval current_tv;
+    gettimeofday(&current_tv, NULL);
+
+    static int scanned = 0;
+    if (inotify_fd == -1 || !scanned) {
         // Set existing cars to 'o'. This allows us to keep
         // track of the ones that need to be removed.
-        struct carinfo *c = cars;
-        while (c != NULL) {
-            if (c->state == 'c') c->state = 'o';
-            c = c->next;
+        for (int i = 0; i < car_count; i++) {
+            cars[i].state = 'o';
         }
-    }
 
-    // Get the current time
-    struct timeval current_tv;
-    gettimeofday(&current_tv, NULL);
+        DIR *dir = opendir("/dev/shm");
+        if (dir) {
+            for (;;) {
+                struct dirent *e = readdir(dir);
+                if (!e) break;
 
-    DIR *dir = opendir("/dev/shm");
-    if (dir) {
-        for (;;) {
-            struct dirent *e = readdir(dir);
-            if (!e) break;
-
-            if (strncmp(e->d_name, "car", 3)==0) {
-                struct carinfo *c = get_car_by_name(e->d_name);
-                char shmname[257];
-                sprintf(shmname, "/%s", e->d_name);
-                int fd = shm_open(shmname, O_RDWR, 0);
-                if (fd == -1) {
-                    // Failed to load - skip and keep looping
+                if (!is_car_segment(e->d_name)) {
                     continue;
                 }
-                car_shared_mem *shm = mmap(0, sizeof(*shm), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
-                if (c == NULL) {
-                    c = malloc(sizeof(struct carinfo));
-                    strncpy(c->name, e->d_name, 127);
-
-                    // Insert in alphabetical order
-                    if (cars == NULL || strcmp(e->d_name, cars->name) == -1) {
-                        c->next = cars;
-                        cars = c;
-                    } else {
-                        struct carinfo *t = cars;
-                        while (t != NULL) {
-                            if (t->next == NULL || strcmp(e->d_name, t->next->name) == -1) {
-                                c->next = t->next;
-                                t->next = c;
-                                break;
-                            }
-                            t = t->next;
-                        }
-                    }
-
-                    c->status_tv = current_tv;
-                    c->mem = *shm;
-                    c->delay = 1000000; // Default (1000ms)
+                int i = find_car(e->d_name);
+                if (i >= 0) {
+                    cars[i].state = 'c'; // Still there - read below
+                } else {
+                    open_car(e->d_name, &current_tv);
                 }
-                c->state = 'c';
-                if (strcmp(c->mem.status, shm->status) != 0 || strcmp(c->mem.current_floor, shm->current_floor) != 0) {
-                    if ((strcmp(c->mem.status, "Between")==0 && strcmp(shm->status, "Opening")==0) ||
-                        (strcmp(c->mem.status, "Between")==0 && strcmp(shm->status, "Closed")==0) ||
-                        (strcmp(c->mem.status, "Opening")==0 && strcmp(shm->status, "Open")==0) ||
-                        (strcmp(c->mem.status, "Closing")==0 && strcmp(shm->status, "Closed")==0) ||
-                        (strcmp(c->mem.current_floor, shm->current_floor)!=0)) {
-                            c->delay = us_diff(&c->status_tv, &current_tv);
-                    }
-                    c->status_tv = current_tv;
-                }
-                c->mem = *shm;
-
-                // Dynamically resize
-                int curr_floor = fti(c->mem.current_floor);
-                highest = MAX(highest, curr_floor);
-                lowest = MIN(lowest, curr_floor);
-                int dest_floor = fti(c->mem.destination_floor);
-                highest = MAX(highest, dest_floor);
-                lowest = MIN(lowest, dest_floor);
-
-                munmap(shm, sizeof(*shm));
-                close(fd);
             }
+
+            closedir(dir);
+        }
+
+        cleanup();
+        scanned = 1;
+    } else {
+        read_inotify(&current_tv);
+    }
+
+    // Reread the cars whose state has changed since the last frame
+    for (int i = 0; i < car_count; i++) {
+        struct carinfo *c = &cars[i];
+        if (car_shm_has_seqlock(c->shm, c->mapped)) {
+            uint32_t seq = __atomic_load_n(&c->shm->seq, __ATOMIC_ACQUIRE);
+            if (seq == c->seq) {
+                continue;
+            }
+            c->seq = seq;
         }
+        car_shm_snapshot snap;
+        if (car_shm_read(c->shm, c->mapped, &snap) != 0) {
+            continue; // Shown as it was last seen
+        }
+        update_car(c, &snap, &current_tv);
+    }
+}
 
-        closedir(dir);
+// map the fleet registry. returns 0 on success, -1 if there isn't one yet
+int map_registry(void)
+{
+    int fd = shm_open(FLEET_SHM_NAME, O_RDWR, 0);
+    if (fd == -1) {
+        return -1;
+    }
+    struct stat st;
+    if (fstat(fd, &st) == -1 || (size_t)st.st_size < sizeof(fleet_shm)) {
+        close(fd);
+        return -1;
+    }
+    // Mapped for writing so the display can count itself in the watchers
+    fleet_shm *f = mmap(0, sizeof(fleet_shm), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (f == MAP_FAILED) {
+        return -1;
     }
+    if (!fleet_shm_valid(f, sizeof(fleet_shm))) {
+        munmap(f, sizeof(fleet_shm));
+        return -1;
+    }
+    fleet_shm_watch(f, 1);
+    __atomic_store_n(&fleet, f, __ATOMIC_RELEASE);
+    return 0;
+}
 
-    cleanup();
+// Waits for the cars' changes to the registry and wakes the display. The
+// registry may not exist yet, in which case the display polls for it and
+// the watcher waits until it has been mapped
+void *watch_registry(void *arg)
+{
+    fleet_shm *f;
+    while ((f = __atomic_load_n(&fleet, __ATOMIC_ACQUIRE)) == NULL) {
+        usleep(REFRESH_DELAY);
+    }
+    uint32_t seen = fleet_shm_changes(f);
+    write(wake_pipe[1], "", 1);
+    for (;;) {
+        fleet_shm_wait(f, seen, NULL);
+        uint32_t changes = fleet_shm_changes(f);
+        if (changes != seen) {
+            seen = changes;
+            write(wake_pipe[1], "", 1); // A full pipe already has a wakeup waiting
+        }
+    }
+    return NULL;
+}
+
+void start_watcher(void)
+{
+    if (pipe(wake_pipe) == -1) {
+        perror("pipe()");
+        exit(1);
+    }
+    fcntl(wake_pipe[0], F_SETFL, O_NONBLOCK);
+    fcntl(wake_pipe[1], F_SETFL, O_NONBLOCK);
+    pthread_t watcher;
+    if (pthread_create(&watcher, NULL, watch_registry, NULL) != 0) {
+        perror("pthread_create()");
+        exit(1);
+    }
+    pthread_detach(watcher);
+}
+
+void scan_registry(void)
+{
+    if (fleet == NULL && map_registry() == -1) {
+        return;
+    }
+
+    struct timeval current_tv;
+    gettimeofday(&current_tv, NULL);
+
+    // The set of slots in use only changes with the generation - otherwise
+    // just the cars already found are read again
+    uint32_t generation = fleet_shm_generation(fleet);
+    if (active_count == -1 || generation != seen_generation) {
+        seen_generation = generation;
+        active_count = 0;
+        for (int i = 0; i < FLEET_SHM_SLOTS; i++) {
+            if (__atomic_load_n(&fleet->slots[i].in_use, __ATOMIC_ACQUIRE)) {
+                active_slots[active_count++] = i;
+            }
+        }
+
+        for (int i = 0; i < car_count; i++) {
+            cars[i].state = 'o';
+        }
+        for (int i = 0; i < active_count; i++) {
+            fleet_slot slot;
+            if (!fleet_shm_read_slot(&fleet->slots[active_slots[i]], &slot)) {
+                continue;
+            }
+            char name[FLEET_NAME_SIZE + 3];
+            snprintf(name, sizeof(name), "car%s", slot.name);
+            car_shm_snapshot snap;
+            fleet_shm_to_snapshot(&slot, &snap);
+            int index = add_car(name, &snap, &current_tv);
+            struct carinfo *c = &cars[index];
+            c->slot = active_slots[i];
+            c->slot_seq = slot.seq;
+            update_car(c, &snap, &current_tv);
+            // The registry has the real delay, so there's nothing to guess
+            c->delay = (int64_t)slot.delay_ms * 1000;
+        }
+        cleanup();
+        return;
+    }
+
+    // Only the slots whose sequence count moved have anything new
+    for (int i = 0; i < car_count; i++) {
+        struct carinfo *c = &cars[i];
+        if (__atomic_load_n(&fleet->slots[c->slot].seq, __ATOMIC_ACQUIRE) == c->slot_seq) {
+            continue;
+        }
+        fleet_slot slot;
+        if (!fleet_shm_read_slot(&fleet->slots[c->slot], &slot)) {
+            continue; // Being released, or busy - the next change will bring it back
+        }
+        c->slot_seq = slot.seq;
+        car_shm_snapshot snap;
+        fleet_shm_to_snapshot(&slot, &snap);
+        update_car(c, &snap, &current_tv);
+        c->delay = (int64_t)slot.delay_ms * 1000;
+    }
 }
@@ -0,0 +1,421 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "sched-sim.h"
+#include "../stop_queue.h"
+#include "../eta_model.h"
+
+// The controller's constants (controller.c)
+#define FLOOR_TIME 1.0
+#define STOP_TIME 3.0
+#define PARK_INTERVAL_US 100000
+#define PARK_IDLE_STOPS 1.0
+
+#define EPOCH_US 1000000    // The virtual clock starts here, so no event is at time 0
+
+enum { CLOSED, OPENING, OPEN, CLOSING, BETWEEN };
+static const char *status_names[] = {"Closed", "Opening", "Open", "Closing", "Between"};
+
+enum { EV_CALL, EV_PHASE, EV_FLOOR, EV_PARK };
+
+typedef struct {
+    int64_t time;           // Virtual microseconds
+    uint64_t seq;           // Events at the same time are handled in the order they were scheduled
+    int kind;
+    int index;              // Passenger for EV_CALL, car otherwise
+    int arg;                // Phase number for EV_PHASE, floor for EV_FLOOR
+} event;
+
+typedef struct {
+    int *items;
+    int count;
+    int capacity;
+} list;
+
+typedef struct {
+    // The car, as car.c behaves
+    int64_t delay_us;
+    int lowest_floor;
+    int highest_floor;
+    int current;
+    int destination;
+    int status;
+    int phase;              // Bumped to cancel the pending phase
+    int phase_pending;
+
+    // The controller's view of it
+    stop_queue queue;
+    eta_model eta;
+    int idle;
+    int64_t idle_since;
+    int park_idle;          // Whether parking last saw the car as idle
+
+    // Passengers given this car
+    list waiting;
+    list riding;
+} sim_car;
+
+static const sched_sim_config *config;
+static sched_sim_passenger *passengers;
+static int64_t *boarded;
+static sim_car *cars;
+static event *heap;
+static int nevents, heap_capacity;
+static uint64_t next_seq;
+static int64_t now;
+static int remaining;
+static int64_t last_exit;
+static park_stats stats;
+static int park_stale;      // A call or status since parking last ran
+
+// EVENT QUEUE (binary heap)
+
+static int before(const event *a, const event *b)
+{
+    return a->time < b->time || (a->time == b->time && a->seq < b->seq);
+}
+
+static void schedule(int64_t time, int kind, int index, int arg)
+{
+    if (nevents == heap_capacity) {
+        heap_capacity = heap_capacity ? heap_capacity * 2 : 1024;
+        heap = realloc(heap, sizeof(event) * heap_capacity);
+        if (!heap) {
+            perror("realloc");
+            exit(1);
+        }
+    }
+    event e = {time, next_seq++, kind, index, arg};
+    int i = nevents++;
+    while (i > 0 && before(&e, &heap[(i - 1) / 2])) {
+        heap[i] = heap[(i - 1) / 2];
+        i = (i - 1) / 2;
+    }
+    heap[i] = e;
+}
+
+static event take(void)
+{
+    event top = heap[0];
+    event last = heap[--nevents];
+    int i = 0;
+    for (;;) {
+        int child = 2 * i + 1;
+        if (child >= nevents) break;
+        if (child + 1 < nevents && before(&heap[child + 1], &heap[child])) child++;
+        if (!before(&heap[child], &last)) break;
+        heap[i] = heap[child];
+        i = child;
+    }
+    heap[i] = last;
+    return top;
+}
+
+static void list_add(list *l, int item)
+{
+    if (l->count == l->capacity) {
+        l->capacity = l->capacity ? l->capacity * 2 : 16;
+        l->items = realloc(l->items, sizeof(int) * l->capacity);
+        if (!l->items) {
+            perror("realloc");
+            exit(1);
+        }
+    }
+    l->items[l->count++] = item;
+}
+
+static int sign(int v)
+{
+    return (v > 0) - (v < 0);
+}
+
+static uint64_t now_ns(void)
+{
+    return (uint64_t)now * 1000;
+}
+
+// PASSENGERS - at every change of a car, the same checks as sim_run()
+
+static void passengers_check(int i)
+{
+    sim_car *c = &cars[i];
+    if (c->status != OPEN) return;
+
+    for (int k = 0; k < c->riding.count; k++) {
+        int p = c->riding.items[k];
+        if (passengers[p].to == c->current) {
+            passengers[p].rode_us = now - boarded[p];
+            c->riding.items[k--] = c->riding.items[--c->riding.count];
+            remaining--;
+            last_exit = now;
+        }
+    }
+
+    int car_dir = sign(c->destination - c->current);
+    for (int k = 0; k < c->waiting.count; k++) {
+        int p = c->waiting.items[k];
+        if (passengers[p].from == c->current && sign(passengers[p].to - passengers[p].from) == car_dir) {
+            passengers[p].waited_us = now - EPOCH_US - passengers[p].arrive_us;
+            boarded[p] = now;
+            c->waiting.items[k--] = c->waiting.items[--c->waiting.count];
+            list_add(&c->riding, p);
+        }
+    }
+}
+
+// CONTROLLER - as controller.c handles statuses, calls and parking
+
+// tell a car to go to the floor at the head of its queue
+static void send_floor(int i)
+{
+    int head;
+    if (stop_queue_head(&cars[i].queue, &head) == 0) {
+        schedule(now, EV_FLOOR, i, head);
+    }
+}
+
+static void controller_status(int i)
+{
+    sim_car *c = &cars[i];
+    eta_model_observe(&c->eta, status_names[c->status], c->current, now_ns());
+    park_stale = 1;
+
+    int opening = c->status == OPENING || c->status == OPEN;
+    stop_queue_set_position(&c->queue, c->current, c->status == BETWEEN, opening);
+    int head;
+    if (opening && stop_queue_head(&c->queue, &head) == 0 && head == c->current) {
+        stop_queue_pop(&c->queue);
+        send_floor(i);
+    }
+
+    if (c->status != CLOSED || c->queue.length > 0) {
+        c->idle = 0;
+    } else if (!c->idle) {
+        c->idle = 1;
+        c->idle_since = now;
+    }
+}
+
+static void controller_call(int p)
+{
+    int n = config->cars;
+    dispatch_car dcars[n];
+    int heads[n];
+    double fleet_floor = 0, fleet_stop = 0;
+    int timed = 0;
+
+    park_stats_record(&stats, passengers[p].from, now_ns());
+    park_stale = 1;
+
+    for (int i = 0; i < n; i++) {
+        if (eta_model_learned(&cars[i].eta)) {
+            double floor_time, stop_time;
+            eta_model_estimate(&cars[i].eta, FLOOR_TIME, STOP_TIME, &floor_time, &stop_time);
+            fleet_floor += floor_time;
+            fleet_stop += stop_time;
+            timed++;
+        }
+    }
+    if (timed > 0) {
+        fleet_floor /= timed;
+        fleet_stop /= timed;
+    } else {
+        fleet_floor = FLOOR_TIME;
+        fleet_stop = STOP_TIME;
+    }
+    for (int i = 0; i < n; i++) {
+        if (stop_queue_head(&cars[i].queue, &heads[i]) == -1) heads[i] = STOP_QUEUE_LOWEST - 1;
+        dcars[i].queue = &cars[i].queue;
+        dcars[i].lowest_floor = cars[i].lowest_floor;
+        dcars[i].highest_floor = cars[i].highest_floor;
+        eta_model_estimate(&cars[i].eta, fleet_floor, fleet_stop, &dcars[i].floor_time, &dcars[i].stop_time);
+    }
+
+    int i = dispatch_assign(dcars, n, passengers[p].from, passengers[p].to, config->cost);
+    if (i == -1) {
+        remaining--; // UNAVAILABLE
+        return;
+    }
+    list_add(&cars[i].waiting, p);
+    int head;
+    if (stop_queue_head(&cars[i].queue, &head) == 0 && head != heads[i]) {
+        send_floor(i);
+    }
+    passengers_check(i); // The car may already be open here
+}
+
+static void controller_park(void)
+{
+    int n = config->cars;
+    park_car pcars[n];
+    int idle = 0, changed = park_stale;
+    for (int i = 0; i < n; i++) {
+        sim_car *c = &cars[i];
+        double floor_time, stop_time;
+        eta_model_estimate(&c->eta, FLOOR_TIME, STOP_TIME, &floor_time, &stop_time);
+        pcars[i].lowest_floor = c->lowest_floor;
+        pcars[i].highest_floor = c->highest_floor;
+        pcars[i].position = c->current;
+        pcars[i].idle = c->idle && c->queue.length == 0 &&
+                        now - c->idle_since >= (int64_t)(PARK_IDLE_STOPS * stop_time * 1e6);
+        pcars[i].target = PARK_STAY;
+        idle += pcars[i].idle;
+        changed |= pcars[i].idle != c->park_idle;
+        c->park_idle = pcars[i].idle;
+    }
+    // Call rates all decay alike, so with no new calls and the same idle cars
+    // at the same floors the policy would choose the same as last time - and
+    // whatever it chose then has since been sent
+    park_stale = 0;
+    if (idle == 0 || !changed) return;
+    config->park(&stats, pcars, n, now_ns());
+    for (int i = 0; i < n; i++) {
+        if (pcars[i].idle && pcars[i].target != PARK_STAY && pcars[i].target != cars[i].current) {
+            schedule(now, EV_FLOOR, i, pcars[i].target);
+            cars[i].idle = 0;
+        }
+    }
+}
+
+// CARS - as car.c's main loop runs them
+
+static void start_phase(int i, int status)
+{
+    sim_car *c = &cars[i];
+    c->status = status;
+    c->phase++;
+    c->phase_pending = 1;
+    schedule(now + c->delay_us, EV_PHASE, i, c->phase);
+}
+
+static void start_moving(int i)
+{
+    sim_car *c = &cars[i];
+    if (!c->phase_pending && c->status == CLOSED && c->current != c->destination) {
+        start_phase(i, BETWEEN);
+    }
+}
+
+// the car has changed - it reports its status and passengers look at it
+static void report(int i)
+{
+    controller_status(i);
+    passengers_check(i);
+}
+
+static void phase_expired(int i)
+{
+    sim_car *c = &cars[i];
+    c->phase_pending = 0;
+    if (c->status == OPENING) {
+        c->status = OPEN;
+        c->phase_pending = 1;
+        schedule(now + c->delay_us, EV_PHASE, i, c->phase);
+    } else if (c->status == OPEN) {
+        start_phase(i, CLOSING);
+    } else if (c->status == CLOSING) {
+        c->status = CLOSED;
+    } else if (c->status == BETWEEN) {
+        c->current += sign(c->destination - c->current);
+        if (c->current != c->destination) {
+            c->phase_pending = 1;
+            schedule(now + c->delay_us, EV_PHASE, i, c->phase);
+        } else {
+            start_phase(i, OPENING);
+        }
+    }
+    start_moving(i);
+    report(i);
+}
+
+// FLOOR from the controller
+static void floor_request(int i, int floor)
+{
+    sim_car *c = &cars[i];
+    int open = floor == c->current && (c->status == CLOSED || c->status == CLOSING);
+    int old_destination = c->destination;
+    c->destination = floor < c->lowest_floor || floor > c->highest_floor ? c->current : floor;
+    int changed = c->destination != old_destination;
+    if (open) {
+        start_phase(i, OPENING);
+        changed = 1;
+    }
+    if (!c->phase_pending && c->status == CLOSED && c->current != c->destination) {
+        start_phase(i, BETWEEN);
+        changed = 1;
+    }
+    if (changed) report(i);
+}
+
+int64_t sched_sim_run(const sched_sim_config *cfg, sched_sim_passenger *p, int npassengers)
+{
+    config = cfg;
+    passengers = p;
+    remaining = npassengers;
+    last_exit = EPOCH_US;
+    nevents = 0;
+    next_seq = 0;
+    boarded = calloc(npassengers, sizeof(int64_t));
+    cars = calloc(cfg->cars, sizeof(sim_car));
+    if (!boarded || !cars) {
+        perror("calloc");
+        exit(1);
+    }
+    park_stats_init(&stats, PARK_HALF_LIFE);
+    park_stale = 1;
+
+    for (int i = 0; i < cfg->cars; i++) {
+        sim_car *c = &cars[i];
+        c->delay_us = (int64_t)cfg->delays_ms[i] * 1000;
+        c->lowest_floor = cfg->lowest_floor;
+        c->highest_floor = cfg->highest_floor;
+        c->current = c->destination = cfg->lowest_floor;
+        c->status = CLOSED;
+        stop_queue_init(&c->queue, cfg->lowest_floor);
+        eta_model_init(&c->eta);
+        c->idle = 1;
+        c->idle_since = EPOCH_US;
+    }
+    int64_t first_call = INT64_MAX;
+    for (int k = 0; k < npassengers; k++) {
+        p[k].waited_us = -1;
+        p[k].rode_us = 0;
+        schedule(EPOCH_US + p[k].arrive_us, EV_CALL, k, 0);
+        if (p[k].arrive_us < first_call) first_call = p[k].arrive_us;
+    }
+    if (cfg->park && npassengers > 0) {
+        schedule(EPOCH_US + first_call, EV_PARK, 0, 0);
+    }
+
+    while (nevents > 0 && remaining > 0) {
+        event e = take();
+        now = e.time;
+        switch (e.kind) {
+        case EV_CALL:
+            controller_call(e.index);
+            break;
+        case EV_PHASE:
+            if (e.arg == cars[e.index].phase) phase_expired(e.index);
+            break;
+        case EV_FLOOR:
+            floor_request(e.index, e.arg);
+            break;
+        case EV_PARK:
+            controller_park();
+            if (nevents > 0) {
+                schedule(now + PARK_INTERVAL_US, EV_PARK, 0, 0); // Until everything has stopped
+            }
+            break;
+        }
+    }
+    for (int i = 0; i < cfg->cars; i++) {
+        free(cars[i].waiting.items);
+        free(cars[i].riding.items);
+    }
+    free(cars);
+    free(boarded);
+    free(heap);
+    heap = NULL;
+    heap_capacity = 0;
+    return last_exit - EPOCH_US;
+}
@@ -0,0 +1,40 @@
+#ifndef SCHED_SIM_H
+#define SCHED_SIM_H
+
+#include <stdint.h>
+#include "../dispatch.h"
+#include "../park.h"
+
+// Discrete-event simulation of the controller and its cars for test-sched
+// (--simulate 1).
+//
+// The controller's own dispatcher, stop queues, learned timings and parking
+// policies are driven the way controller.c drives them, but the cars are
+// state machines with car.c's phases and the clock is virtual, so a day of
+// traffic runs in seconds. FLOOR requests, status updates and call replies
+// are delivered instantly - the results show the policy and nothing else.
+// Passengers board and leave by the same rules as test-sched's passenger
+// threads.
+
+typedef struct {
+    int cars;
+    const int *delays_ms;       // Phase delay of each car
+    int lowest_floor;           // Floors in the controller's numbering (B1 = 0)
+    int highest_floor;
+    dispatch_cost_fn cost;
+    park_fn park;               // NULL leaves idle cars where they are
+} sched_sim_config;
+
+typedef struct {
+    int from;
+    int to;
+    int64_t arrive_us;          // When the passenger calls a car
+    int64_t waited_us;          // Set by the run - call to boarding, -1 if never picked up
+    int64_t rode_us;            // Set by the run - boarding to leaving
+} sched_sim_passenger;
+
+// simulate every passenger's journey. returns the virtual time in
+// microseconds at which the last one left their car
+int64_t sched_sim_run(const sched_sim_config *config, sched_sim_passenger *passengers, int npassengers);
+
+#endif
@@ -0,0 +1,100 @@
+// Tester for the controller's dispatch engine (dispatch.c, no processes)
+// Checks which car each call of a batch goes to, the stops that end up in
+// the cars' queues, and that a batch does better than assigning the same
+// calls one at a time.
+
+#include "../dispatch.h"
+#include "check.h"
+
+#define FLOOR_TIME 1.0
+#define STOP_TIME 5.0
+
+static stop_queue queues[2];
+static dispatch_car cars[2];
+
+// two idle cars, A (0) and B (1), serving floors 1 to 20
+static void park(int a, int b)
+{
+    stop_queue_init(&queues[0], a);
+    stop_queue_init(&queues[1], b);
+    for (int i = 0; i < 2; i++) {
+        cars[i].queue = &queues[i];
+        cars[i].lowest_floor = 1;
+        cars[i].highest_floor = 20;
+        cars[i].floor_time = FLOOR_TIME;
+        cars[i].stop_time = STOP_TIME;
+    }
+}
+
+int main(void)
+{
+    const dispatch_policy *eta = dispatch_find_policy("eta");
+    const dispatch_policy *balance = dispatch_find_policy("balance");
+    check("the eta policy exists", 1, eta != NULL);
+    check("the balance policy exists", 1, balance != NULL);
+    check("unknown policies aren't found", 1, dispatch_find_policy("fastest") == NULL);
+    if (eta == NULL || balance == NULL) {
+        return check_done();
+    }
+
+    // A at 1, B at 10. Both calls are closest to A, but 2 to 3 has more to
+    // lose, so it gets A and 4 to 5 goes to B rather than waiting behind it
+    park(1, 10);
+    dispatch_call batch[] = {{4, 5, -2}, {2, 3, -2}};
+    dispatch_assign_batch(cars, 2, batch, 2, eta->cost);
+    check("4 to 5 goes to B", 1, batch[0].car);
+    check("2 to 3 goes to A", 0, batch[1].car);
+    check_queue("A's stops after the batch", &queues[0], "2 3");
+    check_queue("B's stops after the batch", &queues[1], "4 5");
+
+    // One at a time in arrival order, 4 to 5 takes A and 2 to 3 then joins it
+    park(1, 10);
+    int first = dispatch_assign(cars, 2, 4, 5, eta->cost);
+    int second = dispatch_assign(cars, 2, 2, 3, eta->cost);
+    check("one at a time, 4 to 5 goes to A", 0, first);
+    check("one at a time, 2 to 3 goes to A too", 0, second);
+    check_queue("A's stops one at a time", &queues[0], "2 3 4 5");
+    // There 4 to 5 waits for the stops at 2 and 3 - longer than B would take
+    stop_queue_cost cost;
+    park(1, 10);
+    stop_queue_add(&queues[0], 2, 3);
+    stop_queue_probe(&queues[0], 4, 5, &cost);
+    check("behind 2 to 3, A reaches 4 after 3 floors", 3, cost.pickup_floors);
+    check("behind 2 to 3, A stops twice before 4", 2, cost.pickup_stops);
+    check("so 4 to 5 waits longer on A than on B", 1,
+          cost.pickup_floors * FLOOR_TIME + cost.pickup_stops * STOP_TIME > (10 - 4) * FLOOR_TIME);
+
+    // Calls no car serves are left unassigned, the rest are still placed
+    park(1, 10);
+    dispatch_call mixed[] = {{3, 25, -2}, {12, 15, -2}, {0, 4, -2}};
+    dispatch_assign_batch(cars, 2, mixed, 3, eta->cost);
+    check("a call above every car is unassigned", -1, mixed[0].car);
+    check("12 to 15 goes to B", 1, mixed[1].car);
+    check("a call below every car is unassigned", -1, mixed[2].car);
+    check_queue("A has no stops", &queues[0], "");
+    check_queue("B has 12 to 15", &queues[1], "12 15");
+
+    // A car that doesn't serve a floor is never chosen, even if it is closer
+    park(1, 10);
+    cars[1].highest_floor = 9;
+    dispatch_call high[] = {{9, 11, -2}};
+    dispatch_assign_batch(cars, 2, high, 1, eta->cost);
+    check("a call past B's floors goes to A", 0, high[0].car);
+
+    // From the same floor, eta keeps both calls on one car and balance
+    // spreads them across the fleet
+    park(1, 1);
+    dispatch_call same[] = {{5, 6, -2}, {5, 7, -2}};
+    dispatch_assign_batch(cars, 2, same, 2, eta->cost);
+    check("eta puts the first call on A", 0, same[0].car);
+    check("eta puts the second call on A", 0, same[1].car);
+    check_queue("A's stops under eta", &queues[0], "5 6 7");
+    park(1, 1);
+    same[0].car = same[1].car = -2;
+    dispatch_assign_batch(cars, 2, same, 2, balance->cost);
+    check("balance gives the calls different cars", 1, same[0].car != same[1].car);
+    check("balance leaves A two stops", 2, queues[0].length);
+    check("balance leaves B two stops", 2, queues[1].length);
+
+    return check_done();
+}
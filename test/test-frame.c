@@ -0,0 +1,136 @@
+// Tester for the framing layer (frame.c, over a socketpair, no processes)
+// Frames are written a few bytes at a time to check that frame_fill() and
+// frame_next() put partial frames back together, and oversized frames and a
+// full buffer are checked for.
+
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include "../frame.h"
+#include "check.h"
+
+// write the raw bytes of a frame: its header, then its body
+static size_t encode(char *out, const char *body)
+{
+    uint32_t nlen = htonl(strlen(body));
+    memcpy(out, &nlen, sizeof(nlen));
+    memcpy(out + sizeof(nlen), body, strlen(body));
+    return sizeof(nlen) + strlen(body);
+}
+
+int main(void)
+{
+    int fds[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == -1) {
+        perror("socketpair()");
+        return 1;
+    }
+    fcntl(fds[1], F_SETFL, O_NONBLOCK);
+
+    char storage[64];
+    char msg[32];
+    char raw[128];
+    frame_buffer in;
+    frame_buffer_init(&in, storage, sizeof(storage));
+
+    // Nothing sent yet
+    errno = 0;
+    check("frame_fill() on an empty socket", -1, frame_fill(fds[1], &in));
+    check("errno is EAGAIN", EAGAIN, errno);
+    check("no frame in an empty buffer", 0, frame_next(&in, msg, sizeof(msg)));
+
+    // A frame arriving a piece at a time: 2 bytes of header, the rest of the
+    // header and part of the body, then the rest of the body
+    size_t n = encode(raw, "FLOOR 12");
+    write(fds[0], raw, 2);
+    check("frame_fill() reads a partial header", 2, frame_fill(fds[1], &in));
+    check("a partial header isn't a frame", 0, frame_next(&in, msg, sizeof(msg)));
+    write(fds[0], raw + 2, 5);
+    frame_fill(fds[1], &in);
+    check("a partial body isn't a frame", 0, frame_next(&in, msg, sizeof(msg)));
+    check("nothing is taken from a partial frame", 7, in.len);
+    write(fds[0], raw + 7, n - 7);
+    frame_fill(fds[1], &in);
+    check("the completed frame is taken", 1, frame_next(&in, msg, sizeof(msg)));
+    check_str("the completed frame's body", "FLOOR 12", msg);
+    check("the buffer is empty afterwards", 0, in.len);
+
+    // Several frames from one read, the last of them cut short
+    n = encode(raw, "CAR A 1 5");
+    n += encode(raw + n, "");
+    n += encode(raw + n, "STATUS Open 3 3");
+    size_t cut = encode(raw + n, "CALL 1 2") - 3;
+    write(fds[0], raw, n + cut);
+    check("one read takes every byte sent", n + cut, frame_fill(fds[1], &in));
+    frame_next(&in, msg, sizeof(msg));
+    check_str("first of three frames", "CAR A 1 5", msg);
+    check("an empty frame is a frame", 1, frame_next(&in, msg, sizeof(msg)));
+    check_str("the empty frame's body", "", msg);
+    frame_next(&in, msg, sizeof(msg));
+    check_str("third of three frames", "STATUS Open 3 3", msg);
+    check("the cut frame waits for the rest", 0, frame_next(&in, msg, sizeof(msg)));
+    write(fds[0], raw + n + cut, 3);
+    frame_fill(fds[1], &in);
+    frame_next(&in, msg, sizeof(msg));
+    check_str("the cut frame once the rest arrives", "CALL 1 2", msg);
+
+    // A frame whose body won't fit in 'msg' is refused and left in place
+    n = encode(raw, "a body that is too long for msg");
+    write(fds[0], raw, n);
+    frame_fill(fds[1], &in);
+    check("an oversized frame is refused", -1, frame_next(&in, msg, 16));
+    check("the oversized frame stays in the buffer", n, in.len);
+    check("it is taken when there is room", 1, frame_next(&in, msg, sizeof(msg)));
+    check_str("the oversized frame's body", "a body that is too long for msg", msg);
+
+    // A header announcing more than the buffer can hold fills it up
+    uint32_t huge = htonl(1000);
+    write(fds[0], &huge, sizeof(huge));
+    memset(raw, 'x', sizeof(raw));
+    write(fds[0], raw, sizeof(raw));
+    while (frame_fill(fds[1], &in) > 0) {
+        ;
+    }
+    check("the buffer fills up", sizeof(storage), in.len);
+    check("the too large frame is refused", -1, frame_next(&in, msg, sizeof(msg)));
+    errno = 0;
+    check("frame_fill() on a full buffer", -1, frame_fill(fds[1], &in));
+    check("errno is ENOBUFS", ENOBUFS, errno);
+    frame_buffer_clear(&in);
+    while (read(fds[1], raw, sizeof(raw)) > 0) {
+        ;
+    }
+
+    // Queued frames go out together. The queue refuses what it can't hold
+    char out_storage[32];
+    frame_buffer out;
+    frame_buffer_init(&out, out_storage, sizeof(out_storage));
+    check("queue a frame", 0, frame_queue(&out, "FLOOR 3", 7));
+    check("queue a second frame", 0, frame_queue(&out, "FLOOR 4", 7));
+    check("a frame past the end is refused", -1, frame_queue(&out, "FLOOR 5 and more", 16));
+    check("frame_flush() succeeds", 0, frame_flush(fds[0], &out));
+    check("frame_flush() empties the queue", 0, out.len);
+    ssize_t len = frame_recv(fds[1], &in, msg, sizeof(msg));
+    check("frame_recv() returns the body length", 7, len);
+    check_str("first queued frame", "FLOOR 3", msg);
+    check("the second came with it", 1, frame_next(&in, msg, sizeof(msg)));
+    check_str("second queued frame", "FLOOR 4", msg);
+
+    // frame_send() with a body longer than the buffer of the other end
+    check("frame_send() succeeds", 0, frame_send(fds[0], "0123456789012345678901234567890123456789"));
+    check("frame_recv() refuses what won't fit", -1, frame_recv(fds[1], &in, msg, sizeof(msg)));
+    frame_buffer_clear(&in);
+    while (read(fds[1], raw, sizeof(raw)) > 0) {
+        ;
+    }
+
+    // The peer closing the connection
+    close(fds[0]);
+    check("frame_fill() after the peer closes", 0, frame_fill(fds[1], &in));
+    check("frame_recv() after the peer closes", -1, frame_recv(fds[1], &in, msg, sizeof(msg)));
+    close(fds[1]);
+
+    return check_done();
+}
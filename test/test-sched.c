@@ -1,5 +1,8 @@
 #include "shared.h"
 #include <sys/time.h>
+#include "sched-sim.h"
+#include "traffic.h"
+#include "../floor_label.h"
 
 // This is a multi-component tester that attempts to measure
 // the multi-car scheduling performance of the controller
@@ -9,7 +12,8 @@
 // - controller
 
 // You can control the simulation with the following arguments
-// --car-delay (value)
+// --car-delay (value, or a comma separated list - car n gets the nth delay,
+//              starting again from the first if there are more cars)
 // --cars (value)
 // --num-passengers (value)
 // --lowest-floor (floor name)
@@ -18,6 +22,22 @@
 // --sim-end (value)
 // --histogram-len (number of bars on histogram)
 // --svg (filename - produces an animated svg)
+// --lobby-share (percent of passengers starting from the lowest floor, the
+//                rest start from a random floor)
+// --park (parking policy passed to the controller)
+// --dispatch (dispatch policy passed to the controller)
+// --simulate (1 to run the controller's dispatch against simulated cars on a
+//             virtual clock instead of starting the real programs - fast
+//             enough for days of traffic, e.g. --num-passengers 100000
+//             --sim-end 86400000)
+// --seed (value - the same seed gives the same passengers, default the time)
+// --profile (uniform, up-peak, down-peak or lunch - see traffic.h)
+// --record (filename - saves the passengers to a trace file)
+// --replay (filename - takes the passengers from a trace file instead of
+//           generating them, ignoring --num-passengers, --profile and
+//           --sim-start/--sim-end)
+// --results (filename - writes the results as JSON, or CSV if the name ends
+//            in .csv, for comparing runs)
 
 #define CAR_DELAY       "100" // string, milliseconds
 #define CARS            1
@@ -37,7 +57,7 @@ static double svg_timescale = 10.0;
 
 typedef struct {
   char from[4], to[4], col[4];
-  int delay;
+  int64_t delay;
   int idx;
   int64_t time_waiting;
   int64_t time_in_elevator;
@@ -62,6 +82,9 @@ typedef struct {
 } car_tracker;
 
 pid_t controller(void);
+void run_simulation(void);
+traffic_passenger *make_traffic(void);
+void write_results(int);
 void car(car_tracker *, const char *, const char *, const char *, const char *);
 int get_dir(int, int);
 int fti(const char *);
@@ -99,14 +122,24 @@ static int sim_end = SIM_END;
 static int histogram_len = HISTOGRAM_LEN;
 static const char *svg = NULL;
 static const char *svg_anim_id = SVG_ANIM_ID;
+static int lobby_share = -1;
+static const char *park = NULL;
+static const char *dispatch = NULL;
+static int simulate = 0;
+static uint64_t seed;
+static int seeded = 0;
+static const char *profile = "uniform";
+static const char *record = NULL;
+static const char *replay = NULL;
+static const char *results = NULL;
 
 static car_tracker *car_trackers;
 static passenger_data *pdata;
 static struct timeval start_tv;
 
-int rand_between(int min, int max) {
+int64_t rand_between(int64_t min, int64_t max) {
     int64_t v = rand();
-    return v * (max - min + 1) / ((int64_t)RAND_MAX + 1) + min;
+    return (__int128)v * (max - min + 1) / ((int64_t)RAND_MAX + 1) + min;
 }
 
 void draw_histogram(histogram *h) {
@@ -128,6 +161,204 @@ void draw_histogram(histogram *h) {
     }
 }
 
+// the delay for car 'index' from the --car-delay list
+void car_delay_for(int index, char *out, size_t out_size)
+{
+    int ndelays = 1;
+    for (const char *p = car_delay; *p; p++) {
+        if (*p == ',') ndelays++;
+    }
+    const char *p = car_delay;
+    for (int skip = index % ndelays; skip > 0; skip--) {
+        p = strchr(p, ',') + 1;
+    }
+    size_t len = strcspn(p, ",");
+    if (len >= out_size) len = out_size - 1;
+    memcpy(out, p, len);
+    out[len] = '\0';
+}
+
+// drive the controller's dispatch with simulated cars instead of starting the
+// real programs. Passengers that never got to their floor are left out of the
+// results
+void run_simulation(void)
+{
+    const dispatch_policy *policy = dispatch_find_policy(dispatch ? dispatch : "journey");
+    if (!policy) {
+        fprintf(stderr, "Unknown dispatch policy: %s\n", dispatch);
+        exit(1);
+    }
+    park_fn parking = NULL;
+    if (park) {
+        const park_policy *p = park_find_policy(park);
+        if (!p) {
+            fprintf(stderr, "Unknown parking policy: %s\n", park);
+            exit(1);
+        }
+        parking = p->park;
+    }
+
+    int *delays = malloc(sizeof(int) * cars);
+    for (int i = 0; i < cars; i++) {
+        char delay[16];
+        car_delay_for(i, delay, sizeof(delay));
+        delays[i] = atoi(delay);
+    }
+    sched_sim_config config = {cars, delays, fti(lowest_floor), fti(highest_floor), policy->cost, parking};
+    sched_sim_passenger *sp = malloc(sizeof(sched_sim_passenger) * num_passengers);
+    for (int i = 0; i < num_passengers; i++) {
+        sp[i].from = fti(pdata[i].from);
+        sp[i].to = fti(pdata[i].to);
+        sp[i].arrive_us = pdata[i].delay;
+    }
+
+    struct timeval began, finished;
+    gettimeofday(&began, NULL);
+    int64_t end = sched_sim_run(&config, sp, num_passengers);
+    gettimeofday(&finished, NULL);
+
+    int served = 0;
+    for (int i = 0; i < num_passengers; i++) {
+        if (sp[i].waited_us == -1) continue;
+        pdata[served] = pdata[i];
+        pdata[served].time_waiting = sp[i].waited_us;
+        pdata[served].time_in_elevator = sp[i].rode_us;
+        served++;
+    }
+    printf("Simulated %d passengers over %.1fs in %.2fs\n", num_passengers,
+           (double)end / 1000000.0, (double)us_diff(&began, &finished) / 1000000.0);
+    if (served < num_passengers) {
+        printf("%d passengers were never picked up\n", num_passengers - served);
+    }
+    num_passengers = served;
+
+    free(sp);
+    free(delays);
+}
+
+// the passengers for this run, from --replay or generated from --profile,
+// saved to --record if asked
+traffic_passenger *make_traffic(void)
+{
+    traffic_passenger *traffic;
+    if (replay) {
+        traffic = traffic_read(replay, &num_passengers);
+        if (!traffic) {
+            perror(replay);
+            exit(1);
+        }
+        for (int i = 0; i < num_passengers; i++) {
+            if (traffic[i].from < fti(lowest_floor) || traffic[i].from > fti(highest_floor) ||
+                traffic[i].to < fti(lowest_floor) || traffic[i].to > fti(highest_floor) ||
+                traffic[i].from == traffic[i].to) {
+                fprintf(stderr, "%s: passenger %d is outside --lowest-floor to --highest-floor\n", replay, i);
+                exit(1);
+            }
+        }
+    } else {
+        if (fti(highest_floor) <= fti(lowest_floor)) {
+            fprintf(stderr, "--highest-floor must be above --lowest-floor\n");
+            exit(1);
+        }
+        traffic = malloc(sizeof(traffic_passenger) * (num_passengers ? num_passengers : 1));
+        if (traffic_generate(profile, fti(lowest_floor), fti(highest_floor), lobby_share,
+                             (int64_t)sim_start * 1000, (int64_t)sim_end * 1000, seed,
+                             traffic, num_passengers) == -1) {
+            fprintf(stderr, "Unknown traffic profile: %s\n", profile);
+            exit(1);
+        }
+        printf("Traffic: %s, seed %llu\n", profile, (unsigned long long)seed);
+    }
+    if (record && traffic_write(record, traffic, num_passengers) == -1) {
+        perror(record);
+        exit(1);
+    }
+    return traffic;
+}
+
+static int compare_int64(const void *a, const void *b)
+{
+    int64_t x = *(const int64_t *)a, y = *(const int64_t *)b;
+    return (x > y) - (x < y);
+}
+
+// nearest-rank percentile of sorted values, in milliseconds
+static double percentile(const int64_t *sorted, int n, double p)
+{
+    int rank = (int)ceil(p / 100.0 * n);
+    if (rank < 1) rank = 1;
+    return (double)sorted[rank - 1] / 1000.0;
+}
+
+// write the mean and percentiles of the wait and ride times to --results
+void write_results(int generated)
+{
+    static const double points[] = {50, 90, 95, 99, 100};
+    const int npoints = sizeof(points) / sizeof(points[0]);
+    int n = num_passengers;
+    int64_t *waits = malloc(sizeof(int64_t) * (n ? n : 1));
+    int64_t *rides = malloc(sizeof(int64_t) * (n ? n : 1));
+    double wait_total = 0, ride_total = 0;
+    for (int i = 0; i < n; i++) {
+        waits[i] = pdata[i].time_waiting;
+        rides[i] = pdata[i].time_in_elevator;
+        wait_total += waits[i];
+        ride_total += rides[i];
+    }
+    qsort(waits, n, sizeof(int64_t), compare_int64);
+    qsort(rides, n, sizeof(int64_t), compare_int64);
+
+    FILE *fp = fopen(results, "w");
+    if (!fp) {
+        perror(results);
+        exit(1);
+    }
+    size_t len = strlen(results);
+    int csv = len >= 4 && strcmp(results + len - 4, ".csv") == 0;
+    const char *names[] = {"wait", "ride"};
+    const int64_t *values[] = {waits, rides};
+    const double totals[] = {wait_total, ride_total};
+    if (csv) {
+        fprintf(fp, "metric,passengers,served,mean_ms,p50_ms,p90_ms,p95_ms,p99_ms,max_ms\n");
+        for (int m = 0; m < 2; m++) {
+            fprintf(fp, "%s,%d,%d,%.3f", names[m], generated, n, n ? totals[m] / n / 1000.0 : 0.0);
+            for (int p = 0; p < npoints; p++) {
+                fprintf(fp, ",%.3f", n ? percentile(values[m], n, points[p]) : 0.0);
+            }
+            fprintf(fp, "\n");
+        }
+    } else {
+        if (replay) {
+            fprintf(fp, "{\n  \"trace\": \"%s\",\n", replay);
+        } else {
+            fprintf(fp, "{\n  \"profile\": \"%s\",\n  \"seed\": %llu,\n", profile, (unsigned long long)seed);
+        }
+        fprintf(fp, "  \"dispatch\": \"%s\",\n  \"park\": \"%s\",\n", dispatch ? dispatch : "journey",
+                park ? park : "none");
+        fprintf(fp, "  \"simulated\": %s,\n  \"cars\": %d,\n", simulate ? "true" : "false", cars);
+        fprintf(fp, "  \"passengers\": %d,\n  \"served\": %d", generated, n);
+        for (int m = 0; m < 2; m++) {
+            fprintf(fp, ",\n  \"%s\": {\"mean_ms\": %.3f", names[m], n ? totals[m] / n / 1000.0 : 0.0);
+            for (int p = 0; p < npoints; p++) {
+                double v = n ? percentile(values[m], n, points[p]) : 0.0;
+                if (points[p] == 100) {
+                    fprintf(fp, ", \"max_ms\": %.3f", v);
+                } else {
+                    fprintf(fp, ", \"p%d_ms\": %.3f", (int)points[p], v);
+                }
+            }
+            fprintf(fp, "}");
+        }
+        fprintf(fp, "\n}\n");
+    }
+    if (fclose(fp) != 0) {
+        perror(results);
+        exit(1);
+    }
+    free(waits);
+    free(rides);
+}
+
 void init_args(int argc, char **argv)
 {
     for (int i = 1; i < argc - 1; i+=2) {
@@ -142,6 +373,15 @@ void init_args(int argc, char **argv)
         else if (strcmp(argv[i], "--svg")==0) svg = argv[i+1];
         else if (strcmp(argv[i], "--svg-anim-id")==0) svg_anim_id = argv[i+1];
         else if (strcmp(argv[i], "--svg-timescale")==0) svg_timescale = atof(argv[i+1]);
+        else if (strcmp(argv[i], "--lobby-share")==0) lobby_share = atoi(argv[i+1]);
+        else if (strcmp(argv[i], "--park")==0) park = argv[i+1];
+        else if (strcmp(argv[i], "--dispatch")==0) dispatch = argv[i+1];
+        else if (strcmp(argv[i], "--simulate")==0) simulate = atoi(argv[i+1]);
+        else if (strcmp(argv[i], "--seed")==0) { seed = strtoull(argv[i+1], NULL, 10); seeded = 1; }
+        else if (strcmp(argv[i], "--profile")==0) profile = argv[i+1];
+        else if (strcmp(argv[i], "--record")==0) record = argv[i+1];
+        else if (strcmp(argv[i], "--replay")==0) replay = argv[i+1];
+        else if (strcmp(argv[i], "--results")==0) results = argv[i+1];
         else {
             fprintf(stderr, "Invalid parameter: %s\n", argv[i]);
             exit(1);
@@ -152,32 +392,43 @@ void init_args(int argc, char **argv)
 int main(int argc, char **argv)
 {
     init_args(argc, argv);
+    if (simulate && svg) {
+        fprintf(stderr, "--svg is ignored with --simulate\n");
+        svg = NULL;
+    }
 
-    srand(time(NULL));
+    if (!seeded) seed = time(NULL);
+    srand(seed);
+    traffic_passenger *traffic = make_traffic();
     gettimeofday(&start_tv, NULL);
-    pid_t controller_pid = controller();
-    car_trackers = malloc(sizeof(car_tracker) * cars);
-    for (int i = 0; i < cars; i++) {
-        char carname[16];
-        sprintf(carname, "Sim%d", i + 1);
-        car(&car_trackers[i], carname, lowest_floor, highest_floor, car_delay);
+    pid_t controller_pid = 0;
+    if (!simulate) {
+        controller_pid = controller();
+        car_trackers = malloc(sizeof(car_tracker) * cars);
+        for (int i = 0; i < cars; i++) {
+            char carname[16];
+            sprintf(carname, "Sim%d", i + 1);
+            char delay[16];
+            car_delay_for(i, delay, sizeof(delay));
+            car(&car_trackers[i], carname, lowest_floor, highest_floor, delay);
+        }
     }
-    pthread_t passengers[num_passengers];
+    pthread_t *passengers = malloc(sizeof(pthread_t) * num_passengers);
     pdata = malloc(sizeof(passenger_data) * num_passengers);
     for (int i = 0; i < num_passengers; i++) {
-        itf(pdata[i].from, rand_between(fti(lowest_floor), fti(highest_floor)));
-        for (;;) {
-            itf(pdata[i].to, rand_between(fti(lowest_floor), fti(highest_floor)));
-            if (strcmp(pdata[i].from, pdata[i].to) != 0) break;
-        }
-        pdata[i].delay = rand_between(sim_start * 1000, sim_end * 1000);
+        itf(pdata[i].from, traffic[i].from);
+        itf(pdata[i].to, traffic[i].to);
+        pdata[i].delay = traffic[i].arrive_us;
         int col = rand_between(0, 4095);
         sprintf(pdata[i].col, "%03x", col);
         col = rand_between(0, 2);
         pdata[i].col[col] = '0';
         pdata[i].idx = i;
-        pthread_create(&passengers[i], NULL, sim_run, &pdata[i]);
+        if (!simulate) pthread_create(&passengers[i], NULL, sim_run, &pdata[i]);
     }
+    free(traffic);
+    int generated = num_passengers;
+    if (simulate) run_simulation();
 
     int64_t total_wait_time = 0;
     int64_t total_spent_time = 0;
@@ -186,7 +437,7 @@ int main(int argc, char **argv)
     int64_t max_wait_time = 0;
     int64_t max_spent_time = 0;
     for (int i = 0; i < num_passengers; i++) {
-        pthread_join(passengers[i], NULL);
+        if (!simulate) pthread_join(passengers[i], NULL);
 
         total_wait_time += pdata[i].time_waiting;
         total_spent_time += pdata[i].time_in_elevator;
@@ -224,14 +475,19 @@ int main(int argc, char **argv)
     printf("Longest time: %.2fms\n", (double)max_spent_time / 1000.0);
     draw_histogram(histo_ti);
 
-    for (int i = 0; i < cars; i++) {
-        cleanup_tracker(&car_trackers[i]);
+    if (results) write_results(generated);
+
+    if (!simulate) {
+        for (int i = 0; i < cars; i++) {
+            cleanup_tracker(&car_trackers[i]);
+        }
+        cleanup(controller_pid);
     }
-    cleanup(controller_pid);
 
     svg_write();
 
     free(pdata);
+    free(passengers);
     free(car_trackers);
     return 0;
 }
@@ -312,16 +568,17 @@ int get_dir(int from, int to) {
   return (to - from) / abs(to - from);
 }
 
+// Floor labels go through floor_label.h like everywhere else. A label that
+// isn't a floor counts as B1, as car_shm_read() treats one
 int fti(const char *f)
 {
-    if (f[0] == 'B') return 1-atoi(f+1);
-    else return atoi(f);
+    int floor;
+    return floor_from_label(f, &floor) == 0 ? floor : 0;
 }
 
 void itf(char *out, int f)
 {
-    if (f <= 0) sprintf(out, "B%d", 1-f);
-    else sprintf(out, "%d", f);
+    floor_to_label(f, out, FLOOR_LABEL_SIZE);
 }
 
 int64_t us_diff(const struct timeval *before, const struct timeval *after)
@@ -411,7 +668,8 @@ void *car_tracking_thread(void *p) {
     }
     pthread_mutex_unlock(&shm->mutex);
     pthread_mutex_unlock(&t->mutex);
-    munmap(shm, sizeof(*shm));
+    // Unmapped by cleanup_tracker() - it broadcasts on the segment after
+    // setting 'cancel', which this thread may already have seen
     close(shm_fd);
 
     return NULL;
@@ -434,7 +692,19 @@ pid_t controller(void)
 {
   pid_t pid = fork();
   if (pid == 0) {
-    execlp("./controller", "./controller", NULL);
+    const char *args[6];
+    int n = 0;
+    args[n++] = "./controller";
+    if (park) {
+      args[n++] = "--park";
+      args[n++] = park;
+    }
+    if (dispatch) {
+      args[n++] = "--dispatch";
+      args[n++] = dispatch;
+    }
+    args[n] = NULL;
+    execvp("./controller", (char **)args);
   }
 
   return pid;
@@ -450,6 +720,7 @@ void cleanup_tracker(car_tracker *t)
   pthread_mutex_unlock(&t->mutex);
   pthread_cond_broadcast(&t->shm->cond);
   pthread_join(t->tid, NULL);
+  munmap(t->shm, sizeof(*t->shm));
   kill(t->pid, SIGINT);
 }
 
@@ -0,0 +1,274 @@
+// Tester for the controller's stop queue (stop_queue.c, no processes)
+// Replays the routing of test-controller-4 against the queue itself, plus
+// probing, duplicate stops and the sweep limit, then compares the queue with
+// the controller's old linked list of stops on random calls and car moves.
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include "../stop_queue.h"
+#include "check.h"
+
+// the car reports a status, the way the controller passes it on. Opening at
+// the head of the queue is the car reaching that stop
+static void report(stop_queue *q, const char *status, int floor)
+{
+    int opening = strcmp(status, "Opening") == 0 || strcmp(status, "Open") == 0;
+    stop_queue_set_position(q, floor, strcmp(status, "Between") == 0, opening);
+    int head;
+    if (strcmp(status, "Opening") == 0 && stop_queue_head(q, &head) == 0 && head == floor) {
+        stop_queue_pop(q);
+    }
+}
+
+// THE OLD LIST
+// The controller's queue before stop_queue, kept as the reference for the
+// routing rules. The linked list is an array here, but the walk is the same
+
+typedef struct {
+    int floors[256];
+    int n;
+    int current_floor;
+    int moving;
+    int doors_open;
+} old_list;
+
+static int direction(int from, int to)
+{
+    return (to > from) - (to < from);
+}
+
+static int strictly_between(int a, int floor, int b)
+{
+    return (a < floor && floor < b) || (b < floor && floor < a);
+}
+
+// insert a stop after index 'prev' (-1 for the head). returns its index
+static int old_insert(old_list *l, int prev, int floor)
+{
+    memmove(&l->floors[prev + 2], &l->floors[prev + 1], (l->n - prev - 1) * sizeof(int));
+    l->floors[prev + 1] = floor;
+    l->n++;
+    return prev + 1;
+}
+
+// find_position() from the old controller.c, walking from 'from_floor' after
+// index 'start'. returns the index to insert after
+static int old_find_position(const old_list *l, int start, int from_floor, int floor, int dir, int pickup, int *existing)
+{
+    int a = from_floor;
+    int prev = start;
+    *existing = 0;
+    for (int b = start + 1; b < l->n; b++) {
+        int seg = direction(a, l->floors[b]);
+        int departure = b + 1 < l->n ? direction(l->floors[b], l->floors[b + 1]) : 0;
+        if (l->floors[b] == floor && (!pickup || departure == dir || departure == 0)) {
+            *existing = 1;
+            return b;
+        }
+        if (seg == dir && strictly_between(a, floor, l->floors[b])) {
+            return prev;
+        }
+        if (departure == -seg && direction(l->floors[b], floor) == seg && (!pickup || departure == dir)) {
+            return prev;
+        }
+        a = l->floors[b];
+        prev = b;
+    }
+    if (prev >= 0 && l->floors[prev] == floor) {
+        *existing = 1;
+    }
+    return prev;
+}
+
+// queue_call() from the old controller.c
+static void old_add(old_list *l, int source, int destination)
+{
+    int dir = direction(source, destination);
+    int pickup = -1;
+    int from_floor = l->current_floor;
+    int existing;
+
+    if (source == l->current_floor && !l->moving && (l->n == 0 || direction(source, l->floors[0]) == dir)) {
+        if (!l->doors_open) {
+            pickup = old_insert(l, -1, source);
+            from_floor = source;
+        }
+    } else {
+        int prev = old_find_position(l, -1, l->current_floor, source, dir, 1, &existing);
+        pickup = existing ? prev : old_insert(l, prev, source);
+        from_floor = source;
+    }
+
+    int prev = old_find_position(l, pickup, from_floor, destination, dir, 0, &existing);
+    if (!existing) {
+        old_insert(l, prev, destination);
+    }
+}
+
+static void old_report(old_list *l, const char *status, int floor)
+{
+    l->current_floor = floor;
+    l->moving = strcmp(status, "Between") == 0;
+    l->doors_open = strcmp(status, "Opening") == 0 || strcmp(status, "Open") == 0;
+    if (l->n > 0 && l->floors[0] == floor && l->doors_open) {
+        memmove(&l->floors[0], &l->floors[1], (l->n - 1) * sizeof(int));
+        l->n--;
+    }
+}
+
+static void old_list_string(const old_list *l, char *out, size_t size)
+{
+    out[0] = '\0';
+    for (int i = 0; i < l->n; i++) {
+        snprintf(out + strlen(out), size - strlen(out), i > 0 ? " %d" : "%d", l->floors[i]);
+    }
+}
+
+// splitmix64, so every run sees the same calls
+static uint64_t next_random(uint64_t *state)
+{
+    uint64_t z = (*state += 0x9e3779b97f4a7c15ULL);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+// run random calls and car moves through both queues and return the number of
+// steps after which their stops differed. A run ends early if the stop queue
+// runs out of sweeps, which the old list had no limit on
+static int compare_random(uint64_t seed, int steps, int floors)
+{
+    uint64_t state = seed;
+    stop_queue q;
+    old_list l = { .n = 0 };
+    int floor = 1 + (int)(next_random(&state) % floors);
+    const char *status = "Closed";
+    int mismatches = 0;
+
+    stop_queue_init(&q, floor);
+    report(&q, status, floor);
+    old_report(&l, status, floor);
+    for (int i = 0; i < steps; i++) {
+        int head;
+        if (next_random(&state) % 3 == 0) {
+            int source = 1 + (int)(next_random(&state) % floors);
+            int destination = 1 + (int)(next_random(&state) % (floors - 1));
+            destination += destination >= source;
+            if (stop_queue_add(&q, source, destination) == -1) {
+                break;
+            }
+            old_add(&l, source, destination);
+        } else {
+            // The car closes its doors after opening them, sets off towards
+            // its next stop and reports each floor it passes
+            if (strcmp(status, "Opening") == 0) {
+                status = "Closed";
+            } else if (stop_queue_head(&q, &head) == -1) {
+                continue;
+            } else if (strcmp(status, "Between") == 0 || head != floor) {
+                if (strcmp(status, "Between") == 0) {
+                    floor += direction(floor, head);
+                }
+                status = floor == head ? "Opening" : "Between";
+            } else {
+                status = "Opening";
+            }
+            report(&q, status, floor);
+            old_report(&l, status, floor);
+        }
+
+        int listed[STOP_QUEUE_FLOORS];
+        int n = stop_queue_list(&q, listed, STOP_QUEUE_FLOORS);
+        int same = n == l.n;
+        for (int j = 0; same && j < n; j++) {
+            same = listed[j] == l.floors[j];
+        }
+        if (!same && mismatches++ == 0) {
+            char expected[1024];
+            old_list_string(&l, expected, sizeof(expected));
+            printf("seed %llu step %d: old list \"%s\"\n", (unsigned long long)seed, i, expected);
+            check_queue("the first difference from the old list", &q, expected);
+        }
+    }
+    return mismatches;
+}
+
+int main(void)
+{
+    stop_queue q;
+    stop_queue_cost cost;
+
+    // The route of test-controller-4, one car from floor 1
+    stop_queue_init(&q, 1);
+    report(&q, "Closed", 1);
+    stop_queue_add(&q, 3, 6);
+    check_queue("a call on an empty queue", &q, "3 6");
+
+    // Between 2 and 3, on the way up: 4 is only useful after picking up at 7
+    report(&q, "Between", 2);
+    stop_queue snapshot = q;
+    check("probing 7 to 4 succeeds", 0, stop_queue_probe(&q, 7, 4, &cost));
+    check("7 to 4 adds two stops", 2, cost.added_stops);
+    check("probing leaves the queue alone", 0, memcmp(&snapshot, &q, sizeof(q)));
+    stop_queue_add(&q, 7, 4);
+    check_queue("a call back down goes after the up sweep", &q, "3 6 7 4");
+
+    // 8 goes in before the car turns around and 4 is already queued
+    report(&q, "Opening", 3);
+    report(&q, "Between", 4);
+    check("probing 8 to 4 succeeds", 0, stop_queue_probe(&q, 8, 4, &cost));
+    check("8 to 4 adds only the pickup", 1, cost.added_stops);
+    check("8 to 4 stops once (at 6) before the pickup", 1, cost.pickup_stops);
+    check("8 to 4 rides 4 floors down", 4, cost.ride_floors);
+    stop_queue_add(&q, 8, 4);
+    check_queue("a pickup beyond the turnaround moves it", &q, "6 8 7 4");
+
+    // The same call again adds nothing
+    check("probing the same call succeeds", 0, stop_queue_probe(&q, 8, 4, &cost));
+    check("a repeated call adds no stops", 0, cost.added_stops);
+    stop_queue_add(&q, 8, 4);
+    check_queue("a repeated call leaves the queue alone", &q, "6 8 7 4");
+
+    // Both stops of 6 to 5 are on the way down to 4
+    report(&q, "Opening", 6);
+    report(&q, "Between", 7);
+    report(&q, "Opening", 8);
+    report(&q, "Closing", 8);
+    check_queue("stops are popped as the car reaches them", &q, "7 4");
+    stop_queue_add(&q, 6, 5);
+    check_queue("stops on the way are inserted in order", &q, "7 6 5 4");
+
+    // Standing at 4 with nothing queued, the doors open again first
+    report(&q, "Opening", 7);
+    report(&q, "Opening", 6);
+    report(&q, "Opening", 5);
+    report(&q, "Opening", 4);
+    report(&q, "Closed", 4);
+    check_queue("the queue is empty after the last stop", &q, "");
+    stop_queue_add(&q, 4, 2);
+    check_queue("a call from the car's floor reopens the doors", &q, "4 2");
+
+    // A car can only change direction so many times. Zigzag between 10 and 2
+    // until the route is full, then ask for a pickup that needs another sweep
+    stop_queue_init(&q, 1);
+    for (int i = 0; i < STOP_QUEUE_MAX_SWEEPS; i++) {
+        stop_queue_append(&q, i % 2 ? -1 : 1, i % 2 ? 2 : 10);
+    }
+    check("the route has a sweep per direction", STOP_QUEUE_MAX_SWEEPS, q.nsweeps);
+    check("appending another sweep is refused", -1, stop_queue_append(&q, 1, 10));
+    check("a call needing another sweep is refused", -1, stop_queue_add(&q, 20, 30));
+    check("probing it is refused too", -1, stop_queue_probe(&q, 20, 30, &cost));
+    check("a call on the way still fits", 0, stop_queue_add(&q, 4, 6));
+    check("the route still has the same sweeps", STOP_QUEUE_MAX_SWEEPS, q.nsweeps);
+
+    // Random calls and moves, on a few floors so that calls pile up on shared
+    // stops and turnarounds, and on more floors for longer sweeps
+    int mismatches = 0;
+    for (uint64_t seed = 1; seed <= 2000; seed++) {
+        mismatches += compare_random(seed, 200, seed % 2 ? 6 : 30);
+    }
+    check("steps where the queue differs from the old list", 0, mismatches);
+
+    return check_done();
+}
@@ -0,0 +1,104 @@
+// Tester for the car's timer wheel (timer_wheel.c, no processes)
+
+#include <stdint.h>
+#include "check.h"
+#include "../timer_wheel.h"
+
+#define MS 1000000ULL
+#define START (1000 * MS) // Any time will do - the wheel never reads the clock
+
+static int fired_count = 0;
+static uint64_t fired_at[16];
+static timer_wheel w;
+static timer_wheel_timer a, b;
+
+static void record(timer_wheel_timer *t, void *arg)
+{
+    (void)arg;
+    if (fired_count < 16) {
+        fired_at[fired_count] = t->expires;
+    }
+    fired_count++;
+}
+
+// fires like record() and schedules itself again 2ms after its expiry, the
+// way the car chains its door phases, until 'arg' timers have fired
+static void chain(timer_wheel_timer *t, void *arg)
+{
+    record(t, arg);
+    if (fired_count < *(int *)arg) {
+        timer_wheel_schedule(&w, t, t->expires + 2 * MS);
+    }
+}
+
+// start again with an empty wheel at START
+static void reset(void)
+{
+    timer_wheel_init(&w, START);
+    timer_wheel_timer_init(&a, record, NULL);
+    timer_wheel_timer_init(&b, record, NULL);
+    fired_count = 0;
+}
+
+// the earliest expiry, or 0 if no timers are pending
+static uint64_t next_expiry(void)
+{
+    uint64_t next;
+    return timer_wheel_next(&w, &next) == 0 ? next : 0;
+}
+
+int main(void)
+{
+    // Fires at its expiry and not before
+    reset();
+    timer_wheel_schedule(&w, &a, START + 5 * MS);
+    check("next is the scheduled expiry", START + 5 * MS, next_expiry());
+    check("nothing fires 1ms early", 0, timer_wheel_advance(&w, START + 4 * MS));
+    check("fires at its expiry", 1, timer_wheel_advance(&w, START + 5 * MS));
+    check("nothing pending after firing", 0, next_expiry());
+
+    // Cancelled timers never fire
+    reset();
+    timer_wheel_schedule(&w, &a, START + 3 * MS);
+    timer_wheel_cancel(&w, &a);
+    check("a cancelled timer doesn't fire", 0, timer_wheel_advance(&w, START + 10 * MS));
+    check("nothing pending after cancelling", 0, next_expiry());
+
+    // A timer a turn away shares a slot with a nearer time but waits its turn
+    reset();
+    timer_wheel_schedule(&w, &a, START + (TIMER_WHEEL_SLOTS + 44) * MS);
+    timer_wheel_schedule(&w, &b, START + 44 * MS);
+    check("one timer of a shared slot fires", 1, timer_wheel_advance(&w, START + 44 * MS));
+    check("the one that fired is the nearer", START + 44 * MS, fired_at[0]);
+    check("next is a turn away", START + (TIMER_WHEEL_SLOTS + 44) * MS, next_expiry());
+
+    // A timer scheduled in the past, behind where the wheel has been advanced
+    // to, fires on the next advance rather than a turn later
+    reset();
+    timer_wheel_advance(&w, START + 300 * MS);
+    timer_wheel_schedule(&w, &a, START + 290 * MS);
+    check("next is the past expiry", START + 290 * MS, next_expiry());
+    check("a past timer fires on the next advance", 1, timer_wheel_advance(&w, START + 300 * MS));
+    check("nothing pending after the past timer fired", 0, next_expiry());
+
+    // Chained at its own expiry plus a delay while the car is running late,
+    // every link is already due. They all fire in one advance, and none is
+    // left behind for timer_wheel_next() to keep returning
+    int links = 4;
+    reset();
+    timer_wheel_timer_init(&a, chain, &links);
+    timer_wheel_schedule(&w, &a, START + 1 * MS);
+    check("every due link of a chain fires", links, timer_wheel_advance(&w, START + 20 * MS));
+    check("the last link keeps its own expiry", START + 7 * MS, fired_at[links - 1]);
+    check("nothing pending after the chain", 0, next_expiry());
+
+    // The same chain started after the wheel has moved on
+    reset();
+    timer_wheel_timer_init(&a, chain, &links);
+    timer_wheel_advance(&w, START + 100 * MS);
+    timer_wheel_schedule(&w, &a, START + 50 * MS);
+    check("a chain scheduled in the past fires in one advance", links, timer_wheel_advance(&w, START + 100 * MS));
+    check("nothing pending after the past chain", 0, next_expiry());
+
+    return check_done();
+}
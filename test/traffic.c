@@ -0,0 +1,195 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include "traffic.h"
+
+// Share of passengers, in percent, going from the lobby up and from another
+// floor down to the lobby. The rest travel between other floors
+typedef struct {
+    const char *name;
+    int from_lobby;
+    int to_lobby;
+} profile;
+
+static const profile profiles[] = {
+    {"up-peak", 80, 10},
+    {"down-peak", 10, 80},
+    {"lunch", 40, 40},
+    {NULL, 0, 0}
+};
+
+// HELPER FUNCTIONS
+
+// splitmix64 - the same sequence from a seed on every platform, unlike rand()
+static uint64_t next_random(uint64_t *state)
+{
+    uint64_t z = (*state += 0x9e3779b97f4a7c15ULL);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+static int64_t random_between(uint64_t *state, int64_t min, int64_t max)
+{
+    return min + (int64_t)(next_random(state) % (uint64_t)(max - min + 1));
+}
+
+// a random floor in [lowest, highest] other than 'not'
+static int random_floor_except(uint64_t *state, int lowest, int highest, int not)
+{
+    int floor = random_between(state, lowest, highest - 1);
+    return floor >= not ? floor + 1 : floor;
+}
+
+static int by_arrival(const void *a, const void *b)
+{
+    const traffic_passenger *pa = a, *pb = b;
+    return (pa->arrive_us > pb->arrive_us) - (pa->arrive_us < pb->arrive_us);
+}
+
+static void put_int16(unsigned char *p, int v)
+{
+    p[0] = (unsigned)v & 0xff;
+    p[1] = ((unsigned)v >> 8) & 0xff;
+}
+
+static int get_int16(const unsigned char *p)
+{
+    return (int16_t)(p[0] | (p[1] << 8));
+}
+
+int traffic_generate(const char *name, int lowest_floor, int highest_floor, int lobby_share,
+                     int64_t start_us, int64_t end_us, uint64_t seed, traffic_passenger *out, int n)
+{
+    const profile *p = NULL;
+    if (strcmp(name, "uniform") != 0) {
+        for (p = profiles; p->name != NULL && strcmp(p->name, name) != 0; p++);
+        if (p->name == NULL) {
+            return -1;
+        }
+    }
+
+    uint64_t state = seed;
+    int lobby = lowest_floor;
+    for (int i = 0; i < n; i++) {
+        traffic_passenger *t = &out[i];
+        int kind = random_between(&state, 0, 99);
+        if (p == NULL) {
+            if (lobby_share >= 0 && kind < lobby_share) {
+                t->from = lobby;
+            } else {
+                t->from = random_between(&state, lowest_floor, highest_floor);
+            }
+            t->to = random_floor_except(&state, lowest_floor, highest_floor, t->from);
+        } else if (kind < p->from_lobby) {
+            t->from = lobby;
+            t->to = random_floor_except(&state, lowest_floor, highest_floor, lobby);
+        } else if (kind < p->from_lobby + p->to_lobby) {
+            t->from = random_floor_except(&state, lowest_floor, highest_floor, lobby);
+            t->to = lobby;
+        } else if (highest_floor - lowest_floor >= 2) {
+            t->from = random_floor_except(&state, lowest_floor, highest_floor, lobby);
+            do {
+                t->to = random_floor_except(&state, lowest_floor, highest_floor, lobby);
+            } while (t->to == t->from);
+        } else {
+            t->from = lobby; // Only two floors - nowhere to go between
+            t->to = highest_floor;
+        }
+        t->arrive_us = random_between(&state, start_us, end_us);
+    }
+    qsort(out, n, sizeof(traffic_passenger), by_arrival);
+    return 0;
+}
+
+// TRACE FILES
+
+int traffic_write(const char *path, const traffic_passenger *passengers, int n)
+{
+    FILE *fp = fopen(path, "wb");
+    if (fp == NULL) {
+        return -1;
+    }
+    unsigned char count[4] = {n & 0xff, (n >> 8) & 0xff, (n >> 16) & 0xff, (n >> 24) & 0xff};
+    fwrite(TRAFFIC_MAGIC, 1, strlen(TRAFFIC_MAGIC), fp);
+    fwrite(count, 1, sizeof(count), fp);
+
+    int64_t last = 0;
+    for (int i = 0; i < n; i++) {
+        unsigned char record[14];
+        size_t len = 0;
+        uint64_t delta = passengers[i].arrive_us - last;
+        do {
+            record[len++] = (delta & 0x7f) | (delta > 0x7f ? 0x80 : 0);
+            delta >>= 7;
+        } while (delta > 0);
+        put_int16(&record[len], passengers[i].from);
+        put_int16(&record[len + 2], passengers[i].to);
+        fwrite(record, 1, len + 4, fp);
+        last = passengers[i].arrive_us;
+    }
+
+    if (ferror(fp)) {
+        int saved = errno;
+        fclose(fp);
+        errno = saved;
+        return -1;
+    }
+    return fclose(fp) == 0 ? 0 : -1;
+}
+
+traffic_passenger *traffic_read(const char *path, int *n)
+{
+    FILE *fp = fopen(path, "rb");
+    if (fp == NULL) {
+        return NULL;
+    }
+    char magic[sizeof(TRAFFIC_MAGIC) - 1];
+    unsigned char count[4];
+    if (fread(magic, 1, sizeof(magic), fp) != sizeof(magic) || memcmp(magic, TRAFFIC_MAGIC, sizeof(magic)) != 0 ||
+        fread(count, 1, sizeof(count), fp) != sizeof(count)) {
+        fclose(fp);
+        errno = EINVAL;
+        return NULL;
+    }
+    uint32_t total = count[0] | (count[1] << 8) | (count[2] << 16) | ((uint32_t)count[3] << 24);
+    if (total > INT32_MAX) {
+        fclose(fp);
+        errno = EINVAL;
+        return NULL;
+    }
+    traffic_passenger *passengers = malloc(sizeof(traffic_passenger) * (total ? total : 1));
+    if (passengers == NULL) {
+        fclose(fp);
+        return NULL;
+    }
+
+    int64_t last = 0;
+    for (uint32_t i = 0; i < total; i++) {
+        uint64_t delta = 0;
+        int shift = 0, c;
+        do {
+            c = getc(fp);
+            if (c == EOF || shift > 56) {
+                break;
+            }
+            delta |= (uint64_t)(c & 0x7f) << shift;
+            shift += 7;
+        } while (c & 0x80);
+        unsigned char floors[4];
+        if (c == EOF || (c & 0x80) || fread(floors, 1, sizeof(floors), fp) != sizeof(floors)) {
+            free(passengers);
+            fclose(fp);
+            errno = EINVAL;
+            return NULL;
+        }
+        last += delta;
+        passengers[i].arrive_us = last;
+        passengers[i].from = get_int16(&floors[0]);
+        passengers[i].to = get_int16(&floors[2]);
+    }
+    fclose(fp);
+    *n = total;
+    return passengers;
+}
@@ -0,0 +1,46 @@
+#ifndef TRAFFIC_H
+#define TRAFFIC_H
+
+#include <stdint.h>
+
+// Passenger traffic for test-sched - generated from a seeded profile, or
+// recorded to and replayed from a trace file so that runs against
+// different controller builds see exactly the same passengers.
+//
+// Floors are in the controller's numbering (B1 = 0). The lobby is the
+// lowest floor, as for --lobby-share.
+//
+// A trace file is the magic "LTRACE1\n", a little-endian uint32 passenger
+// count, then for each passenger in order of arrival its arrival time in
+// microseconds since the previous passenger's as an unsigned LEB128
+// varint, followed by its from and to floors as little-endian int16s.
+
+#define TRAFFIC_MAGIC "LTRACE1\n"
+
+typedef struct {
+    int64_t arrive_us;      // Since the start of the run
+    int from;
+    int to;
+} traffic_passenger;
+
+// fill 'out' with 'n' passengers arriving between start_us and end_us, in
+// order of arrival. 'profile' is one of
+//   uniform   - any floor to any other ('lobby_share' percent start from the
+//               lobby if it isn't -1)
+//   up-peak   - morning, mostly from the lobby up
+//   down-peak - evening, mostly down to the lobby
+//   lunch     - to and from the lobby alike
+// returns -1 if there is no such profile. The same seed always gives the
+// same passengers
+int traffic_generate(const char *profile, int lowest_floor, int highest_floor, int lobby_share,
+                     int64_t start_us, int64_t end_us, uint64_t seed, traffic_passenger *out, int n);
+
+// write passengers, which must be in order of arrival, to a trace file.
+// returns -1 with errno set on failure
+int traffic_write(const char *path, const traffic_passenger *passengers, int n);
+
+// read a trace file into a malloc'd array, setting *n. returns NULL with
+// errno set on failure (EINVAL if it isn't a trace)
+traffic_passenger *traffic_read(const char *path, int *n);
+
+#endif
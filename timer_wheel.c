@@ -0,0 +1,152 @@
+#define _POSIX_C_SOURCE 200809L // Enable CLOCK_MONOTONIC definition
+
+#include <string.h>         // String manipulation functions
+#include <time.h>           // Time functions
+#include "timer_wheel.h"
+
+#define SLOT_MASK (TIMER_WHEEL_SLOTS - 1)
+
+// HELPER FUNCTIONS
+
+static void unlink_timer(timer_wheel *w, timer_wheel_timer *t) {
+    if (t->prev != NULL) {
+        t->prev->next = t->next;
+    } else {
+        w->slots[t->slot] = t->next;
+    }
+    if (t->next != NULL) {
+        t->next->prev = t->prev;
+    }
+    t->next = NULL;
+    t->prev = NULL;
+    t->pending = 0;
+    w->count--;
+}
+
+// fire the timers in one slot that are due by 'now'
+static int fire_slot(timer_wheel *w, int slot, uint64_t now) {
+    int fired = 0;
+    timer_wheel_timer *t = w->slots[slot];
+    while (t != NULL) {
+        timer_wheel_timer *next = t->next;
+        if (t->expires <= now) {
+            unlink_timer(w, t);
+            fired++;
+            t->callback(t, t->arg);
+            // The callback may have cancelled or moved any timer, so start
+            // the slot again
+            next = w->slots[slot];
+        }
+        t = next;
+    }
+    return fired;
+}
+
+uint64_t timer_wheel_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+void timer_wheel_init(timer_wheel *w, uint64_t now) {
+    memset(w, 0, sizeof(*w));
+    w->tick = now / TIMER_WHEEL_TICK_NS;
+}
+
+void timer_wheel_timer_init(timer_wheel_timer *t, void (*callback)(timer_wheel_timer *t, void *arg), void *arg) {
+    memset(t, 0, sizeof(*t));
+    t->callback = callback;
+    t->arg = arg;
+}
+
+void timer_wheel_schedule(timer_wheel *w, timer_wheel_timer *t, uint64_t expires) {
+    if (t->pending) {
+        unlink_timer(w, t);
+    }
+    // A timer already behind the wheel goes in the current tick's slot - in
+    // its own it would wait for the wheel to come all the way round
+    uint64_t tick = expires / TIMER_WHEEL_TICK_NS;
+    if (tick < w->tick) {
+        tick = w->tick;
+    }
+    int slot = tick & SLOT_MASK;
+    t->expires = expires;
+    t->slot = slot;
+    t->pending = 1;
+    t->prev = NULL;
+    t->next = w->slots[slot];
+    if (t->next != NULL) {
+        t->next->prev = t;
+    }
+    w->slots[slot] = t;
+    w->count++;
+}
+
+void timer_wheel_cancel(timer_wheel *w, timer_wheel_timer *t) {
+    if (t->pending) {
+        unlink_timer(w, t);
+    }
+}
+
+int timer_wheel_advance(timer_wheel *w, uint64_t now) {
+    uint64_t now_tick = now / TIMER_WHEEL_TICK_NS;
+    int fired = 0;
+
+    if (now_tick < w->tick) {
+        return 0;
+    }
+
+    // After a long idle period every slot is visited once rather than once
+    // per elapsed tick
+    if (now_tick - w->tick >= TIMER_WHEEL_SLOTS) {
+        for (int slot = 0; slot < TIMER_WHEEL_SLOTS; slot++) {
+            fired += fire_slot(w, slot, now);
+        }
+        w->tick = now_tick;
+        return fired;
+    }
+
+    for (;;) {
+        fired += fire_slot(w, w->tick & SLOT_MASK, now);
+        if (w->tick == now_tick) {
+            break; // The rest of this tick's timers are still to come
+        }
+        w->tick++;
+    }
+    return fired;
+}
+
+int timer_wheel_next(const timer_wheel *w, uint64_t *expires) {
+    if (w->count == 0) {
+        return -1;
+    }
+
+    // Walk forward from the current tick. The first slot holding a timer for
+    // this turn of the wheel holds the earliest one
+    for (uint64_t tick = w->tick; tick < w->tick + TIMER_WHEEL_SLOTS; tick++) {
+        int found = 0;
+        uint64_t best = 0;
+        for (const timer_wheel_timer *t = w->slots[tick & SLOT_MASK]; t != NULL; t = t->next) {
+            if (t->expires / TIMER_WHEEL_TICK_NS <= tick && (!found || t->expires < best)) {
+                best = t->expires;
+                found = 1;
+            }
+        }
+        if (found) {
+            *expires = best;
+            return 0;
+        }
+    }
+
+    // Everything is more than a turn away
+    int found = 0;
+    for (int slot = 0; slot < TIMER_WHEEL_SLOTS; slot++) {
+        for (const timer_wheel_timer *t = w->slots[slot]; t != NULL; t = t->next) {
+            if (!found || t->expires < *expires) {
+                *expires = t->expires;
+                found = 1;
+            }
+        }
+    }
+    return 0;
+}
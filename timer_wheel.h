@@ -0,0 +1,60 @@
+#ifndef TIMER_WHEEL_H
+#define TIMER_WHEEL_H
+
+#include <stdint.h>         // Standard integer types
+
+// Hashed timer wheel for scheduling on CLOCK_MONOTONIC.
+//
+// Time is kept in nanoseconds so deadlines are exact, and the wheel turns in
+// one millisecond ticks. A timer is kept in the slot for the tick it expires
+// in, so scheduling and cancelling are O(1) and firing only looks at the slots
+// the clock has passed. Timers further away than one turn of the wheel share
+// slots with nearer ones and are skipped until their turn comes round.
+//
+// Timers are embedded in the caller's structures and the wheel never
+// allocates. The wheel isn't thread safe - callers hold their own lock.
+
+#define TIMER_WHEEL_SLOTS 256           // Must be a power of two
+#define TIMER_WHEEL_TICK_NS 1000000ULL  // 1ms
+
+typedef struct timer_wheel_timer {
+    uint64_t expires;                   // Absolute expiry in nanoseconds
+    int pending;                        // 1 while scheduled
+    int slot;                           // Slot the timer is kept in while pending
+    void (*callback)(struct timer_wheel_timer *t, void *arg);
+    void *arg;
+    struct timer_wheel_timer *next;
+    struct timer_wheel_timer *prev;
+} timer_wheel_timer;
+
+typedef struct {
+    uint64_t tick;                      // Tick the wheel has been advanced to
+    int count;                          // Number of pending timers
+    timer_wheel_timer *slots[TIMER_WHEEL_SLOTS];
+} timer_wheel;
+
+// current CLOCK_MONOTONIC time in nanoseconds
+uint64_t timer_wheel_now(void);
+
+// reset a wheel to empty, starting at time 'now'
+void timer_wheel_init(timer_wheel *w, uint64_t now);
+
+// prepare a timer that calls 'callback' when it fires
+void timer_wheel_timer_init(timer_wheel_timer *t, void (*callback)(timer_wheel_timer *t, void *arg), void *arg);
+
+// (re)schedule a timer to fire at 'expires'. A time the wheel has already
+// passed fires on the next advance
+void timer_wheel_schedule(timer_wheel *w, timer_wheel_timer *t, uint64_t expires);
+
+// cancel a timer. does nothing if it isn't pending
+void timer_wheel_cancel(timer_wheel *w, timer_wheel_timer *t);
+
+// fire every timer due at or before 'now'. A callback may schedule or cancel
+// timers. returns the number of timers fired
+int timer_wheel_advance(timer_wheel *w, uint64_t now);
+
+// earliest expiry of a pending timer, valid after advancing the wheel to the
+// current time. returns 0 on success, -1 if no timers are pending
+int timer_wheel_next(const timer_wheel *w, uint64_t *expires);
+
+#endif